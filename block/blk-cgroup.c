@@ -496,8 +496,13 @@ void blkiocg_add_blkio_group(struct blkio_cgroup *blkcg,
 }
 EXPORT_SYMBOL_GPL(blkiocg_add_blkio_group);
 
-static void __blkiocg_del_blkio_group(struct blkio_group *blkg)
+/* Called with blkcg->lock held */
+static void __blkiocg_del_blkio_group(struct blkio_cgroup *blkcg,
+				      struct blkio_group *blkg)
 {
+	if (rcu_dereference_protected(blkcg->blkg_hint[blkg->plid],
+				lockdep_is_held(&blkcg->lock)) == blkg)
+		rcu_assign_pointer(blkcg->blkg_hint[blkg->plid], NULL);
 	hlist_del_init_rcu(&blkg->blkcg_node);
 	blkg->blkcg_id = 0;
 }
@@ -519,7 +524,7 @@ int blkiocg_del_blkio_group(struct blkio_group *blkg)
 		blkcg = container_of(css, struct blkio_cgroup, css);
 		spin_lock_irqsave(&blkcg->lock, flags);
 		if (!hlist_unhashed(&blkg->blkcg_node)) {
-			__blkiocg_del_blkio_group(blkg);
+			__blkiocg_del_blkio_group(blkcg, blkg);
 			ret = 0;
 		}
 		spin_unlock_irqrestore(&blkcg->lock, flags);
@@ -536,11 +541,36 @@ struct blkio_group *blkiocg_lookup_group(struct blkio_cgroup *blkcg, void *key)
 	struct blkio_group *blkg;
 	struct hlist_node *n;
 	void *__key;
+	unsigned long flags;
+	int i;
+
+	/*
+	 * A cgroup usually issues IO to one device at a time, so check the
+	 * per policy hints before walking the whole list.
+	 */
+	for (i = 0; i < BLKIO_NR_POLICIES; i++) {
+		blkg = rcu_dereference(blkcg->blkg_hint[i]);
+		if (blkg && blkg->key == key)
+			return blkg;
+	}
 
 	hlist_for_each_entry_rcu(blkg, n, &blkcg->blkg_list, blkcg_node) {
 		__key = blkg->key;
-		if (__key == key)
-			return blkg;
+		if (__key != key)
+			continue;
+
+		/*
+		 * Only publish the hint while the group is still hashed so
+		 * that unlinking it clears the hint as well. Lookups are hot,
+		 * don't wait for the lock if someone else holds it.
+		 */
+		if (spin_trylock_irqsave(&blkcg->lock, flags)) {
+			if (!hlist_unhashed(&blkg->blkcg_node))
+				rcu_assign_pointer(blkcg->blkg_hint[blkg->plid],
+						   blkg);
+			spin_unlock_irqrestore(&blkcg->lock, flags);
+		}
+		return blkg;
 	}
 
 	return NULL;
@@ -1567,7 +1597,7 @@ static void blkiocg_destroy(struct cgroup_subsys *subsys, struct cgroup *cgroup)
 		blkg = hlist_entry(blkcg->blkg_list.first, struct blkio_group,
 					blkcg_node);
 		key = rcu_dereference(blkg->key);
-		__blkiocg_del_blkio_group(blkg);
+		__blkiocg_del_blkio_group(blkcg, blkg);
 
 		spin_unlock_irqrestore(&blkcg->lock, flags);
 
@@ -21,6 +21,8 @@ enum blkio_policy_id {
 	BLKIO_POLICY_THROTL,		/* Throttling */
 };
 
+#define BLKIO_NR_POLICIES	(BLKIO_POLICY_THROTL + 1)
+
 /* Max limits for throttle policy */
 #define THROTL_IOPS_MAX		UINT_MAX
 
@@ -116,6 +118,8 @@ struct blkio_cgroup {
 	unsigned int weight;
 	spinlock_t lock;
 	struct hlist_head blkg_list;
+	/* last group looked up per policy, protected like blkg_list */
+	struct blkio_group __rcu *blkg_hint[BLKIO_NR_POLICIES];
 	struct list_head policy_list; /* list of blkio_policy_node */
 };
 
@@ -16,6 +16,7 @@
 #include <linux/backing-dev.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/highmem.h>
 #include <linux/mm.h>
 #include <linux/kernel_stat.h>
@@ -34,6 +35,7 @@
 #include <trace/events/block.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 EXPORT_TRACEPOINT_SYMBOL_GPL(block_bio_remap);
 EXPORT_TRACEPOINT_SYMBOL_GPL(block_rq_remap);
@@ -54,7 +56,7 @@ struct kmem_cache *blk_requestq_cachep;
  */
 static struct workqueue_struct *kblockd_workqueue;
 
-static void drive_stat_acct(struct request *rq, int new_io)
+void drive_stat_acct(struct request *rq, int new_io)
 {
 	struct hd_struct *part;
 	int rw = rq_data_dir(rq);
@@ -90,6 +92,12 @@ static void drive_stat_acct(struct request *rq, int new_io)
 	part_stat_unlock();
 }
 
+/*
+ * Upper bound for the per-cpu batch of the request_list counters, see
+ * blk_queue_congestion_threshold() for how it is scaled down.
+ */
+#define BLK_RL_BATCH	16
+
 void blk_queue_congestion_threshold(struct request_queue *q)
 {
 	int nr;
@@ -103,6 +111,14 @@ void blk_queue_congestion_threshold(struct request_queue *q)
 	if (nr < 1)
 		nr = 1;
 	q->nr_congestion_off = nr;
+
+	/*
+	 * Each cpu may hold up to batch - 1 uncounted requests.  The batch
+	 * does not shrink with the number of cpus, so updates stay local;
+	 * blk_rl_compare() sums the deltas when they could matter.
+	 */
+	nr = q->nr_requests / 8;
+	q->rq.batch = clamp(nr, 1, BLK_RL_BATCH);
 }
 
 /**
@@ -285,6 +301,7 @@ void blk_sync_queue(struct request_queue *q)
 {
 	del_timer_sync(&q->timeout);
 	cancel_delayed_work_sync(&q->delay_work);
+	blk_mq_sync_queue(q);
 }
 EXPORT_SYMBOL(blk_sync_queue);
 
@@ -340,6 +357,63 @@ void blk_run_queue(struct request_queue *q)
 }
 EXPORT_SYMBOL(blk_run_queue);
 
+/**
+ * blk_poll - poll a queue for the completion the caller is waiting on
+ * @q: The queue the caller's IO was issued to
+ *
+ * Description:
+ *    For devices that complete IO faster than an interrupt and a context
+ *    switch can be serviced, a synchronous waiter may spin on the driver's
+ *    completion path instead of sleeping. The caller must have set its
+ *    state to TASK_UNINTERRUPTIBLE and arranged to be woken by the IO
+ *    completion, exactly as it would before io_schedule().
+ *
+ *    Polls for at most q->poll_spin_us. Returns true if the caller was
+ *    woken meanwhile and must not sleep, false if it should fall back to
+ *    io_schedule().
+ */
+bool blk_poll(struct request_queue *q)
+{
+	u64 start, now, budget;
+	bool woken = false;
+
+	if (!q->poll_fn || !blk_queue_io_poll(q))
+		return false;
+
+	budget = (u64)ACCESS_ONCE(q->poll_spin_us) * NSEC_PER_USEC;
+	if (!budget)
+		return false;
+
+	this_cpu_inc(q->poll_stat->invoked);
+	start = now = local_clock();
+
+	while (now - start < budget && !need_resched()) {
+		q->poll_fn(q);
+
+		/* the completion's wakeup has set us TASK_RUNNING */
+		if (current->state == TASK_RUNNING) {
+			woken = true;
+			break;
+		}
+
+		cpu_relax();
+		now = local_clock();
+	}
+
+	if (woken) {
+		now = local_clock() - start;
+		this_cpu_inc(q->poll_stat->success);
+		this_cpu_add(q->poll_stat->success_ns, now);
+		if (now > this_cpu_read(q->poll_stat->max_ns))
+			this_cpu_write(q->poll_stat->max_ns, now);
+	} else {
+		this_cpu_inc(q->poll_stat->fallback);
+	}
+
+	return woken;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
 void blk_put_queue(struct request_queue *q)
 {
 	kobject_put(&q->kobj);
@@ -369,7 +443,8 @@ void blk_drain_queue(struct request_queue *q, bool drain_all)
 		__blk_run_queue(q);
 
 		if (drain_all)
-			nr_rqs = q->rq.count[0] + q->rq.count[1];
+			nr_rqs = blk_rl_count(&q->rq, BLK_RW_SYNC) +
+				 blk_rl_count(&q->rq, BLK_RW_ASYNC);
 		else
 			nr_rqs = q->rq.elvpriv;
 
@@ -412,7 +487,9 @@ void blk_cleanup_queue(struct request_queue *q)
 	 * be trying to tear down @q before its elevator is initialized, in
 	 * which case we don't want to call into draining.
 	 */
-	if (q->elevator)
+	if (q->mq_ops)
+		blk_mq_drain_queue(q);
+	else if (q->elevator)
 		blk_drain_queue(q, true);
 
 	/* @q won't process any more request, flush async actions */
@@ -431,19 +508,57 @@ static int blk_init_free_list(struct request_queue *q)
 	if (unlikely(rl->rq_pool))
 		return 0;
 
-	rl->count[BLK_RW_SYNC] = rl->count[BLK_RW_ASYNC] = 0;
 	rl->starved[BLK_RW_SYNC] = rl->starved[BLK_RW_ASYNC] = 0;
 	rl->elvpriv = 0;
+	rl->full = 0;
 	init_waitqueue_head(&rl->wait[BLK_RW_SYNC]);
 	init_waitqueue_head(&rl->wait[BLK_RW_ASYNC]);
 
+	if (percpu_counter_init(&rl->count[BLK_RW_SYNC], 0))
+		return -ENOMEM;
+	if (percpu_counter_init(&rl->count[BLK_RW_ASYNC], 0))
+		goto out_sync;
+
+	rl->rq_cache = alloc_percpu(struct blk_rq_cache);
+	if (!rl->rq_cache)
+		goto out_async;
+
 	rl->rq_pool = mempool_create_node(BLKDEV_MIN_RQ, mempool_alloc_slab,
 				mempool_free_slab, request_cachep, q->node);
-
 	if (!rl->rq_pool)
-		return -ENOMEM;
+		goto out_cache;
 
 	return 0;
+
+out_cache:
+	free_percpu(rl->rq_cache);
+	rl->rq_cache = NULL;
+out_async:
+	percpu_counter_destroy(&rl->count[BLK_RW_ASYNC]);
+out_sync:
+	percpu_counter_destroy(&rl->count[BLK_RW_SYNC]);
+	return -ENOMEM;
+}
+
+void blk_exit_free_list(struct request_queue *q)
+{
+	struct request_list *rl = &q->rq;
+	int cpu;
+
+	if (!rl->rq_pool)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_rq_cache *cache = per_cpu_ptr(rl->rq_cache, cpu);
+
+		while (cache->nr)
+			mempool_free(cache->rqs[--cache->nr], rl->rq_pool);
+	}
+
+	mempool_destroy(rl->rq_pool);
+	free_percpu(rl->rq_cache);
+	percpu_counter_destroy(&rl->count[BLK_RW_SYNC]);
+	percpu_counter_destroy(&rl->count[BLK_RW_ASYNC]);
 }
 
 struct request_queue *blk_alloc_queue(gfp_t gfp_mask)
@@ -474,7 +589,15 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 		return NULL;
 	}
 
+	q->poll_stat = alloc_percpu(struct blk_poll_stat);
+	if (!q->poll_stat) {
+		kmem_cache_free(blk_requestq_cachep, q);
+		return NULL;
+	}
+	q->poll_spin_us = BLK_POLL_SPIN_US;
+
 	if (blk_throtl_init(q)) {
+		free_percpu(q->poll_stat);
 		kmem_cache_free(blk_requestq_cachep, q);
 		return NULL;
 	}
@@ -617,20 +740,63 @@ int blk_get_queue(struct request_queue *q)
 }
 EXPORT_SYMBOL(blk_get_queue);
 
+/*
+ * Requests are recycled through a small per-cpu cache before they go back
+ * to the mempool, so that submitters on different cpus don't all bounce
+ * the slab and mempool state of the same queue.  The mempool reserve
+ * comes first though: while it is short, or someone sleeps in
+ * mempool_alloc(), the request goes back to the pool, which wakes them.
+ */
+static void __blk_free_request(struct request_queue *q, struct request *rq)
+{
+	struct request_list *rl = &q->rq;
+	mempool_t *pool = rl->rq_pool;
+	struct blk_rq_cache *cache;
+	unsigned long flags;
+
+	if (pool->curr_nr < pool->min_nr || waitqueue_active(&pool->wait)) {
+		mempool_free(rq, pool);
+		return;
+	}
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(rl->rq_cache);
+	if (cache->nr < BLK_RQ_CACHE_SIZE) {
+		cache->rqs[cache->nr++] = rq;
+		rq = NULL;
+	}
+	local_irq_restore(flags);
+
+	if (rq)
+		mempool_free(rq, pool);
+}
+
 static inline void blk_free_request(struct request_queue *q, struct request *rq)
 {
 	if (rq->cmd_flags & REQ_ELVPRIV)
 		elv_put_request(q, rq);
-	mempool_free(rq, q->rq.rq_pool);
+	__blk_free_request(q, rq);
 }
 
 static struct request *
 blk_alloc_request(struct request_queue *q, unsigned int flags, gfp_t gfp_mask)
 {
-	struct request *rq = mempool_alloc(q->rq.rq_pool, gfp_mask);
+	struct request_list *rl = &q->rq;
+	struct blk_rq_cache *cache;
+	struct request *rq = NULL;
+	unsigned long irq_flags;
 
-	if (!rq)
-		return NULL;
+	local_irq_save(irq_flags);
+	cache = this_cpu_ptr(rl->rq_cache);
+	if (cache->nr)
+		rq = cache->rqs[--cache->nr];
+	local_irq_restore(irq_flags);
+
+	if (!rq) {
+		rq = mempool_alloc(rl->rq_pool, gfp_mask);
+		if (!rq)
+			return NULL;
+	}
 
 	blk_rq_init(q, rq);
 
@@ -638,13 +804,46 @@ blk_alloc_request(struct request_queue *q, unsigned int flags, gfp_t gfp_mask)
 
 	if ((flags & REQ_ELVPRIV) &&
 	    unlikely(elv_set_request(q, rq, gfp_mask))) {
-		mempool_free(rq, q->rq.rq_pool);
+		__blk_free_request(q, rq);
 		return NULL;
 	}
 
 	return rq;
 }
 
+static void blk_rl_add(struct request_list *rl, int sync, int nr)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	__percpu_counter_add(&rl->count[sync], nr, ACCESS_ONCE(rl->batch));
+	local_irq_restore(flags);
+}
+
+/*
+ * Compare the number of allocated @sync requests against @nr.  The shared
+ * count is off by less than batch per online cpu; only when @nr is within
+ * that distance are the per-cpu deltas summed up for an exact answer.
+ */
+static int blk_rl_compare(struct request_list *rl, int sync, s64 nr)
+{
+	s64 count = percpu_counter_read(&rl->count[sync]);
+	s64 slack = (ACCESS_ONCE(rl->batch) - 1) * num_online_cpus();
+	unsigned long flags;
+
+	if (count - nr <= slack && nr - count <= slack) {
+		local_irq_save(flags);
+		count = percpu_counter_sum(&rl->count[sync]);
+		local_irq_restore(flags);
+	}
+
+	if (count > nr)
+		return 1;
+	if (count < nr)
+		return -1;
+	return 0;
+}
+
 /*
  * ioc_batching returns true if the ioc is a valid batching request and
  * should be given priority access to a request.
@@ -683,10 +882,10 @@ static void __freed_request(struct request_queue *q, int sync)
 {
 	struct request_list *rl = &q->rq;
 
-	if (rl->count[sync] < queue_congestion_off_threshold(q))
+	if (blk_rl_compare(rl, sync, queue_congestion_off_threshold(q)) < 0)
 		blk_clear_queue_congested(q, sync);
 
-	if (rl->count[sync] + 1 <= q->nr_requests) {
+	if (blk_rl_compare(rl, sync, q->nr_requests) < 0) {
 		if (waitqueue_active(&rl->wait[sync]))
 			wake_up(&rl->wait[sync]);
 
@@ -703,9 +902,10 @@ static void freed_request(struct request_queue *q, unsigned int flags)
 	struct request_list *rl = &q->rq;
 	int sync = rw_is_sync(flags);
 
-	rl->count[sync]--;
+	blk_rl_add(rl, sync, -1);
 	if (flags & REQ_ELVPRIV)
 		rl->elvpriv--;
+	rl->nr_freed++;
 
 	__freed_request(q, sync);
 
@@ -753,8 +953,10 @@ static struct request *get_request(struct request_queue *q, int rw_flags,
 	struct request_list *rl = &q->rq;
 	struct io_context *ioc = NULL;
 	const bool is_sync = rw_is_sync(rw_flags) != 0;
+	unsigned int nr_freed;
 	int may_queue;
 
+retry:
 	if (unlikely(test_bit(QUEUE_FLAG_DEAD, &q->queue_flags)))
 		return NULL;
 
@@ -762,8 +964,25 @@ static struct request *get_request(struct request_queue *q, int rw_flags,
 	if (may_queue == ELV_MQUEUE_NO)
 		goto rq_starved;
 
-	if (rl->count[is_sync]+1 >= queue_congestion_on_threshold(q)) {
-		if (rl->count[is_sync]+1 >= q->nr_requests) {
+	if (blk_rq_should_init_elevator(bio) &&
+	    !test_bit(QUEUE_FLAG_ELVSWITCH, &q->queue_flags)) {
+		rw_flags |= REQ_ELVPRIV;
+		rl->elvpriv++;
+	}
+
+	if (blk_queue_io_stat(q))
+		rw_flags |= REQ_IO_STAT;
+
+	/*
+	 * The request budget is kept in percpu counters and atomic flags,
+	 * don't hold the queue lock while checking it.
+	 */
+	nr_freed = rl->nr_freed;
+	spin_unlock_irq(q->queue_lock);
+
+	if (blk_rl_compare(rl, is_sync,
+			   queue_congestion_on_threshold(q) - 1) >= 0) {
+		if (blk_rl_compare(rl, is_sync, q->nr_requests - 1) >= 0) {
 			ioc = current_io_context(GFP_ATOMIC, q->node);
 			/*
 			 * The queue will fill after this allocation, so set
@@ -771,9 +990,8 @@ static struct request *get_request(struct request_queue *q, int rw_flags,
 			 * This process will be allowed to complete a batch of
 			 * requests, others will be blocked.
 			 */
-			if (!blk_queue_full(q, is_sync)) {
+			if (!blk_test_and_set_queue_full(q, is_sync)) {
 				ioc_set_batching(q, ioc);
-				blk_set_queue_full(q, is_sync);
 			} else {
 				if (may_queue != ELV_MQUEUE_MUST
 						&& !ioc_batching(q, ioc)) {
@@ -782,7 +1000,7 @@ static struct request *get_request(struct request_queue *q, int rw_flags,
 					 * process is not a "batcher", and not
 					 * exempted by the IO scheduler
 					 */
-					goto out;
+					goto out_fail;
 				}
 			}
 		}
@@ -794,22 +1012,12 @@ static struct request *get_request(struct request_queue *q, int rw_flags,
 	 * limit of requests, otherwise we could have thousands of requests
 	 * allocated with any setting of ->nr_requests
 	 */
-	if (rl->count[is_sync] >= (3 * q->nr_requests / 2))
-		goto out;
+	if (blk_rl_compare(rl, is_sync, 3 * q->nr_requests / 2) >= 0)
+		goto out_fail;
 
-	rl->count[is_sync]++;
+	blk_rl_add(rl, is_sync, 1);
 	rl->starved[is_sync] = 0;
 
-	if (blk_rq_should_init_elevator(bio) &&
-	    !test_bit(QUEUE_FLAG_ELVSWITCH, &q->queue_flags)) {
-		rw_flags |= REQ_ELVPRIV;
-		rl->elvpriv++;
-	}
-
-	if (blk_queue_io_stat(q))
-		rw_flags |= REQ_IO_STAT;
-	spin_unlock_irq(q->queue_lock);
-
 	rq = blk_alloc_request(q, rw_flags, gfp_mask);
 	if (unlikely(!rq)) {
 		/*
@@ -830,7 +1038,7 @@ static struct request *get_request(struct request_queue *q, int rw_flags,
 		 * rq mempool into READ and WRITE
 		 */
 rq_starved:
-		if (unlikely(rl->count[is_sync] == 0))
+		if (unlikely(blk_rl_count(rl, is_sync) == 0))
 			rl->starved[is_sync] = 1;
 
 		goto out;
@@ -848,6 +1056,21 @@ rq_starved:
 	trace_block_getrq(q, bio, rw_flags & 1);
 out:
 	return rq;
+
+out_fail:
+	spin_lock_irq(q->queue_lock);
+	if (rw_flags & REQ_ELVPRIV)
+		rl->elvpriv--;
+	rw_flags &= ~(REQ_ELVPRIV | REQ_IO_STAT);
+
+	/*
+	 * Requests are freed under the queue lock. If one went away while
+	 * we looked without it, its wakeup may already have been missed by
+	 * the caller, so look again instead of failing.
+	 */
+	if (rl->nr_freed != nr_freed)
+		goto retry;
+	return NULL;
 }
 
 /**
@@ -910,6 +1133,9 @@ struct request *blk_get_request(struct request_queue *q, int rw, gfp_t gfp_mask)
 
 	BUG_ON(rw != READ && rw != WRITE);
 
+	if (q->mq_ops)
+		return blk_mq_alloc_request(q, rw, gfp_mask);
+
 	spin_lock_irq(q->queue_lock);
 	if (gfp_mask & __GFP_WAIT)
 		rq = get_request_wait(q, rw, NULL);
@@ -1108,6 +1334,11 @@ void __blk_put_request(struct request_queue *q, struct request *req)
 	if (unlikely(--req->ref_count))
 		return;
 
+	if (q->mq_ops) {
+		blk_mq_free_request(req);
+		return;
+	}
+
 	elv_completed_request(q, req);
 
 	/* this is a bio leak */
@@ -1134,6 +1365,11 @@ void blk_put_request(struct request *req)
 	unsigned long flags;
 	struct request_queue *q = req->q;
 
+	if (q->mq_ops) {
+		__blk_put_request(q, req);
+		return;
+	}
+
 	spin_lock_irqsave(q->queue_lock, flags);
 	__blk_put_request(q, req);
 	spin_unlock_irqrestore(q->queue_lock, flags);
@@ -1844,7 +2080,7 @@ static void blk_account_io_completion(struct request *req, unsigned int bytes)
 	}
 }
 
-static void blk_account_io_done(struct request *req)
+void blk_account_io_done(struct request *req)
 {
 	/*
 	 * Account IO completion.  flush_rq isn't accounted as a
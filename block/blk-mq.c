@@ -0,0 +1,767 @@
+/*
+ * Multi-queue block layer
+ *
+ * Requests are allocated from preallocated per hardware queue pools,
+ * indexed by tag, and staged on a per-cpu software queue. Running a
+ * hardware queue moves everything pending on the software queues mapped
+ * to it over to the driver. There is no elevator, merging or plugging on
+ * this path, and q->queue_lock is never taken.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/bitops.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/sched.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+
+static struct blk_mq_ctx *blk_mq_get_ctx(struct request_queue *q)
+{
+	return per_cpu_ptr(q->queue_ctx, get_cpu());
+}
+
+static void blk_mq_put_ctx(struct blk_mq_ctx *ctx)
+{
+	put_cpu();
+}
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL(blk_mq_map_queue);
+
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	return !list_empty_careful(&hctx->dispatch) ||
+		find_first_bit(hctx->ctx_map, hctx->nr_ctx) < hctx->nr_ctx;
+}
+
+/*
+ * Submitters hold a usage reference while they may allocate requests, so
+ * that blk_cleanup_queue() can wait for them after marking the queue dead.
+ */
+static int blk_mq_queue_enter(struct request_queue *q)
+{
+	atomic_inc(&q->mq_usage);
+	smp_mb__after_atomic_inc();
+
+	if (unlikely(test_bit(QUEUE_FLAG_DEAD, &q->queue_flags))) {
+		atomic_dec(&q->mq_usage);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static void blk_mq_queue_exit(struct request_queue *q)
+{
+	atomic_dec(&q->mq_usage);
+}
+
+/*
+ * Tags are plain bits in hctx->tag_map. Each software queue remembers
+ * where it last allocated, so that cpus sharing a hardware queue tend to
+ * search different words of the map.
+ */
+static int blk_mq_get_tag(struct blk_mq_hw_ctx *hctx, struct blk_mq_ctx *ctx)
+{
+	unsigned int depth = hctx->queue_depth;
+	unsigned int tag = ctx->last_tag;
+	bool wrapped = false;
+
+	for (;;) {
+		tag = find_next_zero_bit(hctx->tag_map, depth, tag);
+		if (tag >= depth) {
+			if (wrapped)
+				return -1;
+			wrapped = true;
+			tag = 0;
+			continue;
+		}
+		if (!test_and_set_bit_lock(tag, hctx->tag_map))
+			break;
+		tag++;
+	}
+
+	ctx->last_tag = tag + 1 < depth ? tag + 1 : 0;
+	return tag;
+}
+
+static void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	clear_bit_unlock(tag, hctx->tag_map);
+	smp_mb__after_clear_bit();
+
+	if (waitqueue_active(&hctx->tag_wait))
+		wake_up(&hctx->tag_wait);
+}
+
+static bool blk_mq_has_free_tags(struct blk_mq_hw_ctx *hctx)
+{
+	return find_first_zero_bit(hctx->tag_map, hctx->queue_depth) <
+		hctx->queue_depth;
+}
+
+static struct request *__blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx,
+					      struct blk_mq_ctx *ctx,
+					      unsigned int rw_flags)
+{
+	struct request_queue *q = hctx->queue;
+	struct request *rq;
+	int tag;
+
+	tag = blk_mq_get_tag(hctx, ctx);
+	if (tag < 0)
+		return NULL;
+
+	rq = hctx->rqs[tag];
+	blk_rq_init(q, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	rq->cmd_flags = rw_flags;
+	if (blk_queue_io_stat(q))
+		rq->cmd_flags |= REQ_IO_STAT;
+
+	return rq;
+}
+
+/*
+ * The request is tied to the software queue of the cpu it was allocated
+ * on, and so to that cpu's hardware queue. If the task migrates while
+ * waiting for a tag, the next attempt is made on the new cpu's queue.
+ */
+static struct request *blk_mq_alloc_request_wait(struct request_queue *q,
+						 unsigned int rw_flags,
+						 bool can_wait)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	DEFINE_WAIT(wait);
+
+	for (;;) {
+		ctx = blk_mq_get_ctx(q);
+		hctx = blk_mq_map_queue(q, ctx->cpu);
+		rq = __blk_mq_alloc_request(hctx, ctx, rw_flags);
+		blk_mq_put_ctx(ctx);
+
+		if (rq || !can_wait)
+			return rq;
+
+		prepare_to_wait_exclusive(&hctx->tag_wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		/* a tag may have been freed before we got on the waitqueue */
+		if (!blk_mq_has_free_tags(hctx)) {
+			trace_block_sleeprq(q, NULL, rw_flags & 1);
+			io_schedule();
+		}
+		finish_wait(&hctx->tag_wait, &wait);
+	}
+}
+
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
+				     gfp_t gfp)
+{
+	struct request *rq;
+
+	if (blk_mq_queue_enter(q))
+		return NULL;
+
+	rq = blk_mq_alloc_request_wait(q, rw, gfp & __GFP_WAIT);
+	blk_mq_queue_exit(q);
+
+	return rq;
+}
+EXPORT_SYMBOL(blk_mq_alloc_request);
+
+void blk_mq_free_request(struct request *rq)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+
+	/* this is a bio leak */
+	WARN_ON(rq->bio != NULL);
+
+	blk_mq_put_tag(hctx, rq->tag);
+}
+EXPORT_SYMBOL(blk_mq_free_request);
+
+/**
+ * blk_mq_end_io - end I/O on a multi-queue request
+ * @rq:		the request being completed
+ * @error:	%0 for success, < %0 for error
+ *
+ * Description:
+ *     Complete all bios of @rq and release it, or hand it to its
+ *     ->end_io handler if one is set. May be called from interrupt
+ *     context.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	blk_update_request(rq, error, blk_rq_bytes(rq));
+	blk_account_io_done(rq);
+
+	if (rq->end_io)
+		rq->end_io(rq, error);
+	else
+		blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+static void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				    struct request *rq, bool at_head)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+
+	trace_block_rq_insert(hctx->queue, rq);
+
+	spin_lock(&ctx->lock);
+	if (at_head)
+		list_add(&rq->queuelist, &ctx->rq_list);
+	else
+		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	spin_unlock(&ctx->lock);
+
+	if (!test_bit(ctx->index_hw, hctx->ctx_map))
+		set_bit(ctx->index_hw, hctx->ctx_map);
+}
+
+static void blk_mq_start_request(struct request *rq)
+{
+	trace_block_rq_issue(rq->q, rq);
+
+	/*
+	 * We are now handing the request to the hardware, initialize
+	 * resid_len to full count.
+	 */
+	rq->resid_len = blk_rq_bytes(rq);
+	rq->cmd_flags |= REQ_STARTED;
+}
+
+/*
+ * Move all requests pending on the software queues of @hctx, behind any
+ * that the driver refused earlier, and feed them to ->queue_rq() until it
+ * runs out of room.
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	int bit;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	for_each_set_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		struct blk_mq_ctx *ctx = hctx->ctxs[bit];
+
+		clear_bit(bit, hctx->ctx_map);
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock(&ctx->lock);
+	}
+
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		int ret;
+
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		blk_mq_start_request(rq);
+
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		if (ret == BLK_MQ_RQ_QUEUE_OK)
+			continue;
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		}
+
+		WARN_ON_ONCE(ret != BLK_MQ_RQ_QUEUE_ERROR);
+		rq->errors = -EIO;
+		blk_mq_end_io(rq, -EIO);
+	}
+
+	if (list_empty(&rq_list))
+		return;
+
+	spin_lock(&hctx->lock);
+	list_splice(&rq_list, &hctx->dispatch);
+	spin_unlock(&hctx->lock);
+
+	/*
+	 * The driver stopped the queue before returning BUSY, but it may
+	 * already have restarted it before the requests were put back.
+	 */
+	smp_mb();
+	if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+		kblockd_schedule_delayed_work(q, &hctx->run_work, 0);
+}
+
+static void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (!async)
+		__blk_mq_run_hw_queue(hctx);
+	else
+		kblockd_schedule_delayed_work(hctx->queue, &hctx->run_work, 0);
+}
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (blk_mq_hctx_has_pending(hctx))
+			blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	cancel_delayed_work(&hctx->run_work);
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+/*
+ * Restart all stopped hardware queues of @q. Safe from interrupt context,
+ * the queues are run from kblockd.
+ */
+void blk_mq_start_stopped_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			continue;
+
+		clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+		smp_mb__after_clear_bit();
+		blk_mq_run_hw_queue(hctx, true);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+static void blk_mq_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, run_work.work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+/**
+ * blk_mq_insert_request - queue a prepared request for execution
+ * @q:		the queue @rq was allocated from
+ * @rq:		request from blk_mq_alloc_request()
+ * @at_head:	insert at the head of the software queue
+ * @run_queue:	run the hardware queue right away
+ *
+ * Description:
+ *     Process context only, the hardware queue is run synchronously.
+ */
+void blk_mq_insert_request(struct request_queue *q, struct request *rq,
+			   bool at_head, bool run_queue)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(q, rq->mq_ctx->cpu);
+
+	__blk_mq_insert_request(hctx, rq, at_head);
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, false);
+}
+EXPORT_SYMBOL(blk_mq_insert_request);
+
+static void blk_mq_bio_to_request(struct request_queue *q, struct bio *bio)
+{
+	const int rw = bio_data_dir(bio);
+	unsigned int rw_flags = rw;
+	struct blk_mq_hw_ctx *hctx;
+	struct request *rq;
+
+	if (bio->bi_rw & REQ_SYNC)
+		rw_flags |= REQ_SYNC;
+
+	trace_block_getrq(q, bio, rw);
+	rq = blk_mq_alloc_request_wait(q, rw_flags, true);
+
+	init_request_from_bio(rq, bio);
+	rq->rq_disk = bio->bi_bdev->bd_disk;
+	drive_stat_acct(rq, 1);
+
+	hctx = blk_mq_map_queue(q, rq->mq_ctx->cpu);
+	__blk_mq_insert_request(hctx, rq, false);
+	blk_mq_run_hw_queue(hctx, false);
+}
+
+/*
+ * There is no flush state machine (blk-flush.c) without an elevator, so
+ * cache flushes are sequenced synchronously in the submitter's context.
+ */
+static void blk_mq_end_sync_rq(struct request *rq, int error)
+{
+	struct completion *waiting = rq->end_io_data;
+
+	rq->errors = error;
+	complete(waiting);
+}
+
+static int blk_mq_issue_flush(struct request_queue *q, struct gendisk *disk)
+{
+	DECLARE_COMPLETION_ONSTACK(wait);
+	struct request *rq;
+	int err;
+
+	rq = blk_mq_alloc_request_wait(q, WRITE_FLUSH, true);
+	rq->cmd_type = REQ_TYPE_FS;
+	/* like the flush sequence requests, not accounted as a normal IO */
+	rq->cmd_flags &= ~REQ_IO_STAT;
+	rq->rq_disk = disk;
+	rq->end_io = blk_mq_end_sync_rq;
+	rq->end_io_data = &wait;
+
+	blk_mq_insert_request(q, rq, false, true);
+	wait_for_completion(&wait);
+
+	err = rq->errors;
+	blk_mq_free_request(rq);
+	return err;
+}
+
+struct blk_mq_fua_wait {
+	struct completion	done;
+	int			error;
+};
+
+static void blk_mq_fua_end_io(struct bio *bio, int error)
+{
+	struct blk_mq_fua_wait *fw = bio->bi_private;
+
+	fw->error = error;
+	complete(&fw->done);
+}
+
+/*
+ * Returns true if @bio has been completed here, false if it should
+ * be queued as a normal request.
+ */
+static bool blk_mq_flush_bio(struct request_queue *q, struct bio *bio)
+{
+	struct gendisk *disk = bio->bi_bdev->bd_disk;
+	unsigned int fflags = q->flush_flags;
+	struct blk_mq_fua_wait fw;
+	bio_end_io_t *end_io;
+	void *private;
+	int err;
+
+	if (bio->bi_rw & REQ_FLUSH) {
+		if (!(fflags & REQ_FLUSH)) {
+			bio->bi_rw &= ~REQ_FLUSH;
+			if (!bio->bi_size) {
+				bio_endio(bio, 0);
+				return true;
+			}
+		} else if (bio->bi_size) {
+			err = blk_mq_issue_flush(q, disk);
+			if (err) {
+				bio_endio(bio, err);
+				return true;
+			}
+			bio->bi_rw &= ~REQ_FLUSH;
+		}
+	}
+
+	if (!(bio->bi_rw & REQ_FUA) || (fflags & REQ_FUA))
+		return false;
+
+	/* emulate FUA: wait for the write, then flush the cache */
+	bio->bi_rw &= ~REQ_FUA;
+	init_completion(&fw.done);
+	end_io = bio->bi_end_io;
+	private = bio->bi_private;
+	bio->bi_end_io = blk_mq_fua_end_io;
+	bio->bi_private = &fw;
+
+	blk_mq_bio_to_request(q, bio);
+	wait_for_completion(&fw.done);
+
+	bio->bi_end_io = end_io;
+	bio->bi_private = private;
+
+	err = fw.error;
+	if (!err && (fflags & REQ_FLUSH))
+		err = blk_mq_issue_flush(q, disk);
+	bio_endio(bio, err);
+	return true;
+}
+
+static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	blk_queue_bounce(q, &bio);
+
+	if (blk_mq_queue_enter(q)) {
+		bio_endio(bio, -ENODEV);
+		return;
+	}
+
+	if (unlikely(bio->bi_rw & (REQ_FLUSH | REQ_FUA)) &&
+	    blk_mq_flush_bio(q, bio))
+		goto out;
+
+	blk_mq_bio_to_request(q, bio);
+out:
+	blk_mq_queue_exit(q);
+}
+
+/*
+ * Spread the possible cpus evenly over the hardware queues, keeping
+ * neighbouring cpu ids on the same queue.
+ */
+static void blk_mq_map_queues(unsigned int *map, unsigned int nr_queues)
+{
+	unsigned int nr_cpus = num_possible_cpus();
+	unsigned int idx = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		map[cpu] = (idx++ * nr_queues) / nr_cpus;
+}
+
+static int blk_mq_init_hw_ctx(struct request_queue *q,
+			      struct blk_mq_hw_ctx *hctx,
+			      struct blk_mq_reg *reg, unsigned int index)
+{
+	unsigned int i;
+
+	spin_lock_init(&hctx->lock);
+	INIT_LIST_HEAD(&hctx->dispatch);
+	init_waitqueue_head(&hctx->tag_wait);
+	hctx->queue = q;
+	hctx->queue_num = index;
+	hctx->numa_node = reg->numa_node;
+	hctx->queue_depth = reg->queue_depth;
+
+	hctx->ctxs = kzalloc_node(hctx->nr_ctx * sizeof(void *), GFP_KERNEL,
+				  reg->numa_node);
+	hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(hctx->nr_ctx) *
+				     sizeof(unsigned long), GFP_KERNEL,
+				     reg->numa_node);
+	hctx->tag_map = kzalloc_node(BITS_TO_LONGS(hctx->queue_depth) *
+				     sizeof(unsigned long), GFP_KERNEL,
+				     reg->numa_node);
+	hctx->rqs = kzalloc_node(hctx->queue_depth * sizeof(struct request *),
+				 GFP_KERNEL, reg->numa_node);
+	if (!hctx->ctxs || !hctx->ctx_map || !hctx->tag_map || !hctx->rqs)
+		return -ENOMEM;
+
+	for (i = 0; i < hctx->queue_depth; i++) {
+		hctx->rqs[i] = kzalloc_node(sizeof(struct request) +
+					    reg->cmd_size, GFP_KERNEL,
+					    reg->numa_node);
+		if (!hctx->rqs[i])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void blk_mq_free_hw_ctx(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+	kfree(hctx->tag_map);
+	kfree(hctx->ctx_map);
+	kfree(hctx->ctxs);
+	free_cpumask_var(hctx->cpumask);
+	kfree(hctx);
+}
+
+/**
+ * blk_mq_init_queue - allocate a multi-queue request queue
+ * @reg:	queue geometry and driver operations
+ * @driver_data: passed to ->init_hctx() for each hardware queue
+ *
+ * Description:
+ *     Allocates a queue with @reg->nr_hw_queues hardware queues, each
+ *     with @reg->queue_depth preallocated requests carrying
+ *     @reg->cmd_size bytes of driver data, see blk_mq_rq_to_pdu().
+ *     Returns the queue or an ERR_PTR.
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct request_queue *q;
+	unsigned int nr_hw, i, j;
+	int cpu, ret = -ENOMEM;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq ||
+	    !reg->queue_depth || reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return ERR_PTR(-EINVAL);
+
+	nr_hw = min_t(unsigned int, reg->nr_hw_queues, num_possible_cpus());
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return ERR_PTR(-ENOMEM);
+
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->queue_hw_ctx = kzalloc_node(nr_hw * sizeof(void *), GFP_KERNEL,
+				       reg->numa_node);
+	q->mq_map = kzalloc_node(nr_cpu_ids * sizeof(unsigned int),
+				 GFP_KERNEL, reg->numa_node);
+	if (!q->queue_ctx || !q->queue_hw_ctx || !q->mq_map)
+		goto err;
+	q->nr_hw_queues = nr_hw;
+
+	for (i = 0; i < nr_hw; i++) {
+		hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, reg->numa_node);
+		if (!hctx)
+			goto err;
+		INIT_DELAYED_WORK(&hctx->run_work, blk_mq_work_fn);
+		q->queue_hw_ctx[i] = hctx;
+		if (!zalloc_cpumask_var(&hctx->cpumask, GFP_KERNEL))
+			goto err;
+	}
+
+	blk_mq_map_queues(q->mq_map, nr_hw);
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_ctx *ctx = per_cpu_ptr(q->queue_ctx, cpu);
+
+		memset(ctx, 0, sizeof(*ctx));
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		hctx = blk_mq_map_queue(q, cpu);
+		cpumask_set_cpu(cpu, hctx->cpumask);
+		hctx->nr_ctx++;
+	}
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (blk_mq_init_hw_ctx(q, hctx, reg, i))
+			goto err;
+		hctx->nr_ctx = 0;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_ctx *ctx = per_cpu_ptr(q->queue_ctx, cpu);
+
+		hctx = blk_mq_map_queue(q, cpu);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!reg->ops->init_hctx)
+			break;
+		ret = reg->ops->init_hctx(hctx, driver_data, i);
+		if (ret) {
+			for (j = 0; j < i; j++)
+				if (reg->ops->exit_hctx)
+					reg->ops->exit_hctx(q->queue_hw_ctx[j], j);
+			goto err;
+		}
+	}
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->queue_flags |= 1 << QUEUE_FLAG_IO_STAT;
+	q->mq_ops = reg->ops;
+
+	return q;
+
+err:
+	blk_cleanup_queue(q);
+	return ERR_PTR(ret);
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+/*
+ * Called from blk_cleanup_queue() once the queue is marked dead: wait for
+ * submitters still allocating and for all issued requests to complete.
+ */
+void blk_mq_drain_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	bool busy;
+	int i;
+
+	for (;;) {
+		busy = atomic_read(&q->mq_usage) != 0;
+		queue_for_each_hw_ctx(q, hctx, i) {
+			if (find_first_bit(hctx->tag_map, hctx->queue_depth) <
+			    hctx->queue_depth)
+				busy = true;
+		}
+		if (!busy)
+			break;
+
+		blk_mq_run_queues(q, false);
+		msleep(10);
+	}
+}
+
+void blk_mq_sync_queue(struct request_queue *q)
+{
+	unsigned int i;
+
+	if (!q->queue_hw_ctx)
+		return;
+
+	for (i = 0; i < q->nr_hw_queues; i++)
+		if (q->queue_hw_ctx[i])
+			cancel_delayed_work_sync(&q->queue_hw_ctx[i]->run_work);
+}
+
+/*
+ * Called on the final put of the queue. Copes with a partially set up
+ * queue, blk_mq_init_queue() unwinds through here too.
+ */
+void blk_mq_free_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	if (q->queue_hw_ctx) {
+		for (i = 0; i < q->nr_hw_queues; i++) {
+			hctx = q->queue_hw_ctx[i];
+			if (!hctx)
+				continue;
+			if (q->mq_ops && q->mq_ops->exit_hctx)
+				q->mq_ops->exit_hctx(hctx, i);
+			blk_mq_free_hw_ctx(hctx);
+		}
+		kfree(q->queue_hw_ctx);
+	}
+	kfree(q->mq_map);
+	free_percpu(q->queue_ctx);
+
+	q->queue_hw_ctx = NULL;
+	q->mq_map = NULL;
+	q->queue_ctx = NULL;
+	q->nr_hw_queues = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef INT_BLK_MQ_H
+#define INT_BLK_MQ_H
+
+/*
+ * Per-cpu software submission queue. Requests allocated on a cpu carry
+ * that cpu's ctx and are staged here until the hardware queue the cpu
+ * maps to is run.
+ */
+struct blk_mq_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	rq_list;
+	} ____cacheline_aligned_in_smp;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* bit in hctx->ctx_map */
+	unsigned int		last_tag;	/* tag allocation hint */
+
+	struct request_queue	*queue;
+} ____cacheline_aligned_in_smp;
+
+void blk_mq_drain_queue(struct request_queue *q);
+void blk_mq_sync_queue(struct request_queue *q);
+void blk_mq_free_queue(struct request_queue *q);
+
+#endif
@@ -81,6 +81,21 @@ void blk_queue_softirq_done(struct request_queue *q, softirq_done_fn *fn)
 }
 EXPORT_SYMBOL(blk_queue_softirq_done);
 
+/**
+ * blk_queue_poll - set the completion polling function of a queue
+ * @q:  queue
+ * @fn: polling function
+ *
+ * @fn reaps whatever completions the device has ready without waiting for
+ * an interrupt and returns how many it found. Setting it only makes
+ * polling available, it is turned on through the io_poll queue attribute.
+ */
+void blk_queue_poll(struct request_queue *q, poll_fn *fn)
+{
+	q->poll_fn = fn;
+}
+EXPORT_SYMBOL_GPL(blk_queue_poll);
+
 void blk_queue_rq_timeout(struct request_queue *q, unsigned int timeout)
 {
 	q->rq_timeout = timeout;
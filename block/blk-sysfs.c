@@ -9,6 +9,7 @@
 #include <linux/blktrace_api.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 struct queue_sysfs_entry {
 	struct attribute attr;
@@ -54,24 +55,24 @@ queue_requests_store(struct request_queue *q, const char *page, size_t count)
 	q->nr_requests = nr;
 	blk_queue_congestion_threshold(q);
 
-	if (rl->count[BLK_RW_SYNC] >= queue_congestion_on_threshold(q))
+	if (blk_rl_count(rl, BLK_RW_SYNC) >= queue_congestion_on_threshold(q))
 		blk_set_queue_congested(q, BLK_RW_SYNC);
-	else if (rl->count[BLK_RW_SYNC] < queue_congestion_off_threshold(q))
+	else if (blk_rl_count(rl, BLK_RW_SYNC) < queue_congestion_off_threshold(q))
 		blk_clear_queue_congested(q, BLK_RW_SYNC);
 
-	if (rl->count[BLK_RW_ASYNC] >= queue_congestion_on_threshold(q))
+	if (blk_rl_count(rl, BLK_RW_ASYNC) >= queue_congestion_on_threshold(q))
 		blk_set_queue_congested(q, BLK_RW_ASYNC);
-	else if (rl->count[BLK_RW_ASYNC] < queue_congestion_off_threshold(q))
+	else if (blk_rl_count(rl, BLK_RW_ASYNC) < queue_congestion_off_threshold(q))
 		blk_clear_queue_congested(q, BLK_RW_ASYNC);
 
-	if (rl->count[BLK_RW_SYNC] >= q->nr_requests) {
+	if (blk_rl_count(rl, BLK_RW_SYNC) >= q->nr_requests) {
 		blk_set_queue_full(q, BLK_RW_SYNC);
 	} else {
 		blk_clear_queue_full(q, BLK_RW_SYNC);
 		wake_up(&rl->wait[BLK_RW_SYNC]);
 	}
 
-	if (rl->count[BLK_RW_ASYNC] >= q->nr_requests) {
+	if (blk_rl_count(rl, BLK_RW_ASYNC) >= q->nr_requests) {
 		blk_set_queue_full(q, BLK_RW_ASYNC);
 	} else {
 		blk_clear_queue_full(q, BLK_RW_ASYNC);
@@ -273,6 +274,75 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+static ssize_t queue_poll_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(blk_queue_io_poll(q), page);
+}
+
+static ssize_t queue_poll_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	unsigned long val;
+	ssize_t ret;
+
+	if (!q->poll_fn)
+		return -EINVAL;
+
+	ret = queue_var_store(&val, page, count);
+	spin_lock_irq(q->queue_lock);
+	if (val)
+		queue_flag_set(QUEUE_FLAG_POLL, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_POLL, q);
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t queue_poll_spin_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(q->poll_spin_us, page);
+}
+
+static ssize_t queue_poll_spin_store(struct request_queue *q, const char *page,
+				     size_t count)
+{
+	unsigned long val;
+	ssize_t ret;
+
+	ret = queue_var_store(&val, page, count);
+	if (val > USEC_PER_SEC)
+		return -EINVAL;
+
+	q->poll_spin_us = val;
+	return ret;
+}
+
+static ssize_t queue_poll_stats_show(struct request_queue *q, char *page)
+{
+	unsigned long invoked = 0, success = 0, fallback = 0;
+	u64 success_ns = 0, max_ns = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_poll_stat *stat = per_cpu_ptr(q->poll_stat, cpu);
+
+		invoked += stat->invoked;
+		success += stat->success;
+		fallback += stat->fallback;
+		success_ns += stat->success_ns;
+		max_ns = max(max_ns, stat->max_ns);
+	}
+
+	if (success)
+		do_div(success_ns, success);
+
+	return sprintf(page, "invoked %lu\nsuccess %lu\nfallback %lu\n"
+		       "mean_ns %llu\nmax_ns %llu\n", invoked, success, fallback,
+		       (unsigned long long)success_ns,
+		       (unsigned long long)max_ns);
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -387,6 +457,23 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+static struct queue_sysfs_entry queue_poll_entry = {
+	.attr = {.name = "io_poll", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_show,
+	.store = queue_poll_store,
+};
+
+static struct queue_sysfs_entry queue_poll_spin_entry = {
+	.attr = {.name = "io_poll_spin_us", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_spin_show,
+	.store = queue_poll_spin_store,
+};
+
+static struct queue_sysfs_entry queue_poll_stats_entry = {
+	.attr = {.name = "io_poll_stats", .mode = S_IRUGO },
+	.show = queue_poll_stats_show,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -409,6 +496,9 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_poll_entry.attr,
+	&queue_poll_spin_entry.attr,
+	&queue_poll_stats_entry.attr,
 	NULL,
 };
 
@@ -475,7 +565,6 @@ static void blk_release_queue(struct kobject *kobj)
 {
 	struct request_queue *q =
 		container_of(kobj, struct request_queue, kobj);
-	struct request_list *rl = &q->rq;
 
 	blk_sync_queue(q);
 
@@ -484,8 +573,7 @@ static void blk_release_queue(struct kobject *kobj)
 
 	blk_throtl_exit(q);
 
-	if (rl->rq_pool)
-		mempool_destroy(rl->rq_pool);
+	blk_exit_free_list(q);
 
 	if (q->queue_tags)
 		__blk_queue_free_tags(q);
@@ -493,6 +581,10 @@ static void blk_release_queue(struct kobject *kobj)
 	blk_throtl_release(q);
 	blk_trace_shutdown(q);
 
+	if (q->queue_ctx || q->queue_hw_ctx)
+		blk_mq_free_queue(q);
+
+	free_percpu(q->poll_stat);
 	bdi_destroy(&q->backing_dev_info);
 	kmem_cache_free(blk_requestq_cachep, q);
 }
@@ -18,6 +18,9 @@ static int throtl_grp_quantum = 8;
 /* Total max dispatch from all groups in one round */
 static int throtl_quantum = 32;
 
+/* Max dispatch from one run of the dispatch work, in rounds of throtl_quantum */
+static int throtl_batch_rounds = 4;
+
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
@@ -241,6 +244,13 @@ throtl_tg_fill_dev_details(struct throtl_data *td, struct throtl_grp *tg)
 	if (!tg || tg->blkg.dev)
 		return;
 
+	/*
+	 * Nothing to fill in until the driver registers its device. Don't
+	 * take the queue lock for every bio of a queue which never does.
+	 */
+	if (!ACCESS_ONCE(td->queue->backing_dev_info.dev))
+		return;
+
 	spin_lock_irq(td->queue->queue_lock);
 	__throtl_tg_fill_dev_details(td, tg);
 	spin_unlock_irq(td->queue->queue_lock);
@@ -900,47 +910,64 @@ static void throtl_process_limit_change(struct throtl_data *td)
 	}
 }
 
-/* Dispatch throttled bios. Should be called without queue lock held. */
+static inline bool throtl_dispatch_ready(struct throtl_data *td)
+{
+	struct throtl_grp *tg = throtl_rb_first(&td->tg_service_tree);
+
+	return tg && !time_before(jiffies, tg->disptime);
+}
+
+/*
+ * Dispatch throttled bios. Should be called without queue lock held.
+ *
+ * When many groups have their slices expire together, keep dispatching
+ * rounds of throtl_quantum bios from here instead of bouncing every round
+ * through kthrotld, dropping the queue lock while each round is submitted.
+ */
 static int throtl_dispatch(struct request_queue *q)
 {
 	struct throtl_data *td = q->td;
-	unsigned int nr_disp = 0;
+	unsigned int nr_disp = 0, nr_round, rounds = 0;
 	struct bio_list bio_list_on_stack;
 	struct bio *bio;
 	struct blk_plug plug;
 
+	blk_start_plug(&plug);
 	spin_lock_irq(q->queue_lock);
 
 	throtl_process_limit_change(td);
 
-	if (!total_nr_queued(td))
-		goto out;
+	while (total_nr_queued(td) && rounds++ < throtl_batch_rounds) {
+		bio_list_init(&bio_list_on_stack);
+
+		throtl_log(td, "dispatch nr_queued=%u read=%u write=%u",
+				total_nr_queued(td), td->nr_queued[READ],
+				td->nr_queued[WRITE]);
 
-	bio_list_init(&bio_list_on_stack);
+		nr_round = throtl_select_dispatch(td, &bio_list_on_stack);
+		if (!nr_round)
+			break;
 
-	throtl_log(td, "dispatch nr_queued=%u read=%u write=%u",
-			total_nr_queued(td), td->nr_queued[READ],
-			td->nr_queued[WRITE]);
+		throtl_log(td, "bios disp=%u", nr_round);
+		nr_disp += nr_round;
 
-	nr_disp = throtl_select_dispatch(td, &bio_list_on_stack);
+		spin_unlock_irq(q->queue_lock);
+		while((bio = bio_list_pop(&bio_list_on_stack)))
+			generic_make_request(bio);
+		spin_lock_irq(q->queue_lock);
 
-	if (nr_disp)
-		throtl_log(td, "bios disp=%u", nr_disp);
+		if (!throtl_dispatch_ready(td))
+			break;
+	}
 
 	throtl_schedule_next_dispatch(td);
-out:
 	spin_unlock_irq(q->queue_lock);
 
 	/*
 	 * If we dispatched some requests, unplug the queue to make sure
 	 * immediate dispatch
 	 */
-	if (nr_disp) {
-		blk_start_plug(&plug);
-		while((bio = bio_list_pop(&bio_list_on_stack)))
-			generic_make_request(bio);
-		blk_finish_plug(&plug);
-	}
+	blk_finish_plug(&plug);
 	return nr_disp;
 }
 
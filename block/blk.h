@@ -16,11 +16,39 @@ void blk_rq_bio_prep(struct request_queue *q, struct request *rq,
 int blk_rq_append_bio(struct request_queue *q, struct request *rq,
 		      struct bio *bio);
 void blk_drain_queue(struct request_queue *q, bool drain_all);
+void drive_stat_acct(struct request *rq, int new_io);
+void blk_account_io_done(struct request *req);
 void blk_dequeue_request(struct request *rq);
 void __blk_queue_free_tags(struct request_queue *q);
 bool __blk_end_bidi_request(struct request *rq, int error,
 			    unsigned int nr_bytes, unsigned int bidi_bytes);
 
+/*
+ * Per-cpu cache of free requests in front of the request_list mempool
+ */
+#define BLK_RQ_CACHE_SIZE	8
+
+struct blk_rq_cache {
+	unsigned int nr;
+	struct request *rqs[BLK_RQ_CACHE_SIZE];
+};
+
+void blk_exit_free_list(struct request_queue *q);
+
+/* Default time a synchronous waiter polls before sleeping */
+#define BLK_POLL_SPIN_US	20
+
+/*
+ * Per-cpu completion polling statistics, see blk_poll()
+ */
+struct blk_poll_stat {
+	unsigned long	invoked;	/* waits that started polling */
+	unsigned long	success;	/* woken while polling */
+	unsigned long	fallback;	/* spun out and went to sleep */
+	u64		success_ns;	/* total time polled before a wakeup */
+	u64		max_ns;		/* longest successful poll */
+};
+
 void blk_rq_timed_out_timer(unsigned long data);
 void blk_delete_timer(struct request *);
 void blk_add_timer(struct request *);
@@ -0,0 +1,725 @@
+/*
+ *  Lane deadline i/o scheduler.
+ *
+ *  Deadline scheduling within lanes, one lane per blkio cgroup and io
+ *  priority class. Lanes share the device by weight and the scheduler
+ *  never idles waiting for a lane to issue more IO.
+ *
+ *  Based on the deadline i/o scheduler, Copyright (C) 2002 Jens Axboe
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/rbtree.h>
+#include <linux/ioprio.h>
+#include "blk-cgroup.h"
+
+/*
+ * See Documentation/block/lane-iosched.txt
+ */
+static const int read_expire = HZ / 2;  /* max time before a read is submitted. */
+static const int write_expire = 5 * HZ; /* ditto for writes, these limits are SOFT! */
+static const int writes_starved = 2;    /* max times reads can starve a write */
+static const int fifo_batch = 16;       /* # of sequential requests treated as one
+				     by the above parameters. For throughput. */
+
+/* share of the device per io priority class, multiplied by cgroup weight */
+static const int rt_weight = 4;
+static const int be_weight = 2;
+static const int idle_weight = 1;
+
+#define LANE_WEIGHT_MAX		100
+#define LANE_VTIME_SCALE	(1ULL << 24)
+
+struct lane {
+	struct list_head node;		/* on lane_data->lanes */
+	unsigned int key;		/* cgroup id and io priority class */
+	unsigned short ioprio_class;
+	unsigned int cgroup_weight;	/* refreshed on every request */
+	int ref;			/* requests attached to this lane */
+
+	/*
+	 * requests are present on both sort_list and fifo_list
+	 */
+	struct rb_root sort_list[2];
+	struct list_head fifo_list[2];
+	struct request *next_rq[2];
+	unsigned int starved;		/* times reads have starved writes */
+	unsigned int nr_queued;
+
+	u64 vtime;			/* service received, scaled by weight */
+};
+
+struct lane_data {
+	struct list_head lanes;
+
+	/*
+	 * lane the current batch is dispatched from
+	 */
+	struct lane *active;
+	unsigned int batching;		/* number of sequential requests made */
+	u64 vtime;			/* vtime of the last lane served by share */
+
+	/*
+	 * settings that change how the i/o scheduler behaves
+	 */
+	int fifo_expire[2];
+	int fifo_batch;
+	int writes_starved;
+	int front_merges;
+	int class_weight[IOPRIO_CLASS_IDLE + 1];
+};
+
+#define RQ_LANE(rq)	((struct lane *) (rq)->elevator_private[0])
+
+/*
+ * Lane key of the current task: its blkio cgroup and io priority class.
+ */
+static unsigned int
+lane_task_key(unsigned short *ioprio_class, unsigned int *cgroup_weight)
+{
+	struct io_context *ioc = current->io_context;
+	unsigned int id = 0;
+	unsigned short class;
+
+	if (ioc && ioprio_valid(ioc->ioprio))
+		class = IOPRIO_PRIO_CLASS(ioc->ioprio);
+	else
+		class = task_nice_ioclass(current);
+
+	*cgroup_weight = BLKIO_WEIGHT_DEFAULT;
+#if defined(CONFIG_BLK_CGROUP) || defined(CONFIG_BLK_CGROUP_MODULE)
+	{
+		struct blkio_cgroup *blkcg;
+
+		rcu_read_lock();
+		blkcg = task_blkio_cgroup(current);
+		id = css_id(&blkcg->css);
+		*cgroup_weight = blkcg->weight;
+		rcu_read_unlock();
+	}
+#endif
+
+	*ioprio_class = class;
+	return id << 2 | class;
+}
+
+static struct lane *lane_find(struct lane_data *ld, unsigned int key)
+{
+	struct lane *lane;
+
+	list_for_each_entry(lane, &ld->lanes, node)
+		if (lane->key == key)
+			return lane;
+
+	return NULL;
+}
+
+static inline u64 lane_charge(struct lane_data *ld, struct lane *lane)
+{
+	unsigned int weight;
+
+	weight = lane->cgroup_weight * ld->class_weight[lane->ioprio_class];
+	return div_u64(LANE_VTIME_SCALE, max(weight, 1U));
+}
+
+static inline int
+lane_fifo_expire(struct lane_data *ld, struct lane *lane, int data_dir)
+{
+	switch (lane->ioprio_class) {
+	case IOPRIO_CLASS_RT:
+		return ld->fifo_expire[data_dir] / 4;
+	case IOPRIO_CLASS_IDLE:
+		return ld->fifo_expire[data_dir] * 4;
+	default:
+		return ld->fifo_expire[data_dir];
+	}
+}
+
+/*
+ * Called with the queue lock held.
+ */
+static void lane_put(struct lane_data *ld, struct lane *lane)
+{
+	BUG_ON(lane->ref <= 0);
+
+	if (--lane->ref || lane->nr_queued)
+		return;
+
+	if (ld->active == lane)
+		ld->active = NULL;
+	list_del(&lane->node);
+	kfree(lane);
+}
+
+static void lane_move_request(struct lane_data *, struct request *);
+
+/*
+ * get the request after `rq' in sector-sorted order
+ */
+static inline struct request *
+lane_latter_request(struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+static inline void
+lane_del_rq_rb(struct lane *lane, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	if (lane->next_rq[data_dir] == rq)
+		lane->next_rq[data_dir] = lane_latter_request(rq);
+
+	elv_rb_del(&lane->sort_list[data_dir], rq);
+}
+
+/*
+ * add rq to its lane's rbtree and fifo
+ */
+static void
+lane_add_request(struct request_queue *q, struct request *rq)
+{
+	struct lane_data *ld = q->elevator->elevator_data;
+	struct lane *lane = RQ_LANE(rq);
+	const int data_dir = rq_data_dir(rq);
+
+	/*
+	 * a lane that went idle doesn't get to bank the service it missed
+	 */
+	if (!lane->nr_queued && lane->vtime < ld->vtime)
+		lane->vtime = ld->vtime;
+	lane->nr_queued++;
+
+	elv_rb_add(&lane->sort_list[data_dir], rq);
+
+	/*
+	 * set expire time and add to fifo list
+	 */
+	rq_set_fifo_time(rq, jiffies + lane_fifo_expire(ld, lane, data_dir));
+	list_add_tail(&rq->queuelist, &lane->fifo_list[data_dir]);
+}
+
+/*
+ * remove rq from its lane's rbtree and fifo.
+ */
+static void lane_remove_request(struct request_queue *q, struct request *rq)
+{
+	struct lane *lane = RQ_LANE(rq);
+
+	rq_fifo_clear(rq);
+	lane_del_rq_rb(lane, rq);
+	lane->nr_queued--;
+}
+
+static int
+lane_merge(struct request_queue *q, struct request **req, struct bio *bio)
+{
+	struct lane_data *ld = q->elevator->elevator_data;
+	struct request *__rq;
+	struct lane *lane;
+	unsigned short class;
+	unsigned int weight;
+
+	/*
+	 * check for front merge
+	 */
+	if (ld->front_merges) {
+		sector_t sector = bio->bi_sector + bio_sectors(bio);
+
+		lane = lane_find(ld, lane_task_key(&class, &weight));
+		if (!lane)
+			return ELEVATOR_NO_MERGE;
+
+		__rq = elv_rb_find(&lane->sort_list[bio_data_dir(bio)], sector);
+		if (__rq) {
+			BUG_ON(sector != blk_rq_pos(__rq));
+
+			if (elv_rq_merge_ok(__rq, bio)) {
+				*req = __rq;
+				return ELEVATOR_FRONT_MERGE;
+			}
+		}
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+
+static int
+lane_allow_merge(struct request_queue *q, struct request *rq, struct bio *bio)
+{
+	unsigned short class;
+	unsigned int weight;
+
+	/*
+	 * Don't let a bio ride along in another lane's request
+	 */
+	if (!(rq->cmd_flags & REQ_ELVPRIV) || !RQ_LANE(rq))
+		return 1;
+
+	return RQ_LANE(rq)->key == lane_task_key(&class, &weight);
+}
+
+static void lane_merged_request(struct request_queue *q,
+				struct request *req, int type)
+{
+	struct lane *lane = RQ_LANE(req);
+
+	/*
+	 * if the merge was a front merge, we need to reposition request
+	 */
+	if (type == ELEVATOR_FRONT_MERGE) {
+		elv_rb_del(&lane->sort_list[rq_data_dir(req)], req);
+		elv_rb_add(&lane->sort_list[rq_data_dir(req)], req);
+	}
+}
+
+static void
+lane_merged_requests(struct request_queue *q, struct request *req,
+		     struct request *next)
+{
+	/*
+	 * if next expires before rq, assign its expire time to rq
+	 * and move into next position (next will be deleted) in fifo
+	 */
+	if (RQ_LANE(req) == RQ_LANE(next) &&
+	    !list_empty(&req->queuelist) && !list_empty(&next->queuelist)) {
+		if (time_before(rq_fifo_time(next), rq_fifo_time(req))) {
+			list_move(&req->queuelist, &next->queuelist);
+			rq_set_fifo_time(req, rq_fifo_time(next));
+		}
+	}
+
+	/*
+	 * kill knowledge of next, this one is a goner
+	 */
+	lane_remove_request(q, next);
+}
+
+/*
+ * move an entry to dispatch queue and charge its lane for it
+ */
+static void
+lane_move_request(struct lane_data *ld, struct request *rq)
+{
+	struct lane *lane = RQ_LANE(rq);
+	const int data_dir = rq_data_dir(rq);
+
+	lane->next_rq[READ] = NULL;
+	lane->next_rq[WRITE] = NULL;
+	lane->next_rq[data_dir] = lane_latter_request(rq);
+
+	lane->vtime += lane_charge(ld, lane);
+
+	/*
+	 * take it off the sort and fifo list, move
+	 * to dispatch queue
+	 */
+	lane_remove_request(rq->q, rq);
+	elv_dispatch_add_tail(rq->q, rq);
+}
+
+/*
+ * lane_check_fifo returns 0 if there are no expired requests on the fifo,
+ * 1 otherwise. Requires !list_empty(&lane->fifo_list[data_dir])
+ */
+static inline int lane_check_fifo(struct lane *lane, int ddir)
+{
+	struct request *rq = rq_entry_fifo(lane->fifo_list[ddir].next);
+
+	/*
+	 * rq is expired!
+	 */
+	if (time_after(jiffies, rq_fifo_time(rq)))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Idle class lanes only get the device when nobody else wants it (or
+ * their deadlines expire), the others share it by weighted vtime.
+ */
+static inline bool lane_before(struct lane *a, struct lane *b)
+{
+	bool a_idle = a->ioprio_class == IOPRIO_CLASS_IDLE;
+	bool b_idle = b->ioprio_class == IOPRIO_CLASS_IDLE;
+
+	if (a_idle != b_idle)
+		return b_idle;
+
+	return a->vtime < b->vtime;
+}
+
+/*
+ * Pick the lane to start the next batch from: the one holding the request
+ * that expired first if there is one, otherwise the one furthest behind on
+ * its share.
+ */
+static struct lane *lane_select(struct lane_data *ld)
+{
+	struct lane *lane, *expired = NULL, *next = NULL;
+	unsigned long expire = 0;
+	struct request *rq;
+	int dir;
+
+	list_for_each_entry(lane, &ld->lanes, node) {
+		if (!lane->nr_queued)
+			continue;
+
+		for (dir = READ; dir <= WRITE; dir++) {
+			if (list_empty(&lane->fifo_list[dir]))
+				continue;
+
+			rq = rq_entry_fifo(lane->fifo_list[dir].next);
+			if (time_after(jiffies, rq_fifo_time(rq)) &&
+			    (!expired || time_before(rq_fifo_time(rq), expire))) {
+				expired = lane;
+				expire = rq_fifo_time(rq);
+			}
+		}
+
+		if (!next || lane_before(lane, next))
+			next = lane;
+	}
+
+	if (expired)
+		return expired;
+
+	if (next && next->vtime > ld->vtime)
+		ld->vtime = next->vtime;
+
+	return next;
+}
+
+/*
+ * lane_dispatch_requests selects the best lane by expiry and share, and
+ * the best request within it according to read/write expire, fifo_batch,
+ * etc. It never waits for a lane, an empty lane simply loses its turn.
+ */
+static int lane_dispatch_requests(struct request_queue *q, int force)
+{
+	struct lane_data *ld = q->elevator->elevator_data;
+	struct lane *lane = ld->active;
+	struct request *rq = NULL;
+	int reads, writes;
+	int data_dir;
+
+	/*
+	 * batches are currently reads XOR writes
+	 */
+	if (lane) {
+		if (lane->next_rq[WRITE])
+			rq = lane->next_rq[WRITE];
+		else
+			rq = lane->next_rq[READ];
+	}
+
+	if (rq && ld->batching < ld->fifo_batch)
+		/* we have a next request are still entitled to batch */
+		goto dispatch_request;
+
+	/*
+	 * at this point we are not running a batch. select the lane and
+	 * then the appropriate data direction (read / write)
+	 */
+	lane = lane_select(ld);
+	if (!lane)
+		return 0;
+
+	ld->active = lane;
+	reads = !list_empty(&lane->fifo_list[READ]);
+	writes = !list_empty(&lane->fifo_list[WRITE]);
+
+	if (reads) {
+		BUG_ON(RB_EMPTY_ROOT(&lane->sort_list[READ]));
+
+		if (writes && (lane->starved++ >= ld->writes_starved))
+			goto dispatch_writes;
+
+		data_dir = READ;
+
+		goto dispatch_find_request;
+	}
+
+	/*
+	 * there are either no reads or writes have been starved
+	 */
+dispatch_writes:
+	BUG_ON(RB_EMPTY_ROOT(&lane->sort_list[WRITE]));
+
+	lane->starved = 0;
+
+	data_dir = WRITE;
+
+dispatch_find_request:
+	/*
+	 * we are not running a batch, find best request for selected data_dir
+	 */
+	if (lane_check_fifo(lane, data_dir) || !lane->next_rq[data_dir]) {
+		/*
+		 * A deadline has expired, the last request was in the other
+		 * direction, or we have run out of higher-sectored requests.
+		 * Start again from the request with the earliest expiry time.
+		 */
+		rq = rq_entry_fifo(lane->fifo_list[data_dir].next);
+	} else {
+		/*
+		 * The last req was the same dir and we have a next request in
+		 * sort order. No expired requests so continue on from here.
+		 */
+		rq = lane->next_rq[data_dir];
+	}
+
+	ld->batching = 0;
+
+dispatch_request:
+	/*
+	 * rq is the selected appropriate request.
+	 */
+	ld->batching++;
+	lane_move_request(ld, rq);
+
+	return 1;
+}
+
+/*
+ * Attach the request to the lane of the allocating task, creating the
+ * lane if this is its first request.
+ */
+static int
+lane_set_request(struct request_queue *q, struct request *rq, gfp_t gfp_mask)
+{
+	struct lane_data *ld = q->elevator->elevator_data;
+	struct lane *lane, *new = NULL;
+	unsigned short class;
+	unsigned int key, weight;
+	unsigned long flags;
+	int dir;
+
+	key = lane_task_key(&class, &weight);
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	lane = lane_find(ld, key);
+	if (!lane) {
+		spin_unlock_irqrestore(q->queue_lock, flags);
+
+		new = kmalloc_node(sizeof(*new), gfp_mask | __GFP_ZERO, q->node);
+		if (!new)
+			return 1;
+
+		INIT_LIST_HEAD(&new->node);
+		new->key = key;
+		new->ioprio_class = class;
+		for (dir = READ; dir <= WRITE; dir++) {
+			new->sort_list[dir] = RB_ROOT;
+			INIT_LIST_HEAD(&new->fifo_list[dir]);
+		}
+		new->vtime = ld->vtime;
+
+		spin_lock_irqsave(q->queue_lock, flags);
+		/* somebody may have raced us to it */
+		lane = lane_find(ld, key);
+		if (!lane) {
+			lane = new;
+			new = NULL;
+			list_add_tail(&lane->node, &ld->lanes);
+		}
+	}
+
+	lane->cgroup_weight = weight;
+	lane->ref++;
+	rq->elevator_private[0] = lane;
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	kfree(new);
+	return 0;
+}
+
+static void lane_put_request(struct request *rq)
+{
+	struct lane_data *ld = rq->q->elevator->elevator_data;
+	struct lane *lane = RQ_LANE(rq);
+
+	if (lane) {
+		rq->elevator_private[0] = NULL;
+		lane_put(ld, lane);
+	}
+}
+
+static void lane_exit_queue(struct elevator_queue *e)
+{
+	struct lane_data *ld = e->elevator_data;
+
+	BUG_ON(!list_empty(&ld->lanes));
+
+	kfree(ld);
+}
+
+/*
+ * initialize elevator private data (lane_data).
+ */
+static void *lane_init_queue(struct request_queue *q)
+{
+	struct lane_data *ld;
+
+	ld = kmalloc_node(sizeof(*ld), GFP_KERNEL | __GFP_ZERO, q->node);
+	if (!ld)
+		return NULL;
+
+	INIT_LIST_HEAD(&ld->lanes);
+	ld->fifo_expire[READ] = read_expire;
+	ld->fifo_expire[WRITE] = write_expire;
+	ld->writes_starved = writes_starved;
+	ld->front_merges = 1;
+	ld->fifo_batch = fifo_batch;
+	ld->class_weight[IOPRIO_CLASS_RT] = rt_weight;
+	ld->class_weight[IOPRIO_CLASS_BE] = be_weight;
+	ld->class_weight[IOPRIO_CLASS_IDLE] = idle_weight;
+	/* tasks without a class are BE, see task_nice_ioclass() */
+	ld->class_weight[IOPRIO_CLASS_NONE] = be_weight;
+	return ld;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+lane_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+lane_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct lane_data *ld = e->elevator_data;			\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return lane_var_show(__data, (page));				\
+}
+SHOW_FUNCTION(lane_read_expire_show, ld->fifo_expire[READ], 1);
+SHOW_FUNCTION(lane_write_expire_show, ld->fifo_expire[WRITE], 1);
+SHOW_FUNCTION(lane_writes_starved_show, ld->writes_starved, 0);
+SHOW_FUNCTION(lane_front_merges_show, ld->front_merges, 0);
+SHOW_FUNCTION(lane_fifo_batch_show, ld->fifo_batch, 0);
+SHOW_FUNCTION(lane_rt_weight_show, ld->class_weight[IOPRIO_CLASS_RT], 0);
+SHOW_FUNCTION(lane_be_weight_show, ld->class_weight[IOPRIO_CLASS_BE], 0);
+SHOW_FUNCTION(lane_idle_weight_show, ld->class_weight[IOPRIO_CLASS_IDLE], 0);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct lane_data *ld = e->elevator_data;			\
+	int __data;							\
+	int ret = lane_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(lane_read_expire_store, &ld->fifo_expire[READ], 0, INT_MAX, 1);
+STORE_FUNCTION(lane_write_expire_store, &ld->fifo_expire[WRITE], 0, INT_MAX, 1);
+STORE_FUNCTION(lane_writes_starved_store, &ld->writes_starved, INT_MIN, INT_MAX, 0);
+STORE_FUNCTION(lane_front_merges_store, &ld->front_merges, 0, 1, 0);
+STORE_FUNCTION(lane_fifo_batch_store, &ld->fifo_batch, 0, INT_MAX, 0);
+STORE_FUNCTION(lane_rt_weight_store, &ld->class_weight[IOPRIO_CLASS_RT], 1, LANE_WEIGHT_MAX, 0);
+STORE_FUNCTION(lane_idle_weight_store, &ld->class_weight[IOPRIO_CLASS_IDLE], 1, LANE_WEIGHT_MAX, 0);
+#undef STORE_FUNCTION
+
+/* BE is also the weight of tasks that never set a class */
+static ssize_t
+lane_be_weight_store(struct elevator_queue *e, const char *page, size_t count)
+{
+	struct lane_data *ld = e->elevator_data;
+	int data;
+	int ret = lane_var_store(&data, page, count);
+
+	data = clamp(data, 1, LANE_WEIGHT_MAX);
+	ld->class_weight[IOPRIO_CLASS_BE] = data;
+	ld->class_weight[IOPRIO_CLASS_NONE] = data;
+	return ret;
+}
+
+#define LANE_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, lane_##name##_show, \
+				      lane_##name##_store)
+
+static struct elv_fs_entry lane_attrs[] = {
+	LANE_ATTR(read_expire),
+	LANE_ATTR(write_expire),
+	LANE_ATTR(writes_starved),
+	LANE_ATTR(front_merges),
+	LANE_ATTR(fifo_batch),
+	LANE_ATTR(rt_weight),
+	LANE_ATTR(be_weight),
+	LANE_ATTR(idle_weight),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_lane = {
+	.ops = {
+		.elevator_merge_fn = 		lane_merge,
+		.elevator_merged_fn =		lane_merged_request,
+		.elevator_merge_req_fn =	lane_merged_requests,
+		.elevator_allow_merge_fn =	lane_allow_merge,
+		.elevator_dispatch_fn =		lane_dispatch_requests,
+		.elevator_add_req_fn =		lane_add_request,
+		.elevator_former_req_fn =	elv_rb_former_request,
+		.elevator_latter_req_fn =	elv_rb_latter_request,
+		.elevator_set_req_fn =		lane_set_request,
+		.elevator_put_req_fn =		lane_put_request,
+		.elevator_init_fn =		lane_init_queue,
+		.elevator_exit_fn =		lane_exit_queue,
+	},
+
+	.elevator_attrs = lane_attrs,
+	.elevator_name = "lane",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init lane_init(void)
+{
+	elv_register(&iosched_lane);
+
+	return 0;
+}
+
+static void __exit lane_exit(void)
+{
+	elv_unregister(&iosched_lane);
+}
+
+module_init(lane_init);
+module_exit(lane_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("lane deadline IO scheduler");
@@ -80,11 +80,14 @@
 
 #include <asm/uaccess.h>
 
+#define LOOP_MAX_WORKERS	128
+
 static DEFINE_IDR(loop_index_idr);
 static DEFINE_MUTEX(loop_index_mutex);
 
 static int max_part;
 static int part_shift;
+static int workers = 1;
 
 /*
  * Transfer functions
@@ -402,6 +405,52 @@ lo_receive(struct loop_device *lo, struct bio *bio, int bsize, loff_t pos)
 	return ret;
 }
 
+/*
+ * In nocache mode only the loop device keeps the data cached: write it
+ * through to the backing store and drop the backing file's copy of the
+ * range once the bio has been served.  This is not O_DIRECT, the data
+ * still passes through the backing file's page cache on its way.
+ */
+static int loop_drop_cache(struct loop_device *lo, struct bio *bio, loff_t pos)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	loff_t end = pos + bio->bi_size - 1;
+	int ret = 0;
+
+	if (bio_rw(bio) == WRITE) {
+		ret = filemap_write_and_wait_range(mapping, pos, end);
+		if (unlikely(ret))
+			ret = -EIO;
+	}
+	invalidate_mapping_pages(mapping, pos >> PAGE_CACHE_SHIFT,
+				 end >> PAGE_CACHE_SHIFT);
+	return ret;
+}
+
+/*
+ * Readahead on the backing file only fills its cache with pages we
+ * would drop again, the loop device does its own readahead.
+ */
+static void loop_set_backing_random(struct file *file, bool random)
+{
+	spin_lock(&file->f_lock);
+	if (random)
+		file->f_mode |= FMODE_RANDOM;
+	else
+		file->f_mode &= ~FMODE_RANDOM;
+	spin_unlock(&file->f_lock);
+}
+
+static void loop_update_nocache(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	bool nocache = lo->lo_flags & LO_FLAGS_NOCACHE;
+
+	loop_set_backing_random(file, nocache);
+	if (nocache)
+		invalidate_mapping_pages(file->f_mapping, 0, -1);
+}
+
 static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 {
 	loff_t pos;
@@ -453,6 +502,8 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 	} else
 		ret = lo_receive(lo, bio, lo->lo_blocksize, pos);
 
+	if (!ret && bio->bi_size && (lo->lo_flags & LO_FLAGS_NOCACHE))
+		ret = loop_drop_cache(lo, bio, pos);
 out:
 	return ret;
 }
@@ -505,11 +556,36 @@ struct switch_request {
 
 static void do_loop_switch(struct loop_device *, struct switch_request *);
 
+struct loop_cmd {
+	struct work_struct	work;
+	struct loop_device	*lo;
+	struct bio		*bio;
+};
+
+static void loop_work_fn(struct work_struct *work)
+{
+	struct loop_cmd *cmd = container_of(work, struct loop_cmd, work);
+	struct loop_device *lo = cmd->lo;
+	struct bio *bio = cmd->bio;
+
+	mempool_free(cmd, lo->lo_cmd_pool);
+	bio_endio(bio, do_bio_filebacked(lo, bio));
+}
+
 static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 {
 	if (unlikely(!bio->bi_bdev)) {
+		/* everything handed to the workers has to finish first */
+		flush_workqueue(lo->lo_wq);
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
+	} else if (lo->lo_nr_workers > 1) {
+		struct loop_cmd *cmd = mempool_alloc(lo->lo_cmd_pool, GFP_NOIO);
+
+		INIT_WORK(&cmd->work, loop_work_fn);
+		cmd->lo = lo;
+		cmd->bio = bio;
+		queue_work(lo->lo_wq, &cmd->work);
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
 		bio_endio(bio, ret);
@@ -520,7 +596,9 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
  * worker thread that handles reads/writes to file backed loop devices,
  * to avoid blocking in our make_request_fn. it also does loop decrypting
  * on reads for block backed loop, as that is too heavy to do from
- * b_end_io context where irqs may be disabled.
+ * b_end_io context where irqs may be disabled. With more than one
+ * worker configured it only hands bios off to lo_wq, so that up to
+ * lo_nr_workers of them are in flight on the backing file.
  *
  * Loop explanation:  loop_clr_fd() sets lo_state to Lo_rundown before
  * calling kthread_stop().  Therefore once kthread_should_stop() is
@@ -601,7 +679,11 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 
 	mapping = file->f_mapping;
 	mapping_set_gfp_mask(old_file->f_mapping, lo->old_gfp_mask);
+	if (lo->lo_flags & LO_FLAGS_NOCACHE)
+		loop_set_backing_random(old_file, false);
 	lo->lo_backing_file = file;
+	if (lo->lo_flags & LO_FLAGS_NOCACHE)
+		loop_update_nocache(lo);
 	lo->lo_blocksize = S_ISBLK(mapping->host->i_mode) ?
 		mapping->host->i_bdev->bd_block_size : PAGE_SIZE;
 	lo->old_gfp_mask = mapping_gfp_mask(mapping);
@@ -742,11 +824,64 @@ static ssize_t loop_attr_partscan_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", partscan ? "1" : "0");
 }
 
+static ssize_t loop_attr_nocache_show(struct loop_device *lo, char *buf)
+{
+	int nocache = (lo->lo_flags & LO_FLAGS_NOCACHE);
+
+	return sprintf(buf, "%s\n", nocache ? "1" : "0");
+}
+
+static ssize_t loop_attr_workers_show(struct loop_device *lo, char *buf)
+{
+	return sprintf(buf, "%d\n", lo->lo_nr_workers);
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
+LOOP_ATTR_RO(nocache);
+
+static ssize_t loop_attr_do_store_workers(struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count)
+{
+	struct loop_device *lo = dev_to_disk(dev)->private_data;
+	unsigned long nr;
+	int err;
+
+	err = strict_strtoul(buf, 10, &nr);
+	if (err)
+		return err;
+	if (nr < 1 || nr > LOOP_MAX_WORKERS)
+		return -EINVAL;
+
+	mutex_lock(&lo->lo_ctl_mutex);
+	if (lo->lo_state != Lo_bound) {
+		mutex_unlock(&lo->lo_ctl_mutex);
+		return -ENXIO;
+	}
+	/* one reserved command per bio that can be in flight */
+	err = mempool_resize(lo->lo_cmd_pool, nr, GFP_KERNEL);
+	if (!err) {
+		lo->lo_nr_workers = nr;
+		workqueue_set_max_active(lo->lo_wq, nr);
+	}
+	mutex_unlock(&lo->lo_ctl_mutex);
+
+	return err ? err : count;
+}
+
+static ssize_t loop_attr_do_show_workers(struct device *d,
+				struct device_attribute *attr, char *b)
+{
+	return loop_attr_show(d, b, loop_attr_workers_show);
+}
+
+static struct device_attribute loop_attr_workers =
+	__ATTR(workers, S_IRUGO | S_IWUSR, loop_attr_do_show_workers,
+	       loop_attr_do_store_workers);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -754,6 +889,8 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
+	&loop_attr_nocache.attr,
+	&loop_attr_workers.attr,
 	NULL,
 };
 
@@ -861,6 +998,17 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 	if ((loff_t)(sector_t)size != size)
 		goto out_putf;
 
+	/* before any device state changes, so failing needs no undo */
+	error = -ENOMEM;
+	lo->lo_nr_workers = clamp(workers, 1, LOOP_MAX_WORKERS);
+	lo->lo_wq = alloc_workqueue("kloopd", WQ_UNBOUND | WQ_MEM_RECLAIM,
+				    lo->lo_nr_workers);
+	if (!lo->lo_wq)
+		goto out_putf;
+	lo->lo_cmd_pool = mempool_create_kmalloc_pool(lo->lo_nr_workers,
+						sizeof(struct loop_cmd));
+	if (!lo->lo_cmd_pool)
+		goto out_destroy_wq;
 	error = 0;
 
 	set_device_ro(bdev, (lo_flags & LO_FLAGS_READ_ONLY) != 0);
@@ -921,6 +1069,11 @@ out_clr:
 	kobject_uevent(&disk_to_dev(bdev->bd_disk)->kobj, KOBJ_CHANGE);
 	mapping_set_gfp_mask(mapping, lo->old_gfp_mask);
 	lo->lo_state = Lo_unbound;
+	mempool_destroy(lo->lo_cmd_pool);
+	lo->lo_cmd_pool = NULL;
+ out_destroy_wq:
+	destroy_workqueue(lo->lo_wq);
+	lo->lo_wq = NULL;
  out_putf:
 	fput(file);
  out:
@@ -987,6 +1140,15 @@ static int loop_clr_fd(struct loop_device *lo)
 
 	kthread_stop(lo->lo_thread);
 
+	/* wait for the bios the thread handed off */
+	destroy_workqueue(lo->lo_wq);
+	lo->lo_wq = NULL;
+	mempool_destroy(lo->lo_cmd_pool);
+	lo->lo_cmd_pool = NULL;
+
+	if (lo->lo_flags & LO_FLAGS_NOCACHE)
+		loop_set_backing_random(filp, false);
+
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_backing_file = NULL;
 	spin_unlock_irq(&lo->lo_lock);
@@ -1088,6 +1250,12 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	     (info->lo_flags & LO_FLAGS_AUTOCLEAR))
 		lo->lo_flags ^= LO_FLAGS_AUTOCLEAR;
 
+	if ((lo->lo_flags & LO_FLAGS_NOCACHE) !=
+	     (info->lo_flags & LO_FLAGS_NOCACHE)) {
+		lo->lo_flags ^= LO_FLAGS_NOCACHE;
+		loop_update_nocache(lo);
+	}
+
 	if ((info->lo_flags & LO_FLAGS_PARTSCAN) &&
 	     !(lo->lo_flags & LO_FLAGS_PARTSCAN)) {
 		lo->lo_flags |= LO_FLAGS_PARTSCAN;
@@ -1547,6 +1715,8 @@ static const struct block_device_operations lo_fops = {
 static int max_loop;
 module_param(max_loop, int, S_IRUGO);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
+module_param(workers, int, S_IRUGO);
+MODULE_PARM_DESC(workers, "Default number of bios a loop device serves concurrently");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
 MODULE_LICENSE("GPL");
@@ -60,18 +60,6 @@ static unsigned int nbds_max = 16;
 static struct nbd_device *nbd_dev;
 static int max_part;
 
-/*
- * Use just one lock (or at most 1 per NIC). Two arguments for this:
- * 1. Each NIC is essentially a synchronization point for all servers
- *    accessed through that NIC so there's no need to have more locks
- *    than NICs anyway.
- * 2. More locks lead to more "Dirty cache line bouncing" which will slow
- *    down each lock to the point where they're actually slower than just
- *    a single lock.
- * Thanks go to Jens Axboe and Al Viro for their LKML emails explaining this!
- */
-static DEFINE_SPINLOCK(nbd_lock);
-
 #ifndef NDEBUG
 static const char *ioctl_cmd_to_ascii(int cmd)
 {
@@ -102,21 +90,74 @@ static const char *nbdcmd_to_ascii(int cmd)
 }
 #endif /* NDEBUG */
 
+/*
+ * Tags are handed out when the block layer gives us a request and are
+ * what the reply handle carries back, so matching a reply is a single
+ * array lookup.  Both helpers run under the queue lock.
+ */
+static int nbd_get_tag(struct nbd_device *lo, struct request *req)
+{
+	int tag;
+
+	tag = find_first_zero_bit(lo->tag_map, NBD_NR_TAGS);
+	if (tag >= NBD_NR_TAGS)
+		return -EBUSY;
+
+	__set_bit(tag, lo->tag_map);
+	lo->tags[tag] = req;
+	req->tag = tag;
+	req->special = NULL;
+	return 0;
+}
+
+static void nbd_put_tag(struct nbd_device *lo, struct request *req)
+{
+	lo->tags[req->tag] = NULL;
+	__clear_bit(req->tag, lo->tag_map);
+	req->tag = -1;
+}
+
 static void nbd_end_request(struct request *req)
 {
 	int error = req->errors ? -EIO : 0;
 	struct request_queue *q = req->q;
+	struct nbd_device *lo = req->rq_disk->private_data;
 	unsigned long flags;
 
 	dprintk(DBG_BLKDEV, "%s: request %p: %s\n", req->rq_disk->disk_name,
 			req, error ? "failed" : "done");
 
 	spin_lock_irqsave(q->queue_lock, flags);
+	if (req->tag >= 0)
+		nbd_put_tag(lo, req);
 	__blk_end_request_all(req, error);
+	if (lo->tags_starved) {
+		lo->tags_starved = 0;
+		blk_run_queue_async(q);
+	}
 	spin_unlock_irqrestore(q->queue_lock, flags);
 }
 
-static void sock_shutdown(struct nbd_device *lo, int lock)
+/*
+ * A request sent on @nsock is finished by exactly one party: the
+ * receiver that matched its reply, or the sender if the send failed.
+ * Whoever clears ->special first owns it.
+ */
+static bool nbd_claim_request(struct nbd_sock *nsock, struct request *req)
+{
+	struct request_queue *q = nsock->lo->disk->queue;
+	bool claimed = false;
+
+	spin_lock_irq(q->queue_lock);
+	if (req->special == nsock) {
+		req->special = NULL;
+		claimed = true;
+	}
+	spin_unlock_irq(q->queue_lock);
+	return claimed;
+}
+
+static void sock_shutdown(struct nbd_sock *nsock)
 {
 	/* Forcibly shutdown the socket causing all listeners
 	 * to error
@@ -124,15 +165,19 @@ static void sock_shutdown(struct nbd_device *lo, int lock)
 	 * FIXME: This code is duplicated from sys_shutdown, but
 	 * there should be a more generic interface rather than
 	 * calling socket ops directly here */
-	if (lock)
-		mutex_lock(&lo->tx_lock);
-	if (lo->sock) {
-		dev_warn(disk_to_dev(lo->disk), "shutting down socket\n");
-		kernel_sock_shutdown(lo->sock, SHUT_RDWR);
-		lo->sock = NULL;
-	}
-	if (lock)
-		mutex_unlock(&lo->tx_lock);
+	if (xchg(&nsock->dead, 1))
+		return;
+	dev_warn(disk_to_dev(nsock->lo->disk), "shutting down socket %d\n",
+		 nsock->index);
+	kernel_sock_shutdown(nsock->sock, SHUT_RDWR);
+}
+
+static void nbd_shutdown_socks(struct nbd_device *lo)
+{
+	int i;
+
+	for (i = 0; i < lo->num_connections; i++)
+		sock_shutdown(lo->socks[i]);
 }
 
 static void nbd_xmit_timeout(unsigned long arg)
@@ -147,16 +192,17 @@ static void nbd_xmit_timeout(unsigned long arg)
 /*
  *  Send or receive packet.
  */
-static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
+static int sock_xmit(struct nbd_sock *nsock, int send, void *buf, int size,
 		int msg_flags)
 {
-	struct socket *sock = lo->sock;
+	struct nbd_device *lo = nsock->lo;
+	struct socket *sock = nsock->sock;
 	int result;
 	struct msghdr msg;
 	struct kvec iov;
 	sigset_t blocked, oldset;
 
-	if (unlikely(!sock)) {
+	if (unlikely(nsock->dead)) {
 		dev_err(disk_to_dev(lo->disk),
 			"Attempted %s on closed socket in sock_xmit\n",
 			(send ? "send" : "recv"));
@@ -201,7 +247,7 @@ static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
 				task_pid_nr(current), current->comm,
 				dequeue_signal_lock(current, &current->blocked, &info));
 			result = -EINTR;
-			sock_shutdown(lo, !send);
+			sock_shutdown(nsock);
 			break;
 		}
 
@@ -219,35 +265,38 @@ static int sock_xmit(struct nbd_device *lo, int send, void *buf, int size,
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *lo, struct bio_vec *bvec,
+static inline int sock_send_bvec(struct nbd_sock *nsock, struct bio_vec *bvec,
 		int flags)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 1, kaddr + bvec->bv_offset, bvec->bv_len, flags);
+	result = sock_xmit(nsock, 1, kaddr + bvec->bv_offset, bvec->bv_len,
+			   flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *lo, struct request *req)
+/* always call with the connection's tx_lock held */
+static int nbd_send_req(struct nbd_sock *nsock, struct request *req)
 {
+	struct nbd_device *lo = nsock->lo;
 	int result, flags;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
+	u32 handle[2] = { req->tag, nsock->index };
 
 	request.magic = htonl(NBD_REQUEST_MAGIC);
 	request.type = htonl(nbd_cmd(req));
 	request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
 	request.len = htonl(size);
-	memcpy(request.handle, &req, sizeof(req));
+	memcpy(request.handle, handle, sizeof(request.handle));
 
 	dprintk(DBG_TX, "%s: request %p: sending control (%s@%llu,%uB)\n",
 			lo->disk->disk_name, req,
 			nbdcmd_to_ascii(nbd_cmd(req)),
 			(unsigned long long)blk_rq_pos(req) << 9,
 			blk_rq_bytes(req));
-	result = sock_xmit(lo, 1, &request, sizeof(request),
+	result = sock_xmit(nsock, 1, &request, sizeof(request),
 			(nbd_cmd(req) == NBD_CMD_WRITE) ? MSG_MORE : 0);
 	if (result <= 0) {
 		dev_err(disk_to_dev(lo->disk),
@@ -268,7 +317,7 @@ static int nbd_send_req(struct nbd_device *lo, struct request *req)
 				flags = MSG_MORE;
 			dprintk(DBG_TX, "%s: request %p: sending %d bytes data\n",
 					lo->disk->disk_name, req, bvec->bv_len);
-			result = sock_send_bvec(lo, bvec, flags);
+			result = sock_send_bvec(nsock, bvec, flags);
 			if (result <= 0) {
 				dev_err(disk_to_dev(lo->disk),
 					"Send data failed (result %d)\n",
@@ -283,51 +332,58 @@ error_out:
 	return -EIO;
 }
 
-static struct request *nbd_find_request(struct nbd_device *lo,
-					struct request *xreq)
+static struct request *nbd_find_request(struct nbd_sock *nsock,
+					const char *handle)
 {
-	struct request *req, *tmp;
-	int err;
+	struct nbd_device *lo = nsock->lo;
+	struct request_queue *q = lo->disk->queue;
+	struct request *req = NULL;
+	u32 tag[2];
+
+	memcpy(tag, handle, sizeof(tag));
+	if (tag[0] >= NBD_NR_TAGS || tag[1] != nsock->index)
+		return ERR_PTR(-ENOENT);
+
+	/* look up and claim in one go, a failed send may end it otherwise */
+	spin_lock_irq(q->queue_lock);
+	req = lo->tags[tag[0]];
+	if (req && req->special == nsock)
+		req->special = NULL;
+	else
+		req = NULL;
+	spin_unlock_irq(q->queue_lock);
+
+	if (!req)
+		return ERR_PTR(-ENOENT);
 
-	err = wait_event_interruptible(lo->active_wq, lo->active_req != xreq);
-	if (unlikely(err))
-		goto out;
-
-	spin_lock(&lo->queue_lock);
-	list_for_each_entry_safe(req, tmp, &lo->queue_head, queuelist) {
-		if (req != xreq)
-			continue;
-		list_del_init(&req->queuelist);
-		spin_unlock(&lo->queue_lock);
-		return req;
-	}
-	spin_unlock(&lo->queue_lock);
-
-	err = -ENOENT;
-
-out:
-	return ERR_PTR(err);
+	/*
+	 * A write may still be going out while its reply comes in; the
+	 * sender always finishes, if only because the socket was shut down.
+	 */
+	wait_event(nsock->active_wq, nsock->active_req != req);
+	return req;
 }
 
-static inline int sock_recv_bvec(struct nbd_device *lo, struct bio_vec *bvec)
+static inline int sock_recv_bvec(struct nbd_sock *nsock, struct bio_vec *bvec)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(lo, 0, kaddr + bvec->bv_offset, bvec->bv_len,
+	result = sock_xmit(nsock, 0, kaddr + bvec->bv_offset, bvec->bv_len,
 			MSG_WAITALL);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
 /* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *lo)
+static struct request *nbd_read_stat(struct nbd_sock *nsock)
 {
+	struct nbd_device *lo = nsock->lo;
 	int result;
 	struct nbd_reply reply;
 	struct request *req;
 
 	reply.magic = 0;
-	result = sock_xmit(lo, 0, &reply, sizeof(reply), MSG_WAITALL);
+	result = sock_xmit(nsock, 0, &reply, sizeof(reply), MSG_WAITALL);
 	if (result <= 0) {
 		dev_err(disk_to_dev(lo->disk),
 			"Receive control failed (result %d)\n", result);
@@ -341,7 +397,7 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 		goto harderror;
 	}
 
-	req = nbd_find_request(lo, *(struct request **)reply.handle);
+	req = nbd_find_request(nsock, reply.handle);
 	if (IS_ERR(req)) {
 		result = PTR_ERR(req);
 		if (result != -ENOENT)
@@ -367,7 +423,7 @@ static struct request *nbd_read_stat(struct nbd_device *lo)
 		struct bio_vec *bvec;
 
 		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(lo, bvec);
+			result = sock_recv_bvec(nsock, bvec);
 			if (result <= 0) {
 				dev_err(disk_to_dev(lo->disk), "Receive data failed (result %d)\n",
 					result);
@@ -398,58 +454,10 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
-static int nbd_do_it(struct nbd_device *lo)
+static void nbd_handle_req(struct nbd_sock *nsock, struct request *req)
 {
-	struct request *req;
-	int ret;
-
-	BUG_ON(lo->magic != LO_MAGIC);
-
-	lo->pid = task_pid_nr(current);
-	ret = device_create_file(disk_to_dev(lo->disk), &pid_attr);
-	if (ret) {
-		dev_err(disk_to_dev(lo->disk), "device_create_file failed!\n");
-		lo->pid = 0;
-		return ret;
-	}
+	struct nbd_device *lo = nsock->lo;
 
-	while ((req = nbd_read_stat(lo)) != NULL)
-		nbd_end_request(req);
-
-	device_remove_file(disk_to_dev(lo->disk), &pid_attr);
-	lo->pid = 0;
-	return 0;
-}
-
-static void nbd_clear_que(struct nbd_device *lo)
-{
-	struct request *req;
-
-	BUG_ON(lo->magic != LO_MAGIC);
-
-	/*
-	 * Because we have set lo->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
-	 *
-	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
-	 */
-	BUG_ON(lo->sock);
-	BUG_ON(lo->active_req);
-
-	while (!list_empty(&lo->queue_head)) {
-		req = list_entry(lo->queue_head.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(req);
-	}
-}
-
-
-static void nbd_handle_req(struct nbd_device *lo, struct request *req)
-{
 	if (req->cmd_type != REQ_TYPE_FS)
 		goto error_out;
 
@@ -465,29 +473,28 @@ static void nbd_handle_req(struct nbd_device *lo, struct request *req)
 
 	req->errors = 0;
 
-	mutex_lock(&lo->tx_lock);
-	if (unlikely(!lo->sock)) {
-		mutex_unlock(&lo->tx_lock);
+	mutex_lock(&nsock->tx_lock);
+	if (unlikely(nsock->dead)) {
+		mutex_unlock(&nsock->tx_lock);
 		dev_err(disk_to_dev(lo->disk),
 			"Attempted send on closed socket\n");
 		goto error_out;
 	}
 
-	lo->active_req = req;
+	nsock->active_req = req;
+	req->special = nsock;
 
-	if (nbd_send_req(lo, req) != 0) {
+	if (nbd_send_req(nsock, req) != 0) {
 		dev_err(disk_to_dev(lo->disk), "Request send failed\n");
-		req->errors++;
-		nbd_end_request(req);
-	} else {
-		spin_lock(&lo->queue_lock);
-		list_add(&req->queuelist, &lo->queue_head);
-		spin_unlock(&lo->queue_lock);
+		if (nbd_claim_request(nsock, req)) {
+			req->errors++;
+			nbd_end_request(req);
+		}
 	}
 
-	lo->active_req = NULL;
-	mutex_unlock(&lo->tx_lock);
-	wake_up_all(&lo->active_wq);
+	nsock->active_req = NULL;
+	mutex_unlock(&nsock->tx_lock);
+	wake_up_all(&nsock->active_wq);
 
 	return;
 
@@ -496,9 +503,15 @@ error_out:
 	nbd_end_request(req);
 }
 
-static int nbd_thread(void *data)
+/*
+ * Every connection runs one of these against the shared waiting queue,
+ * so whichever connection is free picks up the next request and sends
+ * on different connections proceed in parallel.
+ */
+static int nbd_send_thread(void *data)
 {
-	struct nbd_device *lo = data;
+	struct nbd_sock *nsock = data;
+	struct nbd_device *lo = nsock->lo;
 	struct request *req;
 
 	set_user_nice(current, -20);
@@ -509,21 +522,180 @@ static int nbd_thread(void *data)
 					 !list_empty(&lo->waiting_queue));
 
 		/* extract request */
-		if (list_empty(&lo->waiting_queue))
-			continue;
-
 		spin_lock_irq(&lo->queue_lock);
+		if (list_empty(&lo->waiting_queue)) {
+			spin_unlock_irq(&lo->queue_lock);
+			continue;
+		}
 		req = list_entry(lo->waiting_queue.next, struct request,
 				 queuelist);
 		list_del_init(&req->queuelist);
 		spin_unlock_irq(&lo->queue_lock);
 
 		/* handle request */
-		nbd_handle_req(lo, req);
+		nbd_handle_req(nsock, req);
 	}
 	return 0;
 }
 
+static int nbd_recv_thread(void *data)
+{
+	struct nbd_sock *nsock = data;
+	struct nbd_device *lo = nsock->lo;
+	struct request *req;
+
+	while ((req = nbd_read_stat(nsock)) != NULL)
+		nbd_end_request(req);
+
+	/* losing one connection takes the whole device down */
+	nbd_shutdown_socks(lo);
+	if (atomic_dec_and_test(&lo->recv_threads))
+		wake_up(&lo->recv_wq);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static void nbd_stop_threads(struct nbd_device *lo)
+{
+	int i;
+
+	for (i = 0; i < lo->num_connections; i++) {
+		struct nbd_sock *nsock = lo->socks[i];
+
+		if (nsock->recv_thread)
+			kthread_stop(nsock->recv_thread);
+		if (nsock->send_thread)
+			kthread_stop(nsock->send_thread);
+		nsock->recv_thread = NULL;
+		nsock->send_thread = NULL;
+	}
+}
+
+static int nbd_start_threads(struct nbd_device *lo)
+{
+	struct task_struct *thread;
+	int i;
+
+	for (i = 0; i < lo->num_connections; i++) {
+		struct nbd_sock *nsock = lo->socks[i];
+
+		thread = kthread_create(nbd_recv_thread, nsock, "%s-rx%d",
+					lo->disk->disk_name, i);
+		if (IS_ERR(thread))
+			goto fail;
+		nsock->recv_thread = thread;
+
+		thread = kthread_create(nbd_send_thread, nsock, "%s-tx%d",
+					lo->disk->disk_name, i);
+		if (IS_ERR(thread))
+			goto fail;
+		nsock->send_thread = thread;
+	}
+
+	atomic_set(&lo->recv_threads, lo->num_connections);
+	for (i = 0; i < lo->num_connections; i++) {
+		wake_up_process(lo->socks[i]->recv_thread);
+		wake_up_process(lo->socks[i]->send_thread);
+	}
+	return 0;
+
+fail:
+	nbd_stop_threads(lo);
+	return PTR_ERR(thread);
+}
+
+static int nbd_do_it(struct nbd_device *lo)
+{
+	int ret;
+
+	BUG_ON(lo->magic != LO_MAGIC);
+
+	lo->pid = task_pid_nr(current);
+	ret = device_create_file(disk_to_dev(lo->disk), &pid_attr);
+	if (ret) {
+		dev_err(disk_to_dev(lo->disk), "device_create_file failed!\n");
+		lo->pid = 0;
+		return ret;
+	}
+
+	ret = nbd_start_threads(lo);
+	if (ret)
+		goto out;
+
+	/* the receivers do the work; SIGKILL still aborts the client */
+	if (wait_event_killable(lo->recv_wq, !atomic_read(&lo->recv_threads))) {
+		nbd_shutdown_socks(lo);
+		wait_event(lo->recv_wq, !atomic_read(&lo->recv_threads));
+	}
+	nbd_stop_threads(lo);
+out:
+	device_remove_file(disk_to_dev(lo->disk), &pid_attr);
+	lo->pid = 0;
+	return ret;
+}
+
+/*
+ * Fail everything the device still owns.  Only called with no sender or
+ * receiver threads running and no connections left, so nothing else can
+ * complete these requests under us.
+ */
+static void nbd_clear_que(struct nbd_device *lo)
+{
+	struct request_queue *q = lo->disk->queue;
+	struct request *req;
+	LIST_HEAD(waiting);
+	int tag;
+
+	BUG_ON(lo->magic != LO_MAGIC);
+	BUG_ON(lo->num_connections);
+
+	spin_lock_irq(&lo->queue_lock);
+	list_splice_init(&lo->waiting_queue, &waiting);
+	spin_unlock_irq(&lo->queue_lock);
+
+	while (!list_empty(&waiting)) {
+		req = list_entry(waiting.next, struct request, queuelist);
+		list_del_init(&req->queuelist);
+		req->errors++;
+		nbd_end_request(req);
+	}
+
+	for (tag = 0; tag < NBD_NR_TAGS; tag++) {
+		spin_lock_irq(q->queue_lock);
+		req = lo->tags[tag];
+		spin_unlock_irq(q->queue_lock);
+		if (!req)
+			continue;
+		req->errors++;
+		nbd_end_request(req);
+	}
+}
+
+/* Drop every connection; the threads using them must be gone already. */
+static void nbd_free_socks(struct nbd_device *lo)
+{
+	struct request_queue *q = lo->disk->queue;
+	int i, num = lo->num_connections;
+
+	spin_lock_irq(q->queue_lock);
+	lo->num_connections = 0;
+	spin_unlock_irq(q->queue_lock);
+
+	for (i = 0; i < num; i++) {
+		struct nbd_sock *nsock = lo->socks[i];
+
+		lo->socks[i] = NULL;
+		fput(nsock->file);
+		kfree(nsock);
+	}
+}
+
 /*
  * We always wait for result of write, for now. It would be nice to make it optional
  * in future
@@ -535,11 +707,9 @@ static void do_nbd_request(struct request_queue *q)
 {
 	struct request *req;
 	
-	while ((req = blk_fetch_request(q)) != NULL) {
+	while ((req = blk_peek_request(q)) != NULL) {
 		struct nbd_device *lo;
 
-		spin_unlock_irq(q->queue_lock);
-
 		dprintk(DBG_BLKDEV, "%s: request %p: dequeued (flags=%x)\n",
 				req->rq_disk->disk_name, req, req->cmd_type);
 
@@ -547,7 +717,9 @@ static void do_nbd_request(struct request_queue *q)
 
 		BUG_ON(lo->magic != LO_MAGIC);
 
-		if (unlikely(!lo->sock)) {
+		if (unlikely(!lo->num_connections)) {
+			blk_start_request(req);
+			spin_unlock_irq(q->queue_lock);
 			dev_err(disk_to_dev(lo->disk),
 				"Attempted send on closed socket\n");
 			req->errors++;
@@ -556,17 +728,22 @@ static void do_nbd_request(struct request_queue *q)
 			continue;
 		}
 
-		spin_lock_irq(&lo->queue_lock);
+		/* out of tags: a completion will run the queue again */
+		if (nbd_get_tag(lo, req)) {
+			lo->tags_starved = 1;
+			break;
+		}
+		blk_start_request(req);
+
+		spin_lock(&lo->queue_lock);
 		list_add_tail(&req->queuelist, &lo->waiting_queue);
-		spin_unlock_irq(&lo->queue_lock);
+		spin_unlock(&lo->queue_lock);
 
 		wake_up(&lo->waiting_wq);
-
-		spin_lock_irq(q->queue_lock);
 	}
 }
 
-/* Must be called with tx_lock held */
+/* Must be called with config_lock held */
 
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		       unsigned int cmd, unsigned long arg)
@@ -574,49 +751,68 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 	switch (cmd) {
 	case NBD_DISCONNECT: {
 		struct request sreq;
+		int i;
 
 		dev_info(disk_to_dev(lo->disk), "NBD_DISCONNECT\n");
 
 		blk_rq_init(NULL, &sreq);
 		sreq.cmd_type = REQ_TYPE_SPECIAL;
 		nbd_cmd(&sreq) = NBD_CMD_DISC;
-		if (!lo->sock)
+		if (!lo->num_connections)
 			return -EINVAL;
-		nbd_send_req(lo, &sreq);
+		for (i = 0; i < lo->num_connections; i++) {
+			struct nbd_sock *nsock = lo->socks[i];
+
+			mutex_lock(&nsock->tx_lock);
+			if (!nsock->dead)
+				nbd_send_req(nsock, &sreq);
+			mutex_unlock(&nsock->tx_lock);
+		}
                 return 0;
 	}
  
-	case NBD_CLEAR_SOCK: {
-		struct file *file;
-
-		lo->sock = NULL;
-		file = lo->file;
-		lo->file = NULL;
+	case NBD_CLEAR_SOCK:
+		/* a running device is torn down by NBD_DO_IT on its way out */
+		if (lo->pid) {
+			nbd_shutdown_socks(lo);
+			return 0;
+		}
+		nbd_free_socks(lo);
 		nbd_clear_que(lo);
-		BUG_ON(!list_empty(&lo->queue_head));
-		if (file)
-			fput(file);
 		return 0;
-	}
 
 	case NBD_SET_SOCK: {
+		struct nbd_sock *nsock;
 		struct file *file;
-		if (lo->file)
+
+		if (lo->pid || lo->num_connections >= NBD_MAX_CONNECTIONS)
 			return -EBUSY;
 		file = fget(arg);
-		if (file) {
-			struct inode *inode = file->f_path.dentry->d_inode;
-			if (S_ISSOCK(inode->i_mode)) {
-				lo->file = file;
-				lo->sock = SOCKET_I(inode);
-				if (max_part > 0)
-					bdev->bd_invalidated = 1;
-				return 0;
-			} else {
-				fput(file);
-			}
+		if (!file)
+			return -EINVAL;
+		if (!S_ISSOCK(file->f_path.dentry->d_inode->i_mode)) {
+			fput(file);
+			return -EINVAL;
 		}
-		return -EINVAL;
+		nsock = kzalloc(sizeof(*nsock), GFP_KERNEL);
+		if (!nsock) {
+			fput(file);
+			return -ENOMEM;
+		}
+		nsock->file = file;
+		nsock->sock = SOCKET_I(file->f_path.dentry->d_inode);
+		nsock->lo = lo;
+		nsock->index = lo->num_connections;
+		mutex_init(&nsock->tx_lock);
+		init_waitqueue_head(&nsock->active_wq);
+
+		lo->socks[nsock->index] = nsock;
+		spin_lock_irq(lo->disk->queue->queue_lock);
+		lo->num_connections++;
+		spin_unlock_irq(lo->disk->queue->queue_lock);
+		if (max_part > 0)
+			bdev->bd_invalidated = 1;
+		return 0;
 	}
 
 	case NBD_SET_BLKSIZE:
@@ -646,36 +842,23 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		return 0;
 
 	case NBD_DO_IT: {
-		struct task_struct *thread;
-		struct file *file;
 		int error;
 
 		if (lo->pid)
 			return -EBUSY;
-		if (!lo->file)
+		if (!lo->num_connections)
 			return -EINVAL;
 
-		mutex_unlock(&lo->tx_lock);
-
-		thread = kthread_create(nbd_thread, lo, lo->disk->disk_name);
-		if (IS_ERR(thread)) {
-			mutex_lock(&lo->tx_lock);
-			return PTR_ERR(thread);
-		}
-		wake_up_process(thread);
+		lo->harderror = 0;
+		mutex_unlock(&lo->config_lock);
 		error = nbd_do_it(lo);
-		kthread_stop(thread);
-
-		mutex_lock(&lo->tx_lock);
+		mutex_lock(&lo->config_lock);
 		if (error)
 			return error;
-		sock_shutdown(lo, 0);
-		file = lo->file;
-		lo->file = NULL;
+		nbd_shutdown_socks(lo);
+		nbd_free_socks(lo);
 		nbd_clear_que(lo);
 		dev_warn(disk_to_dev(lo->disk), "queue cleared\n");
-		if (file)
-			fput(file);
 		lo->bytesize = 0;
 		bdev->bd_inode->i_size = 0;
 		set_capacity(lo->disk, 0);
@@ -689,14 +872,14 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *lo,
 		 * This is for compatibility only.  The queue is always cleared
 		 * by NBD_DO_IT or NBD_CLEAR_SOCK.
 		 */
-		BUG_ON(!lo->sock && !list_empty(&lo->queue_head));
 		return 0;
 
 	case NBD_PRINT_DEBUG:
 		dev_info(disk_to_dev(lo->disk),
-			"next = %p, prev = %p, head = %p\n",
-			lo->queue_head.next, lo->queue_head.prev,
-			&lo->queue_head);
+			"connections = %d, tags in flight = %d, waiting = %s\n",
+			lo->num_connections,
+			bitmap_weight(lo->tag_map, NBD_NR_TAGS),
+			list_empty(&lo->waiting_queue) ? "no" : "yes");
 		return 0;
 	}
 	return -ENOTTY;
@@ -717,9 +900,9 @@ static int nbd_ioctl(struct block_device *bdev, fmode_t mode,
 	dprintk(DBG_IOCTL, "%s: nbd_ioctl cmd=%s(0x%x) arg=%lu\n",
 			lo->disk->disk_name, ioctl_cmd_to_ascii(cmd), cmd, arg);
 
-	mutex_lock(&lo->tx_lock);
+	mutex_lock(&lo->config_lock);
 	error = __nbd_ioctl(bdev, lo, cmd, arg);
-	mutex_unlock(&lo->tx_lock);
+	mutex_unlock(&lo->config_lock);
 
 	return error;
 }
@@ -783,11 +966,22 @@ static int __init nbd_init(void)
 		 * every gendisk to have its very own request_queue struct.
 		 * These structs are big so we dynamically allocate them.
 		 */
-		disk->queue = blk_init_queue(do_nbd_request, &nbd_lock);
+		disk->queue = blk_init_queue(do_nbd_request, NULL);
 		if (!disk->queue) {
 			put_disk(disk);
 			goto out;
 		}
+		nbd_dev[i].tags = kcalloc(NBD_NR_TAGS, sizeof(struct request *),
+					  GFP_KERNEL);
+		nbd_dev[i].tag_map = kcalloc(BITS_TO_LONGS(NBD_NR_TAGS),
+					     sizeof(unsigned long), GFP_KERNEL);
+		if (!nbd_dev[i].tags || !nbd_dev[i].tag_map) {
+			kfree(nbd_dev[i].tags);
+			kfree(nbd_dev[i].tag_map);
+			blk_cleanup_queue(disk->queue);
+			put_disk(disk);
+			goto out;
+		}
 		/*
 		 * Tell the block layer that we are not a rotational device
 		 */
@@ -804,15 +998,14 @@ static int __init nbd_init(void)
 
 	for (i = 0; i < nbds_max; i++) {
 		struct gendisk *disk = nbd_dev[i].disk;
-		nbd_dev[i].file = NULL;
+		nbd_dev[i].num_connections = 0;
 		nbd_dev[i].magic = LO_MAGIC;
 		nbd_dev[i].flags = 0;
 		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
 		spin_lock_init(&nbd_dev[i].queue_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
-		mutex_init(&nbd_dev[i].tx_lock);
-		init_waitqueue_head(&nbd_dev[i].active_wq);
+		mutex_init(&nbd_dev[i].config_lock);
 		init_waitqueue_head(&nbd_dev[i].waiting_wq);
+		init_waitqueue_head(&nbd_dev[i].recv_wq);
 		nbd_dev[i].blksize = 1024;
 		nbd_dev[i].bytesize = 0;
 		disk->major = NBD_MAJOR;
@@ -829,6 +1022,8 @@ out:
 	while (i--) {
 		blk_cleanup_queue(nbd_dev[i].disk->queue);
 		put_disk(nbd_dev[i].disk);
+		kfree(nbd_dev[i].tags);
+		kfree(nbd_dev[i].tag_map);
 	}
 	kfree(nbd_dev);
 	return err;
@@ -845,6 +1040,8 @@ static void __exit nbd_cleanup(void)
 			blk_cleanup_queue(disk->queue);
 			put_disk(disk);
 		}
+		kfree(nbd_dev[i].tags);
+		kfree(nbd_dev[i].tag_map);
 	}
 	unregister_blkdev(NBD_MAJOR, "nbd");
 	kfree(nbd_dev);
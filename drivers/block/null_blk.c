@@ -0,0 +1,463 @@
+/*
+ * Null block device driver.
+ *
+ * Completes every bio or request without touching the data, either right
+ * away or after a simulated device latency, so that the cost of the block
+ * layer itself can be measured. See Documentation/block/null_blk.txt.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/bio.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/log2.h>
+
+struct nullb {
+	struct list_head list;
+	unsigned int index;
+	struct request_queue *q;
+	struct gendisk *disk;
+	spinlock_t lock;		/* queue_lock in NULL_Q_RQ mode */
+};
+
+/*
+ * Per-cpu queue of commands waiting for simulated completion. Requests
+ * are linked through ->queuelist, which the block layer no longer uses
+ * once the driver owns them, bios through ->bi_next.
+ */
+struct completion_queue {
+	struct list_head rq_list;
+	struct bio_list bio_list;
+	struct hrtimer timer;
+	struct tasklet_struct tasklet;
+};
+
+static DEFINE_PER_CPU(struct completion_queue, completion_queues);
+
+static LIST_HEAD(nullb_list);
+static DEFINE_MUTEX(nullb_lock);
+static int null_major;
+
+enum {
+	NULL_IRQ_NONE		= 0,
+	NULL_IRQ_SOFTIRQ	= 1,
+	NULL_IRQ_TIMER		= 2,
+
+	NULL_Q_BIO		= 0,
+	NULL_Q_RQ		= 1,
+	NULL_Q_MQ		= 2,
+};
+
+static int queue_mode = NULL_Q_MQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "Block interface to use (0=bio,1=rq,2=multiqueue)");
+
+static int irqmode = NULL_IRQ_SOFTIRQ;
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "IRQ completion handler. 0-none, 1-softirq, 2-timer");
+
+static unsigned long completion_nsec = 10000;
+module_param(completion_nsec, ulong, S_IRUGO);
+MODULE_PARM_DESC(completion_nsec, "Time in ns to complete a request in hardware. Default: 10,000ns");
+
+static int completion_cpu = -1;
+module_param(completion_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(completion_cpu, "CPU to complete requests on in softirq mode, -1 for the submitting CPU");
+
+static int submit_queues = 1;
+module_param(submit_queues, int, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of hardware submission queues (multiqueue only)");
+
+static int hw_queue_depth = 64;
+module_param(hw_queue_depth, int, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth for each hardware queue (multiqueue only)");
+
+static int bs = 512;
+module_param(bs, int, S_IRUGO);
+MODULE_PARM_DESC(bs, "Block size (in bytes)");
+
+static int nr_devices = 2;
+module_param(nr_devices, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices to register");
+
+static int gb = 250;
+module_param(gb, int, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size in GB");
+
+static void null_end_rq(struct request *rq)
+{
+	if (queue_mode == NULL_Q_MQ)
+		blk_mq_end_io(rq, 0);
+	else
+		blk_end_request_all(rq, 0);
+}
+
+/* Called with interrupts disabled on the cpu owning @cq */
+static int null_complete_cq(struct completion_queue *cq)
+{
+	struct request *rq, *tmp;
+	struct bio *bio;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	list_splice_init(&cq->rq_list, &list);
+	bio = bio_list_get(&cq->bio_list);
+
+	list_for_each_entry_safe(rq, tmp, &list, queuelist) {
+		list_del_init(&rq->queuelist);
+		null_end_rq(rq);
+		nr++;
+	}
+
+	while (bio) {
+		struct bio *next = bio->bi_next;
+
+		bio->bi_next = NULL;
+		bio_endio(bio, 0);
+		bio = next;
+		nr++;
+	}
+
+	return nr;
+}
+
+static enum hrtimer_restart null_timer_fn(struct hrtimer *timer)
+{
+	null_complete_cq(container_of(timer, struct completion_queue, timer));
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Reap this cpu's simulated completions as soon as they are due, on behalf
+ * of a task polling in blk_poll(). The timer remains the "interrupt" for
+ * waiters that gave up polling or were moved to another cpu.
+ */
+static int null_poll(struct request_queue *q)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+	int nr = 0;
+
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+	/* the timer is pinned, its handler can't be running on this cpu */
+	if (hrtimer_active(&cq->timer) &&
+	    ktime_to_ns(hrtimer_get_remaining(&cq->timer)) <= 0 &&
+	    hrtimer_try_to_cancel(&cq->timer) == 1)
+		nr = null_complete_cq(cq);
+	local_irq_restore(flags);
+
+	return nr;
+}
+
+static void null_tasklet_fn(unsigned long data)
+{
+	struct completion_queue *cq = (struct completion_queue *)data;
+	struct bio *bio;
+
+	local_irq_disable();
+	bio = bio_list_get(&cq->bio_list);
+	local_irq_enable();
+
+	while (bio) {
+		struct bio *next = bio->bi_next;
+
+		bio->bi_next = NULL;
+		bio_endio(bio, 0);
+		bio = next;
+	}
+}
+
+/*
+ * Queue a command on this cpu's completion queue. All commands queued
+ * while the timer is pending complete when it fires.
+ */
+static void null_add_timer(struct request *rq, struct bio *bio)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+	bool idle;
+
+	local_irq_save(flags);
+	cq = &__get_cpu_var(completion_queues);
+	idle = list_empty(&cq->rq_list) && bio_list_empty(&cq->bio_list);
+
+	if (rq)
+		list_add_tail(&rq->queuelist, &cq->rq_list);
+	else
+		bio_list_add(&cq->bio_list, bio);
+
+	if (idle)
+		hrtimer_start(&cq->timer, ns_to_ktime(completion_nsec),
+			      HRTIMER_MODE_REL_PINNED);
+	local_irq_restore(flags);
+}
+
+static void null_softirq_done_fn(struct request *rq)
+{
+	null_end_rq(rq);
+}
+
+static void null_handle_rq(struct request *rq)
+{
+	switch (irqmode) {
+	case NULL_IRQ_SOFTIRQ:
+		/* the block softirq sends it to rq->cpu if that is set */
+		if (completion_cpu >= 0)
+			rq->cpu = completion_cpu;
+		blk_complete_request(rq);
+		break;
+	case NULL_IRQ_TIMER:
+		null_add_timer(rq, NULL);
+		break;
+	default:
+		null_end_rq(rq);
+		break;
+	}
+}
+
+static void null_queue_bio(struct request_queue *q, struct bio *bio)
+{
+	struct completion_queue *cq;
+	unsigned long flags;
+
+	switch (irqmode) {
+	case NULL_IRQ_SOFTIRQ:
+		/* no request to hand to the block softirq, use our own */
+		local_irq_save(flags);
+		cq = &__get_cpu_var(completion_queues);
+		bio_list_add(&cq->bio_list, bio);
+		tasklet_schedule(&cq->tasklet);
+		local_irq_restore(flags);
+		break;
+	case NULL_IRQ_TIMER:
+		null_add_timer(NULL, bio);
+		break;
+	default:
+		bio_endio(bio, 0);
+		break;
+	}
+}
+
+static void null_request_fn(struct request_queue *q)
+{
+	struct request *rq;
+
+	while ((rq = blk_fetch_request(q)) != NULL) {
+		spin_unlock_irq(q->queue_lock);
+		null_handle_rq(rq);
+		spin_lock_irq(q->queue_lock);
+	}
+}
+
+static int null_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	null_handle_rq(rq);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static struct blk_mq_ops null_mq_ops = {
+	.queue_rq	= null_queue_rq,
+};
+
+static const struct block_device_operations null_fops = {
+	.owner		= THIS_MODULE,
+};
+
+static void null_del_dev(struct nullb *nullb)
+{
+	list_del_init(&nullb->list);
+
+	del_gendisk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+	put_disk(nullb->disk);
+	kfree(nullb);
+}
+
+static struct request_queue *null_alloc_queue(struct nullb *nullb)
+{
+	struct request_queue *q;
+	struct blk_mq_reg reg;
+
+	switch (queue_mode) {
+	case NULL_Q_MQ:
+		memset(&reg, 0, sizeof(reg));
+		reg.ops = &null_mq_ops;
+		reg.nr_hw_queues = submit_queues;
+		reg.queue_depth = hw_queue_depth;
+		reg.numa_node = NUMA_NO_NODE;
+
+		q = blk_mq_init_queue(&reg, nullb);
+		if (IS_ERR(q))
+			return NULL;
+		break;
+	case NULL_Q_RQ:
+		q = blk_init_queue_node(null_request_fn, &nullb->lock,
+					NUMA_NO_NODE);
+		break;
+	default:
+		q = blk_alloc_queue_node(GFP_KERNEL, NUMA_NO_NODE);
+		if (q)
+			blk_queue_make_request(q, null_queue_bio);
+		break;
+	}
+	if (!q)
+		return NULL;
+
+	if (queue_mode != NULL_Q_BIO) {
+		blk_queue_softirq_done(q, null_softirq_done_fn);
+		if (completion_cpu >= 0)
+			queue_flag_set_unlocked(QUEUE_FLAG_SAME_FORCE, q);
+	}
+
+	/* only simulated latency leaves anything to poll for */
+	if (irqmode == NULL_IRQ_TIMER)
+		blk_queue_poll(q, null_poll);
+
+	return q;
+}
+
+static int null_add_dev(unsigned int index)
+{
+	struct gendisk *disk;
+	struct nullb *nullb;
+	sector_t size;
+	int err = -ENOMEM;
+
+	nullb = kzalloc(sizeof(*nullb), GFP_KERNEL);
+	if (!nullb)
+		return -ENOMEM;
+	nullb->index = index;
+	spin_lock_init(&nullb->lock);
+
+	nullb->q = null_alloc_queue(nullb);
+	if (!nullb->q)
+		goto out_free;
+
+	nullb->q->queuedata = nullb;
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, nullb->q);
+	blk_queue_logical_block_size(nullb->q, bs);
+	blk_queue_physical_block_size(nullb->q, bs);
+
+	disk = nullb->disk = alloc_disk(1);
+	if (!disk)
+		goto out_cleanup_queue;
+
+	size = (sector_t)gb * 1024 * 1024 * 1024ULL;
+	set_capacity(disk, size >> 9);
+
+	disk->major		= null_major;
+	disk->first_minor	= index;
+	disk->fops		= &null_fops;
+	disk->private_data	= nullb;
+	disk->queue		= nullb->q;
+	sprintf(disk->disk_name, "nullb%d", index);
+
+	mutex_lock(&nullb_lock);
+	list_add_tail(&nullb->list, &nullb_list);
+	mutex_unlock(&nullb_lock);
+
+	add_disk(disk);
+	return 0;
+
+out_cleanup_queue:
+	blk_cleanup_queue(nullb->q);
+out_free:
+	kfree(nullb);
+	return err;
+}
+
+static int __init null_init(void)
+{
+	unsigned int i;
+	int err;
+
+	if (queue_mode < NULL_Q_BIO || queue_mode > NULL_Q_MQ) {
+		pr_err("null_blk: invalid queue_mode %d\n", queue_mode);
+		return -EINVAL;
+	}
+	if (irqmode < NULL_IRQ_NONE || irqmode > NULL_IRQ_TIMER) {
+		pr_err("null_blk: invalid irqmode %d\n", irqmode);
+		return -EINVAL;
+	}
+	if (bs < 512 || bs > PAGE_SIZE || !is_power_of_2(bs)) {
+		pr_err("null_blk: invalid block size %d\n", bs);
+		return -EINVAL;
+	}
+	if (hw_queue_depth < 1 || hw_queue_depth > BLK_MQ_MAX_DEPTH) {
+		pr_err("null_blk: invalid hw_queue_depth %d\n", hw_queue_depth);
+		return -EINVAL;
+	}
+
+	if (completion_cpu >= nr_cpu_ids ||
+	    (completion_cpu >= 0 && !cpu_online(completion_cpu))) {
+		pr_warn("null_blk: cpu %d is not online, completing on the submitting cpu\n",
+			completion_cpu);
+		completion_cpu = -1;
+	}
+
+	if (submit_queues < 1)
+		submit_queues = 1;
+	else if (submit_queues > nr_cpu_ids)
+		submit_queues = nr_cpu_ids;
+
+	for_each_possible_cpu(i) {
+		struct completion_queue *cq = &per_cpu(completion_queues, i);
+
+		INIT_LIST_HEAD(&cq->rq_list);
+		bio_list_init(&cq->bio_list);
+		hrtimer_init(&cq->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		cq->timer.function = null_timer_fn;
+		tasklet_init(&cq->tasklet, null_tasklet_fn, (unsigned long)cq);
+	}
+
+	null_major = register_blkdev(0, "nullb");
+	if (null_major < 0)
+		return null_major;
+
+	for (i = 0; i < nr_devices; i++) {
+		err = null_add_dev(i);
+		if (err)
+			goto out;
+	}
+
+	pr_info("null_blk: module loaded\n");
+	return 0;
+
+out:
+	mutex_lock(&nullb_lock);
+	while (!list_empty(&nullb_list))
+		null_del_dev(list_first_entry(&nullb_list, struct nullb, list));
+	mutex_unlock(&nullb_lock);
+	unregister_blkdev(null_major, "nullb");
+	return err;
+}
+
+static void __exit null_exit(void)
+{
+	unsigned int cpu;
+
+	unregister_blkdev(null_major, "nullb");
+
+	mutex_lock(&nullb_lock);
+	while (!list_empty(&nullb_list))
+		null_del_dev(list_first_entry(&nullb_list, struct nullb, list));
+	mutex_unlock(&nullb_lock);
+
+	for_each_possible_cpu(cpu) {
+		struct completion_queue *cq = &per_cpu(completion_queues, cpu);
+
+		hrtimer_cancel(&cq->timer);
+		tasklet_kill(&cq->tasklet);
+	}
+}
+
+module_init(null_init);
+module_exit(null_exit);
+
+MODULE_LICENSE("GPL");
@@ -2,6 +2,7 @@
 #include <linux/spinlock.h>
 #include <linux/slab.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/hdreg.h>
 #include <linux/module.h>
 #include <linux/virtio.h>
@@ -12,6 +13,7 @@
 #include <linux/idr.h>
 
 #define PART_BITS 4
+#define VIRTBLK_QUEUE_DEPTH 64
 
 static int major;
 static DEFINE_IDA(vd_index_ida);
@@ -28,11 +30,6 @@ struct virtio_blk
 	/* The disk structure for the kernel. */
 	struct gendisk *disk;
 
-	/* Request tracking. */
-	struct list_head reqs;
-
-	mempool_t *pool;
-
 	/* Process context for config space updates */
 	struct work_struct config_work;
 
@@ -41,31 +38,39 @@ struct virtio_blk
 
 	/* Ida index - used to track minor number allocations. */
 	int index;
-
-	/* Scatterlist: can be too big for stack. */
-	struct scatterlist sg[/*sg_elems*/];
 };
 
+/* Lives in the driver data area behind each struct request. */
 struct virtblk_req
 {
-	struct list_head list;
 	struct request *req;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
 	u8 status;
+	struct scatterlist sg[/*sg_elems*/];
 };
 
 static void blk_done(struct virtqueue *vq)
 {
 	struct virtio_blk *vblk = vq->vdev->priv;
 	struct virtblk_req *vbr;
+	struct request *req, *tmp;
 	unsigned int len;
 	unsigned long flags;
+	LIST_HEAD(done);
 
 	spin_lock_irqsave(&vblk->lock, flags);
-	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
+	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL)
+		list_add_tail(&vbr->req->queuelist, &done);
+	spin_unlock_irqrestore(&vblk->lock, flags);
+
+	/* Complete outside the lock, submitters contend on it. */
+	list_for_each_entry_safe(req, tmp, &done, queuelist) {
 		int error;
 
+		list_del_init(&req->queuelist);
+		vbr = blk_mq_rq_to_pdu(req);
+
 		switch (vbr->status) {
 		case VIRTIO_BLK_S_OK:
 			error = 0;
@@ -91,25 +96,20 @@ static void blk_done(struct virtqueue *vq)
 			break;
 		}
 
-		__blk_end_request_all(vbr->req, error);
-		list_del(&vbr->list);
-		mempool_free(vbr, vblk->pool);
+		blk_mq_end_io(vbr->req, error);
 	}
 	/* In case queue is stopped waiting for more buffers. */
-	blk_start_queue(vblk->disk->queue);
-	spin_unlock_irqrestore(&vblk->lock, flags);
+	blk_mq_start_stopped_hw_queues(vblk->disk->queue);
 }
 
-static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
-		   struct request *req)
+static int virtio_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *req)
 {
+	struct virtio_blk *vblk = hctx->queue->queuedata;
+	struct virtblk_req *vbr = blk_mq_rq_to_pdu(req);
 	unsigned long num, out = 0, in = 0;
-	struct virtblk_req *vbr;
+	unsigned long flags;
 
-	vbr = mempool_alloc(vblk->pool, GFP_ATOMIC);
-	if (!vbr)
-		/* When another request finishes we'll try again. */
-		return false;
+	BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
 
 	vbr->req = req;
 
@@ -140,7 +140,7 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	sg_set_buf(&vblk->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	sg_set_buf(&vbr->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
 
 	/*
 	 * If this is a packet command we need a couple of additional headers.
@@ -149,17 +149,17 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 	 * inhdr with additional status information before the normal inhdr.
 	 */
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC)
-		sg_set_buf(&vblk->sg[out++], vbr->req->cmd, vbr->req->cmd_len);
+		sg_set_buf(&vbr->sg[out++], vbr->req->cmd, vbr->req->cmd_len);
 
-	num = blk_rq_map_sg(q, vbr->req, vblk->sg + out);
+	num = blk_rq_map_sg(hctx->queue, vbr->req, vbr->sg + out);
 
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC) {
-		sg_set_buf(&vblk->sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
-		sg_set_buf(&vblk->sg[num + out + in++], &vbr->in_hdr,
+		sg_set_buf(&vbr->sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
+		sg_set_buf(&vbr->sg[num + out + in++], &vbr->in_hdr,
 			   sizeof(vbr->in_hdr));
 	}
 
-	sg_set_buf(&vblk->sg[num + out + in++], &vbr->status,
+	sg_set_buf(&vbr->sg[num + out + in++], &vbr->status,
 		   sizeof(vbr->status));
 
 	if (num) {
@@ -172,38 +172,39 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (virtqueue_add_buf(vblk->vq, vblk->sg, out, in, vbr) < 0) {
-		mempool_free(vbr, vblk->pool);
-		return false;
+	spin_lock_irqsave(&vblk->lock, flags);
+	if (virtqueue_add_buf(vblk->vq, vbr->sg, out, in, vbr) < 0) {
+		/* Stop the queue and wait for something to finish to
+		   restart it. */
+		blk_mq_stop_hw_queue(hctx);
+		spin_unlock_irqrestore(&vblk->lock, flags);
+		return BLK_MQ_RQ_QUEUE_BUSY;
 	}
+	virtqueue_kick(vblk->vq);
+	spin_unlock_irqrestore(&vblk->lock, flags);
 
-	list_add_tail(&vbr->list, &vblk->reqs);
-	return true;
+	return BLK_MQ_RQ_QUEUE_OK;
 }
 
-static void do_virtblk_request(struct request_queue *q)
+static int virtblk_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			     unsigned int index)
 {
-	struct virtio_blk *vblk = q->queuedata;
-	struct request *req;
-	unsigned int issued = 0;
+	struct virtio_blk *vblk = data;
+	unsigned int i;
 
-	while ((req = blk_peek_request(q)) != NULL) {
-		BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
+	for (i = 0; i < hctx->queue_depth; i++) {
+		struct virtblk_req *vbr = blk_mq_rq_to_pdu(hctx->rqs[i]);
 
-		/* If this request fails, stop queue and wait for something to
-		   finish to restart it. */
-		if (!do_req(q, vblk, req)) {
-			blk_stop_queue(q);
-			break;
-		}
-		blk_start_request(req);
-		issued++;
+		sg_init_table(vbr->sg, vblk->sg_elems);
 	}
-
-	if (issued)
-		virtqueue_kick(vblk->vq);
+	return 0;
 }
 
+static struct blk_mq_ops virtio_mq_ops = {
+	.queue_rq	= virtio_queue_rq,
+	.init_hctx	= virtblk_init_hctx,
+};
+
 /* return id (s/n) string for *disk to *id_str
  */
 static int virtblk_get_id(struct gendisk *disk, char *id_str)
@@ -353,6 +354,7 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 {
 	struct virtio_blk *vblk;
 	struct request_queue *q;
+	struct blk_mq_reg reg;
 	int err, index;
 	u64 cap;
 	u32 v, blk_size, sg_elems, opt_io_size;
@@ -376,18 +378,15 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 
 	/* We need an extra sg elements at head and tail. */
 	sg_elems += 2;
-	vdev->priv = vblk = kmalloc(sizeof(*vblk) +
-				    sizeof(vblk->sg[0]) * sg_elems, GFP_KERNEL);
+	vdev->priv = vblk = kmalloc(sizeof(*vblk), GFP_KERNEL);
 	if (!vblk) {
 		err = -ENOMEM;
 		goto out_free_index;
 	}
 
-	INIT_LIST_HEAD(&vblk->reqs);
 	spin_lock_init(&vblk->lock);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
-	sg_init_table(vblk->sg, vblk->sg_elems);
 	INIT_WORK(&vblk->config_work, virtblk_config_changed_work);
 
 	/* We expect one virtqueue, for output. */
@@ -397,24 +396,28 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out_free_vblk;
 	}
 
-	vblk->pool = mempool_create_kmalloc_pool(1,sizeof(struct virtblk_req));
-	if (!vblk->pool) {
-		err = -ENOMEM;
-		goto out_free_vq;
-	}
-
 	/* FIXME: How many partitions?  How long is a piece of string? */
 	vblk->disk = alloc_disk(1 << PART_BITS);
 	if (!vblk->disk) {
 		err = -ENOMEM;
-		goto out_mempool;
+		goto out_free_vq;
 	}
 
-	q = vblk->disk->queue = blk_init_queue(do_virtblk_request, &vblk->lock);
-	if (!q) {
-		err = -ENOMEM;
+	/* One hardware queue per virtqueue, requests carry their own sg. */
+	memset(&reg, 0, sizeof(reg));
+	reg.ops = &virtio_mq_ops;
+	reg.nr_hw_queues = 1;
+	reg.queue_depth = VIRTBLK_QUEUE_DEPTH;
+	reg.numa_node = NUMA_NO_NODE;
+	reg.cmd_size = sizeof(struct virtblk_req) +
+		       sizeof(struct scatterlist) * sg_elems;
+
+	q = blk_mq_init_queue(&reg, vblk);
+	if (IS_ERR(q)) {
+		err = PTR_ERR(q);
 		goto out_put_disk;
 	}
+	vblk->disk->queue = q;
 
 	q->queuedata = vblk;
 
@@ -525,8 +528,6 @@ out_del_disk:
 	blk_cleanup_queue(vblk->disk->queue);
 out_put_disk:
 	put_disk(vblk->disk);
-out_mempool:
-	mempool_destroy(vblk->pool);
 out_free_vq:
 	vdev->config->del_vqs(vdev);
 out_free_vblk:
@@ -544,16 +545,12 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 
 	flush_work(&vblk->config_work);
 
-	/* Nothing should be pending. */
-	BUG_ON(!list_empty(&vblk->reqs));
-
 	/* Stop all the virtqueues. */
 	vdev->config->reset(vdev);
 
 	del_gendisk(vblk->disk);
 	blk_cleanup_queue(vblk->disk->queue);
 	put_disk(vblk->disk);
-	mempool_destroy(vblk->pool);
 	vdev->config->del_vqs(vdev);
 	kfree(vblk);
 	ida_simple_remove(&vd_index_ida, index);
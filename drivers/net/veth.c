@@ -25,6 +25,14 @@
 #define MIN_MTU 68		/* Min L3 MTU */
 #define MAX_MTU 65535		/* Max L3 MTU (arbitrary) */
 
+#define VETH_MAX_QUEUES	256
+#define VETH_RING_SIZE	256	/* skbs queued per rx queue before drop */
+#define VETH_NAPI_WEIGHT 64
+
+static unsigned int num_queues = 1;
+module_param(num_queues, uint, 0444);
+MODULE_PARM_DESC(num_queues, "Number of tx/rx queues of each new veth device");
+
 struct veth_net_stats {
 	u64			rx_packets;
 	u64			tx_packets;
@@ -34,9 +42,21 @@ struct veth_net_stats {
 	struct u64_stats_sync	syncp;
 };
 
+/*
+ * Receive queue.  When GRO is enabled on a device, its peer's xmit
+ * queues skbs here and schedules the NAPI context on the sending cpu,
+ * instead of going through netif_rx() and the per-cpu backlog.
+ */
+struct veth_rq {
+	struct napi_struct	napi;
+	struct sk_buff_head	queue;	/* filled by the peer's xmit */
+	struct sk_buff_head	rx;	/* private to veth_poll() */
+};
+
 struct veth_priv {
 	struct net_device *peer;
 	struct veth_net_stats __percpu *stats;
+	struct veth_rq *rq;		/* one per tx queue of the peer */
 };
 
 /*
@@ -112,12 +132,30 @@ static const struct ethtool_ops veth_ethtool_ops = {
  * xmit
  */
 
+static int veth_napi_rx(struct net_device *rcv, struct veth_rq *rq,
+			struct sk_buff *skb)
+{
+	if (__dev_forward_skb(rcv, skb))
+		return NET_RX_DROP;
+
+	/* counted in rx_dropped by veth_xmit() */
+	if (unlikely(skb_queue_len(&rq->queue) >= VETH_RING_SIZE)) {
+		kfree_skb(skb);
+		return NET_RX_DROP;
+	}
+
+	skb_queue_tail(&rq->queue, skb);
+	napi_schedule(&rq->napi);
+	return NET_RX_SUCCESS;
+}
+
 static netdev_tx_t veth_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct net_device *rcv = NULL;
 	struct veth_priv *priv, *rcv_priv;
 	struct veth_net_stats *stats, *rcv_stats;
-	int length;
+	int length, ret;
+	u16 rxq;
 
 	priv = netdev_priv(dev);
 	rcv = priv->peer;
@@ -133,7 +171,14 @@ static netdev_tx_t veth_xmit(struct sk_buff *skb, struct net_device *dev)
 		skb->ip_summed = CHECKSUM_UNNECESSARY;
 
 	length = skb->len;
-	if (dev_forward_skb(rcv, skb) != NET_RX_SUCCESS)
+	if (rcv->features & NETIF_F_GRO) {
+		rxq = skb_get_queue_mapping(skb);
+		if (unlikely(rxq >= rcv->real_num_tx_queues))
+			rxq %= rcv->real_num_tx_queues;
+		ret = veth_napi_rx(rcv, &rcv_priv->rq[rxq], skb);
+	} else
+		ret = dev_forward_skb(rcv, skb);
+	if (ret != NET_RX_SUCCESS)
 		goto rx_drop;
 
 	u64_stats_update_begin(&stats->syncp);
@@ -155,6 +200,81 @@ rx_drop:
 	return NETDEV_TX_OK;
 }
 
+/*
+ * NAPI
+ */
+
+static int veth_poll(struct napi_struct *napi, int budget)
+{
+	struct veth_rq *rq = container_of(napi, struct veth_rq, napi);
+	struct sk_buff *skb;
+	unsigned long flags;
+	int done = 0;
+
+	while (done < budget) {
+		if (skb_queue_empty(&rq->rx)) {
+			/* take everything the peer queued in one go */
+			spin_lock_irqsave(&rq->queue.lock, flags);
+			skb_queue_splice_tail_init(&rq->queue, &rq->rx);
+			spin_unlock_irqrestore(&rq->queue.lock, flags);
+			if (skb_queue_empty(&rq->rx))
+				break;
+		}
+
+		skb = __skb_dequeue(&rq->rx);
+		napi_gro_receive(napi, skb);
+		done++;
+	}
+
+	if (done < budget) {
+		napi_complete(napi);
+
+		/* The peer may have queued an skb after we found the queue
+		 * empty but before NAPI_STATE_SCHED was cleared, in which
+		 * case its napi_schedule() was a no-op. */
+		smp_mb();
+		if (!skb_queue_empty(&rq->queue))
+			napi_schedule(napi);
+	}
+
+	return done;
+}
+
+static void veth_napi_enable(struct net_device *dev)
+{
+	struct veth_priv *priv = netdev_priv(dev);
+	unsigned int i;
+
+	for (i = 0; i < dev->real_num_tx_queues; i++) {
+		struct veth_rq *rq = &priv->rq[i];
+
+		/* The peer kept queueing until IFF_UP was cleared, after
+		 * veth_napi_disable() purged the rings.  Drop that, and
+		 * poll once in case an xmit still in flight queues more
+		 * while NAPI_STATE_SCHED is held and its napi_schedule()
+		 * is lost. */
+		skb_queue_purge(&rq->queue);
+		napi_enable(&rq->napi);
+		local_bh_disable();
+		napi_schedule(&rq->napi);
+		local_bh_enable();
+	}
+}
+
+static void veth_napi_disable(struct net_device *dev)
+{
+	struct veth_priv *priv = netdev_priv(dev);
+	unsigned int i;
+
+	for (i = 0; i < dev->real_num_tx_queues; i++) {
+		struct veth_rq *rq = &priv->rq[i];
+
+		napi_disable(&rq->napi);
+		skb_queue_purge(&rq->queue);
+		__skb_queue_purge(&rq->rx);
+	}
+}
+
 /*
  * general routines
  */
@@ -197,6 +317,8 @@ static int veth_open(struct net_device *dev)
 	if (priv->peer == NULL)
 		return -ENOTCONN;
 
+	veth_napi_enable(dev);
+
 	if (priv->peer->flags & IFF_UP) {
 		netif_carrier_on(dev);
 		netif_carrier_on(priv->peer);
@@ -211,6 +333,8 @@ static int veth_close(struct net_device *dev)
 	netif_carrier_off(dev);
 	netif_carrier_off(priv->peer);
 
+	veth_napi_disable(dev);
+
 	return 0;
 }
 
@@ -231,23 +355,45 @@ static int veth_dev_init(struct net_device *dev)
 {
 	struct veth_net_stats __percpu *stats;
 	struct veth_priv *priv;
+	struct veth_rq *rq;
+	unsigned int i;
 
 	stats = alloc_percpu(struct veth_net_stats);
 	if (stats == NULL)
 		return -ENOMEM;
 
+	rq = kcalloc(dev->num_tx_queues, sizeof(*rq), GFP_KERNEL);
+	if (rq == NULL) {
+		free_percpu(stats);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < dev->num_tx_queues; i++) {
+		skb_queue_head_init(&rq[i].queue);
+		__skb_queue_head_init(&rq[i].rx);
+		netif_napi_add(dev, &rq[i].napi, veth_poll, VETH_NAPI_WEIGHT);
+	}
+
 	priv = netdev_priv(dev);
 	priv->stats = stats;
+	priv->rq = rq;
 	return 0;
 }
 
 static void veth_dev_free(struct net_device *dev)
 {
 	struct veth_priv *priv;
+	struct veth_rq *rq;
+	unsigned int i;
 
 	priv = netdev_priv(dev);
+	rq = priv->rq;
+	for (i = 0; i < dev->num_tx_queues; i++)
+		skb_queue_purge(&rq[i].queue);
 	free_percpu(priv->stats);
+	/* free_netdev() deletes the NAPI contexts embedded in rq */
 	free_netdev(dev);
+	kfree(rq);
 }
 
 static const struct net_device_ops veth_netdev_ops = {
@@ -274,6 +420,15 @@ static void veth_setup(struct net_device *dev)
 	dev->hw_features = NETIF_F_NO_CSUM | NETIF_F_SG | NETIF_F_RXCSUM;
 }
 
+static int veth_get_tx_queues(struct net *net, struct nlattr *tb[],
+			      unsigned int *tx_queues,
+			      unsigned int *real_tx_queues)
+{
+	*tx_queues = num_queues;
+	*real_tx_queues = num_queues;
+	return 0;
+}
+
 /*
  * netlink interface
  */
@@ -434,6 +589,7 @@ static struct rtnl_link_ops veth_link_ops = {
 	.dellink	= veth_dellink,
 	.policy		= veth_policy,
 	.maxtype	= VETH_INFO_MAX,
+	.get_tx_queues	= veth_get_tx_queues,
 };
 
 /*
@@ -442,6 +598,13 @@ static struct rtnl_link_ops veth_link_ops = {
 
 static __init int veth_init(void)
 {
+	if (num_queues < 1 || num_queues > VETH_MAX_QUEUES) {
+		pr_warning("veth: num_queues (%u) should be between "
+			   "1 and %d, resetting to 1\n",
+			   num_queues, VETH_MAX_QUEUES);
+		num_queues = 1;
+	}
+
 	return rtnl_link_register(&veth_link_ops);
 }
 
@@ -4112,7 +4112,8 @@ fc_bsg_remove(struct request_queue *q)
 			 */
 			req = blk_fetch_request(q);
 			/* save requests in use and starved */
-			counts = q->rq.count[0] + q->rq.count[1] +
+			counts = blk_rl_count(&q->rq, BLK_RW_ASYNC) +
+				blk_rl_count(&q->rq, BLK_RW_SYNC) +
 				q->rq.starved[0] + q->rq.starved[1];
 			spin_unlock_irq(q->queue_lock);
 			/* any requests still outstanding? */
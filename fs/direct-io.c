@@ -129,6 +129,7 @@ struct dio {
 	unsigned long refcount;		/* direct_io_worker() and bios */
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
+	struct request_queue *poll_queue; /* queue to poll while waiting */
 
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
@@ -465,7 +466,8 @@ static struct bio *dio_await_one(struct dio *dio)
 		__set_current_state(TASK_UNINTERRUPTIBLE);
 		dio->waiter = current;
 		spin_unlock_irqrestore(&dio->bio_lock, flags);
-		io_schedule();
+		if (!dio->poll_queue || !blk_poll(dio->poll_queue))
+			io_schedule();
 		/* wake up sets us TASK_RUNNING */
 		spin_lock_irqsave(&dio->bio_lock, flags);
 		dio->waiter = NULL;
@@ -1154,6 +1156,9 @@ __blockdev_direct_IO(int rw, struct kiocb *iocb, struct inode *inode,
 	memset(dio, 0, offsetof(struct dio, pages));
 
 	dio->flags = flags;
+	/* synchronous reads may poll for completion instead of sleeping */
+	if (bdev && rw == READ && is_sync_kiocb(iocb))
+		dio->poll_queue = bdev_get_queue(bdev);
 	if (dio->flags & DIO_LOCKING) {
 		if (rw == READ) {
 			struct address_space *mapping =
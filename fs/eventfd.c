@@ -53,10 +53,12 @@ struct eventfd_ctx {
  */
 int eventfd_signal(struct eventfd_ctx *ctx, int n)
 {
+	struct wake_batch batch;
 	unsigned long flags;
 
 	if (n < 0)
 		return -EINVAL;
+	wake_batch_start(&batch);
 	spin_lock_irqsave(&ctx->wqh.lock, flags);
 	if (ULLONG_MAX - ctx->count < n)
 		n = (int) (ULLONG_MAX - ctx->count);
@@ -64,6 +66,7 @@ int eventfd_signal(struct eventfd_ctx *ctx, int n)
 	if (waitqueue_active(&ctx->wqh))
 		wake_up_locked_poll(&ctx->wqh, POLLIN);
 	spin_unlock_irqrestore(&ctx->wqh.lock, flags);
+	wake_batch_finish(&batch);
 
 	return n;
 }
@@ -245,6 +248,7 @@ static ssize_t eventfd_write(struct file *file, const char __user *buf, size_t c
 			     loff_t *ppos)
 {
 	struct eventfd_ctx *ctx = file->private_data;
+	struct wake_batch batch;
 	ssize_t res;
 	__u64 ucnt;
 	DECLARE_WAITQUEUE(wait, current);
@@ -255,6 +259,7 @@ static ssize_t eventfd_write(struct file *file, const char __user *buf, size_t c
 		return -EFAULT;
 	if (ucnt == ULLONG_MAX)
 		return -EINVAL;
+	wake_batch_start(&batch);
 	spin_lock_irq(&ctx->wqh.lock);
 	res = -EAGAIN;
 	if (ULLONG_MAX - ctx->count > ucnt)
@@ -284,6 +289,7 @@ static ssize_t eventfd_write(struct file *file, const char __user *buf, size_t c
 			wake_up_locked_poll(&ctx->wqh, POLLIN);
 	}
 	spin_unlock_irq(&ctx->wqh.lock);
+	wake_batch_finish(&batch);
 
 	return res;
 }
@@ -352,6 +352,7 @@ pipe_read(struct kiocb *iocb, const struct iovec *_iov,
 	struct file *filp = iocb->ki_filp;
 	struct inode *inode = filp->f_path.dentry->d_inode;
 	struct pipe_inode_info *pipe;
+	struct wake_batch batch;
 	int do_wakeup;
 	ssize_t ret;
 	struct iovec *iov = (struct iovec *)_iov;
@@ -362,6 +363,11 @@ pipe_read(struct kiocb *iocb, const struct iovec *_iov,
 	if (unlikely(total_len == 0))
 		return 0;
 
+	/*
+	 * Writers woken while we hold i_mutex only get their IPI once we
+	 * drop it, either in pipe_wait() or at the end.
+	 */
+	wake_batch_start(&batch);
 	do_wakeup = 0;
 	ret = 0;
 	mutex_lock(&inode->i_mutex);
@@ -453,6 +459,7 @@ redo:
 		wake_up_interruptible_sync_poll(&pipe->wait, POLLOUT | POLLWRNORM);
 		kill_fasync(&pipe->fasync_writers, SIGIO, POLL_OUT);
 	}
+	wake_batch_finish(&batch);
 	if (ret > 0)
 		file_accessed(filp);
 	return ret;
@@ -465,6 +472,7 @@ pipe_write(struct kiocb *iocb, const struct iovec *_iov,
 	struct file *filp = iocb->ki_filp;
 	struct inode *inode = filp->f_path.dentry->d_inode;
 	struct pipe_inode_info *pipe;
+	struct wake_batch batch;
 	ssize_t ret;
 	int do_wakeup;
 	struct iovec *iov = (struct iovec *)_iov;
@@ -476,6 +484,8 @@ pipe_write(struct kiocb *iocb, const struct iovec *_iov,
 	if (unlikely(total_len == 0))
 		return 0;
 
+	/* see pipe_read() */
+	wake_batch_start(&batch);
 	do_wakeup = 0;
 	ret = 0;
 	mutex_lock(&inode->i_mutex);
@@ -626,6 +636,7 @@ out:
 		wake_up_interruptible_sync_poll(&pipe->wait, POLLIN | POLLRDNORM);
 		kill_fasync(&pipe->fasync_readers, SIGIO, POLL_IN);
 	}
+	wake_batch_finish(&batch);
 	if (ret > 0)
 		file_update_time(filp);
 	return ret;
@@ -0,0 +1,111 @@
+#ifndef BLK_MQ_H
+#define BLK_MQ_H
+
+#include <linux/blkdev.h>
+
+struct blk_mq_ctx;
+
+/*
+ * A hardware dispatch queue. Each cpu's software queue (struct blk_mq_ctx)
+ * maps onto exactly one of these, and requests are allocated from the
+ * preallocated per-tag pool of the hardware queue they will be issued on.
+ */
+struct blk_mq_hw_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	dispatch;	/* requests the driver refused */
+	} ____cacheline_aligned_in_smp;
+
+	unsigned long		state;		/* BLK_MQ_S_* flags */
+	struct delayed_work	run_work;
+
+	cpumask_var_t		cpumask;	/* cpus mapped to this queue */
+
+	struct request_queue	*queue;
+	void			*driver_data;
+
+	unsigned int		nr_ctx;
+	struct blk_mq_ctx	**ctxs;
+	unsigned long		*ctx_map;	/* ctxs with pending requests */
+
+	unsigned int		queue_depth;
+	struct request		**rqs;		/* indexed by tag */
+	unsigned long		*tag_map;
+	wait_queue_head_t	tag_wait;
+
+	unsigned int		queue_num;
+	unsigned int		numa_node;
+};
+
+struct blk_mq_reg {
+	struct blk_mq_ops	*ops;
+	unsigned int		nr_hw_queues;
+	unsigned int		queue_depth;
+	unsigned int		cmd_size;	/* per-request driver data */
+	int			numa_node;
+};
+
+typedef int (queue_rq_fn)(struct blk_mq_hw_ctx *, struct request *);
+typedef int (init_hctx_fn)(struct blk_mq_hw_ctx *, void *, unsigned int);
+typedef void (exit_hctx_fn)(struct blk_mq_hw_ctx *, unsigned int);
+
+struct blk_mq_ops {
+	/*
+	 * Queue request. Called in process context with preemption enabled,
+	 * possibly concurrently for the same hardware queue, and must return
+	 * one of the BLK_MQ_RQ_QUEUE_* values. A driver that
+	 * returns BUSY must stop the hardware queue first and restart it
+	 * once it can make progress again.
+	 */
+	queue_rq_fn		*queue_rq;
+
+	/*
+	 * Called when a hardware queue is set up and torn down, to attach
+	 * and release driver private data.
+	 */
+	init_hctx_fn		*init_hctx;
+	exit_hctx_fn		*exit_hctx;
+};
+
+enum {
+	BLK_MQ_RQ_QUEUE_OK	= 0,	/* queued fine */
+	BLK_MQ_RQ_QUEUE_BUSY	= 1,	/* requeue IO for later */
+	BLK_MQ_RQ_QUEUE_ERROR	= 2,	/* end IO with error */
+
+	BLK_MQ_S_STOPPED	= 0,
+
+	BLK_MQ_MAX_DEPTH	= 2048,
+};
+
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *, void *);
+
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw, gfp_t gfp);
+void blk_mq_free_request(struct request *rq);
+void blk_mq_insert_request(struct request_queue *q, struct request *rq,
+			   bool at_head, bool run_queue);
+void blk_mq_end_io(struct request *rq, int error);
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *, const int cpu);
+
+void blk_mq_run_queues(struct request_queue *q, bool async);
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
+void blk_mq_start_stopped_hw_queues(struct request_queue *q);
+
+/*
+ * Driver command data is immediately after the request. So subtract request
+ * size to get back to the original request.
+ */
+static inline struct request *blk_mq_rq_from_pdu(void *pdu)
+{
+	return pdu - sizeof(struct request);
+}
+static inline void *blk_mq_rq_to_pdu(struct request *rq)
+{
+	return (void *) rq + sizeof(*rq);
+}
+
+#define queue_for_each_hw_ctx(q, hctx, i)				\
+	for ((i) = 0; (i) < (q)->nr_hw_queues &&			\
+	     ({ hctx = (q)->queue_hw_ctx[i]; 1; }); (i)++)
+
+#endif
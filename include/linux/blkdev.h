@@ -13,6 +13,7 @@
 #include <linux/backing-dev.h>
 #include <linux/wait.h>
 #include <linux/mempool.h>
+#include <linux/percpu_counter.h>
 #include <linux/bio.h>
 #include <linux/stringify.h>
 #include <linux/gfp.h>
@@ -31,6 +32,11 @@ struct blk_trace;
 struct request;
 struct sg_io_hdr;
 struct bsg_job;
+struct blk_mq_ops;
+struct blk_mq_ctx;
+struct blk_mq_hw_ctx;
+struct blk_poll_stat;
+struct blk_rq_cache;
 
 #define BLKDEV_MIN_RQ	4
 #define BLKDEV_MAX_RQ	128	/* Default maximum */
@@ -41,15 +47,42 @@ typedef void (rq_end_io_fn)(struct request *, int);
 struct request_list {
 	/*
 	 * count[], starved[], and wait[] are indexed by
-	 * BLK_RW_SYNC/BLK_RW_ASYNC
+	 * BLK_RW_SYNC/BLK_RW_ASYNC, as are the bits in full.
+	 *
+	 * count[] and full are maintained without q->queue_lock, so the
+	 * request limits they enforce are soft. Use blk_rl_count() for an
+	 * exact count. batch is the per-cpu slack of count[], scaled with
+	 * nr_requests.
 	 */
-	int count[2];
+	struct percpu_counter count[2];
+	int batch;
+	unsigned long full;
+	unsigned int nr_freed;		/* requests freed, under queue_lock */
 	int starved[2];
 	int elvpriv;
 	mempool_t *rq_pool;
+	struct blk_rq_cache __percpu *rq_cache;
 	wait_queue_head_t wait[2];
 };
 
+/*
+ * count[] is also updated from completion interrupts, so it is only ever
+ * touched with interrupts disabled.
+ */
+static inline int blk_rl_count(struct request_list *rl, int sync)
+{
+	unsigned long flags;
+	int count;
+
+	if (!rl->rq_pool)
+		return 0;
+
+	local_irq_save(flags);
+	count = percpu_counter_sum_positive(&rl->count[sync]);
+	local_irq_restore(flags);
+	return count;
+}
+
 /*
  * request command types
  */
@@ -82,6 +115,7 @@ struct request {
 	struct call_single_data csd;
 
 	struct request_queue *q;
+	struct blk_mq_ctx *mq_ctx;	/* submission queue, blk-mq only */
 
 	unsigned int cmd_flags;
 	enum rq_cmd_type_bits cmd_type;
@@ -209,6 +243,7 @@ struct bvec_merge_data {
 typedef int (merge_bvec_fn) (struct request_queue *, struct bvec_merge_data *,
 			     struct bio_vec *);
 typedef void (softirq_done_fn)(struct request *);
+typedef int (poll_fn)(struct request_queue *);
 typedef int (dma_drain_needed_fn)(struct request *);
 typedef int (lld_busy_fn) (struct request_queue *q);
 typedef int (bsg_job_fn) (struct bsg_job *);
@@ -285,6 +320,17 @@ struct request_queue {
 	rq_timed_out_fn		*rq_timed_out_fn;
 	dma_drain_needed_fn	*dma_drain_needed;
 	lld_busy_fn		*lld_busy_fn;
+	poll_fn			*poll_fn;
+
+	/*
+	 * Multi-queue: per-cpu software queues mapped onto hardware queues
+	 */
+	struct blk_mq_ops	*mq_ops;
+	unsigned int		*mq_map;
+	struct blk_mq_ctx __percpu	*queue_ctx;
+	struct blk_mq_hw_ctx	**queue_hw_ctx;
+	unsigned int		nr_hw_queues;
+	atomic_t		mq_usage;
 
 	/*
 	 * Dispatch queue sorting
@@ -375,6 +421,12 @@ struct request_queue {
 	struct list_head	flush_data_in_flight;
 	struct request		flush_rq;
 
+	/*
+	 * completion polling, see blk_poll()
+	 */
+	unsigned int		poll_spin_us;
+	struct blk_poll_stat __percpu *poll_stat;
+
 	struct mutex		sysfs_lock;
 
 #if defined(CONFIG_BLK_DEV_BSG)
@@ -391,8 +443,6 @@ struct request_queue {
 
 #define QUEUE_FLAG_QUEUED	1	/* uses generic tag queueing */
 #define QUEUE_FLAG_STOPPED	2	/* queue is stopped */
-#define	QUEUE_FLAG_SYNCFULL	3	/* read queue has been filled */
-#define QUEUE_FLAG_ASYNCFULL	4	/* write queue has been filled */
 #define QUEUE_FLAG_DEAD		5	/* queue being torn down */
 #define QUEUE_FLAG_ELVSWITCH	6	/* don't use elevator, just do FIFO */
 #define QUEUE_FLAG_BIDI		7	/* queue supports bidi requests */
@@ -408,6 +458,7 @@ struct request_queue {
 #define QUEUE_FLAG_ADD_RANDOM  16	/* Contributes to random pool */
 #define QUEUE_FLAG_SECDISCARD  17	/* supports SECDISCARD */
 #define QUEUE_FLAG_SAME_FORCE  18	/* force complete on same CPU */
+#define QUEUE_FLAG_POLL	       19	/* sync waiters poll for completions */
 
 #define QUEUE_FLAG_DEFAULT	((1 << QUEUE_FLAG_IO_STAT) |		\
 				 (1 << QUEUE_FLAG_STACKABLE)	|	\
@@ -487,6 +538,7 @@ static inline void queue_flag_clear(unsigned int flag, struct request_queue *q)
 #define blk_queue_nonrot(q)	test_bit(QUEUE_FLAG_NONROT, &(q)->queue_flags)
 #define blk_queue_io_stat(q)	test_bit(QUEUE_FLAG_IO_STAT, &(q)->queue_flags)
 #define blk_queue_add_random(q)	test_bit(QUEUE_FLAG_ADD_RANDOM, &(q)->queue_flags)
+#define blk_queue_io_poll(q)	test_bit(QUEUE_FLAG_POLL, &(q)->queue_flags)
 #define blk_queue_stackable(q)	\
 	test_bit(QUEUE_FLAG_STACKABLE, &(q)->queue_flags)
 #define blk_queue_discard(q)	test_bit(QUEUE_FLAG_DISCARD, &(q)->queue_flags)
@@ -535,25 +587,24 @@ static inline bool rq_is_sync(struct request *rq)
 
 static inline int blk_queue_full(struct request_queue *q, int sync)
 {
-	if (sync)
-		return test_bit(QUEUE_FLAG_SYNCFULL, &q->queue_flags);
-	return test_bit(QUEUE_FLAG_ASYNCFULL, &q->queue_flags);
+	return test_bit(sync, &q->rq.full);
 }
 
 static inline void blk_set_queue_full(struct request_queue *q, int sync)
 {
-	if (sync)
-		queue_flag_set(QUEUE_FLAG_SYNCFULL, q);
-	else
-		queue_flag_set(QUEUE_FLAG_ASYNCFULL, q);
+	set_bit(sync, &q->rq.full);
+}
+
+/* Returns true if @sync was full */
+static inline bool blk_test_and_set_queue_full(struct request_queue *q,
+					       int sync)
+{
+	return test_and_set_bit(sync, &q->rq.full);
 }
 
 static inline void blk_clear_queue_full(struct request_queue *q, int sync)
 {
-	if (sync)
-		queue_flag_clear(QUEUE_FLAG_SYNCFULL, q);
-	else
-		queue_flag_clear(QUEUE_FLAG_ASYNCFULL, q);
+	clear_bit(sync, &q->rq.full);
 }
 
 
@@ -708,6 +759,7 @@ extern void __blk_stop_queue(struct request_queue *q);
 extern void __blk_run_queue(struct request_queue *q);
 extern void blk_run_queue(struct request_queue *);
 extern void blk_run_queue_async(struct request_queue *q);
+extern bool blk_poll(struct request_queue *q);
 extern int blk_rq_map_user(struct request_queue *, struct request *,
 			   struct rq_map_data *, void __user *, unsigned long,
 			   gfp_t);
@@ -849,6 +901,7 @@ extern void blk_queue_merge_bvec(struct request_queue *, merge_bvec_fn *);
 extern void blk_queue_dma_alignment(struct request_queue *, int);
 extern void blk_queue_update_dma_alignment(struct request_queue *, int);
 extern void blk_queue_softirq_done(struct request_queue *, softirq_done_fn *);
+extern void blk_queue_poll(struct request_queue *, poll_fn *);
 extern void blk_queue_rq_timed_out(struct request_queue *, rq_timed_out_fn *);
 extern void blk_queue_rq_timeout(struct request_queue *, unsigned int);
 extern void blk_queue_flush(struct request_queue *q, unsigned int flush);
@@ -1154,6 +1207,8 @@ static inline void put_dev_sector(Sector p)
 
 struct work_struct;
 int kblockd_schedule_work(struct request_queue *q, struct work_struct *work);
+int kblockd_schedule_delayed_work(struct request_queue *q,
+			struct delayed_work *dwork, unsigned long delay);
 
 #ifdef CONFIG_BLK_CGROUP
 /*
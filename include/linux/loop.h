@@ -18,6 +18,8 @@
 #include <linux/blkdev.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/mempool.h>
+#include <linux/workqueue.h>
 
 /* Possible states of device */
 enum {
@@ -62,6 +64,11 @@ struct loop_device {
 	struct task_struct	*lo_thread;
 	wait_queue_head_t	lo_event;
 
+	/* bios handed off by lo_thread to run concurrently */
+	int			lo_nr_workers;
+	struct workqueue_struct	*lo_wq;
+	mempool_t		*lo_cmd_pool;
+
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
 };
@@ -75,6 +82,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_AUTOCLEAR	= 4,
 	LO_FLAGS_PARTSCAN	= 8,
+	LO_FLAGS_NOCACHE	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
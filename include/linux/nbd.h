@@ -41,28 +41,62 @@ enum {
 
 #include <linux/wait.h>
 #include <linux/mutex.h>
+#include <linux/atomic.h>
 
 /* values for flags field */
 #define NBD_READ_ONLY 0x0001
 #define NBD_WRITE_NOCHK 0x0002
 
+/* sockets a single device may spread its requests over */
+#define NBD_MAX_CONNECTIONS 16
+
+/* requests in flight per device; a reply handle carries the tag */
+#define NBD_NR_TAGS 256
+
 struct request;
+struct task_struct;
+struct nbd_device;
+
+/*
+ * One connection to the server.  Requests are sent and answered on the
+ * same connection, so each has its own sender and receiver thread and
+ * only the sender of a request ever holds its tx_lock.
+ */
+struct nbd_sock {
+	struct socket * sock;
+	struct file * file;
+	struct nbd_device *lo;
+	int index;
+	int dead;		/* shut down, sends fail fast	*/
+
+	struct mutex tx_lock;
+	struct request *active_req;	/* being sent right now */
+	wait_queue_head_t active_wq;
+
+	struct task_struct *send_thread;
+	struct task_struct *recv_thread;
+};
 
 struct nbd_device {
 	int flags;
 	int harderror;		/* Code of hard error			*/
-	struct socket * sock;
-	struct file * file; 	/* If == NULL, device is not ready, yet	*/
+	struct nbd_sock *socks[NBD_MAX_CONNECTIONS];
+	int num_connections;	/* If == 0, device is not ready, yet	*/
 	int magic;
 
 	spinlock_t queue_lock;
-	struct list_head queue_head;	/* Requests waiting result */
-	struct request *active_req;
-	wait_queue_head_t active_wq;
 	struct list_head waiting_queue;	/* Requests to be sent */
 	wait_queue_head_t waiting_wq;
 
-	struct mutex tx_lock;
+	/* Requests waiting result, indexed by tag, under the queue lock */
+	struct request **tags;
+	unsigned long *tag_map;
+	int tags_starved;
+
+	atomic_t recv_threads;
+	wait_queue_head_t recv_wq;
+
+	struct mutex config_lock;
 	struct gendisk *disk;
 	int blksize;
 	u64 bytesize;
@@ -97,6 +97,8 @@ struct ndt_stats {
 	__u64		ndts_rcv_probes_ucast;
 	__u64		ndts_periodic_gc_runs;
 	__u64		ndts_forced_gc_runs;
+	__u64		ndts_gc_buckets;
+	__u64		ndts_gc_reclaimed;
 };
 
 enum {
@@ -347,12 +347,17 @@ struct napi_struct {
 	struct list_head	dev_list;
 	struct sk_buff		*gro_list;
 	struct sk_buff		*skb;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	unsigned int		napi_id;
+	struct hlist_node	napi_hash_node;
+#endif
 };
 
 enum {
 	NAPI_STATE_SCHED,	/* Poll is scheduled */
 	NAPI_STATE_DISABLE,	/* Disable pending */
 	NAPI_STATE_NPSVC,	/* Netpoll - don't dequeue from poll_list */
+	NAPI_STATE_HASHED,	/* In NAPI hash, findable by napi_id */
 };
 
 enum gro_result {
@@ -2000,7 +2005,7 @@ static inline void netif_wake_subqueue(struct net_device *dev, u16 queue_index)
  * as a distribution range limit for the returned value.
  */
 static inline u16 skb_tx_hash(const struct net_device *dev,
-			      const struct sk_buff *skb)
+			      struct sk_buff *skb)
 {
 	return __skb_tx_hash(dev, skb, dev->real_num_tx_queues);
 }
@@ -2099,6 +2104,8 @@ extern int		dev_set_mac_address(struct net_device *,
 extern int		dev_hard_start_xmit(struct sk_buff *skb,
 					    struct net_device *dev,
 					    struct netdev_queue *txq);
+extern int		__dev_forward_skb(struct net_device *dev,
+					  struct sk_buff *skb);
 extern int		dev_forward_skb(struct net_device *dev,
 					struct sk_buff *skb);
 
@@ -2515,6 +2522,8 @@ extern struct rtnl_link_stats64 *dev_get_stats(struct net_device *dev,
 extern int		netdev_max_backlog;
 extern int		netdev_tstamp_prequeue;
 extern int		weight_p;
+extern int		dev_tx_bulk;
+#define QDISC_BULK_MAX	16	/* upper bound of dev_tx_bulk */
 extern int		bpf_jit_enable;
 extern int		netdev_set_master(struct net_device *dev, struct net_device *master);
 extern int netdev_set_bond_master(struct net_device *dev,
@@ -12,6 +12,15 @@ struct pidmap {
        void *page;
 };
 
+/*
+ * A word of free pids claimed by one cpu, so that alloc_pidmap() can
+ * hand them out without touching the shared pidmap.
+ */
+struct pidmap_cache {
+	int base;		/* pid of bit 0 */
+	unsigned long free;	/* bit n set: base + n is still unused */
+};
+
 #define PIDMAP_ENTRIES         ((PID_MAX_LIMIT + 8*PAGE_SIZE - 1)/PAGE_SIZE/8)
 
 struct bsd_acct_struct;
@@ -20,6 +29,7 @@ struct pid_namespace {
 	struct kref kref;
 	struct pidmap pidmap[PIDMAP_ENTRIES];
 	int last_pid;
+	struct pidmap_cache __percpu *pid_cache;
 	struct task_struct *child_reaper;
 	struct kmem_cache *pid_cachep;
 	unsigned int level;
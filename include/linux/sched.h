@@ -101,6 +101,7 @@ struct bio_list;
 struct fs_struct;
 struct perf_event_context;
 struct blk_plug;
+struct wake_batch;
 
 /*
  * List of flags we want to share for kernel threads,
@@ -380,6 +381,7 @@ struct user_namespace;
 #define DEFAULT_MAX_MAP_COUNT	(USHRT_MAX - MAPCOUNT_ELF_CORE_MARGIN)
 
 extern int sysctl_max_map_count;
+extern int sysctl_fork_parallel_copy_mb;
 
 #include <linux/aio.h>
 
@@ -1227,6 +1229,7 @@ struct task_struct {
 #ifdef CONFIG_SMP
 	struct llist_node wake_entry;
 	int on_cpu;
+	struct wake_batch *wake_batch;	/* deferred wakeup IPIs */
 #endif
 	int on_rq;
 
@@ -2136,6 +2139,36 @@ extern void xtime_update(unsigned long ticks);
 extern int wake_up_state(struct task_struct *tsk, unsigned int state);
 extern int wake_up_process(struct task_struct *tsk);
 extern void wake_up_new_task(struct task_struct *tsk);
+
+/*
+ * Wakeup batching: between wake_batch_start() and wake_batch_finish(), the
+ * reschedule IPIs for wakeups this task queues on other cpus' wake lists
+ * are held back and sent once per target cpu at wake_batch_finish(), or
+ * when the task schedules. Meant to wrap code that wakes many tasks, such
+ * as futex_wake(), ideally with the IPIs sent after dropping the lock the
+ * wakees are about to take. Wakeups from interrupt context are not batched.
+ *
+ * The IPIs are mostly deferred, not avoided: ttwu_queue_remote() already
+ * sends one only when the target's wake list was empty, so a batch saves
+ * one only where the target would have drained its list between two of
+ * the batched wakeups.
+ */
+#define WAKE_BATCH_CPUS		16
+
+struct wake_batch {
+#ifdef CONFIG_SMP
+	unsigned int nr;
+	int cpus[WAKE_BATCH_CPUS];
+#endif
+};
+
+#ifdef CONFIG_SMP
+extern void wake_batch_start(struct wake_batch *batch);
+extern void wake_batch_finish(struct wake_batch *batch);
+#else
+static inline void wake_batch_start(struct wake_batch *batch) { }
+static inline void wake_batch_finish(struct wake_batch *batch) { }
+#endif
 #ifdef CONFIG_SMP
  extern void kick_process(struct task_struct *tsk);
 #else
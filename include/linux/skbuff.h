@@ -354,6 +354,7 @@ typedef unsigned char *sk_buff_data_t;
  *		ports.
  *	@dma_cookie: a cookie to one of several possible DMA operations
  *		done by skb DMA functions
+ *	@napi_id: id of the NAPI struct this skb came from
  *	@secmark: security marking
  *	@mark: Generic packet mark
  *	@dropcount: total number of sk_receive_queue overflows
@@ -452,6 +453,9 @@ struct sk_buff {
 #ifdef CONFIG_NET_DMA
 	dma_cookie_t		dma_cookie;
 #endif
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	unsigned int		napi_id;
+#endif
 #ifdef CONFIG_NETWORK_SECMARK
 	__u32			secmark;
 #endif
@@ -2427,7 +2431,7 @@ static inline bool skb_rx_queue_recorded(const struct sk_buff *skb)
 }
 
 extern u16 __skb_tx_hash(const struct net_device *dev,
-			 const struct sk_buff *skb,
+			 struct sk_buff *skb,
 			 unsigned int num_tx_queues);
 
 #ifdef CONFIG_XFRM
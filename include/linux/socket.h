@@ -154,6 +154,14 @@ struct ucred {
 	__u32	gid;
 };
 
+/* SO_BUSY_POLL_STATS: receives that busy polled an empty queue, and how
+ * many of those found data before the poll time ran out.
+ */
+struct sock_busy_poll_stats {
+	__u64	polls;
+	__u64	hits;
+};
+
 /* Supported address families. */
 #define AF_UNSPEC	0
 #define AF_UNIX		1	/* Unix domain sockets 		*/
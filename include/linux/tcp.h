@@ -343,6 +343,9 @@ struct tcp_sock {
 	u32	rcv_ssthresh;	/* Current window clamp			*/
 
 	u32	frto_highmark;	/* snd_nxt when RTO occurred */
+
+	unsigned long	tsq_flags;	/* TSQ_* bits, see enum tsq_flags */
+	struct list_head tsq_node;	/* anchor in tsq_tasklet.head list */
 	u16	advmss;		/* Advertised MSS			*/
 	u8	frto_counter;	/* Number of new acks after RTO */
 	u8	nonagle     : 4,/* Disable Nagle algorithm?             */
@@ -468,6 +471,12 @@ struct tcp_sock {
 	struct tcp_cookie_values  *cookie_values;
 };
 
+enum tsq_flags {
+	TSQ_THROTTLED,		/* tcp_write_xmit() stopped on the output limit */
+	TSQ_QUEUED,		/* socket is on a per-cpu tsq_tasklet list */
+	TCP_TSQ_DEFERRED,	/* tasklet found socket owned by user */
+};
+
 static inline struct tcp_sock *tcp_sk(const struct sock *sk)
 {
 	return (struct tcp_sock *)sk;
@@ -159,6 +159,8 @@ void __wake_up_sync_key(wait_queue_head_t *q, unsigned int mode, int nr,
 			void *key);
 void __wake_up_locked(wait_queue_head_t *q, unsigned int mode);
 void __wake_up_sync(wait_queue_head_t *q, unsigned int mode, int nr);
+void __wake_up_batch(wait_queue_head_t *q, unsigned int mode, int nr,
+		     void *key);
 void __wake_up_bit(wait_queue_head_t *, void *, int);
 int __wait_on_bit(wait_queue_head_t *, struct wait_bit_queue *, int (*)(void *), unsigned);
 int __wait_on_bit_lock(wait_queue_head_t *, struct wait_bit_queue *, int (*)(void *), unsigned);
@@ -177,6 +179,13 @@ wait_queue_head_t *bit_waitqueue(void *, int);
 #define wake_up_interruptible_all(x)	__wake_up(x, TASK_INTERRUPTIBLE, 0, NULL)
 #define wake_up_interruptible_sync(x)	__wake_up_sync((x), TASK_INTERRUPTIBLE, 1)
 
+/*
+ * Wake all waiters, sending one reschedule IPI per target cpu once the
+ * whole queue has been walked (see wake_batch_start()).
+ */
+#define wake_up_batch(x)		__wake_up_batch(x, TASK_NORMAL, 0, NULL)
+#define wake_up_interruptible_batch(x)	__wake_up_batch(x, TASK_INTERRUPTIBLE, 0, NULL)
+
 /*
  * Wakeup macros to be used to report events to the targets.
  */
@@ -188,6 +197,8 @@ wait_queue_head_t *bit_waitqueue(void *, int);
 	__wake_up(x, TASK_INTERRUPTIBLE, 1, (void *) (m))
 #define wake_up_interruptible_sync_poll(x, m)				\
 	__wake_up_sync_key((x), TASK_INTERRUPTIBLE, 1, (void *) (m))
+#define wake_up_batch_poll(x, m)					\
+	__wake_up_batch((x), TASK_NORMAL, 0, (void *) (m))
 
 #define __wait_event(wq, condition) 					\
 do {									\
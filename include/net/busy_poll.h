@@ -0,0 +1,68 @@
+/*
+ * net/busy_poll.h: Busy polling of a socket's receive device queue
+ *
+ * A socket records the id of the NAPI context its last packet arrived
+ * on.  A blocking receive that finds the queue empty may then run that
+ * NAPI poll routine itself for up to sk_ll_usec microseconds, instead
+ * of sleeping until the interrupt and softirq deliver the packet.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ */
+
+#ifndef _LINUX_NET_BUSY_POLL_H
+#define _LINUX_NET_BUSY_POLL_H
+
+#include <linux/netdevice.h>
+#include <linux/sched.h>
+#include <net/sock.h>
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+
+extern unsigned int sysctl_net_busy_read __read_mostly;
+
+extern bool sk_busy_loop(struct sock *sk, int nonblock);
+
+static inline bool sk_can_busy_loop(const struct sock *sk)
+{
+	return sk->sk_ll_usec && sk->sk_napi_id &&
+	       !need_resched() && !signal_pending(current);
+}
+
+/* used in the NIC receive handler to mark the skb */
+static inline void skb_mark_napi_id(struct sk_buff *skb,
+				    const struct napi_struct *napi)
+{
+	skb->napi_id = napi->napi_id;
+}
+
+/* used in the protocol handler to propagate the napi_id to the socket */
+static inline void sk_mark_napi_id(struct sock *sk, const struct sk_buff *skb)
+{
+	sk->sk_napi_id = skb->napi_id;
+}
+
+#else /* CONFIG_NET_RX_BUSY_POLL */
+
+static inline bool sk_can_busy_loop(const struct sock *sk)
+{
+	return false;
+}
+
+static inline bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	return false;
+}
+
+static inline void skb_mark_napi_id(struct sk_buff *skb,
+				    const struct napi_struct *napi)
+{
+}
+
+static inline void sk_mark_napi_id(struct sock *sk, const struct sk_buff *skb)
+{
+}
+
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+#endif /* _LINUX_NET_BUSY_POLL_H */
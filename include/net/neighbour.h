@@ -86,9 +86,14 @@ struct neigh_statistics {
 	unsigned long forced_gc_runs;	/* number of forced GC runs */
 
 	unsigned long unres_discards;	/* number of unresolved drops */
+
+	unsigned long gc_buckets;	/* number of buckets scanned by GC */
+	unsigned long gc_reclaimed;	/* number of entries released by GC */
 };
 
 #define NEIGH_CACHE_STAT_INC(tbl, field) this_cpu_inc((tbl)->stats->field)
+#define NEIGH_CACHE_STAT_ADD(tbl, field, val) \
+	this_cpu_add((tbl)->stats->field, (val))
 
 struct neighbour {
 	struct neighbour __rcu	*next;
@@ -176,6 +181,10 @@ struct neigh_table {
 	struct neigh_statistics	__percpu *stats;
 	struct neigh_hash_table __rcu *nht;
 	struct pneigh_entry	**phash_buckets;
+	spinlock_t		*hash_locks;
+	unsigned int		hash_locks_mask;
+	unsigned int		gc_bucket;	/* next bucket for periodic GC */
+	unsigned int		forced_gc_bucket;
 };
 
 /* flags for neigh_update() */
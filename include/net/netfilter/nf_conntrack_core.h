@@ -74,6 +74,18 @@ print_tuple(struct seq_file *s, const struct nf_conntrack_tuple *tuple,
             const struct nf_conntrack_l3proto *l3proto,
             const struct nf_conntrack_l4proto *proto);
 
-extern spinlock_t nf_conntrack_lock ;
+/*
+ * The conntrack hash is protected by an array of locks, bucket b by
+ * nf_conntrack_locks[b % CONNTRACK_LOCKS].  Take them with
+ * nf_conntrack_lock() so a table resize, which needs all of them, can
+ * hold everyone off.  Expectations and helper assignment are covered by
+ * nf_conntrack_expect_lock.
+ */
+#define CONNTRACK_LOCKS 1024
+
+extern spinlock_t nf_conntrack_locks[CONNTRACK_LOCKS];
+extern void nf_conntrack_lock(spinlock_t *lock);
+
+extern spinlock_t nf_conntrack_expect_lock;
 
 #endif /* _NF_CONNTRACK_CORE_H */
@@ -25,6 +25,7 @@ enum qdisc_state_t {
 	__QDISC_STATE_SCHED,
 	__QDISC_STATE_DEACTIVATED,
 	__QDISC_STATE_THROTTLED,
+	__QDISC_STATE_MISSED,		/* TCQ_F_NOLOCK: enqueued while running */
 };
 
 /*
@@ -50,6 +51,7 @@ struct Qdisc {
 #define TCQ_F_INGRESS		2
 #define TCQ_F_CAN_BYPASS	4
 #define TCQ_F_MQROOT		8
+#define TCQ_F_NOLOCK		16 /* enqueue/dequeue safe without root lock */
 #define TCQ_F_WARN_NONWC	(1 << 16)
 	int			padded;
 	const struct Qdisc_ops	*ops;
@@ -72,6 +74,7 @@ struct Qdisc {
 	struct Qdisc		*next_sched;
 
 	struct sk_buff		*gso_skb;
+	struct sk_buff_head	requeue;	/* dequeued, not sent, after gso_skb */
 	/*
 	 * For performance sake on SMP, we put highly modified fields at the end
 	 */
@@ -83,15 +86,31 @@ struct Qdisc {
 	struct rcu_head		rcu_head;
 	spinlock_t		busylock;
 	u32			limit;
+	/* TCQ_F_NOLOCK roots: held by the one cpu running the queue */
+	spinlock_t		run_lock;
 };
 
 static inline bool qdisc_is_running(const struct Qdisc *qdisc)
 {
+	if (qdisc->flags & TCQ_F_NOLOCK)
+		return spin_is_locked((spinlock_t *)&qdisc->run_lock);
 	return (qdisc->__state & __QDISC___STATE_RUNNING) ? true : false;
 }
 
 static inline bool qdisc_run_begin(struct Qdisc *qdisc)
 {
+	if (qdisc->flags & TCQ_F_NOLOCK) {
+		if (spin_trylock(&qdisc->run_lock))
+			return true;
+		/*
+		 * Whoever is running may already have found the queue
+		 * empty; make it look again before it lets go, unless it
+		 * let go in the meantime.
+		 */
+		set_bit(__QDISC_STATE_MISSED, &qdisc->state);
+		smp_mb();
+		return spin_trylock(&qdisc->run_lock);
+	}
 	if (qdisc_is_running(qdisc))
 		return false;
 	qdisc->__state |= __QDISC___STATE_RUNNING;
@@ -100,6 +119,13 @@ static inline bool qdisc_run_begin(struct Qdisc *qdisc)
 
 static inline void qdisc_run_end(struct Qdisc *qdisc)
 {
+	if (qdisc->flags & TCQ_F_NOLOCK) {
+		spin_unlock(&qdisc->run_lock);
+		smp_mb();
+		if (unlikely(test_bit(__QDISC_STATE_MISSED, &qdisc->state)))
+			__netif_schedule(qdisc);
+		return;
+	}
 	qdisc->__state &= ~__QDISC___STATE_RUNNING;
 }
 
@@ -296,6 +322,7 @@ static inline void sch_tree_unlock(const struct Qdisc *q)
 extern struct Qdisc noop_qdisc;
 extern struct Qdisc_ops noop_qdisc_ops;
 extern struct Qdisc_ops pfifo_fast_ops;
+extern struct Qdisc_ops pfifo_ring_ops;
 extern struct Qdisc_ops mq_qdisc_ops;
 
 struct Qdisc_class_common {
@@ -347,6 +374,7 @@ extern struct Qdisc *dev_graft_qdisc(struct netdev_queue *dev_queue,
 				     struct Qdisc *qdisc);
 extern void qdisc_reset(struct Qdisc *qdisc);
 extern void qdisc_destroy(struct Qdisc *qdisc);
+extern void qdisc_sync_stats(struct Qdisc *qdisc);
 extern void qdisc_tree_decrease_qlen(struct Qdisc *qdisc, unsigned int n);
 extern struct Qdisc *qdisc_alloc(struct netdev_queue *dev_queue,
 				 struct Qdisc_ops *ops);
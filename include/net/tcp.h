@@ -251,6 +251,7 @@ extern int sysctl_tcp_max_ssthresh;
 extern int sysctl_tcp_cookie_size;
 extern int sysctl_tcp_thin_linear_timeouts;
 extern int sysctl_tcp_thin_dupack;
+extern int sysctl_tcp_limit_output_bytes;
 
 extern atomic_long_t tcp_memory_allocated;
 extern struct percpu_counter tcp_sockets_allocated;
@@ -481,6 +482,8 @@ extern int tcp_syn_flood_action(struct sock *sk,
 				const struct sk_buff *skb,
 				const char *proto);
 extern void tcp_push_one(struct sock *, unsigned int mss_now);
+extern void tcp_release_cb(struct sock *sk);
+extern void tcp_tasklet_init(void);
 extern void tcp_send_ack(struct sock *sk);
 extern void tcp_send_delayed_ack(struct sock *sk);
 
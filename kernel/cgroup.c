@@ -118,6 +118,9 @@ struct cgroupfs_root {
 
 	/* The name for this hierarchy - may be empty */
 	char name[MAX_CGROUP_ROOT_NAMELEN];
+
+	/* roots are freed under RCU, see proc_cgroup_show() */
+	struct rcu_head rcu_head;
 };
 
 /*
@@ -189,7 +192,10 @@ struct cgroup_event {
 	struct work_struct remove;
 };
 
-/* The list of hierarchy roots */
+/*
+ * The list of hierarchy roots. Modified under cgroup_mutex, readers may
+ * walk it either under cgroup_mutex or under rcu_read_lock().
+ */
 
 static LIST_HEAD(roots);
 static int root_count;
@@ -262,6 +268,9 @@ list_for_each_entry(_ss, &_root->subsys_list, sibling)
 #define for_each_active_root(_root) \
 list_for_each_entry(_root, &roots, root_list)
 
+#define for_each_active_root_rcu(_root) \
+list_for_each_entry_rcu(_root, &roots, root_list)
+
 /* the list of cgroups eligible for automatic release. Protected by
  * release_list_lock */
 static LIST_HEAD(release_list);
@@ -647,6 +656,28 @@ static struct css_set *find_css_set(
 	return res;
 }
 
+/*
+ * Look up the cgroup of css_set "css" in the given hierarchy. Must be
+ * called with css_set_lock held. Returns NULL only if "css" has already
+ * been unlinked by __put_css_set(), which can only be seen by callers
+ * that dereferenced the task's css_set under RCU.
+ */
+static struct cgroup *css_set_cgroup_from_root(struct css_set *css,
+					       struct cgroupfs_root *root)
+{
+	struct cg_cgroup_link *link;
+
+	if (css == &init_css_set)
+		return &root->top_cgroup;
+
+	list_for_each_entry(link, &css->cg_links, cg_link_list) {
+		struct cgroup *c = link->cgrp;
+		if (c->root == root)
+			return c;
+	}
+	return NULL;
+}
+
 /*
  * Return the cgroup for "task" from the given hierarchy. Must be
  * called with cgroup_mutex held.
@@ -654,8 +685,7 @@ static struct css_set *find_css_set(
 static struct cgroup *task_cgroup_from_root(struct task_struct *task,
 					    struct cgroupfs_root *root)
 {
-	struct css_set *css;
-	struct cgroup *res = NULL;
+	struct cgroup *res;
 
 	BUG_ON(!mutex_is_locked(&cgroup_mutex));
 	read_lock(&css_set_lock);
@@ -664,24 +694,36 @@ static struct cgroup *task_cgroup_from_root(struct task_struct *task,
 	 * task can't change groups, so the only thing that can happen
 	 * is that it exits and its css is set back to init_css_set.
 	 */
-	css = task->cgroups;
-	if (css == &init_css_set) {
-		res = &root->top_cgroup;
-	} else {
-		struct cg_cgroup_link *link;
-		list_for_each_entry(link, &css->cg_links, cg_link_list) {
-			struct cgroup *c = link->cgrp;
-			if (c->root == root) {
-				res = c;
-				break;
-			}
-		}
-	}
+	res = css_set_cgroup_from_root(task->cgroups, root);
 	read_unlock(&css_set_lock);
 	BUG_ON(!res);
 	return res;
 }
 
+/*
+ * Variant of task_cgroup_from_root() for readers that only hold
+ * rcu_read_lock(). The task may be migrating concurrently, in which case
+ * either its old or its new cgroup is returned. Returns NULL if the
+ * hierarchy is being mounted or unmounted under us.
+ */
+static struct cgroup *task_cgroup_from_root_rcu(struct task_struct *task,
+						struct cgroupfs_root *root)
+{
+	struct css_set *css;
+	struct cgroup *res;
+
+	WARN_ON_ONCE(!rcu_read_lock_held());
+	for (;;) {
+		css = rcu_dereference(task->cgroups);
+		read_lock(&css_set_lock);
+		res = css_set_cgroup_from_root(css, root);
+		read_unlock(&css_set_lock);
+		/* a dead css_set has no links left, retry with the new one */
+		if (res || css == rcu_dereference(task->cgroups))
+			return res;
+	}
+}
+
 /*
  * There is one global cgroup mutex. We also require taking
  * task_lock() when dereferencing a task's cgroup subsys pointers.
@@ -1414,7 +1456,7 @@ static void cgroup_drop_root(struct cgroupfs_root *root)
 	spin_lock(&hierarchy_id_lock);
 	ida_remove(&hierarchy_ida, root->hierarchy_id);
 	spin_unlock(&hierarchy_id_lock);
-	kfree(root);
+	kfree_rcu(root, rcu_head);
 }
 
 static int cgroup_set_super(struct super_block *sb, void *data)
@@ -1571,7 +1613,7 @@ static struct dentry *cgroup_mount(struct file_system_type *fs_type,
 		/* EBUSY should be the only error here */
 		BUG_ON(ret);
 
-		list_add(&root->root_list, &roots);
+		list_add_rcu(&root->root_list, &roots);
 		root_count++;
 
 		sb->s_root->d_fsdata = root_cgrp;
@@ -1660,7 +1702,7 @@ static void cgroup_kill_sb(struct super_block *sb) {
 	write_unlock(&css_set_lock);
 
 	if (!list_empty(&root->root_list)) {
-		list_del(&root->root_list);
+		list_del_rcu(&root->root_list);
 		root_count--;
 	}
 
@@ -1742,12 +1784,11 @@ EXPORT_SYMBOL_GPL(cgroup_path);
 /*
  * cgroup_task_migrate - move a task from one cgroup to another.
  *
- * 'guarantee' is set if the caller promises that a new css_set for the task
- * will already exist. If not set, this function might sleep, and can fail with
- * -ENOMEM. Otherwise, it can only fail with -ESRCH.
+ * Might sleep, and can fail with -ENOMEM or -ESRCH. Whole threadgroups are
+ * moved in a batch by cgroup_attach_proc() instead.
  */
 static int cgroup_task_migrate(struct cgroup *cgrp, struct cgroup *oldcgrp,
-			       struct task_struct *tsk, bool guarantee)
+			       struct task_struct *tsk)
 {
 	struct css_set *oldcg;
 	struct css_set *newcg;
@@ -1763,22 +1804,12 @@ static int cgroup_task_migrate(struct cgroup *cgrp, struct cgroup *oldcgrp,
 	task_unlock(tsk);
 
 	/* locate or allocate a new css_set for this task. */
-	if (guarantee) {
-		/* we know the css_set we want already exists. */
-		struct cgroup_subsys_state *template[CGROUP_SUBSYS_COUNT];
-		read_lock(&css_set_lock);
-		newcg = find_existing_css_set(oldcg, cgrp, template);
-		BUG_ON(!newcg);
-		get_css_set(newcg);
-		read_unlock(&css_set_lock);
-	} else {
-		might_sleep();
-		/* find_css_set will give us newcg already referenced. */
-		newcg = find_css_set(oldcg, cgrp);
-		if (!newcg) {
-			put_css_set(oldcg);
-			return -ENOMEM;
-		}
+	might_sleep();
+	/* find_css_set will give us newcg already referenced. */
+	newcg = find_css_set(oldcg, cgrp);
+	if (!newcg) {
+		put_css_set(oldcg);
+		return -ENOMEM;
 	}
 	put_css_set(oldcg);
 
@@ -1852,7 +1883,7 @@ int cgroup_attach_task(struct cgroup *cgrp, struct task_struct *tsk)
 		}
 	}
 
-	retval = cgroup_task_migrate(cgrp, oldcgrp, tsk, false);
+	retval = cgroup_task_migrate(cgrp, oldcgrp, tsk);
 	if (retval)
 		goto out;
 
@@ -1917,56 +1948,43 @@ EXPORT_SYMBOL_GPL(cgroup_attach_task_all);
 /*
  * cgroup_attach_proc works in two stages, the first of which prefetches all
  * new css_sets needed (to make sure we have enough memory before committing
- * to the move) and stores them in a list of entries of the following type.
- * TODO: possible optimization: use css_set->rcu_head for chaining instead
+ * to the move) and stores them in a list of entries of the following type,
+ * one per distinct old css_set found in the threadgroup. The second stage
+ * then moves every thread under a single hold of css_set_lock, using the
+ * list to map each thread's old css_set to its new one.
  */
 struct cg_list_entry {
-	struct css_set *cg;
+	struct css_set *oldcg;		/* referenced */
+	struct css_set *cg;		/* referenced */
+	int nr_moved;			/* threads moved from oldcg to cg */
 	struct list_head links;
 };
 
-static bool css_set_check_fetched(struct cgroup *cgrp,
-				  struct task_struct *tsk, struct css_set *cg,
-				  struct list_head *newcg_list)
+static struct cg_list_entry *css_set_find_fetched(struct css_set *oldcg,
+						  struct list_head *newcg_list)
 {
-	struct css_set *newcg;
 	struct cg_list_entry *cg_entry;
-	struct cgroup_subsys_state *template[CGROUP_SUBSYS_COUNT];
-
-	read_lock(&css_set_lock);
-	newcg = find_existing_css_set(cg, cgrp, template);
-	if (newcg)
-		get_css_set(newcg);
-	read_unlock(&css_set_lock);
 
-	/* doesn't exist at all? */
-	if (!newcg)
-		return false;
-	/* see if it's already in the list */
 	list_for_each_entry(cg_entry, newcg_list, links) {
-		if (cg_entry->cg == newcg) {
-			put_css_set(newcg);
-			return true;
-		}
+		if (cg_entry->oldcg == oldcg)
+			return cg_entry;
 	}
-
-	/* not found */
-	put_css_set(newcg);
-	return false;
+	return NULL;
 }
 
 /*
- * Find the new css_set and store it in the list in preparation for moving the
- * given task to the given cgroup. Returns 0 or -ENOMEM.
+ * Find the new css_set for threads currently in "oldcg" and store the pair
+ * in the list in preparation for moving them to the given cgroup. Takes
+ * over the caller's reference on "oldcg" on success. Returns 0 or -ENOMEM.
  */
-static int css_set_prefetch(struct cgroup *cgrp, struct css_set *cg,
+static int css_set_prefetch(struct cgroup *cgrp, struct css_set *oldcg,
 			    struct list_head *newcg_list)
 {
 	struct css_set *newcg;
 	struct cg_list_entry *cg_entry;
 
 	/* ensure a new css_set will exist for this thread */
-	newcg = find_css_set(cg, cgrp);
+	newcg = find_css_set(oldcg, cgrp);
 	if (!newcg)
 		return -ENOMEM;
 	/* add it to the list */
@@ -1975,7 +1993,9 @@ static int css_set_prefetch(struct cgroup *cgrp, struct css_set *cg,
 		put_css_set(newcg);
 		return -ENOMEM;
 	}
+	cg_entry->oldcg = oldcg;
 	cg_entry->cg = newcg;
+	cg_entry->nr_moved = 0;
 	list_add(&cg_entry->links, newcg_list);
 	return 0;
 }
@@ -2087,7 +2107,9 @@ int cgroup_attach_proc(struct cgroup *cgrp, struct task_struct *leader)
 
 	/*
 	 * step 2: make sure css_sets exist for all threads to be migrated.
-	 * we use find_css_set, which allocates a new one if necessary.
+	 * we use find_css_set, which allocates a new one if necessary. threads
+	 * of a group usually share their css_set, so this is done once per
+	 * distinct css_set rather than once per thread.
 	 */
 	INIT_LIST_HEAD(&newcg_list);
 	for (i = 0; i < group_size; i++) {
@@ -2107,44 +2129,75 @@ int cgroup_attach_proc(struct cgroup *cgrp, struct task_struct *leader)
 		get_css_set(oldcg);
 		task_unlock(tsk);
 		/* see if the new one for us is already in the list? */
-		if (css_set_check_fetched(cgrp, tsk, oldcg, &newcg_list)) {
+		if (css_set_find_fetched(oldcg, &newcg_list)) {
 			/* was already there, nothing to do. */
 			put_css_set(oldcg);
 		} else {
 			/* we don't already have it. get new one. */
 			retval = css_set_prefetch(cgrp, oldcg, &newcg_list);
-			put_css_set(oldcg);
-			if (retval)
+			if (retval) {
+				put_css_set(oldcg);
 				goto out_list_teardown;
+			}
 		}
 	}
 
 	/*
 	 * step 3: now that we're guaranteed success wrt the css_sets, proceed
-	 * to move all tasks to the new cgroup, calling ss->attach_task for each
-	 * one along the way. there are no failure cases after here, so this is
-	 * the commit point.
+	 * to move all tasks to the new cgroup. there are no failure cases
+	 * after here, so this is the commit point. the whole group is moved
+	 * under one hold of css_set_lock; the references the threads held on
+	 * their old css_sets are dropped once it is released, since the final
+	 * put would need css_set_lock itself. threads that are not moved are
+	 * dropped from the array so that ss->attach_task skips them.
 	 */
 	for_each_subsys(root, ss) {
 		if (ss->pre_attach)
 			ss->pre_attach(cgrp);
 	}
+	write_lock(&css_set_lock);
 	for (i = 0; i < group_size; i++) {
 		tsk = flex_array_get_ptr(group, i);
 		/* leave current thread as it is if it's already there */
-		oldcgrp = task_cgroup_from_root(tsk, root);
+		oldcgrp = css_set_cgroup_from_root(tsk->cgroups, root);
 		if (cgrp == oldcgrp)
-			continue;
+			goto skip;
+		task_lock(tsk);
 		/* if the thread is PF_EXITING, it can just get skipped. */
-		retval = cgroup_task_migrate(cgrp, oldcgrp, tsk, true);
-		if (retval == 0) {
-			/* attach each task to each subsystem */
-			for_each_subsys(root, ss) {
-				if (ss->attach_task)
-					ss->attach_task(cgrp, tsk);
-			}
-		} else {
-			BUG_ON(retval != -ESRCH);
+		if (tsk->flags & PF_EXITING) {
+			task_unlock(tsk);
+			goto skip;
+		}
+		cg_entry = css_set_find_fetched(tsk->cgroups, &newcg_list);
+		BUG_ON(!cg_entry);
+		get_css_set(cg_entry->cg);
+		rcu_assign_pointer(tsk->cgroups, cg_entry->cg);
+		task_unlock(tsk);
+		if (!list_empty(&tsk->cg_list))
+			list_move(&tsk->cg_list, &cg_entry->cg->tasks);
+		cg_entry->nr_moved++;
+		set_bit(CGRP_RELEASABLE, &oldcgrp->flags);
+		continue;
+skip:
+		put_task_struct(tsk);
+		tsk = NULL;
+		flex_array_put_ptr(group, i, tsk, GFP_ATOMIC);
+	}
+	write_unlock(&css_set_lock);
+
+	list_for_each_entry(cg_entry, &newcg_list, links) {
+		while (cg_entry->nr_moved--)
+			put_css_set(cg_entry->oldcg);
+	}
+
+	/* attach each task to each subsystem */
+	for_each_subsys(root, ss) {
+		if (!ss->attach_task)
+			continue;
+		for (i = 0; i < group_size; i++) {
+			tsk = flex_array_get_ptr(group, i);
+			if (tsk)
+				ss->attach_task(cgrp, tsk);
 		}
 	}
 	/* nothing is sensitive to fork() after this point. */
@@ -2169,6 +2222,7 @@ out_list_teardown:
 	/* clean up the list of prefetched css_sets. */
 	list_for_each_entry_safe(cg_entry, temp_nobe, &newcg_list, links) {
 		list_del(&cg_entry->links);
+		put_css_set(cg_entry->oldcg);
 		put_css_set(cg_entry->cg);
 		kfree(cg_entry);
 	}
@@ -2188,7 +2242,8 @@ out_cancel_attach:
 	/* clean up the array of referenced threads in the group. */
 	for (i = 0; i < group_size; i++) {
 		tsk = flex_array_get_ptr(group, i);
-		put_task_struct(tsk);
+		if (tsk)
+			put_task_struct(tsk);
 	}
 out_free_group_list:
 	flex_array_free(group);
@@ -4272,6 +4327,9 @@ void cgroup_unload_subsys(struct cgroup_subsys *ss)
 	dummytop->subsys[ss->subsys_id] = NULL;
 
 	mutex_unlock(&cgroup_mutex);
+
+	/* wait for lockless readers of subsys[] before the module goes away */
+	synchronize_rcu();
 }
 EXPORT_SYMBOL_GPL(cgroup_unload_subsys);
 
@@ -4378,12 +4436,13 @@ out:
  * proc_cgroup_show()
  *  - Print task's cgroup paths into seq_file, one line for each hierarchy
  *  - Used for /proc/<pid>/cgroup.
- *  - No need to task_lock(tsk) on this tsk->cgroup reference, as it
- *    doesn't really matter if tsk->cgroup changes after we read it,
- *    and we take cgroup_mutex, keeping cgroup_attach_task() from changing it
- *    anyway.  No need to check that tsk->cgroup != NULL, thanks to
- *    the_top_cgroup_hack in cgroup_exit(), which sets an exiting tasks
- *    cgroup to top_cgroup.
+ *  - Runs under rcu_read_lock() only, so that monitoring tools reading
+ *    this file don't serialize against mkdir, rmdir and attach on
+ *    cgroup_mutex. Hierarchy roots and cgroups are freed under RCU, the
+ *    task's css_set is freed under RCU, and a task migrating concurrently
+ *    is reported in either its old or its new cgroup. No need to check
+ *    that tsk->cgroup != NULL, thanks to the_top_cgroup_hack in
+ *    cgroup_exit(), which sets an exiting tasks cgroup to top_cgroup.
  */
 
 /* TODO: Use a proper seq_file iterator */
@@ -4408,21 +4467,34 @@ static int proc_cgroup_show(struct seq_file *m, void *v)
 
 	retval = 0;
 
-	mutex_lock(&cgroup_mutex);
+	rcu_read_lock();
 
-	for_each_active_root(root) {
-		struct cgroup_subsys *ss;
+	for_each_active_root_rcu(root) {
+		unsigned long bits = ACCESS_ONCE(root->actual_subsys_bits);
 		struct cgroup *cgrp;
 		int count = 0;
+		int i;
+
+		cgrp = task_cgroup_from_root_rcu(tsk, root);
+		if (!cgrp)
+			continue;
 
 		seq_printf(m, "%d:", root->hierarchy_id);
-		for_each_subsys(root, ss)
-			seq_printf(m, "%s%s", count++ ? "," : "", ss->name);
+		/*
+		 * root->subsys_list is only stable under cgroup_mutex; the
+		 * bitmask is enough to name the bound subsystems.
+		 */
+		for_each_set_bit(i, &bits, CGROUP_SUBSYS_COUNT) {
+			struct cgroup_subsys *ss = ACCESS_ONCE(subsys[i]);
+
+			if (ss)
+				seq_printf(m, "%s%s", count++ ? "," : "",
+					   ss->name);
+		}
 		if (strlen(root->name))
 			seq_printf(m, "%sname=%s", count ? "," : "",
 				   root->name);
 		seq_putc(m, ':');
-		cgrp = task_cgroup_from_root(tsk, root);
 		retval = cgroup_path(cgrp, buf, PAGE_SIZE);
 		if (retval < 0)
 			goto out_unlock;
@@ -4431,7 +4503,7 @@ static int proc_cgroup_show(struct seq_file *m, void *v)
 	}
 
 out_unlock:
-	mutex_unlock(&cgroup_mutex);
+	rcu_read_unlock();
 	put_task_struct(tsk);
 out_free:
 	kfree(buf);
@@ -4459,20 +4531,24 @@ static int proc_cgroupstats_show(struct seq_file *m, void *v)
 
 	seq_puts(m, "#subsys_name\thierarchy\tnum_cgroups\tenabled\n");
 	/*
-	 * ideally we don't want subsystems moving around while we do this.
-	 * cgroup_mutex is also necessary to guarantee an atomic snapshot of
-	 * subsys/hierarchy state.
+	 * Subsystems may be rebound or unloaded while we do this, so each
+	 * line is only a snapshot of that subsystem. Roots are freed under
+	 * RCU and cgroup_unload_subsys() waits for a grace period before the
+	 * module can go away.
 	 */
-	mutex_lock(&cgroup_mutex);
+	rcu_read_lock();
 	for (i = 0; i < CGROUP_SUBSYS_COUNT; i++) {
-		struct cgroup_subsys *ss = subsys[i];
+		struct cgroup_subsys *ss = ACCESS_ONCE(subsys[i]);
+		struct cgroupfs_root *root;
+
 		if (ss == NULL)
 			continue;
+		root = ACCESS_ONCE(ss->root);
 		seq_printf(m, "%s\t%d\t%d\t%d\n",
-			   ss->name, ss->root->hierarchy_id,
-			   ss->root->number_of_cgroups, !ss->disabled);
+			   ss->name, root->hierarchy_id,
+			   root->number_of_cgroups, !ss->disabled);
 	}
-	mutex_unlock(&cgroup_mutex);
+	rcu_read_unlock();
 	return 0;
 }
 
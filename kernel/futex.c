@@ -964,6 +964,7 @@ futex_wake(u32 __user *uaddr, unsigned int flags, int nr_wake, u32 bitset)
 	struct futex_q *this, *next;
 	struct plist_head *head;
 	union futex_key key = FUTEX_KEY_INIT;
+	struct wake_batch batch;
 	int ret;
 
 	if (!bitset)
@@ -974,6 +975,8 @@ futex_wake(u32 __user *uaddr, unsigned int flags, int nr_wake, u32 bitset)
 		goto out;
 
 	hb = hash_futex(&key);
+	/* let the wakees run only once hb->lock has been dropped */
+	wake_batch_start(&batch);
 	spin_lock(&hb->lock);
 	head = &hb->chain;
 
@@ -995,6 +998,7 @@ futex_wake(u32 __user *uaddr, unsigned int flags, int nr_wake, u32 bitset)
 	}
 
 	spin_unlock(&hb->lock);
+	wake_batch_finish(&batch);
 	put_futex_key(&key);
 out:
 	return ret;
@@ -1012,6 +1016,7 @@ futex_wake_op(u32 __user *uaddr1, unsigned int flags, u32 __user *uaddr2,
 	struct futex_hash_bucket *hb1, *hb2;
 	struct plist_head *head;
 	struct futex_q *this, *next;
+	struct wake_batch batch;
 	int ret, op_ret;
 
 retry:
@@ -1058,6 +1063,7 @@ retry_private:
 		goto retry;
 	}
 
+	wake_batch_start(&batch);
 	head = &hb1->chain;
 
 	plist_for_each_entry_safe(this, next, head, list) {
@@ -1083,6 +1089,7 @@ retry_private:
 	}
 
 	double_unlock_hb(hb1, hb2);
+	wake_batch_finish(&batch);
 out_put_keys:
 	put_futex_key(&key2);
 out_put_key1:
@@ -9,15 +9,16 @@
  * against. There is very little to them aside from hashing them and
  * parking tasks using given ID's on a list.
  *
- * The hash is always changed with the tasklist_lock write-acquired,
- * and the hash is only accessed with the tasklist_lock at least
- * read-acquired, so there's no additional SMP locking needed here.
+ * Each hash chain is changed under its own bit lock and searched under
+ * RCU, so inserting and removing pids on different chains doesn't
+ * serialise.
  *
  * We have a list of bitmap pages, which bitmaps represent the PID space.
  * Allocating and freeing PIDs is completely lockless. The worst-case
  * allocation scenario when all but one out of 1 million PIDs possible are
  * allocated already: the scanning of 32 list entries and at most PAGE_SIZE
- * bytes. The typical fastpath is a single successful setbit. Freeing is O(1).
+ * bytes. The typical fastpath takes a pid out of a word of free pids that
+ * this cpu claimed earlier with a single cmpxchg. Freeing is O(1).
  *
  * Pid namespaces:
  *    (C) 2007 Pavel Emelyanov <xemul@openvz.org>, OpenVZ, SWsoft Inc.
@@ -31,6 +32,7 @@
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/rculist.h>
+#include <linux/rculist_bl.h>
 #include <linux/bootmem.h>
 #include <linux/hash.h>
 #include <linux/pid_namespace.h>
@@ -39,7 +41,7 @@
 
 #define pid_hashfn(nr, ns)	\
 	hash_long((unsigned long)nr + (unsigned long)ns, pidhash_shift)
-static struct hlist_head *pid_hash;
+static struct hlist_bl_head *pid_hash;
 static unsigned int pidhash_shift = 4;
 struct pid init_struct_pid = INIT_STRUCT_PID;
 
@@ -62,6 +64,8 @@ static inline int mk_pid(struct pid_namespace *pid_ns,
 #define find_next_offset(map, off)					\
 		find_next_zero_bit((map)->page, BITS_PER_PAGE, off)
 
+static DEFINE_PER_CPU(struct pidmap_cache, init_pid_cache);
+
 /*
  * PID-map pages start out as NULL, they get allocated upon
  * first use and are never deallocated. This way a low pid_max
@@ -76,6 +80,7 @@ struct pid_namespace init_pid_ns = {
 		[ 0 ... PIDMAP_ENTRIES-1] = { ATOMIC_INIT(BITS_PER_PAGE), NULL }
 	},
 	.last_pid = 0,
+	.pid_cache = &init_pid_cache,
 	.level = 0,
 	.child_reaper = &init_task,
 };
@@ -97,8 +102,8 @@ int is_container_init(struct task_struct *tsk)
 EXPORT_SYMBOL(is_container_init);
 
 /*
- * Note: disable interrupts while the pidmap_lock is held as an
- * interrupt might come in and do read_lock(&tasklist_lock).
+ * Note: disable interrupts while the pidmap_lock or a pid_hash chain lock
+ * is held as an interrupt might come in and do read_lock(&tasklist_lock).
  *
  * If we don't disable interrupts there is a nasty deadlock between
  * detach_pid()->free_pid() and another cpu that does
@@ -112,16 +117,20 @@ EXPORT_SYMBOL(is_container_init);
 
 static  __cacheline_aligned_in_smp DEFINE_SPINLOCK(pidmap_lock);
 
-static void free_pidmap(struct upid *upid)
+static void __free_pidmap(struct pid_namespace *pid_ns, int nr)
 {
-	int nr = upid->nr;
-	struct pidmap *map = upid->ns->pidmap + nr / BITS_PER_PAGE;
+	struct pidmap *map = pid_ns->pidmap + nr / BITS_PER_PAGE;
 	int offset = nr & BITS_PER_PAGE_MASK;
 
 	clear_bit(offset, map->page);
 	atomic_inc(&map->nr_free);
 }
 
+static void free_pidmap(struct upid *upid)
+{
+	__free_pidmap(upid->ns, upid->nr);
+}
+
 /*
  * If we started walking pids at 'base', is 'a' seen before 'b'?
  */
@@ -159,11 +168,104 @@ static void set_last_pid(struct pid_namespace *pid_ns, int base, int pid)
 	} while ((prev != last_write) && (pid_before(base, last_write, pid)));
 }
 
+/*
+ * Claim a whole free word of the pidmap, at or after last_pid, for this
+ * cpu's cache.  Only the bitmap page last_pid points into is searched,
+ * and only if it has already been allocated; alloc_pidmap() does the
+ * rest.  Called with preemption disabled.
+ */
+static int pidmap_cache_refill(struct pid_namespace *pid_ns,
+			       struct pidmap_cache *pc)
+{
+	int last = pid_ns->last_pid;
+	int pid = round_up(last + 1, BITS_PER_LONG);
+	unsigned long *word, *end;
+	struct pidmap *map;
+	int limit;
+
+	if (pid < RESERVED_PIDS)
+		pid = round_up(RESERVED_PIDS, BITS_PER_LONG);
+	if (pid + BITS_PER_LONG > pid_max)
+		return 0;
+
+	map = &pid_ns->pidmap[pid / BITS_PER_PAGE];
+	if (!map->page || atomic_read(&map->nr_free) < BITS_PER_LONG)
+		return 0;
+
+	limit = min_t(int, BITS_PER_PAGE, pid_max - mk_pid(pid_ns, map, 0));
+	word = (unsigned long *)map->page +
+		(pid & BITS_PER_PAGE_MASK) / BITS_PER_LONG;
+	end = (unsigned long *)map->page + limit / BITS_PER_LONG;
+
+	for (; word < end; word++) {
+		if (ACCESS_ONCE(*word) || cmpxchg(word, 0UL, ~0UL))
+			continue;
+
+		atomic_sub(BITS_PER_LONG, &map->nr_free);
+		pc->base = mk_pid(pid_ns, map, (word - (unsigned long *)map->page)
+				  * BITS_PER_LONG);
+		pc->free = ~0UL;
+		set_last_pid(pid_ns, last, pc->base + BITS_PER_LONG - 1);
+		return 1;
+	}
+	return 0;
+}
+
+/* Give the unused pids of a cache back to the pidmap */
+static void pidmap_cache_drain(struct pid_namespace *pid_ns,
+			       struct pidmap_cache *pc)
+{
+	while (pc->free) {
+		int n = __ffs(pc->free);
+
+		pc->free &= ~(1UL << n);
+		__free_pidmap(pid_ns, pc->base + n);
+	}
+}
+
+/*
+ * Fast path of alloc_pidmap(): take the next pid cached by this cpu.
+ * The cache is only used once the namespace has handed out its first
+ * pids, so that init still gets pid 1 and the pids below RESERVED_PIDS
+ * are only used before the first wrap, as with the plain bitmap scan.
+ */
+static int pidmap_cache_alloc(struct pid_namespace *pid_ns)
+{
+	struct pidmap_cache *pc;
+	int pid = -1;
+
+	if (pid_ns->last_pid < RESERVED_PIDS)
+		return -1;
+
+	pc = get_cpu_ptr(pid_ns->pid_cache);
+	if (!pc->free && !pidmap_cache_refill(pid_ns, pc))
+		goto out;
+
+	pid = pc->base + __ffs(pc->free);
+	pc->free &= pc->free - 1;
+
+	/* pid_max may have been lowered since the cache was filled */
+	if (unlikely(pid >= pid_max)) {
+		__free_pidmap(pid_ns, pid);
+		pidmap_cache_drain(pid_ns, pc);
+		pid = -1;
+	}
+out:
+	put_cpu_ptr(pid_ns->pid_cache);
+	return pid;
+}
+
 static int alloc_pidmap(struct pid_namespace *pid_ns)
 {
-	int i, offset, max_scan, pid, last = pid_ns->last_pid;
+	int i, offset, max_scan, pid, last;
 	struct pidmap *map;
 
+	pid = pidmap_cache_alloc(pid_ns);
+	if (pid > 0)
+		return pid;
+
+	last = pid_ns->last_pid;
+
 	pid = last + 1;
 	if (pid >= pid_max)
 		pid = RESERVED_PIDS;
@@ -266,10 +368,17 @@ void free_pid(struct pid *pid)
 	int i;
 	unsigned long flags;
 
-	spin_lock_irqsave(&pidmap_lock, flags);
-	for (i = 0; i <= pid->level; i++)
-		hlist_del_rcu(&pid->numbers[i].pid_chain);
-	spin_unlock_irqrestore(&pidmap_lock, flags);
+	local_irq_save(flags);
+	for (i = 0; i <= pid->level; i++) {
+		struct upid *upid = pid->numbers + i;
+		struct hlist_bl_head *head;
+
+		head = &pid_hash[pid_hashfn(upid->nr, upid->ns)];
+		hlist_bl_lock(head);
+		hlist_bl_del_rcu(&upid->pid_chain);
+		hlist_bl_unlock(head);
+	}
+	local_irq_restore(flags);
 
 	for (i = 0; i <= pid->level; i++)
 		free_pidmap(pid->numbers + i);
@@ -307,11 +416,16 @@ struct pid *alloc_pid(struct pid_namespace *ns)
 		INIT_HLIST_HEAD(&pid->tasks[type]);
 
 	upid = pid->numbers + ns->level;
-	spin_lock_irq(&pidmap_lock);
-	for ( ; upid >= pid->numbers; --upid)
-		hlist_add_head_rcu(&upid->pid_chain,
-				&pid_hash[pid_hashfn(upid->nr, upid->ns)]);
-	spin_unlock_irq(&pidmap_lock);
+	local_irq_disable();
+	for ( ; upid >= pid->numbers; --upid) {
+		struct hlist_bl_head *head;
+
+		head = &pid_hash[pid_hashfn(upid->nr, upid->ns)];
+		hlist_bl_lock(head);
+		hlist_bl_add_head_rcu(&upid->pid_chain, head);
+		hlist_bl_unlock(head);
+	}
+	local_irq_enable();
 
 out:
 	return pid;
@@ -327,10 +441,10 @@ out_free:
 
 struct pid *find_pid_ns(int nr, struct pid_namespace *ns)
 {
-	struct hlist_node *elem;
+	struct hlist_bl_node *elem;
 	struct upid *pnr;
 
-	hlist_for_each_entry_rcu(pnr, elem,
+	hlist_bl_for_each_entry_rcu(pnr, elem,
 			&pid_hash[pid_hashfn(nr, ns)], pid_chain)
 		if (pnr->nr == nr && pnr->ns == ns)
 			return container_of(pnr, struct pid,
@@ -549,7 +663,7 @@ void __init pidhash_init(void)
 	pidhash_size = 1 << pidhash_shift;
 
 	for (i = 0; i < pidhash_size; i++)
-		INIT_HLIST_HEAD(&pid_hash[i]);
+		INIT_HLIST_BL_HEAD(&pid_hash[i]);
 }
 
 void __init pidmap_init(void)
@@ -87,6 +87,10 @@ static struct pid_namespace *create_pid_namespace(struct pid_namespace *parent_p
 	if (ns->pid_cachep == NULL)
 		goto out_free_map;
 
+	ns->pid_cache = alloc_percpu(struct pidmap_cache);
+	if (!ns->pid_cache)
+		goto out_free_map;
+
 	kref_init(&ns->kref);
 	ns->level = level;
 	ns->parent = get_pid_ns(parent_pid_ns);
@@ -106,6 +110,7 @@ static struct pid_namespace *create_pid_namespace(struct pid_namespace *parent_p
 out_put_parent_pid_ns:
 	put_pid_ns(parent_pid_ns);
 out_free_map:
+	free_percpu(ns->pid_cache);
 	kfree(ns->pidmap[0].page);
 out_free:
 	kmem_cache_free(pid_ns_cachep, ns);
@@ -119,6 +124,7 @@ static void destroy_pid_namespace(struct pid_namespace *ns)
 
 	for (i = 0; i < PIDMAP_ENTRIES; i++)
 		kfree(ns->pidmap[i].page);
+	free_percpu(ns->pid_cache);
 	kmem_cache_free(pid_ns_cachep, ns);
 }
 
@@ -41,6 +41,7 @@
 #include <linux/cpu.h>
 #include <linux/notifier.h>
 #include <linux/rculist.h>
+#include <linux/kthread.h>
 
 #include <asm/uaccess.h>
 
@@ -96,9 +97,13 @@ EXPORT_SYMBOL_GPL(console_drivers);
 static int console_locked, console_suspended;
 
 /*
- * logbuf_lock protects log_buf, log_start, log_end, con_start and logged_chars
- * It is also used in interesting ways to provide interlocking in
- * console_unlock();.
+ * logbuf_lock serialises the readers of log_buf: it protects log_start,
+ * con_start and log_clear.  It is also used in interesting ways to provide
+ * interlocking in console_unlock();.
+ *
+ * Writers never take it.  printk() reserves room in log_buf by advancing
+ * log_reserve with cmpxchg(), copies its text in, and then publishes it by
+ * moving log_end forward in reservation order, see log_store().
  */
 static DEFINE_RAW_SPINLOCK(logbuf_lock);
 
@@ -111,7 +116,9 @@ static DEFINE_RAW_SPINLOCK(logbuf_lock);
  */
 static unsigned log_start;	/* Index into log_buf: next char to be read by syslog() */
 static unsigned con_start;	/* Index into log_buf: next char to be sent to consoles */
-static unsigned log_end;	/* Index into log_buf: most-recently-written-char + 1 */
+static unsigned log_end;	/* Index into log_buf: most-recently-committed-char + 1 */
+static unsigned log_reserve;	/* Index into log_buf: most-recently-reserved-char + 1 */
+static unsigned log_clear;	/* Index into log_buf: log_end at the last clear */
 
 /*
  * If exclusive_console is non-NULL then only this console is to be printed to.
@@ -142,12 +149,21 @@ EXPORT_SYMBOL(console_set_on_cmdline);
 /* Flag: console code may call schedule() */
 static int console_may_schedule;
 
+/* Writes out log_buf to the consoles on behalf of printk() */
+static struct task_struct *printk_kthread;
+
+/* Work printk() left for the next timer tick on this cpu */
+#define PRINTK_PENDING_WAKEUP	0x01	/* wake up klogd */
+#define PRINTK_PENDING_CONSOLE	0x02	/* wake up printk_kthread */
+
+static DEFINE_PER_CPU(int, printk_pending);
+
 #ifdef CONFIG_PRINTK
 
 static char __log_buf[__LOG_BUF_LEN];
 static char *log_buf = __log_buf;
 static int log_buf_len = __LOG_BUF_LEN;
-static unsigned logged_chars; /* Number of chars produced since last read+clear operation */
+static unsigned logged_chars; /* Number of chars produced since last read+clear operation, for crash dumps */
 static int saved_console_loglevel = -1;
 
 #ifdef CONFIG_KEXEC
@@ -230,6 +246,8 @@ void __init setup_log_buf(int early)
 	log_start -= offset;
 	con_start -= offset;
 	log_end -= offset;
+	log_reserve = log_end;
+	log_clear = (int)(log_clear - offset) > 0 ? log_clear - offset : 0;
 	raw_spin_unlock_irqrestore(&logbuf_lock, flags);
 
 	pr_info("log_buf_len: %d\n", log_buf_len);
@@ -237,6 +255,37 @@ void __init setup_log_buf(int early)
 		free, (free * 100) / __LOG_BUF_LEN);
 }
 
+/*
+ * Oldest index of log_buf that is guaranteed not to be overwritten by a
+ * printk() that is still copying its text in.  Readers must re-check
+ * their position against this after fetching a character.
+ */
+static inline unsigned log_first_valid(void)
+{
+	return ACCESS_ONCE(log_reserve) - log_buf_len;
+}
+
+/*
+ * Move a reader index that fell behind the writers up to the oldest
+ * readable character.  Called with logbuf_lock held.
+ */
+static void log_clamp(unsigned *idx)
+{
+	unsigned first = log_first_valid();
+	unsigned end = ACCESS_ONCE(log_end);
+
+	if ((int)(*idx - first) < 0)
+		*idx = (int)(end - first) < 0 ? end : first;
+}
+
+/* Number of chars produced since the last clear that are still in log_buf */
+static unsigned log_count(void)
+{
+	unsigned count = ACCESS_ONCE(log_end) - log_clear;
+
+	return min_t(unsigned, count, log_buf_len);
+}
+
 #ifdef CONFIG_BOOT_PRINTK_DELAY
 
 static int boot_delay; /* msecs delay after each printk during bootup */
@@ -367,7 +416,13 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 		i = 0;
 		raw_spin_lock_irq(&logbuf_lock);
 		while (!error && (log_start != log_end) && i < len) {
+			log_clamp(&log_start);
+			if (log_start == log_end)
+				break;
 			c = LOG_BUF(log_start);
+			smp_rmb();
+			if ((int)(log_start - log_first_valid()) < 0)
+				continue;	/* overwritten under us, resync */
 			log_start++;
 			raw_spin_unlock_irq(&logbuf_lock);
 			error = __put_user(c,buf);
@@ -400,11 +455,13 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 		if (count > log_buf_len)
 			count = log_buf_len;
 		raw_spin_lock_irq(&logbuf_lock);
-		if (count > logged_chars)
-			count = logged_chars;
-		if (do_clear)
+		limit = ACCESS_ONCE(log_end);
+		if (count > log_count())
+			count = log_count();
+		if (do_clear) {
+			log_clear = limit;
 			logged_chars = 0;
-		limit = log_end;
+		}
 		/*
 		 * __put_user() could sleep, and while we sleep
 		 * printk() could overwrite the messages
@@ -413,9 +470,12 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 		 */
 		for (i = 0; i < count && !error; i++) {
 			j = limit-1-i;
-			if (j + log_buf_len < log_end)
+			if ((int)(j - log_first_valid()) < 0)
 				break;
 			c = LOG_BUF(j);
+			smp_rmb();
+			if ((int)(j - log_first_valid()) < 0)
+				break;
 			raw_spin_unlock_irq(&logbuf_lock);
 			error = __put_user(c,&buf[count-1-i]);
 			cond_resched();
@@ -440,7 +500,10 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 		break;
 	/* Clear ring buffer */
 	case SYSLOG_ACTION_CLEAR:
+		raw_spin_lock_irq(&logbuf_lock);
+		log_clear = ACCESS_ONCE(log_end);
 		logged_chars = 0;
+		raw_spin_unlock_irq(&logbuf_lock);
 		break;
 	/* Disable logging to console */
 	case SYSLOG_ACTION_CONSOLE_OFF:
@@ -469,7 +532,10 @@ int do_syslog(int type, char __user *buf, int len, bool from_file)
 		break;
 	/* Number of chars in the log buffer */
 	case SYSLOG_ACTION_SIZE_UNREAD:
+		raw_spin_lock_irq(&logbuf_lock);
+		log_clamp(&log_start);
 		error = log_end - log_start;
+		raw_spin_unlock_irq(&logbuf_lock);
 		break;
 	/* Size of the log buffer */
 	case SYSLOG_ACTION_SIZE_BUFFER:
@@ -661,16 +727,80 @@ static void call_console_drivers(unsigned start, unsigned end)
 	_call_console_drivers(start_print, end, msg_level);
 }
 
-static void emit_log_char(char c)
+/*
+ * Each printk() formats its message and builds the complete log record
+ * (level prefixes and timestamps included) in a per-cpu buffer, with
+ * interrupts disabled, before touching log_buf.  That keeps the time
+ * spent racing other writers down to a single copy.
+ */
+#define LOG_REC_MAX	2048
+
+struct printk_cpu_buf {
+	char	text[1024];		/* vscnprintf() output */
+	char	rec[LOG_REC_MAX];	/* record as it goes into log_buf */
+	size_t	len;
+};
+
+/*
+ * A printk() that recurses while oopsing gets a buffer of its own, so it
+ * does not scribble over the record the interrupted call is still building.
+ */
+#define PRINTK_MAX_NESTING	2
+
+static DEFINE_PER_CPU(struct printk_cpu_buf [PRINTK_MAX_NESTING],
+		      printk_cpu_buf);
+
+/* printk() nesting depth on this cpu, to catch recursion */
+static DEFINE_PER_CPU(int, printk_nesting);
+
+static void emit_log_char(struct printk_cpu_buf *pb, char c)
+{
+	if (pb->len < LOG_REC_MAX)
+		pb->rec[pb->len++] = c;
+}
+
+/*
+ * Copy a finished record into log_buf.
+ *
+ * Space is claimed by advancing log_reserve with cmpxchg(), so any number of
+ * cpus can be copying into disjoint parts of log_buf at the same time.  The
+ * record only becomes visible to readers once log_end moves past it, and
+ * log_end is advanced in reservation order: we wait for every earlier
+ * reservation to be published first.  Those are held by other cpus with
+ * interrupts disabled and only copying memory, so the wait is short.  When
+ * oopsing, the cpu we are waiting for may never come back, so give up on it
+ * after a while and publish anyway.
+ */
+static void log_store(const char *rec, unsigned len)
 {
-	LOG_BUF(log_end) = c;
-	log_end++;
-	if (log_end - log_start > log_buf_len)
-		log_start = log_end - log_buf_len;
-	if (log_end - con_start > log_buf_len)
-		con_start = log_end - log_buf_len;
-	if (logged_chars < log_buf_len)
-		logged_chars++;
+	unsigned start, end, cur, i;
+	unsigned long spins = 0;
+
+	do {
+		start = ACCESS_ONCE(log_reserve);
+		end = start + len;
+	} while (cmpxchg(&log_reserve, start, end) != start);
+
+	for (i = 0; i < len; i++)
+		LOG_BUF(start + i) = rec[i];
+
+	while ((int)(ACCESS_ONCE(log_end) - start) < 0) {
+		if (unlikely(oops_in_progress) && ++spins > (1UL << 24))
+			break;
+		cpu_relax();
+	}
+
+	smp_wmb();	/* text before log_end */
+	do {
+		cur = ACCESS_ONCE(log_end);
+		if ((int)(end - cur) <= 0)
+			break;
+	} while (cmpxchg(&log_end, cur, end) != cur);
+
+	logged_chars = log_count();
+
+	/* Pairs with the barrier after up() in console_unlock() */
+	smp_mb();
 }
 
 /*
@@ -701,6 +831,27 @@ static int printk_time = 0;
 #endif
 module_param_named(time, printk_time, bool, S_IRUGO | S_IWUSR);
 
+/*
+ * Hand console output to printk_kthread instead of writing it out from
+ * whichever context called printk().  Oopses, early boot, shutdown, NMIs,
+ * callers running with interrupts off and messages of KERN_CRIT or higher
+ * priority still print synchronously: those may be the last thing the
+ * machine ever says.
+ */
+static int printk_console_kthread = 1;
+module_param_named(console_kthread, printk_console_kthread, bool,
+		   S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(console_kthread, "flush consoles from a kernel thread "
+	"instead of the printing context.");
+
+static inline int printk_console_deferred(int level, unsigned long flags)
+{
+	return printk_console_kthread && printk_kthread &&
+		!oops_in_progress && system_state == SYSTEM_RUNNING &&
+		level > 2 /* KERN_CRIT */ && !in_nmi() &&
+		!irqs_disabled_flags(flags);
+}
+
 /* Check if we have any console registered that can be called early in boot. */
 static int have_callable_console(void)
 {
@@ -719,11 +870,14 @@ static int have_callable_console(void)
  *
  * This is printk().  It can be called from any context.  We want it to work.
  *
- * We try to grab the console_lock.  If we succeed, it's easy - we log the output and
- * call the console drivers.  If we fail to get the semaphore we place the output
- * into the log buffer and return.  The current holder of the console_sem will
- * notice the new output in console_unlock(); and will send it to the
- * consoles before releasing the lock.
+ * The message is always stored in the log buffer without taking any lock.
+ * Once the system is up, the consoles are then written by printk_kthread,
+ * which printk() kicks from the next timer tick, so a slow console does not
+ * hold up the caller.  Otherwise we try to grab the console_lock.  If we
+ * succeed, it's easy - we call the console drivers.  If we fail to get the
+ * semaphore the current holder of the console_sem will notice the new
+ * output in console_unlock(); and will send it to the consoles before
+ * releasing the lock.
  *
  * One effect of this deferred printing is that code which calls printk() and
  * then changes console_loglevel may break. This is because console_loglevel
@@ -755,9 +909,6 @@ asmlinkage int printk(const char *fmt, ...)
 	return r;
 }
 
-/* cpu currently holding logbuf_lock */
-static volatile unsigned int printk_cpu = UINT_MAX;
-
 /*
  * Can we actually use the console at this time on this cpu?
  *
@@ -777,14 +928,11 @@ static inline int can_use_console(unsigned int cpu)
  * console_lock held, and 'console_locked' set) if it
  * is successful, false otherwise.
  *
- * This gets called with the 'logbuf_lock' spinlock held and
- * interrupts disabled. It should return with 'lockbuf_lock'
- * released but interrupts still disabled.
+ * This gets called with interrupts disabled.
  */
 static int console_trylock_for_printk(unsigned int cpu)
-	__releases(&logbuf_lock)
 {
-	int retval = 0, wake = 0;
+	int retval = 0;
 
 	if (console_trylock()) {
 		retval = 1;
@@ -797,21 +945,22 @@ static int console_trylock_for_printk(unsigned int cpu)
 		 */
 		if (!can_use_console(cpu)) {
 			console_locked = 0;
-			wake = 1;
+			up(&console_sem);
 			retval = 0;
 		}
 	}
-	printk_cpu = UINT_MAX;
-	if (wake)
-		up(&console_sem);
-	raw_spin_unlock(&logbuf_lock);
 	return retval;
 }
 static const char recursion_bug_msg [] =
 		KERN_CRIT "BUG: recent printk recursion!\n";
 static int recursion_bug;
+
+/*
+ * Whether the last record stored ended a line.  Records are stored whole,
+ * but continuation lines from different cpus can still race here; the
+ * worst outcome is a missing or extra line break.
+ */
 static int new_text_line = 1;
-static char printk_buf[1024];
 
 int printk_delay_msec __read_mostly;
 
@@ -833,9 +982,12 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 	int current_log_level = default_message_loglevel;
 	unsigned long flags;
 	int this_cpu;
+	struct printk_cpu_buf *pb;
 	char *p;
 	size_t plen;
 	char special;
+	int text_line;
+	int nesting;
 
 	boot_delay_msec();
 	printk_delay();
@@ -848,7 +1000,8 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 	/*
 	 * Ouch, printk recursed into itself!
 	 */
-	if (unlikely(printk_cpu == this_cpu)) {
+	nesting = __this_cpu_read(printk_nesting);
+	if (unlikely(nesting)) {
 		/*
 		 * If a crash is occurring during printk() on this CPU,
 		 * then try to get the crash message out but make sure
@@ -856,7 +1009,7 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 		 * recursion and return - but flag the recursion so that
 		 * it can be printed at the next appropriate moment:
 		 */
-		if (!oops_in_progress) {
+		if (!oops_in_progress || nesting >= PRINTK_MAX_NESTING) {
 			recursion_bug = 1;
 			goto out_restore_irqs;
 		}
@@ -864,19 +1017,20 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 	}
 
 	lockdep_off();
-	raw_spin_lock(&logbuf_lock);
-	printk_cpu = this_cpu;
+	__this_cpu_inc(printk_nesting);
+	pb = &__get_cpu_var(printk_cpu_buf)[nesting];
+	pb->len = 0;
 
-	if (recursion_bug) {
-		recursion_bug = 0;
-		strcpy(printk_buf, recursion_bug_msg);
+	if (unlikely(recursion_bug) && xchg(&recursion_bug, 0)) {
+		strcpy(pb->text, recursion_bug_msg);
 		printed_len = strlen(recursion_bug_msg);
 	}
 	/* Emit the output into the temporary buffer */
-	printed_len += vscnprintf(printk_buf + printed_len,
-				  sizeof(printk_buf) - printed_len, fmt, args);
+	printed_len += vscnprintf(pb->text + printed_len,
+				  sizeof(pb->text) - printed_len, fmt, args);
 
-	p = printk_buf;
+	p = pb->text;
+	text_line = ACCESS_ONCE(new_text_line);
 
 	/* Read log level and handle special printk prefix */
 	plen = log_prefix(p, &current_log_level, &special);
@@ -890,33 +1044,33 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 		case 'd': /* Strip <d> KERN_DEFAULT, start new line */
 			plen = 0;
 		default:
-			if (!new_text_line) {
-				emit_log_char('\n');
-				new_text_line = 1;
+			if (!text_line) {
+				emit_log_char(pb, '\n');
+				text_line = 1;
 			}
 		}
 	}
 
 	/*
-	 * Copy the output into log_buf. If the caller didn't provide
+	 * Build the record for log_buf. If the caller didn't provide
 	 * the appropriate log prefix, we insert them here
 	 */
 	for (; *p; p++) {
-		if (new_text_line) {
-			new_text_line = 0;
+		if (text_line) {
+			text_line = 0;
 
 			if (plen) {
 				/* Copy original log prefix */
 				int i;
 
 				for (i = 0; i < plen; i++)
-					emit_log_char(printk_buf[i]);
+					emit_log_char(pb, pb->text[i]);
 				printed_len += plen;
 			} else {
 				/* Add log prefix */
-				emit_log_char('<');
-				emit_log_char(current_log_level + '0');
-				emit_log_char('>');
+				emit_log_char(pb, '<');
+				emit_log_char(pb, current_log_level + '0');
+				emit_log_char(pb, '>');
 				printed_len += 3;
 			}
 
@@ -927,14 +1081,14 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 				unsigned long long t;
 				unsigned long nanosec_rem;
 
-				t = cpu_clock(printk_cpu);
+				t = cpu_clock(this_cpu);
 				nanosec_rem = do_div(t, 1000000000);
 				tlen = sprintf(tbuf, "[%5lu.%06lu] ",
 						(unsigned long) t,
 						nanosec_rem / 1000);
 
 				for (tp = tbuf; tp < tbuf + tlen; tp++)
-					emit_log_char(*tp);
+					emit_log_char(pb, *tp);
 				printed_len += tlen;
 			}
 
@@ -942,22 +1096,26 @@ asmlinkage int vprintk(const char *fmt, va_list args)
 				break;
 		}
 
-		emit_log_char(*p);
+		emit_log_char(pb, *p);
 		if (*p == '\n')
-			new_text_line = 1;
+			text_line = 1;
 	}
 
+	if (pb->len) {
+		new_text_line = text_line;
+		log_store(pb->rec, pb->len);
+	}
+	__this_cpu_dec(printk_nesting);
+
 	/*
-	 * Try to acquire and then immediately release the
-	 * console semaphore. The release will do all the
-	 * actual magic (print out buffers, wake up klogd,
-	 * etc). 
-	 *
-	 * The console_trylock_for_printk() function
-	 * will release 'logbuf_lock' regardless of whether it
-	 * actually gets the semaphore or not.
+	 * Get the new text to the consoles.  Either leave it to
+	 * printk_kthread, or try to acquire and then immediately
+	 * release the console semaphore. The release will do all
+	 * the actual magic (print out buffers, wake up klogd, etc).
 	 */
-	if (console_trylock_for_printk(this_cpu))
+	if (printk_console_deferred(current_log_level, flags))
+		__this_cpu_or(printk_pending, PRINTK_PENDING_CONSOLE);
+	else if (console_trylock_for_printk(this_cpu))
 		console_unlock();
 
 	lockdep_on();
@@ -976,6 +1134,10 @@ static void call_console_drivers(unsigned start, unsigned end)
 {
 }
 
+static void log_clamp(unsigned *idx)
+{
+}
+
 #endif
 
 static int __add_preferred_console(char *name, int idx, char *options,
@@ -1209,13 +1371,15 @@ int is_console_locked(void)
 	return console_locked;
 }
 
-static DEFINE_PER_CPU(int, printk_pending);
-
 void printk_tick(void)
 {
 	if (__this_cpu_read(printk_pending)) {
-		__this_cpu_write(printk_pending, 0);
-		wake_up_interruptible(&log_wait);
+		int pending = __this_cpu_xchg(printk_pending, 0);
+
+		if (pending & PRINTK_PENDING_CONSOLE)
+			wake_up_process(printk_kthread);
+		if (pending & PRINTK_PENDING_WAKEUP)
+			wake_up_interruptible(&log_wait);
 	}
 }
 
@@ -1229,7 +1393,7 @@ int printk_needs_cpu(int cpu)
 void wake_up_klogd(void)
 {
 	if (waitqueue_active(&log_wait))
-		this_cpu_write(printk_pending, 1);
+		this_cpu_or(printk_pending, PRINTK_PENDING_WAKEUP);
 }
 
 /**
@@ -1263,6 +1427,7 @@ again:
 	for ( ; ; ) {
 		raw_spin_lock_irqsave(&logbuf_lock, flags);
 		wake_klogd |= log_start - log_end;
+		log_clamp(&con_start);
 		if (con_start == log_end)
 			break;			/* Nothing to print */
 		_con_start = con_start;
@@ -1288,8 +1453,9 @@ again:
 	 * Someone could have filled up the buffer again, so re-check if there's
 	 * something to flush. In case we cannot trylock the console_sem again,
 	 * there's a new owner and the console_unlock() from them will do the
-	 * flush, no worries.
+	 * flush, no worries.  Pairs with the barrier in log_store().
 	 */
+	smp_mb();
 	raw_spin_lock(&logbuf_lock);
 	if (con_start != log_end)
 		retry = 1;
@@ -1658,6 +1824,36 @@ bool printk_timed_ratelimit(unsigned long *caller_jiffies,
 }
 EXPORT_SYMBOL(printk_timed_ratelimit);
 
+static int printk_kthread_func(void *unused)
+{
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (console_suspended ||
+		    ACCESS_ONCE(con_start) == ACCESS_ONCE(log_end))
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		console_lock();
+		console_unlock();
+	}
+	return 0;
+}
+
+static int __init printk_kthread_init(void)
+{
+	struct task_struct *p;
+
+	p = kthread_run(printk_kthread_func, NULL, "kprintkd");
+	if (IS_ERR(p)) {
+		printk(KERN_ERR "printk: unable to start console thread, "
+			"flushing synchronously\n");
+		return PTR_ERR(p);
+	}
+	printk_kthread = p;
+	return 0;
+}
+early_initcall(printk_kthread_init);
+
 static DEFINE_SPINLOCK(dump_list_lock);
 static LIST_HEAD(dump_list);
 
@@ -1737,7 +1933,7 @@ void kmsg_dump(enum kmsg_dump_reason reason)
 	   will overwrite the start of what we dump. */
 	raw_spin_lock_irqsave(&logbuf_lock, flags);
 	end = log_end & LOG_BUF_MASK;
-	chars = logged_chars;
+	chars = log_count();
 	raw_spin_unlock_irqrestore(&logbuf_lock, flags);
 
 	if (chars > end) {
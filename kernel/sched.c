@@ -699,6 +699,11 @@ struct rq {
 	/* try_to_wake_up() stats */
 	unsigned int ttwu_count;
 	unsigned int ttwu_local;
+
+	/* select_idle_sibling() stats */
+	unsigned int sis_search;
+	unsigned int sis_found;
+	u64 sis_time;
 #endif
 
 #ifdef CONFIG_SMP
@@ -740,6 +745,40 @@ static inline int cpu_of(struct rq *rq)
 #define cpu_curr(cpu)		(cpu_rq(cpu)->curr)
 #define raw_rq()		(&__raw_get_cpu_var(runqueues))
 
+#ifdef CONFIG_SMP
+/*
+ * The highest sched_domain with SD_SHARE_PKG_RESOURCES set, i.e. the cpus
+ * sharing this cpu's last level cache, and a unique id for it: the first
+ * cpu in its span.
+ */
+static DEFINE_PER_CPU(struct sched_domain *, sd_llc);
+static DEFINE_PER_CPU(int, sd_llc_id);
+
+/*
+ * Idle cpus of the cache domain with id 'cpu'.  Every cpu carries a mask,
+ * only those that are an sd_llc_id are used.  A cpu sets its bit when it
+ * picks the idle task and clears it when it switches away, so the mask
+ * lets select_idle_sibling() find an idle cpu without scanning.  It is
+ * only a hint: readers must still check idle_cpu() and the domain span.
+ */
+static DEFINE_PER_CPU(cpumask_var_t, llc_idle_mask);
+
+static inline struct cpumask *cpu_llc_idle_mask(int cpu)
+{
+	return per_cpu(llc_idle_mask, per_cpu(sd_llc_id, cpu));
+}
+
+static inline void update_llc_idle(struct rq *rq, int idle)
+{
+	if (idle)
+		cpumask_set_cpu(cpu_of(rq), cpu_llc_idle_mask(cpu_of(rq)));
+	else
+		cpumask_clear_cpu(cpu_of(rq), cpu_llc_idle_mask(cpu_of(rq)));
+}
+#else
+static inline void update_llc_idle(struct rq *rq, int idle) { }
+#endif
+
 #ifdef CONFIG_CGROUP_SCHED
 
 /*
@@ -2758,9 +2797,78 @@ void scheduler_ipi(void)
 	irq_exit();
 }
 
+static void wake_batch_flush(struct wake_batch *batch)
+{
+	unsigned int i;
+
+	/* a cpu may have gone down since, it drained its list when dying */
+	preempt_disable();
+	for (i = 0; i < batch->nr; i++) {
+		if (cpu_online(batch->cpus[i]))
+			smp_send_reschedule(batch->cpus[i]);
+	}
+	preempt_enable();
+	batch->nr = 0;
+}
+
+/*
+ * Defer the IPI for a wakeup queued on @cpu's wake list if current is
+ * batching its wakeups. Only the first wakeup to find the list empty
+ * gets here, so a cpu normally appears once per batch.
+ */
+static bool wake_batch_add(int cpu)
+{
+	struct wake_batch *batch = current->wake_batch;
+	unsigned int i;
+
+	/* current is only borrowed by interrupts, its batch is not theirs */
+	if (!batch || in_interrupt())
+		return false;
+
+	for (i = 0; i < batch->nr; i++) {
+		if (batch->cpus[i] == cpu)
+			return true;
+	}
+	if (batch->nr == WAKE_BATCH_CPUS)
+		wake_batch_flush(batch);
+	batch->cpus[batch->nr++] = cpu;
+	return true;
+}
+
+/**
+ * wake_batch_start - start batching wakeup IPIs of the current task
+ * @batch: on-stack batch state, passed to wake_batch_finish() later
+ *
+ * Nested batches are folded into the outermost one. In interrupt context
+ * this does nothing: the batch would otherwise be hung off whichever task
+ * was interrupted, and wake_batch_finish() leaves that task's own batch,
+ * if any, alone.
+ */
+void wake_batch_start(struct wake_batch *batch)
+{
+	batch->nr = 0;
+	if (!in_interrupt() && !current->wake_batch)
+		current->wake_batch = batch;
+}
+EXPORT_SYMBOL(wake_batch_start);
+
+/**
+ * wake_batch_finish - send the wakeup IPIs held back since wake_batch_start()
+ * @batch: the batch passed to wake_batch_start()
+ */
+void wake_batch_finish(struct wake_batch *batch)
+{
+	if (current->wake_batch != batch)
+		return;
+	wake_batch_flush(batch);
+	current->wake_batch = NULL;
+}
+EXPORT_SYMBOL(wake_batch_finish);
+
 static void ttwu_queue_remote(struct task_struct *p, int cpu)
 {
-	if (llist_add(&p->wake_entry, &cpu_rq(cpu)->wake_list))
+	if (llist_add(&p->wake_entry, &cpu_rq(cpu)->wake_list) &&
+	    !wake_batch_add(cpu))
 		smp_send_reschedule(cpu);
 }
 
@@ -3030,6 +3138,7 @@ void sched_fork(struct task_struct *p)
 #endif
 #if defined(CONFIG_SMP)
 	p->on_cpu = 0;
+	p->wake_batch = NULL;
 #endif
 #ifdef CONFIG_PREEMPT_COUNT
 	/* Want to start with kernel preemption disabled. */
@@ -4405,6 +4514,12 @@ need_resched:
 	rcu_note_context_switch(cpu);
 	prev = rq->curr;
 
+#ifdef CONFIG_SMP
+	/* don't sit on wakeup IPIs while we are off the cpu */
+	if (unlikely(prev->wake_batch))
+		wake_batch_flush(prev->wake_batch);
+#endif
+
 	schedule_debug(prev);
 
 	if (sched_feat(HRTICK))
@@ -4648,6 +4763,27 @@ void __wake_up(wait_queue_head_t *q, unsigned int mode,
 }
 EXPORT_SYMBOL(__wake_up);
 
+/**
+ * __wake_up_batch - wake up threads blocked on a waitqueue, batching IPIs.
+ * @q: the waitqueue
+ * @mode: which threads
+ * @nr_exclusive: how many wake-one or wake-many threads to wake up
+ * @key: is directly passed to the wakeup function
+ *
+ * Like __wake_up(), but the reschedule IPIs for remote wakeups are sent
+ * once per cpu after the queue lock has been dropped.
+ */
+void __wake_up_batch(wait_queue_head_t *q, unsigned int mode,
+		     int nr_exclusive, void *key)
+{
+	struct wake_batch batch;
+
+	wake_batch_start(&batch);
+	__wake_up(q, mode, nr_exclusive, key);
+	wake_batch_finish(&batch);
+}
+EXPORT_SYMBOL(__wake_up_batch);
+
 /*
  * Same as __wake_up but called with the spinlock in wait_queue_head_t held.
  */
@@ -7033,6 +7169,32 @@ static void destroy_sched_domains(struct sched_domain *sd, int cpu)
 		destroy_sched_domain(sd, cpu);
 }
 
+/*
+ * Recompute sd_llc and sd_llc_id after 'cpu' got a new domain tree and
+ * move its idle bit over to the mask of its new cache domain.  This
+ * races with the cpu entering or leaving idle; a lost bit only costs
+ * select_idle_sibling() a candidate until the next idle entry.
+ */
+static void update_top_cache_domain(struct sched_domain *sd, int cpu)
+{
+	struct sched_domain *llc = NULL;
+	int id = cpu;
+
+	for (; sd; sd = sd->parent) {
+		if (!(sd->flags & SD_SHARE_PKG_RESOURCES))
+			break;
+		llc = sd;
+	}
+	if (llc)
+		id = cpumask_first(sched_domain_span(llc));
+
+	cpumask_clear_cpu(cpu, cpu_llc_idle_mask(cpu));
+	rcu_assign_pointer(per_cpu(sd_llc, cpu), llc);
+	per_cpu(sd_llc_id, cpu) = id;
+	if (idle_cpu(cpu))
+		cpumask_set_cpu(cpu, cpu_llc_idle_mask(cpu));
+}
+
 /*
  * Attach the domain 'sd' to 'cpu' as its base domain. Callers must
  * hold the hotplug lock.
@@ -7072,6 +7234,8 @@ cpu_attach_domain(struct sched_domain *sd, struct root_domain *rd, int cpu)
 	tmp = rq->sd;
 	rcu_assign_pointer(rq->sd, sd);
 	destroy_sched_domains(tmp, cpu);
+
+	update_top_cache_domain(sd, cpu);
 }
 
 /* cpus with isolated domains */
@@ -8189,6 +8353,9 @@ void __init sched_init(void)
 #endif
 #ifdef CONFIG_CPUMASK_OFFSTACK
 	alloc_size += num_possible_cpus() * cpumask_size();
+#ifdef CONFIG_SMP
+	alloc_size += num_possible_cpus() * cpumask_size();
+#endif
 #endif
 	if (alloc_size) {
 		ptr = (unsigned long)kzalloc(alloc_size, GFP_NOWAIT);
@@ -8214,6 +8381,12 @@ void __init sched_init(void)
 			per_cpu(load_balance_tmpmask, i) = (void *)ptr;
 			ptr += cpumask_size();
 		}
+#ifdef CONFIG_SMP
+		for_each_possible_cpu(i) {
+			per_cpu(llc_idle_mask, i) = (void *)ptr;
+			ptr += cpumask_size();
+		}
+#endif
 #endif /* CONFIG_CPUMASK_OFFSTACK */
 	}
 
@@ -8291,6 +8464,7 @@ void __init sched_init(void)
 		rq->next_balance = jiffies;
 		rq->push_cpu = 0;
 		rq->cpu = i;
+		per_cpu(sd_llc_id, i) = i;
 		rq->online = 0;
 		rq->idle_stamp = 0;
 		rq->avg_idle = 2*sysctl_sched_migration_cost;
@@ -2242,14 +2242,15 @@ find_idlest_cpu(struct sched_group *group, struct task_struct *p, int this_cpu)
 }
 
 /*
- * Try and locate an idle CPU in the sched_domain.
+ * Try and locate an idle CPU in the last level cache domain of target.
+ * Returns -1 if there is none.
  */
-static int select_idle_sibling(struct task_struct *p, int target)
+static int __select_idle_sibling(struct task_struct *p, int target)
 {
 	int cpu = smp_processor_id();
 	int prev_cpu = task_cpu(p);
 	struct sched_domain *sd;
-	int i;
+	int i, idle = -1;
 
 	/*
 	 * If the task is going to be woken-up on this cpu and if it is
@@ -2266,32 +2267,48 @@ static int select_idle_sibling(struct task_struct *p, int target)
 		return prev_cpu;
 
 	/*
-	 * Otherwise, iterate the domains and find an elegible idle cpu.
+	 * Otherwise, take the first eligible cpu out of the idle mask of the
+	 * cache domain; it may be stale, so re-check each candidate.
 	 */
 	rcu_read_lock();
-	for_each_domain(target, sd) {
-		if (!(sd->flags & SD_SHARE_PKG_RESOURCES))
-			break;
-
-		for_each_cpu_and(i, sched_domain_span(sd), tsk_cpus_allowed(p)) {
-			if (idle_cpu(i)) {
-				target = i;
-				break;
-			}
-		}
+	sd = rcu_dereference(per_cpu(sd_llc, target));
+	if (!sd)
+		goto unlock;
 
-		/*
-		 * Lets stop looking for an idle sibling when we reached
-		 * the domain that spans the current cpu and prev_cpu.
-		 */
-		if (cpumask_test_cpu(cpu, sched_domain_span(sd)) &&
-		    cpumask_test_cpu(prev_cpu, sched_domain_span(sd)))
+	for_each_cpu_and(i, cpu_llc_idle_mask(target), tsk_cpus_allowed(p)) {
+		if (cpumask_test_cpu(i, sched_domain_span(sd)) && idle_cpu(i)) {
+			idle = i;
 			break;
+		}
 	}
+unlock:
 	rcu_read_unlock();
 
-	return target;
+	return idle;
+}
+
+#ifdef CONFIG_SCHEDSTATS
+static int select_idle_sibling(struct task_struct *p, int target)
+{
+	struct rq *rq = this_rq();
+	u64 start = sched_clock_cpu(cpu_of(rq));
+	int cpu = __select_idle_sibling(p, target);
+
+	schedstat_inc(rq, sis_search);
+	if (cpu >= 0)
+		schedstat_inc(rq, sis_found);
+	schedstat_add(rq, sis_time, sched_clock_cpu(cpu_of(rq)) - start);
+
+	return cpu >= 0 ? cpu : target;
+}
+#else
+static inline int select_idle_sibling(struct task_struct *p, int target)
+{
+	int cpu = __select_idle_sibling(p, target);
+
+	return cpu >= 0 ? cpu : target;
 }
+#endif
 
 /*
  * sched_balance_self: balance the current task (running on cpu) in domains
@@ -1176,6 +1176,14 @@ static struct ctl_table vm_table[] = {
 		.proc_handler	= proc_dointvec_minmax,
 		.extra1		= &zero,
 	},
+	{
+		.procname	= "fork_parallel_copy_mb",
+		.data		= &sysctl_fork_parallel_copy_mb,
+		.maxlen		= sizeof(sysctl_fork_parallel_copy_mb),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &zero,
+	},
 #else
 	{
 		.procname	= "nr_trim_pages",
@@ -41,6 +41,9 @@
 #include <linux/debug_locks.h>
 #include <linux/lockdep.h>
 #include <linux/idr.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
 
 #include "workqueue_sched.h"
 
@@ -167,8 +170,29 @@ struct global_cwq {
 	unsigned int		trustee_state;	/* L: trustee state */
 	wait_queue_head_t	trustee_wait;	/* trustee wait */
 	struct worker		*first_idle;	/* L: first idle worker */
+#ifdef CONFIG_WORKQUEUE_STATS
+	unsigned long		nr_created;	/* L: workers created on demand */
+	unsigned long		nr_mayday;	/* L: mayday timer expirations */
+#endif
 } ____cacheline_aligned_in_smp;
 
+#ifdef CONFIG_WORKQUEUE_STATS
+/*
+ * Latency histograms, in usecs.  Bucket 0 counts latencies below 1us,
+ * bucket n those in [2^(n-1), 2^n) usecs and the last one everything
+ * longer.
+ */
+#define WQ_STAT_BUCKETS		20
+
+struct wq_stats {
+	unsigned long		nr_done;	/* works executed */
+	u64			queue_ns;	/* total queue-to-start time */
+	u64			exec_ns;	/* total start-to-finish time */
+	unsigned long		queue_hist[WQ_STAT_BUCKETS];
+	unsigned long		exec_hist[WQ_STAT_BUCKETS];
+};
+#endif
+
 /*
  * The per-CPU workqueue.  The lower WORK_STRUCT_FLAG_BITS of
  * work_struct->data are used for flags and thus cwqs need to be
@@ -184,6 +208,9 @@ struct cpu_workqueue_struct {
 	int			nr_active;	/* L: nr of active works */
 	int			max_active;	/* L: max active works */
 	struct list_head	delayed_works;	/* L: delayed works */
+#ifdef CONFIG_WORKQUEUE_STATS
+	struct wq_stats		stats;		/* L: latency statistics */
+#endif
 };
 
 /*
@@ -431,6 +458,66 @@ static inline void debug_work_activate(struct work_struct *work) { }
 static inline void debug_work_deactivate(struct work_struct *work) { }
 #endif
 
+#ifdef CONFIG_WORKQUEUE_STATS
+
+static u32 wq_stats_enabled __read_mostly = 1;
+
+static inline void wq_stats_queue(struct work_struct *work)
+{
+	work->queued_at = ACCESS_ONCE(wq_stats_enabled) ? local_clock() : 0;
+}
+
+static inline u64 wq_stats_start(void)
+{
+	return ACCESS_ONCE(wq_stats_enabled) ? local_clock() : 0;
+}
+
+static unsigned int wq_stats_bucket(u64 ns)
+{
+	u64 usecs = div_u64(ns, NSEC_PER_USEC);
+
+	if (!usecs)
+		return 0;
+	return min_t(unsigned int, ilog2(usecs) + 1, WQ_STAT_BUCKETS - 1);
+}
+
+/*
+ * Account a finished work to @cwq.  @queued is the work's queueing
+ * timestamp, @start when it began executing; either is zero if stats
+ * were off at that point.
+ */
+static void wq_stats_done(struct cpu_workqueue_struct *cwq, u64 queued,
+			  u64 start)
+{
+	struct wq_stats *st = &cwq->stats;
+	u64 now;
+
+	if (!start)
+		return;
+
+	now = local_clock();
+	st->nr_done++;
+	st->exec_ns += now - start;
+	st->exec_hist[wq_stats_bucket(now - start)]++;
+
+	/* local_clock() is only roughly synchronised between cpus */
+	if (queued && (s64)(start - queued) > 0) {
+		st->queue_ns += start - queued;
+		st->queue_hist[wq_stats_bucket(start - queued)]++;
+	} else if (queued) {
+		st->queue_hist[0]++;
+	}
+}
+
+#else
+
+static inline void wq_stats_queue(struct work_struct *work) { }
+static inline u64 wq_stats_start(void) { return 0; }
+static inline void wq_stats_done(struct cpu_workqueue_struct *cwq,
+				 u64 queued, u64 start) { }
+
+#endif /* CONFIG_WORKQUEUE_STATS */
+
 /* Serializes the accesses to the list of workqueues. */
 static DEFINE_SPINLOCK(workqueue_lock);
 static LIST_HEAD(workqueues);
@@ -927,6 +1014,7 @@ static void insert_work(struct cpu_workqueue_struct *cwq,
 
 	/* we own @work, set data and link */
 	set_work_cwq(work, cwq, extra_flags);
+	wq_stats_queue(work);
 
 	/*
 	 * Ensure that we get the right work->data if we see the
@@ -1512,6 +1600,9 @@ static void gcwq_mayday_timeout(unsigned long __gcwq)
 	spin_lock_irq(&gcwq->lock);
 
 	if (need_to_create_worker(gcwq)) {
+#ifdef CONFIG_WORKQUEUE_STATS
+		gcwq->nr_mayday++;
+#endif
 		/*
 		 * We've been trying to create a new worker but
 		 * haven't been successful.  We might be hitting an
@@ -1568,6 +1659,9 @@ restart:
 		if (worker) {
 			del_timer_sync(&gcwq->mayday_timer);
 			spin_lock_irq(&gcwq->lock);
+#ifdef CONFIG_WORKQUEUE_STATS
+			gcwq->nr_created++;
+#endif
 			start_worker(worker);
 			BUG_ON(need_to_create_worker(gcwq));
 			return true;
@@ -1805,6 +1899,7 @@ __acquires(&gcwq->lock)
 	work_func_t f = work->func;
 	int work_color;
 	struct worker *collision;
+	u64 queued_at = 0, start;
 #ifdef CONFIG_LOCKDEP
 	/*
 	 * It is permissible to free the struct work_struct from
@@ -1837,6 +1932,9 @@ __acquires(&gcwq->lock)
 	/* record the current cpu number in the work data and dequeue */
 	set_work_cpu(work, gcwq->cpu);
 	list_del_init(&work->entry);
+#ifdef CONFIG_WORKQUEUE_STATS
+	queued_at = work->queued_at;
+#endif
 
 	/*
 	 * If HIGHPRI_PENDING, check the next work, and, if HIGHPRI,
@@ -1866,6 +1964,7 @@ __acquires(&gcwq->lock)
 	lock_map_acquire_read(&cwq->wq->lockdep_map);
 	lock_map_acquire(&lockdep_map);
 	trace_workqueue_execute_start(work);
+	start = wq_stats_start();
 	f(work);
 	/*
 	 * While we must be careful to not use "work" after this, the trace
@@ -1891,6 +1990,8 @@ __acquires(&gcwq->lock)
 	if (unlikely(cpu_intensive))
 		worker_clr_flags(worker, WORKER_CPU_INTENSIVE);
 
+	wq_stats_done(cwq, queued_at, start);
+
 	/* we're done with it, release */
 	hlist_del_init(&worker->hentry);
 	worker->current_work = NULL;
@@ -3767,6 +3868,182 @@ out_unlock:
 }
 #endif /* CONFIG_FREEZER */
 
+#ifdef CONFIG_WORKQUEUE_STATS
+
+static void wq_stats_show_hist(struct seq_file *m, const char *name,
+			       unsigned long *hist)
+{
+	int i;
+
+	seq_printf(m, "  %s", name);
+	for (i = 0; i < WQ_STAT_BUCKETS; i++)
+		seq_printf(m, " %lu", hist[i]);
+	seq_putc(m, '\n');
+}
+
+static int wq_stats_show(struct seq_file *m, void *v)
+{
+	struct workqueue_struct *wq;
+	unsigned int cpu;
+	int i;
+
+	seq_puts(m, "# buckets: <1us");
+	for (i = 1; i < WQ_STAT_BUCKETS - 1; i++)
+		seq_printf(m, " <%luus", 1UL << i);
+	seq_printf(m, " >=%luus\n", 1UL << (WQ_STAT_BUCKETS - 2));
+
+	for_each_gcwq_cpu(cpu) {
+		struct global_cwq *gcwq = get_gcwq(cpu);
+		int nr_workers, nr_idle;
+		unsigned long nr_created, nr_mayday;
+
+		spin_lock_irq(&gcwq->lock);
+		nr_workers = gcwq->nr_workers;
+		nr_idle = gcwq->nr_idle;
+		nr_created = gcwq->nr_created;
+		nr_mayday = gcwq->nr_mayday;
+		spin_unlock_irq(&gcwq->lock);
+
+		if (cpu == WORK_CPU_UNBOUND)
+			seq_puts(m, "pool unbound");
+		else
+			seq_printf(m, "pool cpu%u", cpu);
+		seq_printf(m, " workers %d idle %d created %lu mayday %lu\n",
+			   nr_workers, nr_idle, nr_created, nr_mayday);
+	}
+
+	/*
+	 * The per-cpu stats are read without their gcwq locks, a sum may
+	 * be off by the works that complete while we are adding up.
+	 */
+	spin_lock(&workqueue_lock);
+	list_for_each_entry(wq, &workqueues, list) {
+		struct wq_stats sum;
+
+		memset(&sum, 0, sizeof(sum));
+		for_each_cwq_cpu(cpu, wq) {
+			struct wq_stats *st = &get_cwq(cpu, wq)->stats;
+
+			sum.nr_done += st->nr_done;
+			sum.queue_ns += st->queue_ns;
+			sum.exec_ns += st->exec_ns;
+			for (i = 0; i < WQ_STAT_BUCKETS; i++) {
+				sum.queue_hist[i] += st->queue_hist[i];
+				sum.exec_hist[i] += st->exec_hist[i];
+			}
+		}
+
+		seq_printf(m, "wq %s done %lu", wq->name, sum.nr_done);
+		if (sum.nr_done)
+			seq_printf(m, " queue_avg_us %llu exec_avg_us %llu",
+				   div64_u64(sum.queue_ns, sum.nr_done) /
+					NSEC_PER_USEC,
+				   div64_u64(sum.exec_ns, sum.nr_done) /
+					NSEC_PER_USEC);
+		seq_putc(m, '\n');
+		wq_stats_show_hist(m, "queue", sum.queue_hist);
+		wq_stats_show_hist(m, "exec", sum.exec_hist);
+	}
+	spin_unlock(&workqueue_lock);
+	return 0;
+}
+
+static int wq_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wq_stats_show, NULL);
+}
+
+static const struct file_operations wq_stats_fops = {
+	.open		= wq_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#ifdef CONFIG_WORKQUEUE_STATS_SELFTEST
+#define WQ_STATS_TEST_WORKS	1024
+#define WQ_STATS_TEST_ROUNDS	64
+#define WQ_STATS_TEST_PASSES	5
+
+static void wq_stats_test_fn(struct work_struct *work)
+{
+}
+
+/* Queue and flush WQ_STATS_TEST_ROUNDS batches of empty works */
+static u64 __init wq_stats_flood(struct workqueue_struct *wq,
+				 struct work_struct *works)
+{
+	u64 start = local_clock();
+	int r, i;
+
+	for (r = 0; r < WQ_STATS_TEST_ROUNDS; r++) {
+		for (i = 0; i < WQ_STATS_TEST_WORKS; i++)
+			queue_work(wq, &works[i]);
+		flush_workqueue(wq);
+	}
+	return local_clock() - start;
+}
+
+static void __init wq_stats_selftest(void)
+{
+	struct workqueue_struct *wq;
+	struct work_struct *works;
+	u64 off = ULLONG_MAX, on = ULLONG_MAX, overhead;
+	int i;
+
+	works = vmalloc(WQ_STATS_TEST_WORKS * sizeof(*works));
+	wq = alloc_workqueue("wq_stats_test", 0, 0);
+	if (!works || !wq) {
+		printk(KERN_ERR "workqueue: stats selftest: out of memory\n");
+		goto out;
+	}
+	for (i = 0; i < WQ_STATS_TEST_WORKS; i++)
+		INIT_WORK(&works[i], wq_stats_test_fn);
+
+	/* warm up, then take the best of several alternating passes */
+	wq_stats_flood(wq, works);
+	for (i = 0; i < WQ_STATS_TEST_PASSES; i++) {
+		wq_stats_enabled = 0;
+		off = min(off, wq_stats_flood(wq, works));
+		wq_stats_enabled = 1;
+		on = min(on, wq_stats_flood(wq, works));
+	}
+
+	/* in hundredths of a percent */
+	overhead = on > off ? div64_u64((on - off) * 10000, off) : 0;
+	printk("%sworkqueue: stats overhead %llu.%02llu%% "
+	       "(%llu ns with, %llu ns without, %d works)\n",
+	       overhead > 100 ? KERN_WARNING : KERN_INFO,
+	       overhead / 100, overhead % 100, on, off,
+	       WQ_STATS_TEST_WORKS * WQ_STATS_TEST_ROUNDS);
+out:
+	if (wq)
+		destroy_workqueue(wq);
+	vfree(works);
+}
+#else
+static inline void wq_stats_selftest(void) { }
+#endif /* CONFIG_WORKQUEUE_STATS_SELFTEST */
+
+static int __init wq_stats_init(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("workqueue", NULL);
+	if (dir) {
+		debugfs_create_file("stats", S_IRUSR, dir, NULL,
+				    &wq_stats_fops);
+		debugfs_create_bool("stats_enable", S_IRUSR | S_IWUSR, dir,
+				    &wq_stats_enabled);
+	}
+
+	wq_stats_selftest();
+	return 0;
+}
+late_initcall(wq_stats_init);
+
+#endif /* CONFIG_WORKQUEUE_STATS */
+
 static int __init init_workqueues(void)
 {
 	unsigned int cpu;
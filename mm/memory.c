@@ -57,6 +57,7 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/gfp.h>
+#include <linux/workqueue.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -1042,11 +1043,154 @@ static inline int copy_pud_range(struct mm_struct *dst_mm, struct mm_struct *src
 	return 0;
 }
 
-int copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
-		struct vm_area_struct *vma)
+static int copy_pgd_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
+		struct vm_area_struct *vma, unsigned long addr, unsigned long end)
 {
 	pgd_t *src_pgd, *dst_pgd;
 	unsigned long next;
+
+	dst_pgd = pgd_offset(dst_mm, addr);
+	src_pgd = pgd_offset(src_mm, addr);
+	do {
+		next = pgd_addr_end(addr, end);
+		if (pgd_none_or_clear_bad(src_pgd))
+			continue;
+		if (unlikely(copy_pud_range(dst_mm, src_mm, dst_pgd, src_pgd,
+					    vma, addr, next)))
+			return -ENOMEM;
+	} while (dst_pgd++, src_pgd++, addr = next, addr != end);
+
+	return 0;
+}
+
+/*
+ * Anonymous vmas of at least this many megabytes have their page tables
+ * copied at fork time by several cpus at once; 0 disables it.
+ */
+int sysctl_fork_parallel_copy_mb __read_mostly;
+
+/*
+ * The parallel copy splits a vma into chunks made of whole pmds, so that
+ * no two cpus ever fill the same page table page of the child.  Upper
+ * levels may be shared, but __pud_alloc() and __pmd_alloc() already cope
+ * with concurrent faults populating them.
+ */
+#define COPY_CHUNK_SIZE		(64 * PMD_SIZE)
+#define COPY_MAX_WORKERS	16
+
+static struct workqueue_struct *fork_copy_wq;
+
+struct copy_range_ctl {
+	struct mm_struct *dst_mm, *src_mm;
+	struct vm_area_struct *vma;
+	unsigned long start, end;
+	atomic_long_t next;		/* index of the next chunk to copy */
+	int error;
+};
+
+struct copy_range_work {
+	struct work_struct work;
+	struct copy_range_ctl *ctl;
+};
+
+static void copy_range_chunks(struct copy_range_ctl *ctl)
+{
+	unsigned long base = ctl->start & ~(COPY_CHUNK_SIZE - 1);
+
+	while (!ACCESS_ONCE(ctl->error)) {
+		unsigned long i = atomic_long_inc_return(&ctl->next) - 1;
+		unsigned long addr = base + i * COPY_CHUNK_SIZE;
+		unsigned long end;
+
+		if (i >= DIV_ROUND_UP(ctl->end - base, COPY_CHUNK_SIZE))
+			break;
+		end = ctl->end - addr > COPY_CHUNK_SIZE ?
+			addr + COPY_CHUNK_SIZE : ctl->end;
+		addr = max(addr, ctl->start);
+
+		if (copy_pgd_range(ctl->dst_mm, ctl->src_mm, ctl->vma,
+				   addr, end))
+			ctl->error = -ENOMEM;
+		cond_resched();
+	}
+}
+
+static void copy_range_work_fn(struct work_struct *work)
+{
+	struct copy_range_work *w;
+
+	w = container_of(work, struct copy_range_work, work);
+	copy_range_chunks(w->ctl);
+}
+
+static bool copy_page_range_parallel_ok(struct vm_area_struct *vma)
+{
+	unsigned long size_mb = (vma->vm_end - vma->vm_start) >> 20;
+
+	return sysctl_fork_parallel_copy_mb && fork_copy_wq &&
+		size_mb >= sysctl_fork_parallel_copy_mb &&
+		vma->anon_vma && !vma->vm_file &&
+		!(vma->vm_flags & (VM_HUGETLB|VM_NONLINEAR|VM_PFNMAP|
+				   VM_INSERTPAGE|VM_MIXEDMAP)) &&
+		num_online_cpus() > 1;
+}
+
+/*
+ * Copy the page tables of a large anonymous vma with the help of up to
+ * COPY_MAX_WORKERS kworkers.  The caller holds mmap_sem of both mms for
+ * writing, which keeps the vma and both page table trees stable for the
+ * workers as well, so we just have to wait for them before returning.
+ */
+static int copy_page_range_parallel(struct mm_struct *dst_mm,
+		struct mm_struct *src_mm, struct vm_area_struct *vma)
+{
+	struct copy_range_ctl ctl = {
+		.dst_mm	= dst_mm,
+		.src_mm	= src_mm,
+		.vma	= vma,
+		.start	= vma->vm_start,
+		.end	= vma->vm_end,
+		.next	= ATOMIC_LONG_INIT(0),
+	};
+	unsigned long chunks;
+	struct copy_range_work *works;
+	int i, nr;
+
+	chunks = DIV_ROUND_UP(vma->vm_end - (vma->vm_start &
+				~(COPY_CHUNK_SIZE - 1)), COPY_CHUNK_SIZE);
+	nr = min_t(unsigned long, num_online_cpus() - 1, chunks - 1);
+	nr = min(nr, COPY_MAX_WORKERS);
+
+	works = nr > 0 ? kmalloc(nr * sizeof(*works), GFP_KERNEL) : NULL;
+	if (!works)
+		return copy_pgd_range(dst_mm, src_mm, vma,
+				      vma->vm_start, vma->vm_end);
+
+	for (i = 0; i < nr; i++) {
+		INIT_WORK(&works[i].work, copy_range_work_fn);
+		works[i].ctl = &ctl;
+		queue_work(fork_copy_wq, &works[i].work);
+	}
+
+	copy_range_chunks(&ctl);
+
+	for (i = 0; i < nr; i++)
+		flush_work(&works[i].work);
+	kfree(works);
+
+	return ctl.error;
+}
+
+static int __init fork_copy_init(void)
+{
+	fork_copy_wq = alloc_workqueue("fork_copy", WQ_UNBOUND, 0);
+	return 0;
+}
+core_initcall(fork_copy_init);
+
+int copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
+		struct vm_area_struct *vma)
+{
 	unsigned long addr = vma->vm_start;
 	unsigned long end = vma->vm_end;
 	int ret;
@@ -1084,19 +1228,10 @@ int copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	if (is_cow_mapping(vma->vm_flags))
 		mmu_notifier_invalidate_range_start(src_mm, addr, end);
 
-	ret = 0;
-	dst_pgd = pgd_offset(dst_mm, addr);
-	src_pgd = pgd_offset(src_mm, addr);
-	do {
-		next = pgd_addr_end(addr, end);
-		if (pgd_none_or_clear_bad(src_pgd))
-			continue;
-		if (unlikely(copy_pud_range(dst_mm, src_mm, dst_pgd, src_pgd,
-					    vma, addr, next))) {
-			ret = -ENOMEM;
-			break;
-		}
-	} while (dst_pgd++, src_pgd++, addr = next, addr != end);
+	if (copy_page_range_parallel_ok(vma))
+		ret = copy_page_range_parallel(dst_mm, src_mm, vma);
+	else
+		ret = copy_pgd_range(dst_mm, src_mm, vma, addr, end);
 
 	if (is_cow_mapping(vma->vm_flags))
 		mmu_notifier_invalidate_range_end(src_mm,
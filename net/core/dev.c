@@ -137,6 +137,7 @@
 #include <linux/if_pppox.h>
 #include <linux/ppp_defs.h>
 #include <linux/net_tstamp.h>
+#include <net/busy_poll.h>
 
 #include "net-sysfs.h"
 
@@ -1551,24 +1552,17 @@ static inline bool is_skb_forwardable(struct net_device *dev,
 }
 
 /**
- * dev_forward_skb - loopback an skb to another netif
+ * __dev_forward_skb - prepare an skb to be looped back to another netif
  *
  * @dev: destination network device
  * @skb: buffer to forward
  *
- * return values:
- *	NET_RX_SUCCESS	(no congestion)
- *	NET_RX_DROP     (packet was dropped, but freed)
- *
- * dev_forward_skb can be used for injecting an skb from the
- * start_xmit function of one device into the receive queue
- * of another device.
- *
- * The receiving device may be in another namespace, so
- * we have to clear all information in the skb that could
- * impact namespace isolation.
+ * Does everything dev_forward_skb() does short of queueing the skb,
+ * for drivers that deliver it themselves (e.g. through their own NAPI
+ * context).  Returns 0 if the skb may be delivered, NET_RX_DROP if it
+ * was dropped and freed.
  */
-int dev_forward_skb(struct net_device *dev, struct sk_buff *skb)
+int __dev_forward_skb(struct net_device *dev, struct sk_buff *skb)
 {
 	if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY) {
 		if (skb_copy_ubufs(skb, GFP_ATOMIC)) {
@@ -1590,7 +1584,31 @@ int dev_forward_skb(struct net_device *dev, struct sk_buff *skb)
 	skb->tstamp.tv64 = 0;
 	skb->pkt_type = PACKET_HOST;
 	skb->protocol = eth_type_trans(skb, dev);
-	return netif_rx(skb);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(__dev_forward_skb);
+
+/**
+ * dev_forward_skb - loopback an skb to another netif
+ *
+ * @dev: destination network device
+ * @skb: buffer to forward
+ *
+ * return values:
+ *	NET_RX_SUCCESS	(no congestion)
+ *	NET_RX_DROP     (packet was dropped, but freed)
+ *
+ * dev_forward_skb can be used for injecting an skb from the
+ * start_xmit function of one device into the receive queue
+ * of another device.
+ *
+ * The receiving device may be in another namespace, so
+ * we have to clear all information in the skb that could
+ * impact namespace isolation.
+ */
+int dev_forward_skb(struct net_device *dev, struct sk_buff *skb)
+{
+	return __dev_forward_skb(dev, skb) ?: netif_rx(skb);
 }
 EXPORT_SYMBOL_GPL(dev_forward_skb);
 
@@ -2084,25 +2102,6 @@ static int dev_gso_segment(struct sk_buff *skb, int features)
 	return 0;
 }
 
-/*
- * Try to orphan skb early, right before transmission by the device.
- * We cannot orphan skb if tx timestamp is requested or the sk-reference
- * is needed on driver level for other reasons, e.g. see net/can/raw.c
- */
-static inline void skb_orphan_try(struct sk_buff *skb)
-{
-	struct sock *sk = skb->sk;
-
-	if (sk && !skb_shinfo(skb)->tx_flags) {
-		/* skb_tx_hash() wont be able to get sk.
-		 * We copy sk_hash into skb->rxhash
-		 */
-		if (!skb->rxhash)
-			skb->rxhash = sk->sk_hash;
-		skb_orphan(skb);
-	}
-}
-
 static bool can_checksum_protocol(unsigned long features, __be16 protocol)
 {
 	return ((features & NETIF_F_GEN_CSUM) ||
@@ -2187,8 +2186,6 @@ int dev_hard_start_xmit(struct sk_buff *skb, struct net_device *dev,
 		if (!list_empty(&ptype_all))
 			dev_queue_xmit_nit(skb, dev);
 
-		skb_orphan_try(skb);
-
 		features = netif_skb_features(skb);
 
 		if (vlan_tx_tag_present(skb) &&
@@ -2275,7 +2272,7 @@ static u32 hashrnd __read_mostly;
  * Returns a Tx hash based on the given packet descriptor a Tx queues' number
  * to be used as a distribution range.
  */
-u16 __skb_tx_hash(const struct net_device *dev, const struct sk_buff *skb,
+u16 __skb_tx_hash(const struct net_device *dev, struct sk_buff *skb,
 		  unsigned int num_tx_queues)
 {
 	u32 hash;
@@ -2295,9 +2292,12 @@ u16 __skb_tx_hash(const struct net_device *dev, const struct sk_buff *skb,
 		qcount = dev->tc_to_txq[tc].count;
 	}
 
-	if (skb->sk && skb->sk->sk_hash)
+	if (skb->sk && skb->sk->sk_hash) {
 		hash = skb->sk->sk_hash;
-	else
+		/* keep the flow's hash if a stacked device orphans the skb */
+		if (!skb->rxhash)
+			skb->rxhash = hash;
+	} else
 		hash = (__force u16) skb->protocol ^ skb->rxhash;
 	hash = jhash_1word(hash, hashrnd);
 
@@ -2403,6 +2403,19 @@ static inline int __dev_xmit_skb(struct sk_buff *skb, struct Qdisc *q,
 
 	qdisc_skb_cb(skb)->pkt_len = skb->len;
 	qdisc_calculate_pkt_len(skb, q);
+
+	if (q->flags & TCQ_F_NOLOCK) {
+		/* the qdisc and qdisc_run() bring their own exclusion */
+		if (unlikely(test_bit(__QDISC_STATE_DEACTIVATED, &q->state))) {
+			kfree_skb(skb);
+			return NET_XMIT_DROP;
+		}
+		skb_dst_force(skb);
+		rc = q->enqueue(skb, q) & NET_XMIT_MASK;
+		qdisc_run(q);
+		return rc;
+	}
+
 	/*
 	 * Heuristic to force contended enqueues to serialize on a
 	 * separate lock before trying to get qdisc main lock.
@@ -2574,6 +2587,7 @@ int netdev_max_backlog __read_mostly = 1000;
 int netdev_tstamp_prequeue __read_mostly = 1;
 int netdev_budget __read_mostly = 300;
 int weight_p __read_mostly = 64;            /* old backlog weight */
+int dev_tx_bulk __read_mostly = 8;          /* skbs per driver lock hold */
 
 /* Called with irq disabled */
 static inline void ____napi_schedule(struct softnet_data *sd,
@@ -3080,6 +3094,13 @@ static void net_tx_action(struct softirq_action *h)
 
 			head = head->next_sched;
 
+			if (q->flags & TCQ_F_NOLOCK) {
+				smp_mb__before_clear_bit();
+				clear_bit(__QDISC_STATE_SCHED, &q->state);
+				qdisc_run(q);
+				continue;
+			}
+
 			root_lock = qdisc_lock(q);
 			if (spin_trylock(root_lock)) {
 				smp_mb__before_clear_bit();
@@ -3618,6 +3639,7 @@ EXPORT_SYMBOL(skb_gro_reset_offset);
 
 gro_result_t napi_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
+	skb_mark_napi_id(skb, napi);
 	skb_gro_reset_offset(skb);
 
 	return napi_skb_finish(__napi_gro_receive(napi, skb), skb);
@@ -3719,6 +3741,7 @@ gro_result_t napi_gro_frags(struct napi_struct *napi)
 	if (!skb)
 		return GRO_DROP;
 
+	skb_mark_napi_id(skb, napi);
 	return napi_frags_finish(napi, skb, __napi_gro_receive(napi, skb));
 }
 EXPORT_SYMBOL(napi_gro_frags);
@@ -3829,7 +3852,8 @@ void __napi_complete(struct napi_struct *n)
 	BUG_ON(!test_bit(NAPI_STATE_SCHED, &n->state));
 	BUG_ON(n->gro_list);
 
-	list_del(&n->poll_list);
+	/* A napi owned by sk_busy_loop() is not on any poll_list */
+	list_del_init(&n->poll_list);
 	smp_mb__before_clear_bit();
 	clear_bit(NAPI_STATE_SCHED, &n->state);
 }
@@ -3853,6 +3877,149 @@ void napi_complete(struct napi_struct *n)
 }
 EXPORT_SYMBOL(napi_complete);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+#define NAPI_HASH_BITS	8
+#define NAPI_HASH_SIZE	(1U << NAPI_HASH_BITS)
+
+/* Busy poll budget per napi->poll() call from sk_busy_loop() */
+#define BUSY_POLL_BUDGET 8
+
+unsigned int sysctl_net_busy_read __read_mostly;
+
+static struct hlist_head napi_hash[NAPI_HASH_SIZE];
+static DEFINE_SPINLOCK(napi_hash_lock);
+static unsigned int napi_gen_id;
+
+/* must be called under rcu_read_lock(), as we dont take a reference */
+static struct napi_struct *napi_by_id(unsigned int napi_id)
+{
+	struct napi_struct *napi;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(napi, node,
+				 &napi_hash[napi_id & (NAPI_HASH_SIZE - 1)],
+				 napi_hash_node)
+		if (napi->napi_id == napi_id)
+			return napi;
+
+	return NULL;
+}
+
+static void napi_hash_add(struct napi_struct *napi)
+{
+	if (test_and_set_bit(NAPI_STATE_HASHED, &napi->state))
+		return;
+
+	spin_lock(&napi_hash_lock);
+
+	/* 0 is not a valid id, we also skip an id that is taken
+	 * we expect both events to be extremely rare
+	 */
+	do {
+		if (unlikely(++napi_gen_id == 0))
+			napi_gen_id = 1;
+	} while (napi_by_id(napi_gen_id));
+	napi->napi_id = napi_gen_id;
+
+	hlist_add_head_rcu(&napi->napi_hash_node,
+			   &napi_hash[napi->napi_id & (NAPI_HASH_SIZE - 1)]);
+
+	spin_unlock(&napi_hash_lock);
+}
+
+/* Warning : caller is responsible to make sure rcu grace period
+ * is respected before freeing memory containing @napi
+ */
+static bool napi_hash_del(struct napi_struct *napi)
+{
+	if (!test_and_clear_bit(NAPI_STATE_HASHED, &napi->state))
+		return false;
+
+	spin_lock(&napi_hash_lock);
+	hlist_del_rcu(&napi->napi_hash_node);
+	spin_unlock(&napi_hash_lock);
+	return true;
+}
+
+static inline unsigned long busy_loop_us_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+/**
+ *	sk_busy_loop - poll the device queue a socket receives from
+ *	@sk: socket with an empty receive queue
+ *	@nonblock: make a single pass instead of polling for sk_ll_usec
+ *
+ *	Run the poll routine of the napi context that last delivered to @sk
+ *	until a packet lands on the socket receive queue, the time budget
+ *	runs out, or the task needs to reschedule.  A napi that is already
+ *	scheduled elsewhere is left alone for that iteration.  Returns true
+ *	if the receive queue is non empty on exit.
+ */
+bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	unsigned long end_time = busy_loop_us_clock() +
+				 ACCESS_ONCE(sk->sk_ll_usec);
+	struct napi_struct *napi;
+	bool rc = false;
+
+	rcu_read_lock();
+
+	napi = napi_by_id(sk->sk_napi_id);
+	if (!napi)
+		goto out;
+
+	sk->sk_ll_polls++;
+	do {
+		int work = 0;
+
+		local_bh_disable();
+		if (!test_and_set_bit(NAPI_STATE_SCHED, &napi->state)) {
+			void *have = netpoll_poll_lock(napi);
+
+			work = napi->poll(napi, BUSY_POLL_BUDGET);
+			trace_napi_poll(napi);
+
+			/* The driver consumed its whole budget and kept the
+			 * napi scheduled; hand it over to net_rx_action().
+			 */
+			if (work == BUSY_POLL_BUDGET) {
+				local_irq_disable();
+				____napi_schedule(&__get_cpu_var(softnet_data),
+						  napi);
+				local_irq_enable();
+			}
+			netpoll_poll_unlock(have);
+		}
+		if (work > 0)
+			NET_ADD_STATS_BH(sock_net(sk),
+					 LINUX_MIB_BUSYPOLLRXPACKETS, work);
+		local_bh_enable();
+
+		rc = !skb_queue_empty(&sk->sk_receive_queue);
+	} while (!rc && !nonblock && !need_resched() &&
+		 !signal_pending(current) &&
+		 time_before(busy_loop_us_clock(), end_time));
+
+	if (rc)
+		sk->sk_ll_hits++;
+out:
+	rcu_read_unlock();
+	return rc;
+}
+EXPORT_SYMBOL(sk_busy_loop);
+#else
+static inline void napi_hash_add(struct napi_struct *napi)
+{
+}
+
+static inline bool napi_hash_del(struct napi_struct *napi)
+{
+	return false;
+}
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
 void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 		    int (*poll)(struct napi_struct *, int), int weight)
 {
@@ -3869,6 +4036,7 @@ void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 	napi->poll_owner = -1;
 #endif
 	set_bit(NAPI_STATE_SCHED, &napi->state);
+	napi_hash_add(napi);
 }
 EXPORT_SYMBOL(netif_napi_add);
 
@@ -3876,6 +4044,9 @@ void netif_napi_del(struct napi_struct *napi)
 {
 	struct sk_buff *skb, *next;
 
+	might_sleep();
+	if (napi_hash_del(napi))
+		synchronize_net();
 	list_del_init(&napi->dev_list);
 	napi_free_frags(napi);
 
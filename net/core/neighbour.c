@@ -66,10 +66,16 @@ static const struct file_operations neigh_stat_seq_fops;
 #endif
 
 /*
-   Neighbour hash table buckets are protected with rwlock tbl->lock.
-
-   - All the scans/updates to hash buckets MUST be made under this lock.
-   - NOTHING clever should be made under this lock: no callbacks
+   Neighbour hash table buckets are protected with rwlock tbl->lock
+   and the per-bucket spinlocks tbl->hash_locks.
+
+   - Lookups walk the buckets under RCU only.
+   - Inserting or unlinking a single entry (neigh_create and the GC)
+     is made holding tbl->lock as a reader plus the lock of its bucket,
+     so it runs in parallel with other buckets.
+   - Resizing the table and whole-table flushes take tbl->lock as a
+     writer, which excludes all of the above.
+   - NOTHING clever should be made under these locks: no callbacks
      to protocol backends, no attempts to send something to network.
      It will result in deadlocks, if backend/driver wants to use neighbour
      cache.
@@ -126,48 +132,117 @@ unsigned long neigh_rand_reach_time(unsigned long base)
 EXPORT_SYMBOL(neigh_rand_reach_time);
 
 
-static int neigh_forced_gc(struct neigh_table *tbl)
+/* Number of hash buckets a single GC pass looks at */
+#define NEIGH_GC_BUCKETS	512
+
+static inline spinlock_t *neigh_bucket_lock(struct neigh_table *tbl,
+					    unsigned int hash_val)
+{
+	return &tbl->hash_locks[hash_val & tbl->hash_locks_mask];
+}
+
+static bool neigh_forced_gc_ok(struct neighbour *n)
+{
+	/* Neighbour record may be discarded if:
+	 * - nobody refers to it.
+	 * - it is not permanent
+	 */
+	return atomic_read(&n->refcnt) == 1 &&
+	       !(n->nud_state & NUD_PERMANENT);
+}
+
+static bool neigh_periodic_gc_ok(struct neighbour *n)
 {
+	unsigned int state = n->nud_state;
+
+	if (state & (NUD_PERMANENT | NUD_IN_TIMER))
+		return false;
+
+	if (time_before(n->used, n->confirmed))
+		n->used = n->confirmed;
+
+	return atomic_read(&n->refcnt) == 1 &&
+	       (state == NUD_FAILED ||
+		time_after(jiffies, n->used + n->parms->gc_staletime));
+}
+
+/*
+ * Release the unused entries of one hash bucket.  The caller holds
+ * tbl->lock as a reader with BH disabled, so the table cannot be resized
+ * under us; the bucket itself is serialized by its hash lock.
+ */
+static int neigh_gc_bucket(struct neigh_table *tbl,
+			   struct neigh_hash_table *nht,
+			   unsigned int hash_val, bool forced)
+{
+	spinlock_t *lock = neigh_bucket_lock(tbl, hash_val);
+	struct neighbour __rcu **np;
+	struct neighbour *n;
 	int shrunk = 0;
-	int i;
+
+	spin_lock(lock);
+	np = &nht->hash_buckets[hash_val];
+	while ((n = rcu_dereference_protected(*np,
+					lockdep_is_held(lock))) != NULL) {
+		bool release;
+
+		write_lock(&n->lock);
+		release = forced ? neigh_forced_gc_ok(n) :
+				   neigh_periodic_gc_ok(n);
+		if (release) {
+			rcu_assign_pointer(*np,
+				rcu_dereference_protected(n->next,
+						lockdep_is_held(lock)));
+			n->dead = 1;
+			shrunk++;
+			write_unlock(&n->lock);
+			neigh_cleanup_and_release(n);
+			continue;
+		}
+		write_unlock(&n->lock);
+		np = &n->next;
+	}
+	spin_unlock(lock);
+
+	return shrunk;
+}
+
+/*
+ * Called from neigh_alloc() when the table is getting full.  Rather
+ * than walking the whole table, scan at most NEIGH_GC_BUCKETS buckets
+ * starting where the previous forced run stopped, and stop early once
+ * the table is back under gc_thresh2.
+ */
+static int neigh_forced_gc(struct neigh_table *tbl)
+{
 	struct neigh_hash_table *nht;
+	unsigned int i, size, budget, scanned = 0;
+	int shrunk = 0;
 
 	NEIGH_CACHE_STAT_INC(tbl, forced_gc_runs);
 
-	write_lock_bh(&tbl->lock);
+	read_lock_bh(&tbl->lock);
 	nht = rcu_dereference_protected(tbl->nht,
 					lockdep_is_held(&tbl->lock));
-	for (i = 0; i < (1 << nht->hash_shift); i++) {
-		struct neighbour *n;
-		struct neighbour __rcu **np;
-
-		np = &nht->hash_buckets[i];
-		while ((n = rcu_dereference_protected(*np,
-					lockdep_is_held(&tbl->lock))) != NULL) {
-			/* Neighbour record may be discarded if:
-			 * - nobody refers to it.
-			 * - it is not permanent
-			 */
-			write_lock(&n->lock);
-			if (atomic_read(&n->refcnt) == 1 &&
-			    !(n->nud_state & NUD_PERMANENT)) {
-				rcu_assign_pointer(*np,
-					rcu_dereference_protected(n->next,
-						  lockdep_is_held(&tbl->lock)));
-				n->dead = 1;
-				shrunk	= 1;
-				write_unlock(&n->lock);
-				neigh_cleanup_and_release(n);
-				continue;
-			}
-			write_unlock(&n->lock);
-			np = &n->next;
-		}
+	size = 1 << nht->hash_shift;
+	budget = min_t(unsigned int, size, NEIGH_GC_BUCKETS);
+	i = tbl->forced_gc_bucket;
+
+	while (scanned < budget) {
+		i &= size - 1;
+		shrunk += neigh_gc_bucket(tbl, nht, i++, true);
+		scanned++;
+		if (shrunk && atomic_read(&tbl->entries) < tbl->gc_thresh2)
+			break;
 	}
 
+	tbl->forced_gc_bucket = i;
 	tbl->last_flush = jiffies;
 
-	write_unlock_bh(&tbl->lock);
+	NEIGH_CACHE_STAT_ADD(tbl, gc_buckets, scanned);
+	NEIGH_CACHE_STAT_ADD(tbl, gc_reclaimed, shrunk);
+
+	read_unlock_bh(&tbl->lock);
 
 	return shrunk;
 }
@@ -464,6 +539,7 @@ struct neighbour *neigh_create(struct neigh_table *tbl, const void *pkey,
 	int error;
 	struct neighbour *n1, *rc, *n = neigh_alloc(tbl);
 	struct neigh_hash_table *nht;
+	spinlock_t *lock;
 
 	if (!n) {
 		rc = ERR_PTR(-ENOBUFS);
@@ -489,14 +565,28 @@ struct neighbour *neigh_create(struct neigh_table *tbl, const void *pkey,
 
 	n->confirmed = jiffies - (n->parms->base_reachable_time << 1);
 
-	write_lock_bh(&tbl->lock);
+	read_lock_bh(&tbl->lock);
 	nht = rcu_dereference_protected(tbl->nht,
 					lockdep_is_held(&tbl->lock));
 
-	if (atomic_read(&tbl->entries) > (1 << nht->hash_shift))
-		nht = neigh_hash_grow(tbl, nht->hash_shift + 1);
+	if (unlikely(atomic_read(&tbl->entries) > (1 << nht->hash_shift))) {
+		/* Resizing needs the table to ourselves */
+		read_unlock_bh(&tbl->lock);
+		write_lock_bh(&tbl->lock);
+		nht = rcu_dereference_protected(tbl->nht,
+						lockdep_is_held(&tbl->lock));
+		if (atomic_read(&tbl->entries) > (1 << nht->hash_shift))
+			neigh_hash_grow(tbl, nht->hash_shift + 1);
+		write_unlock_bh(&tbl->lock);
+
+		read_lock_bh(&tbl->lock);
+		nht = rcu_dereference_protected(tbl->nht,
+						lockdep_is_held(&tbl->lock));
+	}
 
 	hash_val = tbl->hash(pkey, dev, nht->hash_rnd) >> (32 - nht->hash_shift);
+	lock = neigh_bucket_lock(tbl, hash_val);
+	spin_lock(lock);
 
 	if (n->parms->dead) {
 		rc = ERR_PTR(-EINVAL);
@@ -504,10 +594,10 @@ struct neighbour *neigh_create(struct neigh_table *tbl, const void *pkey,
 	}
 
 	for (n1 = rcu_dereference_protected(nht->hash_buckets[hash_val],
-					    lockdep_is_held(&tbl->lock));
+					    lockdep_is_held(lock));
 	     n1 != NULL;
 	     n1 = rcu_dereference_protected(n1->next,
-			lockdep_is_held(&tbl->lock))) {
+			lockdep_is_held(lock))) {
 		if (dev == n1->dev && !memcmp(n1->primary_key, pkey, key_len)) {
 			neigh_hold(n1);
 			rc = n1;
@@ -519,15 +609,17 @@ struct neighbour *neigh_create(struct neigh_table *tbl, const void *pkey,
 	neigh_hold(n);
 	rcu_assign_pointer(n->next,
 			   rcu_dereference_protected(nht->hash_buckets[hash_val],
-						     lockdep_is_held(&tbl->lock)));
+						     lockdep_is_held(lock)));
 	rcu_assign_pointer(nht->hash_buckets[hash_val], n);
-	write_unlock_bh(&tbl->lock);
+	spin_unlock(lock);
+	read_unlock_bh(&tbl->lock);
 	NEIGH_PRINTK2("neigh %p is created.\n", n);
 	rc = n;
 out:
 	return rc;
 out_tbl_unlock:
-	write_unlock_bh(&tbl->lock);
+	spin_unlock(lock);
+	read_unlock_bh(&tbl->lock);
 out_neigh_release:
 	neigh_release(n);
 	goto out;
@@ -740,14 +832,14 @@ static void neigh_connect(struct neighbour *neigh)
 static void neigh_periodic_work(struct work_struct *work)
 {
 	struct neigh_table *tbl = container_of(work, struct neigh_table, gc_work.work);
-	struct neighbour *n;
-	struct neighbour __rcu **np;
-	unsigned int i;
+	unsigned int i, start, end, size;
+	unsigned long delay;
+	int shrunk = 0;
 	struct neigh_hash_table *nht;
 
 	NEIGH_CACHE_STAT_INC(tbl, periodic_gc_runs);
 
-	write_lock_bh(&tbl->lock);
+	read_lock_bh(&tbl->lock);
 	nht = rcu_dereference_protected(tbl->nht,
 					lockdep_is_held(&tbl->lock));
 
@@ -763,53 +855,30 @@ static void neigh_periodic_work(struct work_struct *work)
 				neigh_rand_reach_time(p->base_reachable_time);
 	}
 
-	for (i = 0 ; i < (1 << nht->hash_shift); i++) {
-		np = &nht->hash_buckets[i];
+	/* Each run scans the next NEIGH_GC_BUCKETS buckets only. */
+	size = 1 << nht->hash_shift;
+	start = tbl->gc_bucket;
+	if (start >= size)
+		start = 0;
+	end = min_t(unsigned int, start + NEIGH_GC_BUCKETS, size);
 
-		while ((n = rcu_dereference_protected(*np,
-				lockdep_is_held(&tbl->lock))) != NULL) {
-			unsigned int state;
+	for (i = start; i < end; i++)
+		shrunk += neigh_gc_bucket(tbl, nht, i, false);
 
-			write_lock(&n->lock);
-
-			state = n->nud_state;
-			if (state & (NUD_PERMANENT | NUD_IN_TIMER)) {
-				write_unlock(&n->lock);
-				goto next_elt;
-			}
+	tbl->gc_bucket = end < size ? end : 0;
 
-			if (time_before(n->used, n->confirmed))
-				n->used = n->confirmed;
+	NEIGH_CACHE_STAT_ADD(tbl, gc_buckets, end - start);
+	NEIGH_CACHE_STAT_ADD(tbl, gc_reclaimed, shrunk);
 
-			if (atomic_read(&n->refcnt) == 1 &&
-			    (state == NUD_FAILED ||
-			     time_after(jiffies, n->used + n->parms->gc_staletime))) {
-				*np = n->next;
-				n->dead = 1;
-				write_unlock(&n->lock);
-				neigh_cleanup_and_release(n);
-				continue;
-			}
-			write_unlock(&n->lock);
-
-next_elt:
-			np = &n->next;
-		}
-		/*
-		 * It's fine to release lock here, even if hash table
-		 * grows while we are preempted.
-		 */
-		write_unlock_bh(&tbl->lock);
-		cond_resched();
-		write_lock_bh(&tbl->lock);
-	}
 	/* Cycle through all hash buckets every base_reachable_time/2 ticks.
 	 * ARP entry timeouts range from 1/2 base_reachable_time to 3/2
-	 * base_reachable_time.
+	 * base_reachable_time.  The runs needed for one cycle are spread
+	 * evenly over that period.
 	 */
-	schedule_delayed_work(&tbl->gc_work,
-			      tbl->parms.base_reachable_time >> 1);
-	write_unlock_bh(&tbl->lock);
+	delay = (tbl->parms.base_reachable_time >> 1) /
+		DIV_ROUND_UP(size, NEIGH_GC_BUCKETS);
+	schedule_delayed_work(&tbl->gc_work, max(delay, 1UL));
+	read_unlock_bh(&tbl->lock);
 }
 
 static __inline__ int neigh_max_probes(struct neighbour *n)
@@ -1467,6 +1536,33 @@ static void neigh_parms_destroy(struct neigh_parms *parms)
 
 static struct lock_class_key neigh_table_proxy_queue_class;
 
+static int neigh_hash_locks_alloc(struct neigh_table *tbl)
+{
+	unsigned int i, size = 256;
+#if defined(CONFIG_PROVE_LOCKING)
+	unsigned int nr_pcpus = 2;
+#else
+	unsigned int nr_pcpus = num_possible_cpus();
+#endif
+
+	if (nr_pcpus >= 4)
+		size = 512;
+	if (nr_pcpus >= 8)
+		size = 1024;
+	if (nr_pcpus >= 16)
+		size = 2048;
+	if (nr_pcpus >= 32)
+		size = 4096;
+
+	tbl->hash_locks = kmalloc(size * sizeof(spinlock_t), GFP_KERNEL);
+	if (!tbl->hash_locks)
+		return -ENOMEM;
+	for (i = 0; i < size; i++)
+		spin_lock_init(&tbl->hash_locks[i]);
+	tbl->hash_locks_mask = size - 1;
+	return 0;
+}
+
 void neigh_table_init_no_netlink(struct neigh_table *tbl)
 {
 	unsigned long now = jiffies;
@@ -1500,6 +1596,9 @@ void neigh_table_init_no_netlink(struct neigh_table *tbl)
 	if (!tbl->nht || !tbl->phash_buckets)
 		panic("cannot allocate neighbour cache hashes");
 
+	if (neigh_hash_locks_alloc(tbl))
+		panic("cannot allocate neighbour cache hash locks");
+
 	rwlock_init(&tbl->lock);
 	INIT_DELAYED_WORK_DEFERRABLE(&tbl->gc_work, neigh_periodic_work);
 	schedule_delayed_work(&tbl->gc_work, tbl->parms.reachable_time);
@@ -1561,6 +1660,9 @@ int neigh_table_clear(struct neigh_table *tbl)
 	kfree(tbl->phash_buckets);
 	tbl->phash_buckets = NULL;
 
+	kfree(tbl->hash_locks);
+	tbl->hash_locks = NULL;
+
 	remove_proc_entry(tbl->id, init_net.proc_net_stat);
 
 	free_percpu(tbl->stats);
@@ -1835,6 +1937,8 @@ static int neightbl_fill_info(struct sk_buff *skb, struct neigh_table *tbl,
 			ndst.ndts_rcv_probes_ucast	+= st->rcv_probes_ucast;
 			ndst.ndts_periodic_gc_runs	+= st->periodic_gc_runs;
 			ndst.ndts_forced_gc_runs	+= st->forced_gc_runs;
+			ndst.ndts_gc_buckets		+= st->gc_buckets;
+			ndst.ndts_gc_reclaimed		+= st->gc_reclaimed;
 		}
 
 		NLA_PUT(skb, NDTA_STATS, sizeof(ndst), &ndst);
@@ -2536,12 +2640,12 @@ static int neigh_stat_seq_show(struct seq_file *seq, void *v)
 	struct neigh_statistics *st = v;
 
 	if (v == SEQ_START_TOKEN) {
-		seq_printf(seq, "entries  allocs destroys hash_grows  lookups hits  res_failed  rcv_probes_mcast rcv_probes_ucast  periodic_gc_runs forced_gc_runs unresolved_discards\n");
+		seq_printf(seq, "entries  allocs destroys hash_grows  lookups hits  res_failed  rcv_probes_mcast rcv_probes_ucast  periodic_gc_runs forced_gc_runs unresolved_discards gc_buckets gc_reclaimed\n");
 		return 0;
 	}
 
 	seq_printf(seq, "%08x  %08lx %08lx %08lx  %08lx %08lx  %08lx  "
-			"%08lx %08lx  %08lx %08lx %08lx\n",
+			"%08lx %08lx  %08lx %08lx %08lx %08lx %08lx\n",
 		   atomic_read(&tbl->entries),
 
 		   st->allocs,
@@ -2558,7 +2662,9 @@ static int neigh_stat_seq_show(struct seq_file *seq, void *v)
 
 		   st->periodic_gc_runs,
 		   st->forced_gc_runs,
-		   st->unres_discards
+		   st->unres_discards,
+		   st->gc_buckets,
+		   st->gc_reclaimed
 		   );
 
 	return 0;
@@ -197,6 +197,7 @@
 #define F_QUEUE_MAP_RND (1<<13)	/* queue map Random */
 #define F_QUEUE_MAP_CPU (1<<14)	/* queue map mirrors smp_processor_id() */
 #define F_NODE          (1<<15)	/* Node memory alloc*/
+#define F_QUEUE_XMIT    (1<<16)	/* send through the qdisc */
 
 /* Thread control flag bits */
 #define T_STOP        (1<<0)	/* Stop run */
@@ -674,6 +675,9 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 	if (pkt_dev->flags & F_NODE)
 		seq_printf(seq, "NODE_ALLOC  ");
 
+	if (pkt_dev->flags & F_QUEUE_XMIT)
+		seq_printf(seq, "QUEUE_XMIT  ");
+
 	seq_puts(seq, "\n");
 
 	/* not really stopped, more like last-running-at */
@@ -1071,7 +1075,8 @@ static ssize_t pktgen_if_write(struct file *file,
 		if (len < 0)
 			return len;
 		if ((value > 0) &&
-		    (!(pkt_dev->odev->priv_flags & IFF_TX_SKB_SHARING)))
+		    ((pkt_dev->flags & F_QUEUE_XMIT) ||
+		     !(pkt_dev->odev->priv_flags & IFF_TX_SKB_SHARING)))
 			return -ENOTSUPP;
 		i += len;
 		pkt_dev->clone_skb = value;
@@ -1235,12 +1240,21 @@ static ssize_t pktgen_if_write(struct file *file,
 		else if (strcmp(f, "!NODE_ALLOC") == 0)
 			pkt_dev->flags &= ~F_NODE;
 
+		else if (strcmp(f, "QUEUE_XMIT") == 0) {
+			/* a queued skb can't be sent again */
+			pkt_dev->flags |= F_QUEUE_XMIT;
+			pkt_dev->clone_skb = 0;
+		}
+
+		else if (strcmp(f, "!QUEUE_XMIT") == 0)
+			pkt_dev->flags &= ~F_QUEUE_XMIT;
+
 		else {
 			sprintf(pg_result,
 				"Flag -:%s:- unknown\nAvailable flags, (prepend ! to un-set flag):\n%s",
 				f,
 				"IPSRC_RND, IPDST_RND, UDPSRC_RND, UDPDST_RND, "
-				"MACSRC_RND, MACDST_RND, TXSIZE_RND, IPV6, MPLS_RND, VID_RND, SVID_RND, FLOW_SEQ, IPSEC, NODE_ALLOC\n");
+				"MACSRC_RND, MACDST_RND, TXSIZE_RND, IPV6, MPLS_RND, VID_RND, SVID_RND, FLOW_SEQ, IPSEC, NODE_ALLOC, QUEUE_XMIT\n");
 			return count;
 		}
 		sprintf(pg_result, "OK: flags=0x%x", pkt_dev->flags);
@@ -3296,6 +3310,42 @@ static void pktgen_wait_for_skb(struct pktgen_dev *pkt_dev)
 	pkt_dev->idle_acc += ktime_to_ns(ktime_sub(ktime_now(), idle_start));
 }
 
+/*
+ * Send through dev_queue_xmit(), qdisc and all, the way a socket would.
+ * The stack picks the tx queue, so with XPS set up one pktgen thread per
+ * cpu drives every queue of the device, and the root qdisc along with it.
+ */
+static void pktgen_queue_xmit(struct pktgen_dev *pkt_dev)
+{
+	int ret;
+
+	atomic_inc(&(pkt_dev->skb->users));
+	local_bh_disable();
+	ret = dev_queue_xmit(pkt_dev->skb);
+	local_bh_enable();
+
+	/* never resend: the skb may still sit in the qdisc */
+	pkt_dev->last_ok = 1;
+
+	switch (ret) {
+	case NET_XMIT_SUCCESS:
+		pkt_dev->sofar++;
+		pkt_dev->seq_num++;
+		pkt_dev->tx_bytes += pkt_dev->last_pkt_size;
+		break;
+	case NET_XMIT_DROP:
+	case NET_XMIT_CN:
+	case NET_XMIT_POLICED:
+		/* skb has been consumed */
+		pkt_dev->errors++;
+		break;
+	default: /* device down, or no queue and the driver was busy */
+		if (net_ratelimit())
+			pr_info("%s xmit error: %d\n", pkt_dev->odevname, ret);
+		pkt_dev->errors++;
+	}
+}
+
 static void pktgen_xmit(struct pktgen_dev *pkt_dev)
 {
 	struct net_device *odev = pkt_dev->odev;
@@ -3340,6 +3390,11 @@ static void pktgen_xmit(struct pktgen_dev *pkt_dev)
 	if (pkt_dev->delay && pkt_dev->last_ok)
 		spin(pkt_dev, pkt_dev->next_tx);
 
+	if (pkt_dev->flags & F_QUEUE_XMIT) {
+		pktgen_queue_xmit(pkt_dev);
+		goto out;
+	}
+
 	queue_map = skb_get_queue_mapping(pkt_dev->skb);
 	txq = netdev_get_tx_queue(odev, queue_map);
 
@@ -3380,7 +3435,7 @@ static void pktgen_xmit(struct pktgen_dev *pkt_dev)
 	}
 unlock:
 	__netif_tx_unlock_bh(txq);
-
+out:
 	/* If pkt_dev->count is zero, then run forever */
 	if ((pkt_dev->count != 0) && (pkt_dev->sofar >= pkt_dev->count)) {
 		pktgen_wait_for_skb(pkt_dev);
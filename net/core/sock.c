@@ -132,6 +132,7 @@
 
 #ifdef CONFIG_INET
 #include <net/tcp.h>
+#include <net/busy_poll.h>
 #endif
 
 /*
@@ -516,6 +517,13 @@ int sock_setsockopt(struct socket *sock, int level, int optname,
 	case SO_REUSEADDR:
 		sk->sk_reuse = valbool;
 		break;
+	case SO_REUSEPORT:
+		/* the IPv6 lookups and bind conflict checks don't know it */
+		if (valbool && sk->sk_family == AF_INET6)
+			ret = -EOPNOTSUPP;
+		else
+			sk->sk_reuseport = valbool;
+		break;
 	case SO_TYPE:
 	case SO_PROTOCOL:
 	case SO_DOMAIN:
@@ -740,6 +748,18 @@ set_rcvbuf:
 	case SO_RXQ_OVFL:
 		sock_valbool_flag(sk, SOCK_RXQ_OVFL, valbool);
 		break;
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	case SO_BUSY_POLL:
+		/* allow unprivileged users to decrease the value */
+		if ((val > sk->sk_ll_usec) && !capable(CAP_NET_ADMIN))
+			ret = -EPERM;
+		else if (val < 0)
+			ret = -EINVAL;
+		else
+			sk->sk_ll_usec = val;
+		break;
+#endif
 	default:
 		ret = -ENOPROTOOPT;
 		break;
@@ -810,6 +830,10 @@ int sock_getsockopt(struct socket *sock, int level, int optname,
 		v.val = sk->sk_reuse;
 		break;
 
+	case SO_REUSEPORT:
+		v.val = sk->sk_reuseport;
+		break;
+
 	case SO_KEEPALIVE:
 		v.val = !!sock_flag(sk, SOCK_KEEPOPEN);
 		break;
@@ -961,6 +985,25 @@ int sock_getsockopt(struct socket *sock, int level, int optname,
 		v.val = !!sock_flag(sk, SOCK_RXQ_OVFL);
 		break;
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	case SO_BUSY_POLL:
+		v.val = sk->sk_ll_usec;
+		break;
+
+	case SO_BUSY_POLL_STATS:
+	{
+		struct sock_busy_poll_stats st;
+
+		if (len > sizeof(st))
+			len = sizeof(st);
+		st.polls = sk->sk_ll_polls;
+		st.hits = sk->sk_ll_hits;
+		if (copy_to_user(optval, &st, len))
+			return -EFAULT;
+		goto lenout;
+	}
+#endif
+
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -1265,6 +1308,10 @@ struct sock *sk_clone(const struct sock *sk, const gfp_t priority)
 
 		newsk->sk_err	   = 0;
 		newsk->sk_priority = 0;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+		newsk->sk_ll_polls = 0;
+		newsk->sk_ll_hits  = 0;
+#endif
 		/*
 		 * Before updating sk_refcnt, we must commit prior changes to memory
 		 * (Documentation/RCU/rculist_nulls.txt for details)
@@ -2018,6 +2065,13 @@ void sock_init_data(struct socket *sock, struct sock *sk)
 
 	sk->sk_stamp = ktime_set(-1L, 0);
 
+	sk->sk_pacing_rate = ~0U;
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	sk->sk_napi_id		=	0;
+	sk->sk_ll_usec		=	sysctl_net_busy_read;
+#endif
+
 	/*
 	 * Before updating sk_refcnt, we must commit prior changes to memory
 	 * (Documentation/RCU/rculist_nulls.txt for details)
@@ -2054,6 +2108,10 @@ void release_sock(struct sock *sk)
 	spin_lock_bh(&sk->sk_lock.slock);
 	if (sk->sk_backlog.tail)
 		__release_sock(sk);
+
+	if (sk->sk_prot->release_cb)
+		sk->sk_prot->release_cb(sk);
+
 	sk->sk_lock.owned = 0;
 	if (waitqueue_active(&sk->sk_lock.wq))
 		wake_up(&sk->sk_lock.wq);
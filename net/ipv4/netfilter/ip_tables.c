@@ -24,8 +24,12 @@
 #include <linux/proc_fs.h>
 #include <linux/err.h>
 #include <linux/cpumask.h>
+#include <linux/sort.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 
 #include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/xt_tcpudp.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <net/netfilter/nf_log.h>
 #include "../../netfilter/xt_repldata.h"
@@ -284,6 +288,696 @@ struct ipt_entry *ipt_next_entry(const struct ipt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+/*
+ * Rule classifier.
+ *
+ * In a big table most rules fail because they select some other address,
+ * interface, protocol or port.  When the table is loaded, every rule is
+ * indexed on each such field (a dimension) by the prefix of it that the
+ * rule requires.  Exact matches, like the protocol, are prefixes of full
+ * length; ports are indexed when a rule's first match is a plain "tcp" or
+ * "udp" port.  Rules that take any value of the field, or only exclude
+ * one, go on the wildcard list of the dimension.  Rules that can never
+ * match on it go nowhere.
+ *
+ * The prefixes of a dimension form a containment tree.  Looking a packet
+ * up in the sorted boundaries of the ranges they cover gives the longest
+ * prefix it matches.  Its rules, those of its ancestors and the wildcard
+ * list are the candidates of that dimension, each list sorted by offset.
+ *
+ * ipt_do_table() steps from one rule straight to the next offset that is
+ * a candidate in every dimension the classifier uses, i.e. it intersects
+ * the per-dimension sets lazily.  Skipping a rule that cannot match is
+ * exactly what the linear walk does with it, so verdicts, counters and
+ * jumps are unchanged.
+ */
+#define IPT_CLS_MAX_DIMS	3	/* dimensions intersected per packet */
+#define IPT_CLS_MAX_DEPTH	4	/* nested prefixes kept per dimension */
+#define IPT_CLS_NONE		UINT_MAX
+#define IPT_CLS_ANY		-1
+#define IPT_CLS_NEVER		-2
+
+enum ipt_cls_field {
+	IPT_CLS_SRC,
+	IPT_CLS_DST,
+	IPT_CLS_IN,
+	IPT_CLS_OUT,
+	IPT_CLS_PROTO,
+	IPT_CLS_SPORT,
+	IPT_CLS_DPORT,
+	IPT_CLS_NFIELDS
+};
+
+/* Width of each field in bits; ports are keyed together with the protocol. */
+static const unsigned int ipt_cls_width[IPT_CLS_NFIELDS] = {
+	[IPT_CLS_SRC]	= 32,
+	[IPT_CLS_DST]	= 32,
+	[IPT_CLS_IN]	= IFNAMSIZ * 8,
+	[IPT_CLS_OUT]	= IFNAMSIZ * 8,
+	[IPT_CLS_PROTO]	= 8,
+	[IPT_CLS_SPORT]	= 24,
+	[IPT_CLS_DPORT]	= 24,
+};
+
+/* Big endian, so that memcmp() orders keys like the values they hold. */
+struct ipt_cls_key {
+	u8 b[IFNAMSIZ];
+};
+
+struct ipt_cls_node {
+	struct ipt_cls_key	key;		/* masked to plen bits */
+	unsigned int		plen;
+	int			parent;		/* enclosing node, or -1 */
+	unsigned int		depth;
+	unsigned int		n;
+	u32			*offs;		/* rule offsets, ascending */
+};
+
+/* Keys from here up to the next point fall into node (-1: none). */
+struct ipt_cls_point {
+	struct ipt_cls_key	key;
+	int			node;
+};
+
+struct ipt_cls_dim {
+	enum ipt_cls_field	field;
+	unsigned int		nnodes, npoints, nwild;
+	struct ipt_cls_node	*nodes;
+	struct ipt_cls_point	*points;
+	u32			*offs;		/* storage for nodes[].offs */
+	u32			*wild;		/* rule offsets, ascending */
+};
+
+struct ipt_cls {
+	unsigned int		ndims;
+	struct ipt_cls_dim	*dim[IPT_CLS_MAX_DIMS];
+};
+
+/* The candidate lists of one packet, with a merge position in each. */
+struct ipt_cls_cursor {
+	unsigned int		ndims;
+	struct ipt_cls_lists {
+		unsigned int	n;
+		const u32	*v[IPT_CLS_MAX_DEPTH + 1];
+		unsigned int	len[IPT_CLS_MAX_DEPTH + 1];
+		unsigned int	pos[IPT_CLS_MAX_DEPTH + 1];
+	} d[IPT_CLS_MAX_DIMS];
+};
+
+static unsigned int classify_min_rules __read_mostly = 64;
+module_param(classify_min_rules, uint, 0644);
+MODULE_PARM_DESC(classify_min_rules,
+		 "Smallest table to build a rule classifier for (0 disables)");
+
+/*
+ * Returns false when the field is not known for this packet, in which
+ * case every rule is a candidate in that dimension.  Ports are only known
+ * where the tcp and udp matches would read them without hotdropping.
+ */
+static bool
+ipt_cls_packet_key(enum ipt_cls_field field, const struct sk_buff *skb,
+		   const struct iphdr *ip, const char *indev,
+		   const char *outdev, const struct xt_action_param *par,
+		   struct ipt_cls_key *key)
+{
+	struct tcphdr _th;
+	const __be16 *ports;
+	unsigned int size;
+
+	memset(key, 0, sizeof(*key));
+	switch (field) {
+	case IPT_CLS_SRC:
+		memcpy(key->b, &ip->saddr, sizeof(ip->saddr));
+		break;
+	case IPT_CLS_DST:
+		memcpy(key->b, &ip->daddr, sizeof(ip->daddr));
+		break;
+	case IPT_CLS_IN:
+		memcpy(key->b, indev, IFNAMSIZ);
+		break;
+	case IPT_CLS_OUT:
+		memcpy(key->b, outdev, IFNAMSIZ);
+		break;
+	case IPT_CLS_PROTO:
+		key->b[0] = ip->protocol;
+		break;
+	case IPT_CLS_SPORT:
+	case IPT_CLS_DPORT:
+		key->b[0] = ip->protocol;
+		if (ip->protocol == IPPROTO_TCP)
+			size = sizeof(struct tcphdr);
+		else if (ip->protocol == IPPROTO_UDP)
+			size = sizeof(struct udphdr);
+		else
+			break;		/* no port rule can match */
+		if (par->fragoff != 0)
+			return false;
+		ports = skb_header_pointer(skb, par->thoff, size, &_th);
+		if (ports == NULL)
+			return false;
+		memcpy(&key->b[1], &ports[field == IPT_CLS_DPORT], 2);
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+/* Number of leading one bits of the @len byte mask, or -1 if not a prefix. */
+static int ipt_cls_prefix_len(const u8 *mask, unsigned int len)
+{
+	unsigned int i, plen = 0;
+
+	for (i = 0; i < len && mask[i] == 0xff; i++)
+		plen += 8;
+	if (i < len) {
+		u8 m = mask[i++];
+
+		while (m & 0x80) {
+			m <<= 1;
+			plen++;
+		}
+		if (m)
+			return -1;
+	}
+	for (; i < len; i++)
+		if (mask[i])
+			return -1;
+	return plen;
+}
+
+/*
+ * Fills in the prefix @e requires of @field and returns its length, or
+ * IPT_CLS_ANY if it takes any value, or IPT_CLS_NEVER if none.
+ */
+static int
+ipt_cls_rule_key(const struct ipt_entry *e, enum ipt_cls_field field,
+		 struct ipt_cls_key *key)
+{
+	const struct ipt_ip *ip = &e->ip;
+	const struct xt_entry_match *m;
+	const __be32 *addr, *msk;
+	const char *iface;
+	const unsigned char *iface_mask;
+	const u16 *pts;
+	u16 port;
+	u8 proto, inv;
+	int plen, i;
+
+	memset(key, 0, sizeof(*key));
+	switch (field) {
+	case IPT_CLS_SRC:
+	case IPT_CLS_DST:
+		if (ip->invflags & (field == IPT_CLS_SRC ? IPT_INV_SRCIP :
+							  IPT_INV_DSTIP))
+			return IPT_CLS_ANY;
+		addr = field == IPT_CLS_SRC ? &ip->src.s_addr :
+					      &ip->dst.s_addr;
+		msk = field == IPT_CLS_SRC ? &ip->smsk.s_addr :
+					     &ip->dmsk.s_addr;
+		/* compared unmasked by ip_packet_match() */
+		if (*addr & ~*msk)
+			return IPT_CLS_NEVER;
+		plen = ipt_cls_prefix_len((const u8 *)msk, sizeof(*msk));
+		if (plen <= 0)
+			return IPT_CLS_ANY;
+		memcpy(key->b, addr, sizeof(*addr));
+		return plen;
+	case IPT_CLS_IN:
+	case IPT_CLS_OUT:
+		if (ip->invflags & (field == IPT_CLS_IN ? IPT_INV_VIA_IN :
+							 IPT_INV_VIA_OUT))
+			return IPT_CLS_ANY;
+		iface = field == IPT_CLS_IN ? ip->iniface : ip->outiface;
+		iface_mask = field == IPT_CLS_IN ? ip->iniface_mask :
+						   ip->outiface_mask;
+		plen = ipt_cls_prefix_len(iface_mask, IFNAMSIZ);
+		if (plen <= 0)
+			return IPT_CLS_ANY;
+		for (i = 0; i < IFNAMSIZ; i++)
+			key->b[i] = iface[i] & iface_mask[i];
+		return plen;
+	case IPT_CLS_PROTO:
+		if (ip->proto == 0 || (ip->invflags & IPT_INV_PROTO))
+			return IPT_CLS_ANY;
+		key->b[0] = ip->proto;
+		return 8;
+	case IPT_CLS_SPORT:
+	case IPT_CLS_DPORT:
+		/* only the first match runs before any with side effects */
+		if (e->target_offset == sizeof(struct ipt_entry))
+			return IPT_CLS_ANY;
+		m = (const void *)e->elems;
+		if (m->u.kernel.match->revision != 0)
+			return IPT_CLS_ANY;
+		if (strcmp(m->u.kernel.match->name, "tcp") == 0) {
+			const struct xt_tcp *tcp = (const void *)m->data;
+
+			pts = field == IPT_CLS_SPORT ? tcp->spts : tcp->dpts;
+			inv = tcp->invflags & (field == IPT_CLS_SPORT ?
+					       XT_TCP_INV_SRCPT :
+					       XT_TCP_INV_DSTPT);
+			proto = IPPROTO_TCP;
+		} else if (strcmp(m->u.kernel.match->name, "udp") == 0) {
+			const struct xt_udp *udp = (const void *)m->data;
+
+			pts = field == IPT_CLS_SPORT ? udp->spts : udp->dpts;
+			inv = udp->invflags & (field == IPT_CLS_SPORT ?
+					       XT_UDP_INV_SRCPT :
+					       XT_UDP_INV_DSTPT);
+			proto = IPPROTO_UDP;
+		} else {
+			return IPT_CLS_ANY;
+		}
+		if (inv || pts[0] != pts[1])
+			return IPT_CLS_ANY;
+		port = pts[0];
+		key->b[0] = proto;
+		key->b[1] = port >> 8;
+		key->b[2] = port & 0xff;
+		return 24;
+	default:
+		return IPT_CLS_ANY;
+	}
+}
+
+/* Whether the first @plen bits of @a and @b are equal. */
+static bool ipt_cls_prefix_eq(const struct ipt_cls_key *a,
+			      const struct ipt_cls_key *b, unsigned int plen)
+{
+	unsigned int bytes = plen / 8, bits = plen % 8;
+
+	if (memcmp(a->b, b->b, bytes))
+		return false;
+	return !bits || !((a->b[bytes] ^ b->b[bytes]) & (0xff00 >> bits));
+}
+
+/*
+ * Sets @key to the first key after the range of @node, within @width
+ * bits; false if the range extends to the end of the field.
+ */
+static bool ipt_cls_range_next(const struct ipt_cls_node *node,
+			       unsigned int width, struct ipt_cls_key *key)
+{
+	int i;
+
+	*key = node->key;
+	for (i = node->plen; i < width; i++)
+		key->b[i / 8] |= 0x80 >> (i % 8);
+	for (i = width / 8 - 1; i >= 0; i--)
+		if (++key->b[i])
+			return true;
+	return false;
+}
+
+static void *ipt_cls_alloc(size_t size)
+{
+	if (size <= PAGE_SIZE)
+		return kzalloc(size, GFP_KERNEL);
+	return vzalloc(size);
+}
+
+static void ipt_cls_kvfree(void *p)
+{
+	if (is_vmalloc_addr(p))
+		vfree(p);
+	else
+		kfree(p);
+}
+
+static void ipt_cls_free_dim(struct ipt_cls_dim *dim)
+{
+	if (dim == NULL)
+		return;
+	ipt_cls_kvfree(dim->nodes);
+	ipt_cls_kvfree(dim->points);
+	ipt_cls_kvfree(dim->offs);
+	ipt_cls_kvfree(dim->wild);
+	kfree(dim);
+}
+
+static void ipt_cls_free(struct ipt_cls *cls)
+{
+	unsigned int i;
+
+	if (cls == NULL)
+		return;
+	for (i = 0; i < cls->ndims; i++)
+		ipt_cls_free_dim(cls->dim[i]);
+	kfree(cls);
+}
+
+struct ipt_cls_rule {
+	struct ipt_cls_key	key;
+	unsigned int		plen;
+	u32			off;
+};
+
+static int ipt_cls_rule_cmp(const void *a, const void *b)
+{
+	const struct ipt_cls_rule *ra = a, *rb = b;
+	int ret = memcmp(ra->key.b, rb->key.b, sizeof(ra->key.b));
+
+	if (ret)
+		return ret;
+	if (ra->plen != rb->plen)
+		return ra->plen < rb->plen ? -1 : 1;
+	return ra->off < rb->off ? -1 : ra->off > rb->off;
+}
+
+static int ipt_cls_off_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void ipt_cls_point(struct ipt_cls_dim *dim,
+			  const struct ipt_cls_key *key, int node)
+{
+	struct ipt_cls_point *p = dim->points + dim->npoints;
+
+	if (dim->npoints == 0 ||
+	    memcmp(p[-1].key.b, key->b, sizeof(key->b)) != 0) {
+		p->key = *key;
+		dim->npoints++;
+	}
+	p = dim->points + dim->npoints - 1;
+	p->node = node;
+}
+
+/* Closes the range of the innermost open node, see ipt_cls_link(). */
+static void ipt_cls_pop(struct ipt_cls_dim *dim, int *stack,
+			unsigned int *sp)
+{
+	struct ipt_cls_key next;
+	int top = stack[--*sp];
+
+	if (ipt_cls_range_next(&dim->nodes[top], ipt_cls_width[dim->field],
+			       &next))
+		ipt_cls_point(dim, &next, *sp ? stack[*sp - 1] : -1);
+}
+
+/*
+ * Links every node to the one enclosing it and lays the ranges out as
+ * points.  Nodes come sorted by key and then length, so parents come
+ * before their children.  Nodes nested deeper than IPT_CLS_MAX_DEPTH hand
+ * their rules to the wildcard list; returns how many that were.
+ */
+static unsigned int ipt_cls_link(struct ipt_cls_dim *dim)
+{
+	int stack[IPT_CLS_MAX_DEPTH];
+	unsigned int i, sp = 0, demoted = 0;
+
+	for (i = 0; i < dim->nnodes; i++) {
+		struct ipt_cls_node *node = &dim->nodes[i];
+
+		while (sp && !ipt_cls_prefix_eq(&dim->nodes[stack[sp - 1]].key,
+						&node->key,
+						dim->nodes[stack[sp - 1]].plen))
+			ipt_cls_pop(dim, stack, &sp);
+
+		node->parent = sp ? stack[sp - 1] : -1;
+		node->depth = sp + 1;
+		if (node->depth > IPT_CLS_MAX_DEPTH) {
+			memcpy(dim->wild + dim->nwild, node->offs,
+			       node->n * sizeof(u32));
+			dim->nwild += node->n;
+			demoted += node->n;
+			node->n = 0;
+			continue;
+		}
+		ipt_cls_point(dim, &node->key, i);
+		stack[sp++] = i;
+	}
+	while (sp)
+		ipt_cls_pop(dim, stack, &sp);
+	return demoted;
+}
+
+/*
+ * Builds the index of @field.  *cost is set to the number of rules a
+ * packet can be expected to look at in this dimension: the wildcard list
+ * plus the size of the node an indexed rule typically shares.
+ */
+static struct ipt_cls_dim *
+ipt_cls_build_dim(const struct xt_table_info *info, const void *entry0,
+		  struct ipt_cls_rule *rules, enum ipt_cls_field field,
+		  unsigned int *cost)
+{
+	const struct ipt_entry *iter;
+	struct ipt_cls_dim *dim;
+	struct ipt_cls_key key;
+	unsigned int i, n = 0, npinned;
+	u64 sumsq = 0;
+	int plen;
+
+	dim = kzalloc(sizeof(*dim), GFP_KERNEL);
+	if (dim == NULL)
+		return NULL;
+	dim->field = field;
+	dim->wild = ipt_cls_alloc(info->number * sizeof(u32));
+	if (dim->wild == NULL)
+		goto err;
+
+	xt_entry_foreach(iter, entry0, info->size) {
+		u32 off = (void *)iter - entry0;
+
+		plen = ipt_cls_rule_key(iter, field, &key);
+		if (plen == IPT_CLS_ANY) {
+			dim->wild[dim->nwild++] = off;
+		} else if (plen != IPT_CLS_NEVER) {
+			rules[n].key = key;
+			rules[n].plen = plen;
+			rules[n++].off = off;
+		}
+	}
+	sort(rules, n, sizeof(*rules), ipt_cls_rule_cmp, NULL);
+
+	dim->offs = ipt_cls_alloc(max(n, 1U) * sizeof(u32));
+	dim->nodes = ipt_cls_alloc(max(n, 1U) * sizeof(*dim->nodes));
+	dim->points = ipt_cls_alloc((2 * n + 1) * sizeof(*dim->points));
+	if (!dim->offs || !dim->nodes || !dim->points)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		struct ipt_cls_node *node = dim->nodes + dim->nnodes;
+
+		if (dim->nnodes == 0 || node[-1].plen != rules[i].plen ||
+		    memcmp(node[-1].key.b, rules[i].key.b, sizeof(key.b))) {
+			dim->nnodes++;
+			node->key = rules[i].key;
+			node->plen = rules[i].plen;
+			node->offs = dim->offs + i;
+		} else {
+			node--;
+		}
+		node->offs[node->n++] = rules[i].off;
+	}
+
+	npinned = n - ipt_cls_link(dim);
+	sort(dim->wild, dim->nwild, sizeof(u32), ipt_cls_off_cmp, NULL);
+
+	for (i = 0; i < dim->nnodes; i++)
+		sumsq += (u64)dim->nodes[i].n * dim->nodes[i].n;
+	*cost = dim->nwild;
+	if (npinned)
+		*cost += div_u64(sumsq, npinned);
+	return dim;
+
+err:
+	ipt_cls_free_dim(dim);
+	return NULL;
+}
+
+/*
+ * Returns the classifier for the table at @entry0, or NULL when the table
+ * is small or no field narrows the search enough to be worth it.  Up to
+ * IPT_CLS_MAX_DIMS of the most selective fields are used, best first.
+ */
+static struct ipt_cls *
+ipt_cls_build(const struct xt_table_info *info, const void *entry0)
+{
+	struct ipt_cls_dim *best[IPT_CLS_MAX_DIMS + 1], *dim;
+	unsigned int cost[IPT_CLS_MAX_DIMS + 1], c, i, n = 0;
+	struct ipt_cls_rule *rules;
+	struct ipt_cls *cls = NULL;
+	enum ipt_cls_field field;
+
+	if (classify_min_rules == 0 || info->number < classify_min_rules)
+		return NULL;
+
+	rules = ipt_cls_alloc(info->number * sizeof(*rules));
+	if (rules == NULL)
+		return NULL;
+
+	for (field = 0; field < IPT_CLS_NFIELDS; field++) {
+		dim = ipt_cls_build_dim(info, entry0, rules, field, &c);
+		if (dim == NULL)
+			continue;
+		/* a further dimension pays if it drops a quarter of rules */
+		if (c >= info->number - info->number / 4) {
+			ipt_cls_free_dim(dim);
+			continue;
+		}
+
+		/* insertion sort by cost, dropping the worst */
+		for (i = n; i > 0 && cost[i - 1] > c; i--) {
+			best[i] = best[i - 1];
+			cost[i] = cost[i - 1];
+		}
+		best[i] = dim;
+		cost[i] = c;
+		if (n < IPT_CLS_MAX_DIMS)
+			n++;
+		else
+			ipt_cls_free_dim(best[IPT_CLS_MAX_DIMS]);
+	}
+	ipt_cls_kvfree(rules);
+
+	/* the best one has to halve the work at least */
+	if (n && cost[0] < info->number / 2)
+		cls = kzalloc(sizeof(*cls), GFP_KERNEL);
+	if (cls == NULL) {
+		for (i = 0; i < n; i++)
+			ipt_cls_free_dim(best[i]);
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		duprintf("classifier: field %u, %u rules, ~%u per packet\n",
+			 best[i]->field, info->number, cost[i]);
+		cls->dim[i] = best[i];
+	}
+	cls->ndims = n;
+	return cls;
+}
+
+/* Performance critical - once per packet and table */
+static void
+ipt_cls_lookup(const struct ipt_cls *cls, struct ipt_cls_cursor *c,
+	       const struct sk_buff *skb, const struct iphdr *ip,
+	       const char *indev, const char *outdev,
+	       const struct xt_action_param *par)
+{
+	const struct ipt_cls_point *points;
+	const struct ipt_cls_dim *dim;
+	struct ipt_cls_lists *l;
+	struct ipt_cls_key key;
+	unsigned int i, lo, hi, mid;
+	int node;
+
+	c->ndims = 0;
+	for (i = 0; i < cls->ndims; i++) {
+		dim = cls->dim[i];
+		if (!ipt_cls_packet_key(dim->field, skb, ip, indev, outdev,
+					par, &key))
+			continue;
+
+		l = &c->d[c->ndims++];
+		l->n = 0;
+		if (dim->nwild) {
+			l->v[l->n] = dim->wild;
+			l->len[l->n] = dim->nwild;
+			l->pos[l->n++] = 0;
+		}
+
+		/* the last point at or below key */
+		points = dim->points;
+		lo = 0;
+		hi = dim->npoints;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (memcmp(points[mid].key.b, key.b,
+				   sizeof(key.b)) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		node = lo ? points[lo - 1].node : -1;
+		for (; node >= 0; node = dim->nodes[node].parent) {
+			l->v[l->n] = dim->nodes[node].offs;
+			l->len[l->n] = dim->nodes[node].n;
+			l->pos[l->n++] = 0;
+		}
+	}
+}
+
+/*
+ * Returns the first candidate of one dimension at or after @off.
+ * Traversal mostly moves forward, so each list remembers where the last
+ * search ended; jumps and returns just search a different part of it.
+ */
+static unsigned int ipt_cls_next_in(struct ipt_cls_lists *l, u32 off)
+{
+	unsigned int i, lo, hi, mid, next = IPT_CLS_NONE;
+
+	for (i = 0; i < l->n; i++) {
+		const u32 *v = l->v[i];
+
+		lo = l->pos[i];
+		hi = l->len[i];
+		if (lo > 0 && v[lo - 1] >= off) {
+			hi = lo;
+			lo = 0;
+		}
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (v[mid] < off)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		l->pos[i] = lo;
+		if (lo < l->len[i] && v[lo] < next)
+			next = v[lo];
+	}
+	return next;
+}
+
+/*
+ * Returns the first offset at or after @off that is a candidate in every
+ * dimension, by moving @off up to the next candidate of each dimension in
+ * turn until all of them agree on it.
+ */
+static unsigned int ipt_cls_next(struct ipt_cls_cursor *c, u32 off)
+{
+	unsigned int d = 0, agree = 0, next;
+
+	while (agree < c->ndims) {
+		next = ipt_cls_next_in(&c->d[d], off);
+		if (next == IPT_CLS_NONE)
+			return next;
+		if (next == off) {
+			agree++;
+		} else {
+			off = next;
+			agree = 1;
+		}
+		if (++d == c->ndims)
+			d = 0;
+	}
+	return off;
+}
+
+/* Performance critical - once per rule actually looked at */
+static inline struct ipt_entry *
+ipt_cls_skip(struct ipt_cls_cursor *c, const void *base, struct ipt_entry *e)
+{
+	unsigned int next = ipt_cls_next(c, (void *)e - base);
+
+	/* Nothing left to match: let the linear walk have it. */
+	if (next == IPT_CLS_NONE)
+		return e;
+	return (struct ipt_entry *)(base + next);
+}
+
+static void ipt_free_table_info(struct xt_table_info *info)
+{
+	ipt_cls_free(info->classifier);
+	xt_free_table_info(info);
+}
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ipt_do_table(struct sk_buff *skb,
@@ -301,6 +995,8 @@ ipt_do_table(struct sk_buff *skb,
 	struct ipt_entry *e, **jumpstack;
 	unsigned int *stackptr, origptr, cpu;
 	const struct xt_table_info *private;
+	const struct ipt_cls *cls;
+	struct ipt_cls_cursor cursor;
 	struct xt_action_param acpar;
 	unsigned int addend;
 
@@ -331,6 +1027,9 @@ ipt_do_table(struct sk_buff *skb,
 	jumpstack  = (struct ipt_entry **)private->jumpstack[cpu];
 	stackptr   = per_cpu_ptr(private->stackptr, cpu);
 	origptr    = *stackptr;
+	cls        = private->classifier;
+	if (cls)
+		ipt_cls_lookup(cls, &cursor, skb, ip, indev, outdev, &acpar);
 
 	e = get_entry(table_base, private->hook_entry[hook]);
 
@@ -343,6 +1042,8 @@ ipt_do_table(struct sk_buff *skb,
 		const struct xt_entry_match *ematch;
 
 		IP_NF_ASSERT(e);
+		if (cls)
+			e = ipt_cls_skip(&cursor, table_base, e);
 		if (!ip_packet_match(ip, indev, outdev,
 		    &e->ip, acpar.fragoff)) {
  no_match:
@@ -414,9 +1115,13 @@ ipt_do_table(struct sk_buff *skb,
 		verdict = t->u.kernel.target->target(skb, &acpar);
 		/* Target might have changed stuff. */
 		ip = ip_hdr(skb);
-		if (verdict == XT_CONTINUE)
+		if (verdict == XT_CONTINUE) {
+			/* including the fields we classified on */
+			if (cls)
+				ipt_cls_lookup(cls, &cursor, skb, ip, indev,
+					       outdev, &acpar);
 			e = ipt_next_entry(e);
-		else
+		} else
 			/* Verdict */
 			break;
 	} while (!acpar.hotdrop);
@@ -869,6 +1574,9 @@ translate_table(struct net *net, struct xt_table_info *newinfo, void *entry0,
 			memcpy(newinfo->entries[i], entry0, newinfo->size);
 	}
 
+	/* Offsets are the same in every copy; failing here only costs speed. */
+	newinfo->classifier = ipt_cls_build(newinfo, entry0);
+
 	return ret;
 }
 
@@ -1225,7 +1933,7 @@ __do_replace(struct net *net, const char *name, unsigned int valid_hooks,
 	xt_entry_foreach(iter, loc_cpu_old_entry, oldinfo->size)
 		cleanup_entry(iter, net);
 
-	xt_free_table_info(oldinfo);
+	ipt_free_table_info(oldinfo);
 	if (copy_to_user(counters_ptr, counters,
 			 sizeof(struct xt_counters) * num_counters) != 0)
 		ret = -EFAULT;
@@ -1287,7 +1995,7 @@ do_replace(struct net *net, const void __user *user, unsigned int len)
 	xt_entry_foreach(iter, loc_cpu_entry, newinfo->size)
 		cleanup_entry(iter, net);
  free_newinfo:
-	xt_free_table_info(newinfo);
+	ipt_free_table_info(newinfo);
 	return ret;
 }
 
@@ -1758,7 +2466,7 @@ translate_compat_table(struct net *net,
 				break;
 			cleanup_entry(iter1, net);
 		}
-		xt_free_table_info(newinfo);
+		ipt_free_table_info(newinfo);
 		return ret;
 	}
 
@@ -1767,13 +2475,15 @@ translate_compat_table(struct net *net,
 		if (newinfo->entries[i] && newinfo->entries[i] != entry1)
 			memcpy(newinfo->entries[i], entry1, newinfo->size);
 
+	newinfo->classifier = ipt_cls_build(newinfo, entry1);
+
 	*pinfo = newinfo;
 	*pentry0 = entry1;
-	xt_free_table_info(info);
+	ipt_free_table_info(info);
 	return 0;
 
 free_newinfo:
-	xt_free_table_info(newinfo);
+	ipt_free_table_info(newinfo);
 out:
 	xt_entry_foreach(iter0, entry0, total_size) {
 		if (j-- == 0)
@@ -1837,7 +2547,7 @@ compat_do_replace(struct net *net, void __user *user, unsigned int len)
 	xt_entry_foreach(iter, loc_cpu_entry, newinfo->size)
 		cleanup_entry(iter, net);
  free_newinfo:
-	xt_free_table_info(newinfo);
+	ipt_free_table_info(newinfo);
 	return ret;
 }
 
@@ -2089,7 +2799,7 @@ struct xt_table *ipt_register_table(struct net *net,
 	return new_table;
 
 out_free:
-	xt_free_table_info(newinfo);
+	ipt_free_table_info(newinfo);
 out:
 	return ERR_PTR(ret);
 }
@@ -2109,7 +2819,7 @@ void ipt_unregister_table(struct net *net, struct xt_table *table)
 		cleanup_entry(iter, net);
 	if (private->number > private->initial_entries)
 		module_put(table_owner);
-	xt_free_table_info(private);
+	ipt_free_table_info(private);
 }
 
 /* Returns 1 if the type and code is matched by the range, 0 otherwise */
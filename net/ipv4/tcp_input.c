@@ -3673,6 +3673,26 @@ static int tcp_process_frto(struct sock *sk, int flag)
 	return 0;
 }
 
+/* Set sk_pacing_rate to twice the current delivery rate, mss * cwnd / srtt,
+ * so that a pacing qdisc can spread a window over the round trip instead
+ * of sending it as one line-rate burst. srtt is in jiffies << 3; while it
+ * is not yet known (or below one jiffy) assume 125 usec, which leaves the
+ * flow effectively unpaced.
+ */
+static void tcp_update_pacing_rate(struct sock *sk)
+{
+	const struct tcp_sock *tp = tcp_sk(sk);
+	u64 rate;
+
+	rate = (u64)tp->mss_cache * 2 * (HZ << 3);
+	rate *= max(tp->snd_cwnd, tp->packets_out);
+
+	if (tp->srtt > 8 + 2)
+		do_div(rate, tp->srtt);
+
+	sk->sk_pacing_rate = min_t(u64, rate, ~0U);
+}
+
 /* This routine deals with incoming acks, but not outgoing ones. */
 static int tcp_ack(struct sock *sk, const struct sk_buff *skb, int flag)
 {
@@ -3781,6 +3801,7 @@ static int tcp_ack(struct sock *sk, const struct sk_buff *skb, int flag)
 	if ((flag & FLAG_FORWARD_PROGRESS) || !(flag & FLAG_NOT_DUP))
 		dst_confirm(__sk_dst_get(sk));
 
+	tcp_update_pacing_rate(sk);
 	return 1;
 
 no_queue:
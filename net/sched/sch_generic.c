@@ -37,32 +37,72 @@
  * - enqueue, dequeue are serialized via qdisc root lock
  * - ingress filtering is also serialized via qdisc root lock
  * - updates to tree and tree walking are only done under the rtnl mutex.
+ *
+ * TCQ_F_NOLOCK root qdiscs do their own enqueue/dequeue synchronisation;
+ * for them the root lock is replaced by qdisc->run_lock, which is held by
+ * whoever runs the queue and covers gso_skb and the requeue list.  Their
+ * q.qlen belongs to the qdisc, so requeued skbs are not counted in it.
  */
 
+static inline void qdisc_requeue_count(struct Qdisc *q, int n)
+{
+	if (!(q->flags & TCQ_F_NOLOCK))
+		q->q.qlen += n;	/* it's still part of the queue */
+}
+
+/* Lockless qdiscs cannot cheaply tell; the next dequeue will find out. */
+static inline int qdisc_more_to_send(const struct Qdisc *q)
+{
+	return (q->flags & TCQ_F_NOLOCK) ? 1 : qdisc_qlen(q);
+}
+
 static inline int dev_requeue_skb(struct sk_buff *skb, struct Qdisc *q)
 {
 	skb_dst_force(skb);
 	q->gso_skb = skb;
 	q->qstats.requeues++;
-	q->q.qlen++;	/* it's still part of the queue */
+	qdisc_requeue_count(q, 1);
 	__netif_schedule(q);
 
 	return 0;
 }
 
+/* Puts back skbs a bulk dequeue took but did not get to send, in order. */
+static void dev_requeue_bulk(struct sk_buff **skbs, int n, struct Qdisc *q)
+{
+	while (n-- > 0) {
+		skb_dst_force(skbs[n]);
+		__skb_queue_head(&q->requeue, skbs[n]);
+		qdisc_requeue_count(q, 1);
+	}
+}
+
+/* Returns the skb queued at @q's head if its tx queue can take it now. */
+static inline bool requeued_skb_ready(struct Qdisc *q, struct sk_buff *skb)
+{
+	struct net_device *dev = qdisc_dev(q);
+	struct netdev_queue *txq;
+
+	/* check the reason of requeuing without tx lock first */
+	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
+	return !netif_tx_queue_frozen_or_stopped(txq);
+}
+
 static inline struct sk_buff *dequeue_skb(struct Qdisc *q)
 {
 	struct sk_buff *skb = q->gso_skb;
 
 	if (unlikely(skb)) {
-		struct net_device *dev = qdisc_dev(q);
-		struct netdev_queue *txq;
-
-		/* check the reason of requeuing without tx lock first */
-		txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
-		if (!netif_tx_queue_frozen_or_stopped(txq)) {
+		if (requeued_skb_ready(q, skb)) {
 			q->gso_skb = NULL;
-			q->q.qlen--;
+			qdisc_requeue_count(q, -1);
+		} else
+			skb = NULL;
+	} else if (unlikely(skb_queue_len(&q->requeue))) {
+		skb = skb_peek(&q->requeue);
+		if (requeued_skb_ready(q, skb)) {
+			__skb_unlink(skb, &q->requeue);
+			qdisc_requeue_count(q, -1);
 		} else
 			skb = NULL;
 	} else {
@@ -89,7 +129,7 @@ static inline int handle_dev_cpu_collision(struct sk_buff *skb,
 		if (net_ratelimit())
 			pr_warning("Dead loop on netdevice %s, fix it urgently!\n",
 				   dev_queue->dev->name);
-		ret = qdisc_qlen(q);
+		ret = qdisc_more_to_send(q);
 	} else {
 		/*
 		 * Another cpu is holding lock, requeue & delay xmits for
@@ -103,34 +143,54 @@ static inline int handle_dev_cpu_collision(struct sk_buff *skb,
 }
 
 /*
- * Transmit one skb, and handle the return status as required. Holding the
- * __QDISC_STATE_RUNNING bit guarantees that only one CPU can execute this
- * function.
+ * Transmit @n skbs bound for @txq under one hold of the driver lock, and
+ * handle the return status as required.  Holding the
+ * __QDISC_STATE_RUNNING bit (or run_lock) guarantees that only one CPU
+ * can execute this function.  @root_lock is NULL for TCQ_F_NOLOCK qdiscs.
  *
  * Returns to the caller:
  *				0  - queue is empty or throttled.
  *				>0 - queue is not empty.
  */
-int sch_direct_xmit(struct sk_buff *skb, struct Qdisc *q,
-		    struct net_device *dev, struct netdev_queue *txq,
-		    spinlock_t *root_lock)
+static int sch_direct_xmit_bulk(struct sk_buff **skbs, int n, struct Qdisc *q,
+				struct net_device *dev,
+				struct netdev_queue *txq,
+				spinlock_t *root_lock)
 {
 	int ret = NETDEV_TX_BUSY;
+	struct sk_buff *skb;
+	int sent = 0;
 
 	/* And release qdisc */
-	spin_unlock(root_lock);
+	if (root_lock)
+		spin_unlock(root_lock);
 
 	HARD_TX_LOCK(dev, txq, smp_processor_id());
-	if (!netif_tx_queue_frozen_or_stopped(txq))
-		ret = dev_hard_start_xmit(skb, dev, txq);
+	while (sent < n && !netif_tx_queue_frozen_or_stopped(txq)) {
+		ret = dev_hard_start_xmit(skbs[sent], dev, txq);
+		if (!dev_xmit_complete(ret))
+			break;
+		sent++;
+	}
 
 	HARD_TX_UNLOCK(dev, txq);
 
-	spin_lock(root_lock);
+	if (root_lock)
+		spin_lock(root_lock);
+
+	if (sent == n) {
+		/* Driver sent out skbs successfully or they were consumed */
+		ret = qdisc_more_to_send(q);
+		goto out;
+	}
+
+	/* The ones after the unsent skb go back in behind it */
+	dev_requeue_bulk(skbs + sent + 1, n - sent - 1, q);
+	skb = skbs[sent];
 
 	if (dev_xmit_complete(ret)) {
-		/* Driver sent out skb successfully or skb was consumed */
-		ret = qdisc_qlen(q);
+		/* Queue stopped before this skb was tried */
+		ret = dev_requeue_skb(skb, q);
 	} else if (ret == NETDEV_TX_LOCKED) {
 		/* Driver try lock failed */
 		ret = handle_dev_cpu_collision(skb, txq, q);
@@ -143,12 +203,20 @@ int sch_direct_xmit(struct sk_buff *skb, struct Qdisc *q,
 		ret = dev_requeue_skb(skb, q);
 	}
 
+out:
 	if (ret && netif_tx_queue_frozen_or_stopped(txq))
 		ret = 0;
 
 	return ret;
 }
 
+int sch_direct_xmit(struct sk_buff *skb, struct Qdisc *q,
+		    struct net_device *dev, struct netdev_queue *txq,
+		    spinlock_t *root_lock)
+{
+	return sch_direct_xmit_bulk(&skb, 1, q, dev, txq, root_lock);
+}
+
 /*
  * NOTE: Called under qdisc_lock(q) with locally disabled BH.
  *
@@ -168,30 +236,58 @@ int sch_direct_xmit(struct sk_buff *skb, struct Qdisc *q,
  *				>0 - queue is not empty.
  *
  */
-static inline int qdisc_restart(struct Qdisc *q)
+static inline int qdisc_restart(struct Qdisc *q, int *quota)
 {
+	struct sk_buff *skbs[QDISC_BULK_MAX];
 	struct netdev_queue *txq;
 	struct net_device *dev;
 	spinlock_t *root_lock;
 	struct sk_buff *skb;
+	int n, bulk;
 
 	/* Dequeue packet */
 	skb = dequeue_skb(q);
 	if (unlikely(!skb))
 		return 0;
 	WARN_ON_ONCE(skb_dst_is_noref(skb));
-	root_lock = qdisc_lock(q);
+	root_lock = (q->flags & TCQ_F_NOLOCK) ? NULL : qdisc_lock(q);
 	dev = qdisc_dev(q);
 	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
 
-	return sch_direct_xmit(skb, q, dev, txq, root_lock);
+	/*
+	 * Take whatever else is queued for the same tx queue, so the
+	 * driver lock is taken once for all of them.
+	 */
+	bulk = clamp(min(dev_tx_bulk, *quota), 1, QDISC_BULK_MAX);
+	skbs[0] = skb;
+	for (n = 1; n < bulk; n++) {
+		skb = dequeue_skb(q);
+		if (!skb)
+			break;
+		WARN_ON_ONCE(skb_dst_is_noref(skb));
+		if (skb_get_queue_mapping(skb) != skb_get_queue_mapping(skbs[0])) {
+			/* first in line next time round */
+			dev_requeue_bulk(&skb, 1, q);
+			break;
+		}
+		skbs[n] = skb;
+	}
+	*quota -= n - 1;
+
+	return sch_direct_xmit_bulk(skbs, n, q, dev, txq, root_lock);
 }
 
 void __qdisc_run(struct Qdisc *q)
 {
 	int quota = weight_p;
 
-	while (qdisc_restart(q)) {
+	/* anyone who found us running is covered from here on */
+	if (q->flags & TCQ_F_NOLOCK) {
+		clear_bit(__QDISC_STATE_MISSED, &q->state);
+		smp_mb__after_clear_bit();
+	}
+
+	while (qdisc_restart(q, &quota)) {
 		/*
 		 * Ordered by possible occurrence: Postpone processing if
 		 * 1. we've exceeded packet quota
@@ -544,6 +640,246 @@ struct Qdisc_ops pfifo_fast_ops __read_mostly = {
 };
 EXPORT_SYMBOL(pfifo_fast_ops);
 
+/*
+ * pfifo_ring: pfifo_fast's three bands, each a bounded MPMC ring, so the
+ * qdisc runs as TCQ_F_NOLOCK: cpus enqueue concurrently without the root
+ * lock, and only whoever holds run_lock dequeues (qdisc_reset() may too,
+ * which the rings allow).  Each band holds up to tx_queue_len packets.
+ *
+ * The rings are the usual sequence-numbered array: a slot whose sequence
+ * equals the producer position is free, one whose sequence is one past
+ * the consumer position is full.
+ */
+struct pfifo_ring_slot {
+	unsigned long		seq;
+	struct sk_buff		*skb;
+};
+
+struct pfifo_ring {
+	unsigned long		head ____cacheline_aligned_in_smp;
+	unsigned long		tail ____cacheline_aligned_in_smp;
+	unsigned long		mask;
+	struct pfifo_ring_slot	*slots;
+};
+
+struct pfifo_ring_priv {
+	struct pfifo_ring	band[PFIFO_FAST_BANDS];
+	atomic_t		qlen;
+	atomic_t		drops;
+};
+
+static bool pfifo_ring_produce(struct pfifo_ring *r, struct sk_buff *skb)
+{
+	unsigned long pos = ACCESS_ONCE(r->head), old;
+	struct pfifo_ring_slot *slot;
+	long diff;
+
+	for (;;) {
+		slot = &r->slots[pos & r->mask];
+		diff = (long)ACCESS_ONCE(slot->seq) - (long)pos;
+		if (diff == 0) {
+			old = cmpxchg(&r->head, pos, pos + 1);
+			if (old == pos)
+				break;
+			pos = old;
+		} else if (diff < 0) {
+			return false;		/* full */
+		} else {
+			pos = ACCESS_ONCE(r->head);
+		}
+	}
+
+	slot->skb = skb;
+	smp_wmb();
+	slot->seq = pos + 1;
+	return true;
+}
+
+static struct sk_buff *pfifo_ring_consume(struct pfifo_ring *r)
+{
+	unsigned long pos = ACCESS_ONCE(r->tail), old;
+	struct pfifo_ring_slot *slot;
+	struct sk_buff *skb;
+	long diff;
+
+	for (;;) {
+		slot = &r->slots[pos & r->mask];
+		diff = (long)ACCESS_ONCE(slot->seq) - (long)(pos + 1);
+		if (diff == 0) {
+			old = cmpxchg(&r->tail, pos, pos + 1);
+			if (old == pos)
+				break;
+			pos = old;
+		} else if (diff < 0) {
+			return NULL;		/* empty */
+		} else {
+			pos = ACCESS_ONCE(r->tail);
+		}
+	}
+
+	smp_rmb();
+	skb = slot->skb;
+	/* done with the slot before the producers may see it free */
+	smp_mb();
+	slot->seq = pos + r->mask + 1;
+	return skb;
+}
+
+static int pfifo_ring_enqueue(struct sk_buff *skb, struct Qdisc *qdisc)
+{
+	struct pfifo_ring_priv *priv = qdisc_priv(qdisc);
+	int band = prio2band[skb->priority & TC_PRIO_MAX];
+
+	if (likely(pfifo_ring_produce(&priv->band[band], skb))) {
+		atomic_inc(&priv->qlen);
+		return NET_XMIT_SUCCESS;
+	}
+
+	atomic_inc(&priv->drops);
+	kfree_skb(skb);
+	return NET_XMIT_DROP;
+}
+
+static struct sk_buff *pfifo_ring_dequeue(struct Qdisc *qdisc)
+{
+	struct pfifo_ring_priv *priv = qdisc_priv(qdisc);
+	struct sk_buff *skb;
+	int band;
+
+	for (band = 0; band < PFIFO_FAST_BANDS; band++) {
+		skb = pfifo_ring_consume(&priv->band[band]);
+		if (skb) {
+			atomic_dec(&priv->qlen);
+			qdisc_bstats_update(qdisc, skb);
+			return skb;
+		}
+	}
+
+	return NULL;
+}
+
+static void pfifo_ring_reset(struct Qdisc *qdisc)
+{
+	struct pfifo_ring_priv *priv = qdisc_priv(qdisc);
+	struct sk_buff *skb;
+	int band;
+
+	for (band = 0; band < PFIFO_FAST_BANDS; band++) {
+		if (!priv->band[band].slots)
+			continue;
+		while ((skb = pfifo_ring_consume(&priv->band[band])) != NULL) {
+			atomic_dec(&priv->qlen);
+			kfree_skb(skb);
+		}
+	}
+}
+
+static void pfifo_ring_free(struct pfifo_ring_priv *priv)
+{
+	struct pfifo_ring_slot *slots;
+	int band;
+
+	for (band = 0; band < PFIFO_FAST_BANDS; band++) {
+		slots = priv->band[band].slots;
+		if (is_vmalloc_addr(slots))
+			vfree(slots);
+		else
+			kfree(slots);
+		priv->band[band].slots = NULL;
+	}
+}
+
+static void pfifo_ring_destroy(struct Qdisc *qdisc)
+{
+	pfifo_ring_free(qdisc_priv(qdisc));
+}
+
+/*
+ * A lockless qdisc keeps its queue length and drops in atomics; bring the
+ * q.qlen and qstats copies up to date before they are reported.  Nothing
+ * else reads them for such a qdisc.
+ */
+void qdisc_sync_stats(struct Qdisc *qdisc)
+{
+	struct pfifo_ring_priv *priv;
+
+	if (qdisc->ops != &pfifo_ring_ops)
+		return;
+	priv = qdisc_priv(qdisc);
+	qdisc->q.qlen = atomic_read(&priv->qlen);
+	qdisc->qstats.drops = atomic_read(&priv->drops);
+}
+EXPORT_SYMBOL(qdisc_sync_stats);
+
+static int pfifo_ring_dump(struct Qdisc *qdisc, struct sk_buff *skb)
+{
+	qdisc_sync_stats(qdisc);
+	return pfifo_fast_dump(qdisc, skb);
+}
+
+/*
+ * Only a queue's root qdisc, or mq's per-queue children, can run without
+ * a lock; under any other parent q.qlen would have to be exact.
+ */
+static bool pfifo_ring_is_root(const struct Qdisc *qdisc)
+{
+	const struct Qdisc *root = qdisc_dev(qdisc)->qdisc;
+
+	if (qdisc->parent == TC_H_ROOT)
+		return true;
+	return root && (root->flags & TCQ_F_MQROOT) &&
+	       TC_H_MAJ(qdisc->parent) == TC_H_MAJ(root->handle);
+}
+
+static int pfifo_ring_init(struct Qdisc *qdisc, struct nlattr *opt)
+{
+	struct pfifo_ring_priv *priv = qdisc_priv(qdisc);
+	unsigned long i, size;
+	int band;
+
+	if (!pfifo_ring_is_root(qdisc))
+		return -EOPNOTSUPP;
+
+	size = roundup_pow_of_two(max_t(unsigned long,
+					qdisc_dev(qdisc)->tx_queue_len, 2));
+
+	for (band = 0; band < PFIFO_FAST_BANDS; band++) {
+		struct pfifo_ring *r = &priv->band[band];
+		size_t bytes = size * sizeof(*r->slots);
+
+		if (bytes <= PAGE_SIZE)
+			r->slots = kmalloc(bytes, GFP_KERNEL);
+		else
+			r->slots = vmalloc(bytes);
+		if (!r->slots) {
+			/* qdisc_create() does not call ->destroy on failure */
+			pfifo_ring_free(priv);
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < size; i++)
+			r->slots[i].seq = i;
+		r->mask = size - 1;
+	}
+
+	qdisc->flags |= TCQ_F_NOLOCK;
+	return 0;
+}
+
+struct Qdisc_ops pfifo_ring_ops __read_mostly = {
+	.id		=	"pfifo_ring",
+	.priv_size	=	sizeof(struct pfifo_ring_priv),
+	.enqueue	=	pfifo_ring_enqueue,
+	.dequeue	=	pfifo_ring_dequeue,
+	.peek		=	qdisc_peek_dequeued,
+	.init		=	pfifo_ring_init,
+	.reset		=	pfifo_ring_reset,
+	.destroy	=	pfifo_ring_destroy,
+	.dump		=	pfifo_ring_dump,
+	.owner		=	THIS_MODULE,
+};
+EXPORT_SYMBOL(pfifo_ring_ops);
+
 struct Qdisc *qdisc_alloc(struct netdev_queue *dev_queue,
 			  struct Qdisc_ops *ops)
 {
@@ -570,7 +906,9 @@ struct Qdisc *qdisc_alloc(struct netdev_queue *dev_queue,
 	}
 	INIT_LIST_HEAD(&sch->list);
 	skb_queue_head_init(&sch->q);
+	__skb_queue_head_init(&sch->requeue);
 	spin_lock_init(&sch->busylock);
+	spin_lock_init(&sch->run_lock);
 	sch->ops = ops;
 	sch->enqueue = ops->enqueue;
 	sch->dequeue = ops->dequeue;
@@ -607,15 +945,29 @@ EXPORT_SYMBOL(qdisc_create_dflt);
 void qdisc_reset(struct Qdisc *qdisc)
 {
 	const struct Qdisc_ops *ops = qdisc->ops;
+	bool nolock = qdisc->flags & TCQ_F_NOLOCK;
+
+	/* the root lock does not keep a lockless qdisc's runner out */
+	if (nolock)
+		spin_lock(&qdisc->run_lock);
 
 	if (ops->reset)
 		ops->reset(qdisc);
 
+	if (skb_queue_len(&qdisc->requeue)) {
+		__skb_queue_purge(&qdisc->requeue);
+		if (!nolock)
+			qdisc->q.qlen = 0;
+	}
 	if (qdisc->gso_skb) {
 		kfree_skb(qdisc->gso_skb);
 		qdisc->gso_skb = NULL;
-		qdisc->q.qlen = 0;
+		if (!nolock)
+			qdisc->q.qlen = 0;
 	}
+
+	if (nolock)
+		qdisc_run_end(qdisc);
 }
 EXPORT_SYMBOL(qdisc_reset);
 
@@ -649,6 +1001,8 @@ void qdisc_destroy(struct Qdisc *qdisc)
 	dev_put(qdisc_dev(qdisc));
 
 	kfree_skb(qdisc->gso_skb);
+	if (skb_queue_len(&qdisc->requeue))
+		__skb_queue_purge(&qdisc->requeue);
 	/*
 	 * gen_estimator est_timer() might access qdisc->q.lock,
 	 * wait a RCU grace period before freeing qdisc.
@@ -787,6 +1141,24 @@ static void dev_deactivate_queue(struct net_device *dev,
 	}
 }
 
+/*
+ * A lockless enqueue tests __QDISC_STATE_DEACTIVATED without the root
+ * lock, so it can slip an skb in after dev_deactivate_queue() reset the
+ * qdisc.  Once synchronize_net() has waited those out, reset it again.
+ */
+static void dev_reset_nolock_queue(struct net_device *dev,
+				   struct netdev_queue *dev_queue,
+				   void *unused)
+{
+	struct Qdisc *qdisc = dev_queue->qdisc_sleeping;
+
+	if (qdisc && (qdisc->flags & TCQ_F_NOLOCK)) {
+		spin_lock_bh(qdisc_lock(qdisc));
+		qdisc_reset(qdisc);
+		spin_unlock_bh(qdisc_lock(qdisc));
+	}
+}
+
 static bool some_qdisc_is_busy(struct net_device *dev)
 {
 	unsigned int i;
@@ -848,6 +1220,12 @@ void dev_deactivate_many(struct list_head *head)
 	list_for_each_entry(dev, head, unreg_list)
 		while (some_qdisc_is_busy(dev))
 			yield();
+
+	/* Dismantled devices get their qdiscs destroyed instead */
+	if (sync_needed)
+		list_for_each_entry(dev, head, unreg_list)
+			netdev_for_each_tx_queue(dev, dev_reset_nolock_queue,
+						 NULL);
 }
 
 void dev_deactivate(struct net_device *dev)
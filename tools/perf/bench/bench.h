@@ -4,6 +4,11 @@
 extern int bench_sched_messaging(int argc, const char **argv, const char *prefix);
 extern int bench_sched_pipe(int argc, const char **argv, const char *prefix);
 extern int bench_mem_memcpy(int argc, const char **argv, const char *prefix __used);
+extern int bench_mem_fork(int argc, const char **argv, const char *prefix __used);
+extern int bench_net_conntrack(int argc, const char **argv, const char *prefix __used);
+extern int bench_net_iptables(int argc, const char **argv, const char *prefix __used);
+extern int bench_net_busypoll(int argc, const char **argv, const char *prefix __used);
+extern int bench_net_tun(int argc, const char **argv, const char *prefix __used);
 
 #define BENCH_FORMAT_DEFAULT_STR	"default"
 #define BENCH_FORMAT_DEFAULT		0
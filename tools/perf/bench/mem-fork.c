@@ -0,0 +1,150 @@
+/*
+ * mem-fork.c
+ *
+ * fork: Cost of fork() for a process with a large anonymous footprint
+ *
+ * Most of that cost is copying the page tables of the parent, which is
+ * what vm.fork_parallel_copy_mb speeds up for large mappings.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static const char	*size_str	= "1GB";
+static int		loops		= 10;
+
+static const struct option options[] = {
+	OPT_STRING('s', "size", &size_str, "1GB",
+		    "Specify size of anonymous memory touched before fork(). "
+		    "available unit: B, MB, GB (upper and lower)"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of loops"),
+	OPT_END()
+};
+
+static const char * const bench_mem_fork_usage[] = {
+	"perf bench mem fork <options>",
+	NULL
+};
+
+static void timeval_add_diff(struct timeval *sum, struct timeval *start,
+			     struct timeval *stop)
+{
+	struct timeval diff;
+
+	timersub(stop, start, &diff);
+	timeradd(sum, &diff, sum);
+}
+
+int bench_mem_fork(int argc, const char **argv,
+		   const char *prefix __used)
+{
+	struct timeval start, forked, reaped;
+	struct timeval fork_tv = { 0, 0 }, exit_tv = { 0, 0 };
+	unsigned long long fork_usec, exit_usec;
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t size, off;
+	char *buf;
+	int i, wait_stat;
+	pid_t pid;
+
+	argc = parse_options(argc, argv, options,
+			     bench_mem_fork_usage, 0);
+
+	size = (size_t)perf_atoll((char *)size_str);
+	if ((s64)size <= 0) {
+		fprintf(stderr, "Invalid size:%s\n", size_str);
+		return 1;
+	}
+	if (loops <= 0) {
+		fprintf(stderr, "Invalid number of loops:%d\n", loops);
+		return 1;
+	}
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	/* populate every pte so that fork() has to copy them */
+	for (off = 0; off < size; off += page_size)
+		buf[off] = 1;
+
+	/*
+	 * Only the time until fork() returns in the parent is charged to
+	 * fork; the child's exit and its reaping are reported separately
+	 * as teardown, since they cost about as much again for a large
+	 * footprint.
+	 */
+	for (i = 0; i < loops; i++) {
+		gettimeofday(&start, NULL);
+		pid = fork();
+		if (!pid)
+			_exit(0);
+		gettimeofday(&forked, NULL);
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (waitpid(pid, &wait_stat, 0) != pid ||
+		    !WIFEXITED(wait_stat)) {
+			fprintf(stderr, "child %d did not exit cleanly\n",
+				pid);
+			return 1;
+		}
+		gettimeofday(&reaped, NULL);
+
+		timeval_add_diff(&fork_tv, &start, &forked);
+		timeval_add_diff(&exit_tv, &forked, &reaped);
+	}
+
+	munmap(buf, size);
+
+	fork_usec = fork_tv.tv_sec * 1000000ULL + fork_tv.tv_usec;
+	exit_usec = exit_tv.tv_sec * 1000000ULL + exit_tv.tv_usec;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# Executed %d fork()s of a task with %s of anonymous memory\n\n",
+		       loops, size_str);
+
+		printf(" %14s: %lu.%03lu [sec]\n", "fork",
+		       fork_tv.tv_sec,
+		       (unsigned long) (fork_tv.tv_usec/1000));
+		printf(" %14s: %lu.%03lu [sec]\n\n", "exit + wait",
+		       exit_tv.tv_sec,
+		       (unsigned long) (exit_tv.tv_usec/1000));
+
+		printf(" %14lf usecs/fork\n",
+		       (double)fork_usec / (double)loops);
+		printf(" %14lf usecs/teardown\n",
+		       (double)exit_usec / (double)loops);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lf %lf\n", (double)fork_usec / (double)loops,
+		       (double)exit_usec / (double)loops);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
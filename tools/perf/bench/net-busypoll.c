@@ -0,0 +1,297 @@
+/*
+ * net-busypoll.c
+ *
+ * busypoll: UDP round trip latency over a veth pair, with and without
+ * busy polling
+ *
+ * A veth pair is created and one end is moved into a network namespace
+ * owned by the client thread, so that the datagrams really cross the
+ * pair instead of being routed over loopback.  The client sends one
+ * byte and waits for the echo from an unconnected server socket on the
+ * other end, first with SO_BUSY_POLL off on both sockets and then with
+ * it on.  veth only receives through NAPI, and so can be busy polled,
+ * while GRO is enabled on it, which it is by default.
+ *
+ * Needs root and the ip utility.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL		46
+#endif
+#ifndef SO_BUSY_POLL_STATS
+#define SO_BUSY_POLL_STATS	47
+#endif
+
+#define VETH_SERVER	"pbveth0"
+#define VETH_CLIENT	"pbveth1"
+#define ADDR_SERVER	"198.18.0.1"	/* RFC 2544 benchmarking range */
+#define ADDR_CLIENT	"198.18.0.2"
+
+static int		loops		= 100000;
+static int		busy_usec	= 50;
+static int		port		= 9998;
+
+static const struct option options[] = {
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of round trips per run"),
+	OPT_INTEGER('u', "usec", &busy_usec,
+		    "Specify SO_BUSY_POLL value of the busy polling run"),
+	OPT_INTEGER('p', "port", &port,
+		    "Specify UDP port of the server socket"),
+	OPT_END()
+};
+
+static const char * const bench_net_busypoll_usage[] = {
+	"perf bench net busypoll <options>",
+	NULL
+};
+
+struct busy_poll_stats {
+	u64	polls;
+	u64	hits;
+};
+
+static pthread_barrier_t barrier;
+static pid_t client_tid;
+static int client_fd, server_fd;
+static unsigned long long usec[2];
+static int lost[2];
+
+static int run_cmd(const char *cmd)
+{
+	int ret = system(cmd);
+
+	if (ret)
+		fprintf(stderr, "'%s' failed\n", cmd);
+	return ret;
+}
+
+static void set_busy_poll(int fd, int val)
+{
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)))
+		die("SO_BUSY_POLL: %s", strerror(errno));
+}
+
+/* Kernels without the option may answer option 47 with something else. */
+static bool get_stats(int fd, struct busy_poll_stats *st)
+{
+	socklen_t len = sizeof(*st);
+
+	return !getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_STATS, st, &len) &&
+		len == sizeof(*st);
+}
+
+static int open_socket(const char *addr, int sport)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		die("socket: %s", strerror(errno));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(addr);
+	sin.sin_port = htons(sport);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)))
+		die("bind %s: %s", addr, strerror(errno));
+	return fd;
+}
+
+/* Echoes every datagram back to its sender, until it reads an empty one. */
+static void *server_thread(void *arg __used)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	char buf[1];
+	ssize_t n;
+
+	for (;;) {
+		len = sizeof(sin);
+		n = recvfrom(server_fd, buf, sizeof(buf), 0,
+			     (struct sockaddr *)&sin, &len);
+		if (n <= 0)
+			break;
+		sendto(server_fd, buf, n, 0, (struct sockaddr *)&sin, len);
+	}
+	return NULL;
+}
+
+/* Returns false if no echo came back within the receive timeout. */
+static bool round_trip(void)
+{
+	char buf[1] = { 1 };
+
+	if (send(client_fd, buf, sizeof(buf), 0) != 1)
+		return false;
+	return recv(client_fd, buf, sizeof(buf), 0) == 1;
+}
+
+static void *client_thread(void *arg __used)
+{
+	struct timeval start, stop, diff, timeout = { 1, 0 };
+	struct sockaddr_in sin;
+	int mode, i;
+
+	/* only this thread, and what it forks, sees the new namespace */
+	if (unshare(CLONE_NEWNET))
+		die("unshare: %s", strerror(errno));
+	client_tid = syscall(SYS_gettid);
+	pthread_barrier_wait(&barrier);
+
+	/* the main thread moves the client end of the pair in here */
+	pthread_barrier_wait(&barrier);
+	if (run_cmd("ip addr add " ADDR_CLIENT "/24 dev " VETH_CLIENT) ||
+	    run_cmd("ip link set " VETH_CLIENT " up"))
+		exit(1);
+
+	client_fd = open_socket(ADDR_CLIENT, 0);
+	setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO,
+		   &timeout, sizeof(timeout));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(ADDR_SERVER);
+	sin.sin_port = htons(port);
+	if (connect(client_fd, (struct sockaddr *)&sin, sizeof(sin)))
+		die("connect: %s", strerror(errno));
+
+	/* resolves the neighbours, and waits for the link to come up */
+	for (i = 0; i < 10 && !round_trip(); i++)
+		;
+	if (i == 10)
+		die("no echo from " ADDR_SERVER);
+
+	for (mode = 0; mode < 2; mode++) {
+		set_busy_poll(client_fd, mode ? busy_usec : 0);
+		pthread_barrier_wait(&barrier);
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < loops; i++)
+			if (!round_trip())
+				lost[mode]++;
+		gettimeofday(&stop, NULL);
+
+		timersub(&stop, &start, &diff);
+		usec[mode] = diff.tv_sec * 1000000ULL + diff.tv_usec;
+		pthread_barrier_wait(&barrier);
+	}
+
+	/* an empty datagram stops the server */
+	send(client_fd, NULL, 0, 0);
+	return NULL;
+}
+
+int bench_net_busypoll(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	struct busy_poll_stats st[2];
+	pthread_t client, server;
+	char cmd[128];
+	bool have_stats;
+	int mode;
+
+	argc = parse_options(argc, argv, options,
+			     bench_net_busypoll_usage, 0);
+
+	if (loops <= 0 || busy_usec <= 0 || port <= 0 || port > 65535) {
+		fprintf(stderr, "Invalid loop, usec or port\n");
+		return 1;
+	}
+
+	if (run_cmd("ip link add " VETH_SERVER " type veth peer name "
+		    VETH_CLIENT))
+		return 1;
+
+	pthread_barrier_init(&barrier, NULL, 2);
+	if (pthread_create(&client, NULL, client_thread, NULL))
+		die("pthread_create: %s", strerror(errno));
+	pthread_barrier_wait(&barrier);
+
+	snprintf(cmd, sizeof(cmd), "ip link set " VETH_CLIENT " netns %d",
+		 (int)client_tid);
+	if (run_cmd(cmd) ||
+	    run_cmd("ip addr add " ADDR_SERVER "/24 dev " VETH_SERVER) ||
+	    run_cmd("ip link set " VETH_SERVER " up")) {
+		run_cmd("ip link del " VETH_SERVER);
+		return 1;
+	}
+
+	server_fd = open_socket(ADDR_SERVER, port);
+	if (pthread_create(&server, NULL, server_thread, NULL))
+		die("pthread_create: %s", strerror(errno));
+	pthread_barrier_wait(&barrier);
+
+	for (mode = 0; mode < 2; mode++) {
+		set_busy_poll(server_fd, mode ? busy_usec : 0);
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+	}
+
+	pthread_join(client, NULL);
+	pthread_join(server, NULL);
+	/* only the second run polls */
+	have_stats = get_stats(server_fd, &st[0]) &&
+		     get_stats(client_fd, &st[1]);
+	pthread_barrier_destroy(&barrier);
+	close(client_fd);
+	close(server_fd);
+	run_cmd("ip link del " VETH_SERVER);
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d UDP round trips over a veth pair per run\n\n",
+		       loops);
+		for (mode = 0; mode < 2; mode++) {
+			if (mode)
+				printf(" busy poll %d usecs:\n", busy_usec);
+			else
+				printf(" busy poll off:\n");
+			printf(" %14lf usecs/round trip\n",
+			       (double)usec[mode] / (double)loops);
+			if (lost[mode])
+				printf(" %14d lost\n", lost[mode]);
+		}
+		if (have_stats)
+			printf("\n# busy polls that found data:"
+			       " %llu/%llu server, %llu/%llu client\n",
+			       (unsigned long long)st[0].hits,
+			       (unsigned long long)st[0].polls,
+			       (unsigned long long)st[1].hits,
+			       (unsigned long long)st[1].polls);
+		else
+			printf("\n# SO_BUSY_POLL_STATS not supported\n");
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lf %lf\n", (double)usec[0] / (double)loops,
+		       (double)usec[1] / (double)loops);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
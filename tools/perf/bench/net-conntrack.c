@@ -0,0 +1,211 @@
+/*
+ * net-conntrack.c
+ *
+ * conntrack: Rate at which new connections get tracked
+ *
+ * Every thread sends UDP datagrams over loopback to a different
+ * 127.0.0.0/8 address per packet, so each one creates a new conntrack
+ * entry (and, once nf_conntrack_max is reached, evicts one). All of
+ * them land on a single wildcard socket that is never read, so no
+ * ICMP errors are generated. With --flows the addresses repeat and the
+ * established lookup path is measured instead.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define CONNTRACK_COUNT	"/proc/sys/net/netfilter/nf_conntrack_count"
+#define NR_ADDRS	0xfffffe		/* 127.0.0.1 - 127.255.255.254 */
+
+static int		nr_threads;
+static int		loops		= 1000000;
+static int		flows;
+static int		port		= 9999;
+
+static const struct option options[] = {
+	OPT_INTEGER('t', "threads", &nr_threads,
+		    "Specify number of sending threads (default: online cpus)"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of packets per thread"),
+	OPT_INTEGER('r', "flows", &flows,
+		    "Cycle through this many flows per thread (0: all new)"),
+	OPT_INTEGER('p', "port", &port,
+		    "Specify UDP port of the sink socket"),
+	OPT_END()
+};
+
+static const char * const bench_net_conntrack_usage[] = {
+	"perf bench net conntrack <options>",
+	NULL
+};
+
+struct sender {
+	pthread_t	thread;
+	unsigned int	first;
+	unsigned long	sent;
+};
+
+static pthread_barrier_t start_barrier;
+
+static long conntrack_count(void)
+{
+	FILE *f = fopen(CONNTRACK_COUNT, "r");
+	long count = -1;
+
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld", &count) != 1)
+		count = -1;
+	fclose(f);
+	return count;
+}
+
+static void *sender_thread(void *arg)
+{
+	struct sender *s = arg;
+	struct sockaddr_in sin;
+	char buf[1] = { 0 };
+	unsigned int n;
+	int fd, i;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		die("socket: %s", strerror(errno));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < loops; i++) {
+		n = flows ? i % flows : i;
+		n = (s->first + n) % NR_ADDRS + 1;
+		sin.sin_addr.s_addr = htonl(0x7f000000 | n);
+		if (sendto(fd, buf, sizeof(buf), 0,
+			   (struct sockaddr *)&sin, sizeof(sin)) == 1)
+			s->sent++;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+int bench_net_conntrack(int argc, const char **argv,
+			const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	struct sockaddr_in sin;
+	struct sender *senders;
+	unsigned long long result_usec;
+	unsigned long sent = 0;
+	long count_before, count_after;
+	int sink, rcvbuf = 4096, i;
+
+	argc = parse_options(argc, argv, options,
+			     bench_net_conntrack_usage, 0);
+
+	if (!nr_threads)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads <= 0 || loops <= 0 || flows < 0) {
+		fprintf(stderr, "Invalid threads, loop or flows\n");
+		return 1;
+	}
+
+	/* unread, with a tiny buffer: delivery ends in a cheap drop */
+	sink = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sink < 0)
+		die("socket: %s", strerror(errno));
+	setsockopt(sink, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(port);
+	if (bind(sink, (struct sockaddr *)&sin, sizeof(sin)))
+		die("bind: %s", strerror(errno));
+
+	senders = zalloc(nr_threads * sizeof(*senders));
+	if (!senders)
+		die("not enough memory");
+
+	pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+	for (i = 0; i < nr_threads; i++) {
+		senders[i].first = (unsigned int)
+			((unsigned long long)NR_ADDRS * i / nr_threads);
+		if (pthread_create(&senders[i].thread, NULL,
+				   sender_thread, &senders[i]))
+			die("pthread_create: %s", strerror(errno));
+	}
+
+	count_before = conntrack_count();
+	pthread_barrier_wait(&start_barrier);
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(senders[i].thread, NULL);
+		sent += senders[i].sent;
+	}
+
+	gettimeofday(&stop, NULL);
+	count_after = conntrack_count();
+	timersub(&stop, &start, &diff);
+	result_usec = diff.tv_sec * 1000000ULL + diff.tv_usec;
+
+	close(sink);
+	free(senders);
+	pthread_barrier_destroy(&start_barrier);
+
+	if (!sent) {
+		fprintf(stderr, "No packet could be sent\n");
+		return 1;
+	}
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d threads sent %lu packets to %s flows\n",
+		       nr_threads, sent, flows ? "repeating" : "new");
+		if (count_before < 0)
+			printf("# %s not found, conntrack is not loaded\n",
+			       CONNTRACK_COUNT);
+		else
+			printf("# conntrack entries: %ld -> %ld\n",
+			       count_before, count_after);
+		printf("\n");
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec,
+		       (unsigned long) (diff.tv_usec/1000));
+
+		printf(" %14lf usecs/packet\n",
+		       (double)result_usec / (double)sent);
+		printf(" %14.0lf packets/sec\n",
+		       (double)sent * 1000000 / (double)result_usec);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%.0lf\n",
+		       (double)sent * 1000000 / (double)result_usec);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,327 @@
+/*
+ * net-iptables.c
+ *
+ * iptables: Packet rate through the filter table as it grows
+ *
+ * A generated chain of rules on loopback addresses, protocols and ports is
+ * hooked into OUTPUT, and UDP datagrams are sent through it over loopback,
+ * once with the ip_tables rule classifier disabled (classify_min_rules=0,
+ * the linear walk) and once with it enabled. With --verify the per-rule
+ * counters of both runs are compared: they only agree if every packet
+ * matched the same rules, and so got the same verdict, on both paths.
+ *
+ * Needs root and the legacy (not nft) iptables-restore and iptables-save.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define CHAIN		"perf-bench"
+#define CLASSIFY_PARAM	"/sys/module/ip_tables/parameters/classify_min_rules"
+#define NR_PORTS	8
+
+static const char	*rules_str	= "10,100,1000,10000,20000";
+static int		loops		= 200000;
+static int		port		= 9990;
+static bool		verify;
+
+static const struct option options[] = {
+	OPT_STRING('r', "rules", &rules_str, "10,100,1000,10000,20000",
+		    "Comma separated list of rule counts to measure"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of packets per run"),
+	OPT_INTEGER('p', "port", &port,
+		    "Specify first of the 8 UDP ports packets are sent to"),
+	OPT_BOOLEAN('v', "verify", &verify,
+		    "Check that both paths leave the same rule counters"),
+	OPT_END()
+};
+
+static const char * const bench_net_iptables_usage[] = {
+	"perf bench net iptables <options>",
+	NULL
+};
+
+/* Deterministic, so that both paths see the same rules and packets. */
+static unsigned int next_rand(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) & 0x7fff;
+}
+
+static void print_rule(FILE *f, unsigned int *seed)
+{
+	static const unsigned int plens[] = { 32, 32, 32, 30, 24, 16 };
+	const char *proto = NULL;
+
+	fprintf(f, "-A " CHAIN);
+	if (next_rand(seed) % 4)
+		fprintf(f, " %s-d 127.0.%u.%u/%u",
+			next_rand(seed) % 16 ? "" : "! ",
+			next_rand(seed) % 4, next_rand(seed) % 64,
+			plens[next_rand(seed) % ARRAY_SIZE(plens)]);
+	if (next_rand(seed) % 8 == 0)
+		fprintf(f, " -s 127.0.0.1/32");
+	switch (next_rand(seed) % 24) {
+	case 0 ... 3:
+		fprintf(f, " -o lo");
+		break;
+	case 4 ... 5:
+		fprintf(f, " -o eth+");
+		break;
+	case 6:
+		fprintf(f, " ! -o lo");
+		break;
+	}
+	switch (next_rand(seed) % 8) {
+	case 0 ... 5:
+		proto = "udp";
+		break;
+	case 6:
+		proto = "tcp";
+		break;
+	}
+	if (proto) {
+		fprintf(f, " -p %s", proto);
+		switch (next_rand(seed) % 16) {
+		case 0 ... 7:
+			fprintf(f, " --dport %u",
+				port + next_rand(seed) % NR_PORTS);
+			break;
+		case 8 ... 9:
+			fprintf(f, " --dport %u:%u", port, port + 3);
+			break;
+		case 10:
+			fprintf(f, " ! --dport %u", port);
+			break;
+		}
+	}
+	if (next_rand(seed) % 32 == 0)
+		fprintf(f, " -j RETURN");
+	fprintf(f, "\n");
+}
+
+static int run_cmd(const char *cmd)
+{
+	int ret = system(cmd);
+
+	if (ret)
+		fprintf(stderr, "'%s' failed\n", cmd);
+	return ret;
+}
+
+static int load_rules(int nr_rules)
+{
+	unsigned int seed = 1;
+	FILE *f;
+	int i;
+
+	f = popen("iptables-restore --noflush", "w");
+	if (!f)
+		return -1;
+	/* declaring the chain flushes it, with the counters */
+	fprintf(f, "*filter\n:" CHAIN " - [0:0]\n");
+	for (i = 0; i < nr_rules; i++)
+		print_rule(f, &seed);
+	fprintf(f, "COMMIT\n");
+	return pclose(f) ? -1 : 0;
+}
+
+static int set_classify(const char *val)
+{
+	FILE *f = fopen(CLASSIFY_PARAM, "w");
+
+	if (!f)
+		return -1;
+	fputs(val, f);
+	return fclose(f) ? -1 : 0;
+}
+
+/* Returns the counters of all rules in the chain, as iptables-save shows them. */
+static char *save_counters(void)
+{
+	char line[BUFSIZ], *buf = NULL;
+	size_t len = 0, n;
+	FILE *f;
+
+	f = popen("iptables-save -c -t filter", "r");
+	if (!f)
+		return NULL;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strstr(line, "-A " CHAIN " "))
+			continue;
+		n = strlen(line);
+		buf = realloc(buf, len + n + 1);
+		if (!buf)
+			break;
+		memcpy(buf + len, line, n + 1);
+		len += n;
+	}
+	pclose(f);
+	return buf;
+}
+
+/* Sends loops datagrams; returns the time it took in usecs. */
+static unsigned long long send_packets(int fd)
+{
+	struct timeval start, stop, diff;
+	struct sockaddr_in sin;
+	unsigned int seed = 2;
+	char buf[1] = { 0 };
+	int i;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < loops; i++) {
+		sin.sin_addr.s_addr = htonl(0x7f000000 |
+					    (next_rand(&seed) % 4) << 8 |
+					    next_rand(&seed) % 64);
+		sin.sin_port = htons(port + next_rand(&seed) % NR_PORTS);
+		sendto(fd, buf, sizeof(buf), 0,
+		       (struct sockaddr *)&sin, sizeof(sin));
+	}
+	gettimeofday(&stop, NULL);
+
+	timersub(&stop, &start, &diff);
+	return diff.tv_sec * 1000000ULL + diff.tv_usec;
+}
+
+/* Sinks on all the ports, never read, so that no ICMP errors are sent. */
+static int open_sinks(int *sinks)
+{
+	struct sockaddr_in sin;
+	int i, rcvbuf = 4096;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	for (i = 0; i < NR_PORTS; i++) {
+		sinks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sinks[i] < 0)
+			return -1;
+		setsockopt(sinks[i], SOL_SOCKET, SO_RCVBUF,
+			   &rcvbuf, sizeof(rcvbuf));
+		sin.sin_port = htons(port + i);
+		if (bind(sinks[i], (struct sockaddr *)&sin, sizeof(sin)))
+			return -1;
+	}
+	return 0;
+}
+
+int bench_net_iptables(int argc, const char **argv,
+		       const char *prefix __used)
+{
+	static const char *modes[2] = { "0", "1" };
+	unsigned long long usec[2];
+	char *counters[2], *end, old_param[32] = "";
+	const char *p;
+	int sinks[NR_PORTS], fd, nr_rules, mode, i, status = 0;
+	FILE *f;
+
+	argc = parse_options(argc, argv, options,
+			     bench_net_iptables_usage, 0);
+
+	if (loops <= 0 || port <= 0 || port + NR_PORTS > 65536) {
+		fprintf(stderr, "Invalid loop or port\n");
+		return 1;
+	}
+
+	f = fopen(CLASSIFY_PARAM, "r");
+	if (!f || !fgets(old_param, sizeof(old_param), f)) {
+		fprintf(stderr, "%s: %s\n", CLASSIFY_PARAM, strerror(errno));
+		return 1;
+	}
+	fclose(f);
+
+	if (open_sinks(sinks))
+		die("sink: %s", strerror(errno));
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		die("socket: %s", strerror(errno));
+
+	if (run_cmd("iptables -N " CHAIN) ||
+	    run_cmd("iptables -I OUTPUT -o lo -p udp -j " CHAIN))
+		return 1;
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# %d packets per run\n\n %8s %14s %14s %8s%s\n",
+		       loops, "rules", "linear pps", "classified pps",
+		       "speedup", verify ? "  counters" : "");
+
+	for (p = rules_str; *p; p = *end ? end + 1 : end) {
+		nr_rules = strtol(p, &end, 10);
+		if (end == p || nr_rules < 0 || (*end && *end != ',')) {
+			fprintf(stderr, "Invalid rule counts:%s\n", rules_str);
+			status = 1;
+			break;
+		}
+
+		for (mode = 0; mode < 2; mode++) {
+			/* the classifier is built when the table is loaded */
+			if (set_classify(modes[mode]) || load_rules(nr_rules)) {
+				fprintf(stderr, "Could not load %d rules\n",
+					nr_rules);
+				status = 1;
+				goto out;
+			}
+			usec[mode] = send_packets(fd);
+			counters[mode] = verify ? save_counters() : NULL;
+		}
+
+		switch (bench_format) {
+		case BENCH_FORMAT_DEFAULT:
+			printf(" %8d %14.0lf %14.0lf %7.2lfx", nr_rules,
+			       loops * 1000000.0 / usec[0],
+			       loops * 1000000.0 / usec[1],
+			       (double)usec[0] / (double)usec[1]);
+			break;
+		case BENCH_FORMAT_SIMPLE:
+			printf("%d %.0lf %.0lf", nr_rules,
+			       loops * 1000000.0 / usec[0],
+			       loops * 1000000.0 / usec[1]);
+			break;
+		default:
+			/* reaching here is something disaster */
+			fprintf(stderr, "Unknown format:%d\n", bench_format);
+			exit(1);
+			break;
+		}
+
+		if (verify) {
+			if (counters[0] && counters[1] &&
+			    !strcmp(counters[0], counters[1])) {
+				printf("  same");
+			} else {
+				printf("  DIFFERENT");
+				status = 1;
+			}
+			for (i = 0; i < 2; i++)
+				free(counters[i]);
+		}
+		printf("\n");
+	}
+
+out:
+	run_cmd("iptables -D OUTPUT -o lo -p udp -j " CHAIN);
+	run_cmd("iptables -F " CHAIN);
+	run_cmd("iptables -X " CHAIN);
+	set_classify(old_param);
+	for (i = 0; i < NR_PORTS; i++)
+		close(sinks[i]);
+	close(fd);
+	return status;
+}
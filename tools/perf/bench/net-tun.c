@@ -0,0 +1,274 @@
+/*
+ * net-tun.c
+ *
+ * tun: Packet rate through the queues of a multiqueue tun device
+ *
+ * For 1, 2, 4, ... queues, an IFF_MULTI_QUEUE tun device is opened with
+ * one fd per queue and one reader thread per fd.  As many sender threads
+ * send UDP datagrams from the stack to an address routed over the
+ * device, spread over 64 destination ports per sender.  So every packet
+ * goes through tun_select_queue() and tun_net_xmit() into the socket
+ * queue of one of the fds, and is read from there.  The rates sent and
+ * received, and the received rate of each queue, are reported.
+ *
+ * Needs root and the ip utility.
+ */
+
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+/* from linux/if_tun.h, which does not build against util/include */
+#define TUNSETIFF		_IOW('T', 202, int)
+#define IFF_TUN			0x0001
+#define IFF_MULTI_QUEUE		0x0100
+#define IFF_NO_PI		0x1000
+
+#define TUN_NAME	"pbtun0"
+#define TUN_PEER	"198.19.0.2"	/* routed over the device */
+#define MAX_QUEUES	8		/* MAX_TAP_QUEUES of the driver */
+#define NR_FLOWS	64		/* destination ports per sender */
+
+static int		max_queues;
+static int		loops		= 1000000;
+static int		port		= 9000;
+
+static const struct option options[] = {
+	OPT_INTEGER('q', "queues", &max_queues,
+		    "Specify maximum number of queues, readers and senders"
+		    " (default: online cpus, at most 8)"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of packets per sender"),
+	OPT_INTEGER('p', "port", &port,
+		    "Specify first destination UDP port"),
+	OPT_END()
+};
+
+static const char * const bench_net_tun_usage[] = {
+	"perf bench net tun <options>",
+	NULL
+};
+
+struct sender {
+	pthread_t	thread;
+	unsigned int	nr;
+	unsigned long	sent;
+};
+
+struct reader {
+	pthread_t	thread;
+	int		fd;
+	unsigned long	received;
+};
+
+static pthread_barrier_t start_barrier;
+static volatile int done;
+
+static int run_cmd(const char *cmd)
+{
+	int ret = system(cmd);
+
+	if (ret)
+		fprintf(stderr, "'%s' failed\n", cmd);
+	return ret;
+}
+
+static void *sender_thread(void *arg)
+{
+	struct sender *s = arg;
+	struct sockaddr_in sin;
+	char buf[18] = { 0 };
+	int fd, i;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		die("socket: %s", strerror(errno));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr(TUN_PEER);
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (i = 0; i < loops; i++) {
+		sin.sin_port = htons(port + s->nr * NR_FLOWS + i % NR_FLOWS);
+		/* a full queue drops in the qdisc, not counted as sent */
+		if (sendto(fd, buf, sizeof(buf), 0,
+			   (struct sockaddr *)&sin, sizeof(sin)) == sizeof(buf))
+			s->sent++;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+/* Reads its queue until the senders are done and it is drained. */
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+	char buf[2048];
+
+	pthread_barrier_wait(&start_barrier);
+
+	for (;;) {
+		while (read(r->fd, buf, sizeof(buf)) > 0)
+			r->received++;
+		if (done)
+			break;
+		poll(&pfd, 1, 10);
+	}
+	return NULL;
+}
+
+/* Opens nr_queues queues of one device; they go away with the fds. */
+static int open_tun(struct reader *readers, int nr_queues)
+{
+	struct ifreq ifr;
+	int i, fd;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, TUN_NAME);
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+
+	for (i = 0; i < nr_queues; i++) {
+		fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+		if (fd < 0 || ioctl(fd, TUNSETIFF, &ifr)) {
+			fprintf(stderr, "TUNSETIFF %s: %s\n", TUN_NAME,
+				strerror(errno));
+			return -1;
+		}
+		readers[i].fd = fd;
+	}
+
+	return run_cmd("ip addr add 198.19.0.1/24 dev " TUN_NAME) ||
+		run_cmd("ip link set " TUN_NAME " up") ? -1 : 0;
+}
+
+/* Runs nr senders against nr queues; returns the time it took in usecs. */
+static double run(int nr, struct reader *readers, unsigned long *sent)
+{
+	struct timeval start, stop, diff;
+	struct sender senders[MAX_QUEUES];
+	int i;
+
+	memset(readers, 0, nr * sizeof(*readers));
+	if (open_tun(readers, nr))
+		exit(1);
+
+	done = 0;
+	pthread_barrier_init(&start_barrier, NULL, 2 * nr + 1);
+	for (i = 0; i < nr; i++) {
+		senders[i].nr = i;
+		senders[i].sent = 0;
+		if (pthread_create(&senders[i].thread, NULL,
+				   sender_thread, &senders[i]) ||
+		    pthread_create(&readers[i].thread, NULL,
+				   reader_thread, &readers[i]))
+			die("pthread_create: %s", strerror(errno));
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	gettimeofday(&start, NULL);
+
+	*sent = 0;
+	for (i = 0; i < nr; i++) {
+		pthread_join(senders[i].thread, NULL);
+		*sent += senders[i].sent;
+	}
+
+	gettimeofday(&stop, NULL);
+	done = 1;
+	for (i = 0; i < nr; i++) {
+		pthread_join(readers[i].thread, NULL);
+		close(readers[i].fd);
+	}
+
+	timersub(&stop, &start, &diff);
+	pthread_barrier_destroy(&start_barrier);
+	return diff.tv_sec * 1000000.0 + diff.tv_usec;
+}
+
+int bench_net_tun(int argc, const char **argv,
+		  const char *prefix __used)
+{
+	struct reader readers[MAX_QUEUES];
+	unsigned long sent, received;
+	double usec, base = 0;
+	int nr, i;
+
+	argc = parse_options(argc, argv, options,
+			     bench_net_tun_usage, 0);
+
+	if (!max_queues) {
+		max_queues = sysconf(_SC_NPROCESSORS_ONLN);
+		if (max_queues > MAX_QUEUES)
+			max_queues = MAX_QUEUES;
+	}
+	if (max_queues <= 0 || max_queues > MAX_QUEUES || loops <= 0 ||
+	    port <= 0 || port + NR_FLOWS * MAX_QUEUES > 65536) {
+		fprintf(stderr, "Invalid queues, loop or port\n");
+		return 1;
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# %d packets per sender, one sender and one reader"
+		       " per queue\n\n %6s %12s %12s %8s  %s\n", loops,
+		       "queues", "sent pps", "received pps", "scaling",
+		       "received pps of each queue");
+
+	/* 1, 2, 4, ... queues, and max_queues itself */
+	for (nr = 1; ; nr *= 2) {
+		if (nr > max_queues)
+			nr = max_queues;
+		usec = run(nr, readers, &sent);
+		received = 0;
+		for (i = 0; i < nr; i++)
+			received += readers[i].received;
+		if (nr == 1)
+			base = received / usec;
+
+		switch (bench_format) {
+		case BENCH_FORMAT_DEFAULT:
+			printf(" %6d %12.0lf %12.0lf %7.2lfx ", nr,
+			       sent * 1000000.0 / usec,
+			       received * 1000000.0 / usec,
+			       received / usec / base);
+			for (i = 0; i < nr; i++)
+				printf(" %.0lf",
+				       readers[i].received * 1000000.0 / usec);
+			printf("\n");
+			break;
+		case BENCH_FORMAT_SIMPLE:
+			printf("%d %.0lf %.0lf\n", nr,
+			       sent * 1000000.0 / usec,
+			       received * 1000000.0 / usec);
+			break;
+		default:
+			/* reaching here is something disaster */
+			fprintf(stderr, "Unknown format:%d\n", bench_format);
+			exit(1);
+			break;
+		}
+		if (nr == max_queues)
+			break;
+	}
+
+	return 0;
+}
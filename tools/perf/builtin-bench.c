@@ -13,6 +13,7 @@
  * Available subsystem list:
  *  sched ... scheduler and IPC mechanism
  *  mem   ... memory access performance
+ *  net   ... networking stack
  *
  */
 
@@ -52,12 +53,34 @@ static struct bench_suite mem_suites[] = {
 	{ "memcpy",
 	  "Simple memory copy in various ways",
 	  bench_mem_memcpy },
+	{ "fork",
+	  "fork() of a task with a large anonymous footprint",
+	  bench_mem_fork },
 	suite_all,
 	{ NULL,
 	  NULL,
 	  NULL             }
 };
 
+static struct bench_suite net_suites[] = {
+	{ "conntrack",
+	  "Rate of new connections going through conntrack",
+	  bench_net_conntrack },
+	{ "iptables",
+	  "Packet rate through iptables, linear and classified",
+	  bench_net_iptables },
+	{ "busypoll",
+	  "UDP round trip over veth, with and without busy polling",
+	  bench_net_busypoll },
+	{ "tun",
+	  "Packet rate through the queues of a multiqueue tun",
+	  bench_net_tun },
+	suite_all,
+	{ NULL,
+	  NULL,
+	  NULL                }
+};
+
 struct bench_subsys {
 	const char *name;
 	const char *summary;
@@ -71,6 +94,9 @@ static struct bench_subsys subsystems[] = {
 	{ "mem",
 	  "memory access performance",
 	  mem_suites },
+	{ "net",
+	  "networking stack",
+	  net_suites },
 	{ "all",		/* sentinel: easy for help */
 	  "test all subsystem (pseudo subsystem)",
 	  NULL },